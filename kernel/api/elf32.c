@@ -667,6 +667,14 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
         pt_unmap_range(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
         tlb_flush_all();
 
+        /* Small executables are cheaper to read in whole than to fault in a
+         * page at a time. Failure here is harmless, the pages will just be
+         * faulted in as usual. */
+        uint32_t prognpages = ADDR_TO_PN(PAGE_ALIGN_UP(proghigh)) - ADDR_TO_PN(proglow);
+        if (prognpages <= EXEC_POPULATE_PAGES) {
+                vmmap_populate(curproc->p_vmmap, ADDR_TO_PN(proglow), prognpages, 0);
+        }
+
         /* Set the process break and starting break (immediately after the mapped-in
          * text/data/bss from the executable) */
         curproc->p_brk = proghigh;
@@ -19,7 +19,9 @@
 #include "mm/pframe.h"
 #include "mm/kmalloc.h"
 
+#include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
+#include "fs/file.h"
 #include "fs/vnode.h"
 
 #include "test/kshell/kshell.h"
@@ -46,6 +48,85 @@ static uint32_t min(uint32_t a, uint32_t b){
     return a < b ? a : b;
 }
 
+/*
+ * Returns whether fd is a file opened with O_DIRECT, which read(2) and
+ * write(2) do not copy through a kernel buffer.
+ */
+static int
+fd_is_direct(int fd)
+{
+    if (fd < 0){
+        return 0;
+    }
+
+    file_t *f = fget(fd);
+
+    if (f == NULL){
+        return 0;
+    }
+
+    int direct = f->f_mode & FMODE_DIRECT;
+    fput(f);
+    return direct;
+}
+
+/*
+ * read(2) and write(2) of an O_DIRECT file. The user buffer must be page
+ * aligned and a whole number of pages long. Its pages are faulted in and
+ * pinned DIRECT_IO_PAGES at a time, and the file's data goes straight
+ * between them and the disk (see do_read_pages()). Returns the number of
+ * bytes transferred, or -errno.
+ */
+static int
+sys_direct_io(int fd, void *buf, size_t nbytes, int forwrite)
+{
+    if (!PAGE_ALIGNED(buf) || !PAGE_ALIGNED(nbytes)){
+        return -EINVAL;
+    }
+
+    pframe_t *pinned[DIRECT_IO_PAGES];
+    void *pages[DIRECT_IO_PAGES];
+    uint32_t total = 0;
+
+    while (total < nbytes){
+        uint32_t npages = min((nbytes - total) / PAGE_SIZE, DIRECT_IO_PAGES);
+        uint32_t npinned;
+        int ret = 0;
+
+        /* reading the file writes to the buffer, and vice versa */
+        for (npinned = 0; npinned < npages; npinned++){
+            ret = vmmap_pin(curproc->p_vmmap,
+                    (char *) buf + total + npinned * PAGE_SIZE, !forwrite,
+                    &pinned[npinned]);
+            if (ret < 0){
+                break;
+            }
+            pages[npinned] = pinned[npinned]->pf_addr;
+        }
+
+        if (ret >= 0){
+            ret = forwrite ? do_write_pages(fd, pages, npages)
+                           : do_read_pages(fd, pages, npages);
+        }
+
+        while (npinned > 0){
+            pframe_unpin(pinned[--npinned]);
+        }
+
+        if (ret < 0){
+            return total > 0 ? (int) total : ret;
+        }
+
+        total += ret;
+
+        if ((uint32_t) ret < npages * PAGE_SIZE){
+            break;
+        }
+    }
+
+    return total;
+}
+
 /*
  * this is one of the few sys_* functions you have to write. be sure to
  * check out the sys_* functions we have provided before trying to write
@@ -68,6 +149,16 @@ sys_read(read_args_t *arg)
         return -1;
     }
 
+    if (fd_is_direct(kern_args.fd)){
+        int ret = sys_direct_io(kern_args.fd, kern_args.buf, kern_args.nbytes, 0);
+
+        if (ret < 0){
+            curthr->kt_errno = -ret;
+            return -1;
+        }
+        return ret;
+    }
+
     char *tmpbuf = (char *) page_alloc();
 
     if (tmpbuf == NULL){
@@ -121,6 +212,16 @@ sys_write(write_args_t *arg)
         return -1;
     }
 
+    if (fd_is_direct(kern_args.fd)){
+        int ret = sys_direct_io(kern_args.fd, kern_args.buf, kern_args.nbytes, 1);
+
+        if (ret < 0){
+            curthr->kt_errno = -ret;
+            return -1;
+        }
+        return ret;
+    }
+
     char *tmpbuf = (char *) page_alloc();
 
     if (tmpbuf == NULL){
@@ -287,6 +388,16 @@ static int sys_close(int fd)
         } else return err;
 }
 
+static int sys_fsync(int fd)
+{
+        int err;
+
+        if ((err = do_fsync(fd)) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        } else return err;
+}
+
 static int sys_dup(int fd)
 {
         int err;
@@ -504,6 +615,24 @@ static int sys_lseek(lseek_args_t *args)
         } else return err;
 }
 
+static int sys_fallocate(fallocate_args_t *args)
+{
+        fallocate_args_t        kargs;
+        int                     err;
+
+        if ((err = copy_from_user(&kargs, args, sizeof(fallocate_args_t))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+
+        err = do_fallocate(kargs.fd, kargs.offset, kargs.len);
+
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        } else return err;
+}
+
 static int sys_open(open_args_t *arg)
 {
         open_args_t             kern_args;
@@ -547,6 +676,78 @@ static int sys_munmap(munmap_args_t *args)
         return 0;
 }
 
+static int sys_madvise(madvise_args_t *args)
+{
+        madvise_args_t          kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(madvise_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_madvise(kargs.addr, kargs.len, kargs.advice);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_mlock(mlock_args_t *args)
+{
+        mlock_args_t            kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(mlock_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_mlock(kargs.addr, kargs.len);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_msync(msync_args_t *args)
+{
+        msync_args_t            kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(msync_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_msync(kargs.addr, kargs.len, kargs.flags);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_munlock(mlock_args_t *args)
+{
+        mlock_args_t            kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(mlock_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_munlock(kargs.addr, kargs.len);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
 static void *sys_mmap(mmap_args_t *arg)
 {
         mmap_args_t             kargs;
@@ -607,6 +808,7 @@ static void *sys_brk(void *addr)
 static void sys_sync(void)
 {
         pframe_clean_all();
+        vfs_sync();
 }
 
 static void sys_halt(void)
@@ -866,6 +1068,9 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                 case SYS_getpid:
                         return curproc->p_pid;
 
+                case SYS_get_free_mem:
+                        return page_free_count() * PAGE_SIZE;
+
                 case SYS_sync:
                         sys_sync();
                         return 0;
@@ -884,6 +1089,18 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                 case SYS_munmap:
                         return sys_munmap((munmap_args_t *) args);
 
+                case SYS_madvise:
+                        return sys_madvise((madvise_args_t *) args);
+
+                case SYS_mlock:
+                        return sys_mlock((mlock_args_t *) args);
+
+                case SYS_munlock:
+                        return sys_munlock((mlock_args_t *) args);
+
+                case SYS_msync:
+                        return sys_msync((msync_args_t *) args);
+
                 case SYS_open:
                         return sys_open((open_args_t *) args);
 
@@ -899,6 +1116,12 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                 case SYS_dup:
                         return sys_dup((int)args);
 
+                case SYS_fsync:
+                        return sys_fsync((int)args);
+
+                case SYS_fallocate:
+                        return sys_fallocate((fallocate_args_t *)args);
+
                 case SYS_dup2:
                         return sys_dup2((dup2_args_t *)args);
 
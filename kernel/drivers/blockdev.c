@@ -2,9 +2,15 @@
 #include "types.h"
 #include "util/debug.h"
 #include "util/list.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#include "main/tsc.h"
 
 #include "drivers/blockdev.h"
 #include "drivers/disk/ata.h"
+#include "drivers/disk/ahci.h"
+#include "drivers/disk/virtio_blk.h"
 
 #include "mm/pframe.h"
 #include "mm/mmobj.h"
@@ -34,6 +40,8 @@ blockdev_init()
         list_init(&blockdevs);
         /* Initialize all subsystems */
         ata_init();
+        ahci_init();
+        virtio_blk_init();
 }
 
 int
@@ -55,6 +63,7 @@ blockdev_register(blockdev_t *dev)
 
         /* Initialize its object here */
         mmobj_init(&dev->bd_mmobj, &blockdev_mmobj_ops);
+        memset(&dev->bd_stats, 0, sizeof(dev->bd_stats));
 
         list_insert_tail(&blockdevs, &dev->bd_link);
         return 0;
@@ -71,6 +80,147 @@ blockdev_lookup(devid_t id)
         return NULL;
 }
 
+/* Accounts for an operation that took from start until now. */
+static void
+blockdev_account(blockdev_t *dev, int op, uint64_t start, uint64_t now,
+                 size_t count, int err)
+{
+        blockdev_opstats_t *bo = &dev->bd_stats.bs_op[op];
+        uint32_t usecs = tsc_to_usecs(now - start);
+        int bucket = 0;
+
+        bo->bo_ops++;
+        if (err < 0)
+                bo->bo_errors++;
+        else
+                bo->bo_blocks += count;
+        bo->bo_usecs += usecs;
+        bo->bo_maxusecs = MAX(bo->bo_maxusecs, usecs);
+
+        while (usecs > 1 && bucket < BLOCKDEV_HIST_BUCKETS - 1) {
+                usecs >>= 1;
+                bucket++;
+        }
+        bo->bo_hist[bucket]++;
+}
+
+static int
+blockdev_io(blockdev_t *dev, char *buf, blocknum_t loc, size_t count,
+            int write)
+{
+        blockdev_stats_t *bs = &dev->bd_stats;
+        uint64_t start, end;
+        int err;
+
+        start = rdtsc();
+        if (0 == bs->bs_inflight++)
+                bs->bs_busysince = start;
+        bs->bs_maxinflight = MAX(bs->bs_maxinflight, bs->bs_inflight);
+        bs->bs_depthsum += bs->bs_inflight;
+        if (loc != bs->bs_nextblock) {
+                bs->bs_seeks++;
+                bs->bs_seekblocks += (loc > bs->bs_nextblock)
+                                     ? loc - bs->bs_nextblock
+                                     : bs->bs_nextblock - loc;
+        }
+        bs->bs_nextblock = loc + count;
+
+        if (write)
+                err = dev->bd_ops->write_block(dev, buf, loc, count);
+        else
+                err = dev->bd_ops->read_block(dev, buf, loc, count);
+
+        end = rdtsc();
+        if (0 == --bs->bs_inflight)
+                bs->bs_busycycles += end - bs->bs_busysince;
+        blockdev_account(dev, write ? BLOCKDEV_WRITE : BLOCKDEV_READ,
+                         start, end, count, err);
+        return err;
+}
+
+int
+blockdev_read(blockdev_t *dev, char *buf, blocknum_t loc, size_t count)
+{
+        return blockdev_io(dev, buf, loc, count, 0);
+}
+
+int
+blockdev_write(blockdev_t *dev, const char *buf, blocknum_t loc, size_t count)
+{
+        return blockdev_io(dev, (char *)buf, loc, count, 1);
+}
+
+static void
+blockdev_info_one(blockdev_t *dev, char **buf, size_t *size)
+{
+        static const char *opnames[BLOCKDEV_NOPS] = { "read", "write", "flush" };
+        blockdev_stats_t *bs = &dev->bd_stats;
+        uint32_t ops = bs->bs_op[BLOCKDEV_READ].bo_ops
+                       + bs->bs_op[BLOCKDEV_WRITE].bo_ops;
+        uint32_t depth100 = ops ? (uint32_t)(bs->bs_depthsum * 100 / ops) : 0;
+        int op, i;
+
+        iprintf(buf, size, "disk%u: %u blocks\n", MINOR(dev->bd_id),
+                dev->bd_nblocks);
+        iprintf(buf, size, "           ops   blocks errors    avg us    max us\n");
+        for (op = 0; op < BLOCKDEV_NOPS; op++) {
+                blockdev_opstats_t *bo = &bs->bs_op[op];
+                iprintf(buf, size, "  %-5s %8u %8u %6u %9u %9u\n", opnames[op],
+                        bo->bo_ops, bo->bo_blocks, bo->bo_errors,
+                        bo->bo_ops ? (uint32_t)(bo->bo_usecs / bo->bo_ops) : 0,
+                        bo->bo_maxusecs);
+        }
+        iprintf(buf, size, "  through the page cache (metadata): "
+                "%u blocks read, %u written\n",
+                bs->bs_cached[BLOCKDEV_READ], bs->bs_cached[BLOCKDEV_WRITE]);
+        iprintf(buf, size, "  queue depth: avg %u.%02u, max %u\n",
+                depth100 / 100, depth100 % 100, bs->bs_maxinflight);
+        iprintf(buf, size, "  seeks: %u, avg distance %u blocks\n",
+                bs->bs_seeks,
+                bs->bs_seeks ? (uint32_t)(bs->bs_seekblocks / bs->bs_seeks) : 0);
+        iprintf(buf, size, "  busy: %u ms\n",
+                tsc_to_usecs(bs->bs_busycycles) / 1000);
+
+        iprintf(buf, size, "  latency (us)          read    write    flush\n");
+        for (i = 0; i < BLOCKDEV_HIST_BUCKETS; i++) {
+                uint32_t lo = (0 == i) ? 0 : 1U << i;
+                if (0 == bs->bs_op[BLOCKDEV_READ].bo_hist[i]
+                    && 0 == bs->bs_op[BLOCKDEV_WRITE].bo_hist[i]
+                    && 0 == bs->bs_op[BLOCKDEV_FLUSH].bo_hist[i])
+                        continue;
+                if (BLOCKDEV_HIST_BUCKETS - 1 == i)
+                        iprintf(buf, size, "  %9u and up ", lo);
+                else
+                        iprintf(buf, size, "  %9u-%-9u", lo, (2U << i) - 1);
+                iprintf(buf, size, "%8u %8u %8u\n",
+                        bs->bs_op[BLOCKDEV_READ].bo_hist[i],
+                        bs->bs_op[BLOCKDEV_WRITE].bo_hist[i],
+                        bs->bs_op[BLOCKDEV_FLUSH].bo_hist[i]);
+        }
+}
+
+size_t
+blockdev_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        blockdev_t *bd;
+
+        KASSERT(NULL != buf);
+
+        if (NULL != arg) {
+                blockdev_info_one((blockdev_t *)arg, &buf, &size);
+                return size;
+        }
+
+        if (list_empty(&blockdevs)) {
+                iprintf(&buf, &size, "no block devices\n");
+        }
+        list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+                blockdev_info_one(bd, &buf, &size);
+        } list_iterate_end();
+        return size;
+}
+
 /*
  * Clean and then free all resident pages belonging to this
  * particular block device.
@@ -80,6 +230,8 @@ void
 blockdev_flush_all(blockdev_t *dev)
 {
         pframe_t *pf;
+        uint64_t start = rdtsc();
+        uint32_t ncleaned = 0;
 
         /* Clean all pages - see pframe_clean_all for
          * explanation of this loop */
@@ -88,6 +240,7 @@ clean:
                            pframe_t, pf_olink) {
                 if (pframe_is_dirty(pf)) {
                         pframe_clean(pf);
+                        ncleaned++;
                         goto clean;
                 }
         } list_iterate_end();
@@ -98,6 +251,8 @@ clean:
                 KASSERT(!pframe_is_dirty(pf));
                 pframe_free(pf);
         } list_iterate_end();
+
+        blockdev_account(dev, BLOCKDEV_FLUSH, start, rdtsc(), ncleaned, 0);
 }
 
 /* Implementation of mmobj entry points: */
@@ -122,7 +277,8 @@ blockdev_fillpage(mmobj_t *o, pframe_t *pf)
         /* Find the corresponding blockdev */
         blockdev_t *bd = CONTAINER_OF(pf->pf_obj, blockdev_t, bd_mmobj);
         /* And fill in the page by reading from it */
-        return bd->bd_ops->read_block(bd, pf->pf_addr, pf->pf_pagenum, 1);
+        bd->bd_stats.bs_cached[BLOCKDEV_READ]++;
+        return blockdev_read(bd, pf->pf_addr, pf->pf_pagenum, 1);
 }
 
 /* block devices don't need to make use of this entry point: */
@@ -139,5 +295,6 @@ blockdev_cleanpage(mmobj_t *o, pframe_t *pf)
         /* Find the corresponding blockdev */
         blockdev_t *bd = CONTAINER_OF(pf->pf_obj, blockdev_t, bd_mmobj);
         /* Clean the corresponding page by writing it back */
-        return bd->bd_ops->write_block(bd, pf->pf_addr, pf->pf_pagenum, 1);
+        bd->bd_stats.bs_cached[BLOCKDEV_WRITE]++;
+        return blockdev_write(bd, pf->pf_addr, pf->pf_pagenum, 1);
 }
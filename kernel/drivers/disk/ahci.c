@@ -0,0 +1,691 @@
+/*
+ * AHCI (Serial ATA) host bus adapter driver.
+ *
+ * Every port of an AHCI controller has a command list in memory with up
+ * to 32 command slots. A command is issued by filling in a slot -- a
+ * command header pointing at a command table, which holds the command FIS
+ * and the physical region descriptors (PRDs) of the buffer -- and setting
+ * the slot's bit in the port's CI register. With native command queuing
+ * (NCQ) the disk works on all issued commands at once, in whatever order
+ * suits it, and reports each one complete as it finishes.
+ *
+ * Any number of threads can have commands in flight on a port: each takes
+ * free slots, issues its commands and sleeps on each slot's queue until
+ * the interrupt handler sees that command complete. A request too big for
+ * one command table is split over several slots, all issued before
+ * waiting for any of them. Slot state is only touched with the disk
+ * interrupt masked, so there is no mutex.
+ */
+
+#include "types.h"
+#include "kernel.h"
+#include "errno.h"
+
+#include "main/interrupt.h"
+
+#include "util/string.h"
+#include "util/debug.h"
+#include "util/delay.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/pci.h"
+#include "drivers/disk/ahci.h"
+
+#include "proc/sched.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+
+/* PCI class of an AHCI controller (mass storage, SATA, AHCI 1.0) */
+#define AHCI_PCI_CLASS          0x01
+#define AHCI_PCI_SUBCLASS       0x06
+#define AHCI_PCI_INTERFACE      0x01
+#define AHCI_PCI_ABAR           5       /* BAR with the HBA registers */
+
+/* HBA registers */
+#define AHCI_CAP        0x00
+#define AHCI_GHC        0x04
+#define AHCI_IS         0x08
+#define AHCI_PI         0x0c
+
+#define AHCI_CAP_NCS(cap)       ((((cap) >> 8) & 0x1f) + 1)
+#define AHCI_CAP_SNCQ           BIT(30)
+
+#define AHCI_GHC_HR             BIT(0)
+#define AHCI_GHC_IE             BIT(1)
+#define AHCI_GHC_AE             0x80000000
+
+#define AHCI_MAX_PORTS          32
+#define AHCI_MAX_SLOTS          32
+#define AHCI_PORT(port)         (0x100 + (port) * 0x80)
+#define AHCI_REGS_SIZE          AHCI_PORT(AHCI_MAX_PORTS)
+
+/* Port registers, as offsets from AHCI_PORT(port) */
+#define AHCI_PxCLB      0x00    /* command list base address */
+#define AHCI_PxCLBU     0x04
+#define AHCI_PxFB       0x08    /* received FIS base address */
+#define AHCI_PxFBU      0x0c
+#define AHCI_PxIS       0x10    /* interrupt status */
+#define AHCI_PxIE       0x14    /* interrupt enable */
+#define AHCI_PxCMD      0x18
+#define AHCI_PxTFD      0x20    /* task file data: the ATA status */
+#define AHCI_PxSIG      0x24    /* signature of the attached device */
+#define AHCI_PxSSTS     0x28    /* SATA status */
+#define AHCI_PxSERR     0x30    /* SATA error */
+#define AHCI_PxSACT     0x34    /* queued commands outstanding */
+#define AHCI_PxCI       0x38    /* commands issued */
+
+#define AHCI_PxCMD_ST   BIT(0)  /* start processing the command list */
+#define AHCI_PxCMD_FRE  BIT(4)  /* receive FISes */
+#define AHCI_PxCMD_FR   BIT(14) /* FIS receive running */
+#define AHCI_PxCMD_CR   BIT(15) /* command list running */
+
+#define AHCI_PxIS_DHRS  BIT(0)  /* register FIS: a command completed */
+#define AHCI_PxIS_PSS   BIT(1)  /* PIO setup FIS */
+#define AHCI_PxIS_DSS   BIT(2)  /* DMA setup FIS */
+#define AHCI_PxIS_SDBS  BIT(3)  /* set device bits FIS: queued commands
+                                 * completed */
+#define AHCI_PxIS_IFS   BIT(27) /* interface fatal error */
+#define AHCI_PxIS_HBDS  BIT(28) /* host bus data error */
+#define AHCI_PxIS_HBFS  BIT(29) /* host bus fatal error */
+#define AHCI_PxIS_TFES  BIT(30) /* task file error: the disk failed a
+                                 * command */
+#define AHCI_PxIS_ERRORS \
+        (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+#define AHCI_PxTFD_BSY  0x80
+#define AHCI_PxTFD_DRQ  0x08
+#define AHCI_PxTFD_ERR  0x01
+
+#define AHCI_PxSSTS_DET(ssts)   ((ssts) & 0x0f)
+#define AHCI_DET_PRESENT        3       /* device present, link up */
+#define AHCI_SIG_ATA            0x00000101
+
+/* Register FIS, host to device */
+#define AHCI_FIS_H2D            0x27
+#define AHCI_FIS_CMD            0x80    /* the FIS holds a command */
+#define AHCI_DEVICE_LBA         0x40
+
+/* ATA commands */
+#define ATA_CMD_READ_DMA_EXT            0x25
+#define ATA_CMD_WRITE_DMA_EXT           0x35
+#define ATA_CMD_READ_FPDMA_QUEUED       0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED      0x61
+#define ATA_CMD_IDENTIFY                0xec
+
+/* IDENTIFY DEVICE words */
+#define ATA_IDENT_LBA28         60      /* 2 words: sectors */
+#define ATA_IDENT_QUEUE_DEPTH   75      /* bits 4:0: NCQ depth - 1 */
+#define ATA_IDENT_SATA_CAP      76      /* bit 8: NCQ supported */
+#define ATA_IDENT_CMDSET2       83      /* bit 10: LBA48 supported */
+#define ATA_IDENT_LBA48         100     /* 4 words: sectors */
+#define ATA_IDENT_WORDS         256
+
+#define ATA_SECTOR_SIZE         512
+#define AHCI_SECTORS_PER_BLOCK  (BLOCK_SIZE / ATA_SECTOR_SIZE)
+
+/* Polls are 10us apart, and give up after half a second */
+#define AHCI_POLL_TRIES         50000
+
+/*
+ * Command tables are 256 bytes, which leaves room for 8 PRDs. Each PRD
+ * describes one page of the buffer, since consecutive pages of kernel
+ * memory are not necessarily consecutive in physical memory, so a command
+ * moves at most 8 blocks.
+ */
+#define AHCI_MAX_PRDS           8
+#define AHCI_CMDTABLE_SIZE      256
+#define AHCI_CMDTABLE_PAGES     (AHCI_MAX_SLOTS * AHCI_CMDTABLE_SIZE / PAGE_SIZE)
+#define AHCI_CMDLIST_SIZE       1024    /* the received FIS area follows */
+
+typedef struct ahci_cmd_header {
+        uint16_t        ch_flags;       /* FIS length in dwords, write */
+        uint16_t        ch_prdtl;       /* number of PRDs */
+        uint32_t        ch_prdbc;       /* bytes transferred */
+        uint32_t        ch_ctba;        /* command table, physical */
+        uint32_t        ch_ctbau;
+        uint32_t        ch_reserved[4];
+} ahci_cmd_header_t;
+
+#define AHCI_CH_WRITE   BIT(6)
+
+typedef struct ahci_prd {
+        uint32_t        prd_dba;        /* buffer, physical */
+        uint32_t        prd_dbau;
+        uint32_t        prd_reserved;
+        uint32_t        prd_dbc;        /* bytes - 1 */
+} ahci_prd_t;
+
+typedef struct ahci_cmd_table {
+        uint8_t         ct_cfis[64];    /* the command FIS */
+        uint8_t         ct_acmd[16];    /* ATAPI command */
+        uint8_t         ct_reserved[48];
+        ahci_prd_t      ct_prdt[AHCI_MAX_PRDS];
+} ahci_cmd_table_t;
+
+typedef struct ahci_fis_h2d {
+        uint8_t         fis_type;
+        uint8_t         fis_flags;
+        uint8_t         fis_command;
+        uint8_t         fis_featurel;
+        uint8_t         fis_lba0;
+        uint8_t         fis_lba1;
+        uint8_t         fis_lba2;
+        uint8_t         fis_device;
+        uint8_t         fis_lba3;
+        uint8_t         fis_lba4;
+        uint8_t         fis_lba5;
+        uint8_t         fis_featureh;
+        uint8_t         fis_countl;
+        uint8_t         fis_counth;
+        uint8_t         fis_icc;
+        uint8_t         fis_control;
+        uint8_t         fis_reserved[4];
+} ahci_fis_h2d_t;
+
+typedef struct ahci_port {
+        int             ap_portno;
+        uintptr_t       ap_regs;        /* the port's registers, mapped */
+
+        ahci_cmd_header_t *ap_cmdlist;
+        ahci_cmd_table_t *ap_tables;    /* one per slot */
+
+        uint32_t        ap_allslots;    /* slots we use */
+        int             ap_ncq;         /* queue commands with NCQ */
+        uint32_t        ap_size;        /* sectors */
+
+        uint32_t        ap_busy;        /* slots taken by some thread */
+        uint32_t        ap_issued;      /* slots whose command is in flight */
+        uint32_t        ap_failed;      /* slots whose command failed */
+
+        /* Threads waiting for a free slot */
+        ktqueue_t       ap_slotq;
+
+        /* The thread waiting for the command in each slot to complete */
+        ktqueue_t       ap_waitq[AHCI_MAX_SLOTS];
+
+        blockdev_t      ap_bdev;
+} ahci_port_t;
+
+#define bd_to_ahci(bd) (CONTAINER_OF((bd), ahci_port_t, ap_bdev))
+
+#define ahci_read(reg) (*(volatile uint32_t *)(ahci_regs + (reg)))
+#define ahci_write(reg, val) (*(volatile uint32_t *)(ahci_regs + (reg)) = (val))
+#define ahci_port_read(port, reg) \
+        (*(volatile uint32_t *)((port)->ap_regs + (reg)))
+#define ahci_port_write(port, reg, val) \
+        (*(volatile uint32_t *)((port)->ap_regs + (reg)) = (val))
+
+static uintptr_t ahci_regs;
+static ahci_port_t *ahci_ports[AHCI_MAX_PORTS];
+
+static void ahci_intr(regs_t *regs);
+static int ahci_read_block(blockdev_t *bdev, char *data,
+                           blocknum_t blocknum, unsigned int count);
+static int ahci_write_block(blockdev_t *bdev, const char *data,
+                            blocknum_t blocknum, unsigned int count);
+
+static blockdev_ops_t ahci_disk_ops = {
+        .read_block  = ahci_read_block,
+        .write_block = ahci_write_block
+};
+
+/* Waits for the given bits of a port register to clear. */
+static int
+ahci_port_wait(ahci_port_t *port, uint32_t reg, uint32_t mask)
+{
+        int i;
+        for (i = 0; i < AHCI_POLL_TRIES; i++) {
+                if (!(ahci_port_read(port, reg) & mask))
+                        return 0;
+                udelay(10);
+        }
+        return -ETIMEDOUT;
+}
+
+/* Stops the port processing its command list. */
+static void
+ahci_port_stop(ahci_port_t *port)
+{
+        ahci_port_write(port, AHCI_PxCMD,
+                        ahci_port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+        if (ahci_port_wait(port, AHCI_PxCMD, AHCI_PxCMD_CR))
+                dbg(DBG_DISK, "AHCI port %d: command list does not stop\n",
+                    port->ap_portno);
+}
+
+/* Starts the port processing its command list, once the disk is idle. */
+static void
+ahci_port_start(ahci_port_t *port)
+{
+        if (ahci_port_wait(port, AHCI_PxTFD, AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ))
+                dbg(DBG_DISK, "AHCI port %d: disk stays busy\n",
+                    port->ap_portno);
+        ahci_port_write(port, AHCI_PxCMD,
+                        ahci_port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+static int
+ahci_queued(uint8_t command)
+{
+        return ATA_CMD_READ_FPDMA_QUEUED == command
+               || ATA_CMD_WRITE_FPDMA_QUEUED == command;
+}
+
+/* Fills in the command header and table of the given slot. */
+static void
+ahci_setup(ahci_port_t *port, int slot, uint8_t command, uint32_t lba,
+           uint16_t nsectors, char *buf, size_t nbytes, int write)
+{
+        ahci_cmd_header_t *ch = &port->ap_cmdlist[slot];
+        ahci_cmd_table_t *ct = &port->ap_tables[slot];
+        ahci_fis_h2d_t *fis = (ahci_fis_h2d_t *)ct->ct_cfis;
+        uint16_t nprds = 0;
+
+        memset(fis, 0, sizeof(*fis));
+        fis->fis_type = AHCI_FIS_H2D;
+        fis->fis_flags = AHCI_FIS_CMD;
+        fis->fis_command = command;
+        fis->fis_device = AHCI_DEVICE_LBA;
+        fis->fis_lba0 = lba & 0xff;
+        fis->fis_lba1 = (lba >> 8) & 0xff;
+        fis->fis_lba2 = (lba >> 16) & 0xff;
+        fis->fis_lba3 = (lba >> 24) & 0xff;
+        if (ahci_queued(command)) {
+                /* queued commands keep the count in the feature register,
+                 * and the tag in the count register */
+                fis->fis_featurel = nsectors & 0xff;
+                fis->fis_featureh = nsectors >> 8;
+                fis->fis_countl = slot << 3;
+        } else {
+                fis->fis_countl = nsectors & 0xff;
+                fis->fis_counth = nsectors >> 8;
+        }
+
+        while (nbytes > 0) {
+                size_t n = MIN(nbytes, PAGE_SIZE - PAGE_OFFSET(buf));
+                KASSERT(nprds < AHCI_MAX_PRDS);
+                ct->ct_prdt[nprds].prd_dba = pt_virt_to_phys((uintptr_t)buf);
+                ct->ct_prdt[nprds].prd_dbau = 0;
+                ct->ct_prdt[nprds].prd_reserved = 0;
+                ct->ct_prdt[nprds].prd_dbc = n - 1;
+                nprds++;
+                buf += n;
+                nbytes -= n;
+        }
+
+        ch->ch_flags = sizeof(ahci_fis_h2d_t) / sizeof(uint32_t)
+                       | (write ? AHCI_CH_WRITE : 0);
+        ch->ch_prdtl = nprds;
+        ch->ch_prdbc = 0;
+}
+
+static void
+ahci_issue(ahci_port_t *port, int slot)
+{
+        uint32_t bit = 1U << slot;
+
+        KASSERT(!(port->ap_issued & bit));
+        port->ap_issued |= bit;
+        /* the HBA reads the command from memory once it sees the bit */
+        __asm__ volatile("" ::: "memory");
+        if (port->ap_ncq)
+                ahci_port_write(port, AHCI_PxSACT, bit);
+        ahci_port_write(port, AHCI_PxCI, bit);
+}
+
+/* Marks the given slots complete, and wakes up their threads. */
+static void
+ahci_complete(ahci_port_t *port, uint32_t done, int failed)
+{
+        int slot;
+
+        port->ap_issued &= ~done;
+        if (failed)
+                port->ap_failed |= done;
+        for (slot = 0; done; slot++, done >>= 1) {
+                if (done & 1)
+                        sched_wakeup_on(&port->ap_waitq[slot]);
+        }
+}
+
+/* The slots whose commands the HBA has not finished with. */
+static uint32_t
+ahci_port_active(ahci_port_t *port)
+{
+        uint32_t active = ahci_port_read(port, AHCI_PxCI);
+        if (port->ap_ncq)
+                active |= ahci_port_read(port, AHCI_PxSACT);
+        return active;
+}
+
+/*
+ * The port stops processing commands when one fails. There is no telling
+ * which queued command it was without reading the NCQ error log, so every
+ * command still outstanding fails, and the port is restarted.
+ */
+static void
+ahci_port_error(ahci_port_t *port, uint32_t is)
+{
+        uint32_t active = ahci_port_active(port);
+
+        dbg(DBG_DISK, "AHCI port %d: error, IS 0x%x, TFD 0x%x, SERR 0x%x\n",
+            port->ap_portno, is, ahci_port_read(port, AHCI_PxTFD),
+            ahci_port_read(port, AHCI_PxSERR));
+
+        ahci_complete(port, port->ap_issued & ~active, 0);
+
+        ahci_port_stop(port);
+        ahci_port_write(port, AHCI_PxSERR, 0xffffffff);
+        ahci_port_write(port, AHCI_PxIS, 0xffffffff);
+        ahci_complete(port, port->ap_issued, 1);
+        ahci_port_start(port);
+}
+
+static void
+ahci_port_intr(ahci_port_t *port)
+{
+        uint32_t is = ahci_port_read(port, AHCI_PxIS);
+        ahci_port_write(port, AHCI_PxIS, is);
+
+        if (is & AHCI_PxIS_ERRORS)
+                ahci_port_error(port, is);
+        else
+                ahci_complete(port, port->ap_issued & ~ahci_port_active(port), 0);
+}
+
+static void
+ahci_intr(regs_t *regs)
+{
+        uint32_t is = ahci_read(AHCI_IS);
+        int i;
+
+        dbg(DBG_DISK, "AHCI interrupt, IS 0x%x\n", is);
+        for (i = 0; i < AHCI_MAX_PORTS; i++) {
+                if ((is & (1U << i)) && NULL != ahci_ports[i])
+                        ahci_port_intr(ahci_ports[i]);
+        }
+        /* the port interrupts have to be cleared first, or this bit sets
+         * again right away */
+        ahci_write(AHCI_IS, is);
+}
+
+/* Takes a free slot. */
+static int
+ahci_get_slot(ahci_port_t *port)
+{
+        uint32_t free = port->ap_allslots & ~port->ap_busy;
+        int slot = 0;
+
+        KASSERT(0 != free);
+        while (!(free & 1)) {
+                free >>= 1;
+                slot++;
+        }
+        port->ap_busy |= 1U << slot;
+        return slot;
+}
+
+/*
+ * Waits for the commands in the given slots to complete and gives the
+ * slots back.
+ *
+ * @return 0 if they all succeeded, -EIO otherwise
+ */
+static int
+ahci_reap(ahci_port_t *port, uint32_t slots)
+{
+        int slot, ret = 0;
+
+        for (slot = 0; slots; slot++, slots >>= 1) {
+                uint32_t bit = 1U << slot;
+                if (!(slots & 1))
+                        continue;
+                while (port->ap_issued & bit)
+                        sched_sleep_on(&port->ap_waitq[slot]);
+                if (port->ap_failed & bit)
+                        ret = -EIO;
+                port->ap_failed &= ~bit;
+                port->ap_busy &= ~bit;
+                sched_wakeup_on(&port->ap_slotq);
+        }
+        return ret;
+}
+
+static int
+ahci_do_io(ahci_port_t *port, char *buf, blocknum_t blocknum,
+           unsigned int count, int write)
+{
+        uint8_t command;
+        uint32_t mine = 0;
+        int ret = 0, err;
+
+        if (port->ap_ncq)
+                command = write ? ATA_CMD_WRITE_FPDMA_QUEUED
+                          : ATA_CMD_READ_FPDMA_QUEUED;
+        else
+                command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+
+        uint8_t oldipl = intr_getipl();
+        intr_setipl(INTR_DISK_AHCI);
+
+        while (count > 0 && 0 == ret) {
+                unsigned int n = MIN(count, AHCI_MAX_PRDS);
+                int slot;
+
+                /* A thread waiting for a free slot must not hold any,
+                 * or every thread could end up waiting for each other */
+                while (port->ap_busy == port->ap_allslots) {
+                        if (0 != mine) {
+                                ret = ahci_reap(port, mine);
+                                mine = 0;
+                        } else {
+                                sched_sleep_on(&port->ap_slotq);
+                        }
+                }
+                if (0 != ret)
+                        break;
+
+                slot = ahci_get_slot(port);
+                ahci_setup(port, slot, command,
+                           blocknum * AHCI_SECTORS_PER_BLOCK,
+                           n * AHCI_SECTORS_PER_BLOCK, buf, n * BLOCK_SIZE,
+                           write);
+                ahci_issue(port, slot);
+                mine |= 1U << slot;
+
+                buf += n * BLOCK_SIZE;
+                blocknum += n;
+                count -= n;
+        }
+
+        if (0 != (err = ahci_reap(port, mine)) && 0 == ret)
+                ret = err;
+
+        intr_setipl(oldipl);
+        return ret;
+}
+
+static int
+ahci_read_block(blockdev_t *bdev, char *data, blocknum_t blocknum,
+                unsigned int count)
+{
+        return ahci_do_io(bd_to_ahci(bdev), data, blocknum, count, 0);
+}
+
+static int
+ahci_write_block(blockdev_t *bdev, const char *data, blocknum_t blocknum,
+                 unsigned int count)
+{
+        return ahci_do_io(bd_to_ahci(bdev), (char *)data, blocknum, count, 1);
+}
+
+/*
+ * Sends IDENTIFY DEVICE through slot 0 and polls for it to finish; this
+ * is done before the port's interrupts are enabled.
+ */
+static int
+ahci_identify(ahci_port_t *port, uint16_t *ident)
+{
+        ahci_setup(port, 0, ATA_CMD_IDENTIFY, 0, 0, (char *)ident,
+                   ATA_IDENT_WORDS * sizeof(uint16_t), 0);
+        __asm__ volatile("" ::: "memory");
+        ahci_port_write(port, AHCI_PxCI, 1);
+
+        if (ahci_port_wait(port, AHCI_PxCI, 1)
+            || (ahci_port_read(port, AHCI_PxIS) & AHCI_PxIS_ERRORS)
+            || (ahci_port_read(port, AHCI_PxTFD) & AHCI_PxTFD_ERR))
+                return -EIO;
+        ahci_port_write(port, AHCI_PxIS, 0xffffffff);
+        return 0;
+}
+
+static ahci_port_t *
+ahci_port_init(int portno, uint32_t cap)
+{
+        ahci_port_t *port;
+        uint16_t *ident;
+        char *cmdpage;
+        int i, nslots;
+
+        if (NULL == (port = (ahci_port_t *)kmalloc(sizeof(ahci_port_t)))
+            || NULL == (cmdpage = (char *)page_alloc())
+            || NULL == (port->ap_tables = (ahci_cmd_table_t *)
+                        page_alloc_n(AHCI_CMDTABLE_PAGES))
+            || NULL == (ident = (uint16_t *)page_alloc()))
+                panic("Not enough memory for AHCI port!\n");
+
+        port->ap_portno = portno;
+        port->ap_regs = ahci_regs + AHCI_PORT(portno);
+        port->ap_cmdlist = (ahci_cmd_header_t *)cmdpage;
+        port->ap_busy = 0;
+        port->ap_issued = 0;
+        port->ap_failed = 0;
+        sched_queue_init(&port->ap_slotq);
+        for (i = 0; i < AHCI_MAX_SLOTS; i++)
+                sched_queue_init(&port->ap_waitq[i]);
+
+        /* Take the port over from the firmware */
+        ahci_port_stop(port);
+        ahci_port_write(port, AHCI_PxCMD,
+                        ahci_port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+        if (ahci_port_wait(port, AHCI_PxCMD, AHCI_PxCMD_FR))
+                dbg(DBG_DISK, "AHCI port %d: FIS receive does not stop\n",
+                    portno);
+
+        memset(cmdpage, 0, PAGE_SIZE);
+        memset(port->ap_tables, 0, AHCI_CMDTABLE_PAGES * PAGE_SIZE);
+        for (i = 0; i < AHCI_MAX_SLOTS; i++) {
+                port->ap_cmdlist[i].ch_ctba =
+                        pt_virt_to_phys((uintptr_t)&port->ap_tables[i]);
+        }
+        ahci_port_write(port, AHCI_PxCLB, pt_virt_to_phys((uintptr_t)cmdpage));
+        ahci_port_write(port, AHCI_PxCLBU, 0);
+        ahci_port_write(port, AHCI_PxFB,
+                        pt_virt_to_phys((uintptr_t)cmdpage + AHCI_CMDLIST_SIZE));
+        ahci_port_write(port, AHCI_PxFBU, 0);
+
+        ahci_port_write(port, AHCI_PxSERR, 0xffffffff);
+        ahci_port_write(port, AHCI_PxIS, 0xffffffff);
+        ahci_port_write(port, AHCI_PxCMD,
+                        ahci_port_read(port, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+        ahci_port_start(port);
+
+        if (0 > ahci_identify(port, ident)) {
+                dbg(DBG_DISK, "AHCI port %d: IDENTIFY failed\n", portno);
+                ahci_port_stop(port);
+                page_free(ident);
+                page_free_n(port->ap_tables, AHCI_CMDTABLE_PAGES);
+                page_free(cmdpage);
+                kfree(port);
+                return NULL;
+        }
+
+        if (ident[ATA_IDENT_CMDSET2] & BIT(10))
+                port->ap_size = ident[ATA_IDENT_LBA48]
+                                | (uint32_t)ident[ATA_IDENT_LBA48 + 1] << 16;
+        else
+                port->ap_size = ident[ATA_IDENT_LBA28]
+                                | (uint32_t)ident[ATA_IDENT_LBA28 + 1] << 16;
+
+        nslots = AHCI_CAP_NCS(cap);
+        port->ap_ncq = (cap & AHCI_CAP_SNCQ)
+                       && (ident[ATA_IDENT_SATA_CAP] & BIT(8));
+        if (port->ap_ncq)
+                nslots = MIN(nslots, (ident[ATA_IDENT_QUEUE_DEPTH] & 0x1f) + 1);
+        port->ap_allslots = (nslots == AHCI_MAX_SLOTS) ? 0xffffffff
+                            : (1U << nslots) - 1;
+        page_free(ident);
+
+        ahci_port_write(port, AHCI_PxIE, AHCI_PxIS_DHRS | AHCI_PxIS_SDBS
+                        | AHCI_PxIS_ERRORS);
+
+        dbg(DBG_DISK, "Initialized AHCI port %d, size %d, %d slots%s\n",
+            portno, port->ap_size, nslots, port->ap_ncq ? ", NCQ" : "");
+        return port;
+}
+
+void
+ahci_init()
+{
+        pcidev_t *dev;
+        uint32_t abar, cap, pi, command;
+        int i, minor = 0;
+
+        if (NULL == (dev = pci_lookup(AHCI_PCI_CLASS, AHCI_PCI_SUBCLASS,
+                                      AHCI_PCI_INTERFACE)))
+                return;
+
+        command = pci_read_config(dev, PCI_COMMAND, 2);
+        command |= PCI_CMD_MMIO | PCI_CMD_BUSMASTER;
+        command &= ~PCI_CMD_INTX_DISABLE;
+        pci_write_config(dev, PCI_COMMAND, command, 2);
+
+        abar = dev->pci_bar[AHCI_PCI_ABAR].base_addr & ~0xf;
+        ahci_regs = pt_phys_perm_map((uintptr_t)PAGE_ALIGN_DOWN(abar),
+                                     (PAGE_OFFSET(abar) + AHCI_REGS_SIZE
+                                      + PAGE_SIZE - 1) / PAGE_SIZE)
+                    + PAGE_OFFSET(abar);
+
+        ahci_write(AHCI_GHC, AHCI_GHC_AE);
+        ahci_write(AHCI_GHC, AHCI_GHC_AE | AHCI_GHC_HR);
+        for (i = 0; i < AHCI_POLL_TRIES && (ahci_read(AHCI_GHC) & AHCI_GHC_HR); i++)
+                udelay(10);
+        /* a reset clears AE too */
+        ahci_write(AHCI_GHC, AHCI_GHC_AE);
+
+        cap = ahci_read(AHCI_CAP);
+        pi = ahci_read(AHCI_PI);
+
+        uint8_t oldipl = intr_getipl();
+        intr_setipl(INTR_DISK_AHCI);
+
+        for (i = 0; i < AHCI_MAX_PORTS; i++) {
+                ahci_port_t *port;
+                uint32_t regs = AHCI_PORT(i);
+
+                if (!(pi & (1U << i))
+                    || AHCI_DET_PRESENT != AHCI_PxSSTS_DET(ahci_read(regs + AHCI_PxSSTS))
+                    || AHCI_SIG_ATA != ahci_read(regs + AHCI_PxSIG))
+                        continue;
+                if (NULL == (port = ahci_port_init(i, cap)))
+                        continue;
+
+                while (NULL != blockdev_lookup(MKDEVID(DISK_MAJOR, minor)))
+                        minor++;
+                port->ap_bdev.bd_id = MKDEVID(DISK_MAJOR, minor);
+                port->ap_bdev.bd_ops = &ahci_disk_ops;
+                port->ap_bdev.bd_nblocks = port->ap_size / AHCI_SECTORS_PER_BLOCK;
+                blockdev_register(&port->ap_bdev);
+                ahci_ports[i] = port;
+        }
+
+        intr_map(dev->pci_irq, INTR_DISK_AHCI);
+        intr_register(INTR_DISK_AHCI, ahci_intr);
+        ahci_write(AHCI_IS, 0xffffffff);
+        ahci_write(AHCI_GHC, ahci_read(AHCI_GHC) | AHCI_GHC_IE);
+
+        intr_setipl(oldipl);
+}
@@ -292,8 +292,10 @@ ata_init()
         /* wait some time for the drive to process */
         ata_pause(channel);
 
-        /* If status register is 0xff, drive does not exist */
-        if (0x00 == ata_inb_reg(channel, ATA_REG_STATUS)) {
+        /* If status register is 0x00 (or 0xff, a floating bus), drive
+         * does not exist */
+        status = ata_inb_reg(channel, ATA_REG_STATUS);
+        if (0x00 == status || 0xff == status) {
             dbgq(DBG_DISK, "Drive does not exist\n");
             continue;
         }
@@ -354,6 +356,7 @@ ata_init()
 
         adisk->ata_bdev.bd_id = MKDEVID(DISK_MAJOR, ii);
         adisk->ata_bdev.bd_ops = &ata_disk_ops;
+        adisk->ata_bdev.bd_nblocks = adisk->ata_size / adisk->ata_sectors_per_block;
         blockdev_register(&adisk->ata_bdev);
     }
     intr_setipl(oldipl);
@@ -0,0 +1,535 @@
+/*
+ * virtio-blk driver, for the paravirtual disk QEMU provides.
+ *
+ * A virtio device and its driver share a virtqueue in memory: a table of
+ * descriptors describing buffers, an "available" ring in which the driver
+ * hands descriptor chains to the device, and a "used" ring in which the
+ * device hands them back. A request is a chain of a header (type and
+ * sector), the data buffers, and a status byte the device writes.
+ *
+ * Every request uses an indirect descriptor: its ring descriptor points at
+ * a table of its own holding the whole chain, so each request takes up
+ * exactly one ring descriptor, whose index doubles as the request id. A
+ * request of many pages is split over several ring descriptors, and all
+ * of them are published with a single notification. With the event index
+ * feature the device is only notified, and only interrupts, when the
+ * other side is not already going to look at the ring anyway.
+ *
+ * As with AHCI, any number of threads can have requests in flight, and
+ * the state of the request slots is only touched with the disk interrupt
+ * masked.
+ */
+
+#include "types.h"
+#include "kernel.h"
+#include "errno.h"
+
+#include "main/interrupt.h"
+#include "main/io.h"
+
+#include "util/string.h"
+#include "util/debug.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/pci.h"
+#include "drivers/disk/virtio_blk.h"
+
+#include "proc/sched.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+
+#define VIRTIO_PCI_VENDOR       0x1af4
+#define VIRTIO_PCI_BLK          0x1001  /* legacy (transitional) block device */
+
+/* Legacy virtio PCI registers, in the I/O space of BAR 0 */
+#define VIRTIO_PCI_HOST_FEATURES        0x00
+#define VIRTIO_PCI_GUEST_FEATURES       0x04
+#define VIRTIO_PCI_QUEUE_PFN            0x08
+#define VIRTIO_PCI_QUEUE_NUM            0x0c
+#define VIRTIO_PCI_QUEUE_SEL            0x0e
+#define VIRTIO_PCI_QUEUE_NOTIFY         0x10
+#define VIRTIO_PCI_STATUS               0x12
+#define VIRTIO_PCI_ISR                  0x13
+#define VIRTIO_PCI_CONFIG               0x14    /* without MSI-X */
+
+#define VIRTIO_STATUS_ACKNOWLEDGE       0x01
+#define VIRTIO_STATUS_DRIVER            0x02
+#define VIRTIO_STATUS_DRIVER_OK         0x04
+#define VIRTIO_STATUS_FAILED            0x80
+
+#define VIRTIO_ISR_QUEUE                0x01
+
+/* Feature bits */
+#define VIRTIO_BLK_F_SEG_MAX            BIT(2)
+#define VIRTIO_BLK_F_RO                 BIT(5)
+#define VIRTIO_RING_F_INDIRECT_DESC     BIT(28)
+#define VIRTIO_RING_F_EVENT_IDX         BIT(29)
+#define VIRTIO_BLK_FEATURES \
+        (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO \
+         | VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX)
+
+/* Block device configuration, as offsets from VIRTIO_PCI_CONFIG */
+#define VIRTIO_BLK_CFG_CAPACITY         0x00    /* 64 bits, in sectors */
+#define VIRTIO_BLK_CFG_SEG_MAX          0x0c
+
+#define VIRTIO_BLK_T_IN                 0
+#define VIRTIO_BLK_T_OUT                1
+#define VIRTIO_BLK_S_OK                 0
+
+#define VIRTIO_BLK_SECTOR_SIZE          512
+#define VIRTIO_BLK_SECTORS_PER_BLOCK    (BLOCK_SIZE / VIRTIO_BLK_SECTOR_SIZE)
+
+#define VRING_DESC_F_NEXT               1
+#define VRING_DESC_F_WRITE              2       /* the device writes it */
+#define VRING_DESC_F_INDIRECT           4
+#define VRING_USED_F_NO_NOTIFY          1
+
+typedef struct vring_desc {
+        uint64_t        vd_addr;        /* physical */
+        uint32_t        vd_len;
+        uint16_t        vd_flags;
+        uint16_t        vd_next;
+} vring_desc_t;
+
+typedef struct vring_avail {
+        uint16_t        va_flags;
+        uint16_t        va_idx;
+        uint16_t        va_ring[];      /* then used_event */
+} vring_avail_t;
+
+typedef struct vring_used_elem {
+        uint32_t        vu_id;
+        uint32_t        vu_len;
+} vring_used_elem_t;
+
+typedef struct vring_used {
+        uint16_t        vu_flags;
+        uint16_t        vu_idx;
+        vring_used_elem_t vu_ring[];    /* then avail_event */
+} vring_used_t;
+
+/* The legacy layout of a virtqueue of n descriptors: the descriptors and
+ * the available ring, then the used ring on the next page */
+#define VRING_ROUND(x)          (((x) + PAGE_SIZE - 1) & PAGE_MASK)
+#define VRING_AVAIL_OFF(n)      ((n) * sizeof(vring_desc_t))
+#define VRING_USED_OFF(n) \
+        VRING_ROUND(VRING_AVAIL_OFF(n) + (3 + (n)) * sizeof(uint16_t))
+#define VRING_SIZE(n) \
+        (VRING_USED_OFF(n) \
+         + VRING_ROUND(3 * sizeof(uint16_t) + (n) * sizeof(vring_used_elem_t)))
+
+/*
+ * Each request has its indirect descriptor table and its header and status
+ * byte in one 512-byte slot, so that it never straddles a page. A request
+ * moves at most VIRTIO_BLK_MAX_SEGS pages.
+ */
+#define VIRTIO_BLK_MAX_SEGS     28
+#define VIRTIO_BLK_NREQS        32
+#define VIRTIO_BLK_REQ_SIZE     512
+#define VIRTIO_BLK_REQ_PAGES    (VIRTIO_BLK_NREQS * VIRTIO_BLK_REQ_SIZE / PAGE_SIZE)
+
+typedef struct virtio_blk_req {
+        vring_desc_t    vr_desc[VIRTIO_BLK_MAX_SEGS + 2];
+        /* the request header */
+        uint32_t        vr_type;
+        uint32_t        vr_reserved;
+        uint64_t        vr_sector;
+        uint8_t         vr_status;
+        uint8_t         vr_pad[15];
+} virtio_blk_req_t;
+
+typedef struct virtio_blk {
+        uint16_t        vb_iobase;
+        uint32_t        vb_features;    /* features both sides support */
+        uint32_t        vb_maxsegs;
+        uint32_t        vb_size;        /* sectors */
+
+        uint16_t        vb_qsize;
+        vring_desc_t   *vb_desc;
+        vring_avail_t  *vb_avail;
+        vring_used_t   *vb_used;
+        uint16_t        vb_next_avail;  /* next available entry, published
+                                         * at the next kick */
+        uint16_t        vb_last_used;   /* next used entry to look at */
+
+        virtio_blk_req_t *vb_reqs;
+        uint32_t        vb_allreqs;     /* request slots we use */
+        uint32_t        vb_busy;        /* slots taken by some thread */
+        uint32_t        vb_issued;      /* slots whose request is in flight */
+        uint32_t        vb_failed;      /* slots whose request failed */
+
+        /* Threads waiting for a free slot */
+        ktqueue_t       vb_slotq;
+
+        /* The thread waiting for the request in each slot to complete */
+        ktqueue_t       vb_waitq[VIRTIO_BLK_NREQS];
+
+        blockdev_t      vb_bdev;
+} virtio_blk_t;
+
+#define bd_to_virtio(bd) (CONTAINER_OF((bd), virtio_blk_t, vb_bdev))
+
+/* The driver's view of the ring has to be in memory, in order, before the
+ * device looks at it; x86 only reorders a store with a later load */
+#define virtio_wmb() __asm__ volatile("" ::: "memory")
+#define virtio_rmb() __asm__ volatile("" ::: "memory")
+#define virtio_mb() __asm__ volatile("lock; addl $0,(%%esp)" ::: "memory")
+
+#define vring_used_event(vb) \
+        (*(volatile uint16_t *)&(vb)->vb_avail->va_ring[(vb)->vb_qsize])
+#define vring_avail_event(vb) \
+        (*(volatile uint16_t *)&(vb)->vb_used->vu_ring[(vb)->vb_qsize])
+
+static virtio_blk_t *virtio_blk_dev;
+
+static void virtio_blk_intr(regs_t *regs);
+static int virtio_blk_read(blockdev_t *bdev, char *data,
+                           blocknum_t blocknum, unsigned int count);
+static int virtio_blk_write(blockdev_t *bdev, const char *data,
+                            blocknum_t blocknum, unsigned int count);
+
+static blockdev_ops_t virtio_blk_ops = {
+        .read_block  = virtio_blk_read,
+        .write_block = virtio_blk_write
+};
+
+/* Whether the other side asked to hear about idx moving past event, when
+ * it moved from old to new */
+static int
+vring_need_event(uint16_t event, uint16_t new, uint16_t old)
+{
+        return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+
+/* Fills in the indirect descriptor table of the given request slot, and
+ * adds it to the available ring. It is not published until the next
+ * virtio_blk_kick(). */
+static void
+virtio_blk_queue(virtio_blk_t *vb, int id, uint32_t sector, char *buf,
+                 size_t nbytes, int write)
+{
+        virtio_blk_req_t *req = &vb->vb_reqs[id];
+        vring_desc_t *d = req->vr_desc;
+        int n = 0;
+
+        req->vr_type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        req->vr_reserved = 0;
+        req->vr_sector = sector;
+        req->vr_status = 0xff;
+
+        d[n].vd_addr = pt_virt_to_phys((uintptr_t)&req->vr_type);
+        d[n].vd_len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
+        d[n].vd_flags = VRING_DESC_F_NEXT;
+        d[n].vd_next = n + 1;
+        n++;
+
+        while (nbytes > 0) {
+                uintptr_t phys = pt_virt_to_phys((uintptr_t)buf);
+                size_t len = MIN(nbytes, PAGE_SIZE - PAGE_OFFSET(buf));
+
+                if (n > 1 && d[n - 1].vd_addr + d[n - 1].vd_len == phys) {
+                        /* physically contiguous with the last page */
+                        d[n - 1].vd_len += len;
+                } else {
+                        KASSERT(n <= VIRTIO_BLK_MAX_SEGS);
+                        d[n].vd_addr = phys;
+                        d[n].vd_len = len;
+                        d[n].vd_flags = VRING_DESC_F_NEXT
+                                        | (write ? 0 : VRING_DESC_F_WRITE);
+                        d[n].vd_next = n + 1;
+                        n++;
+                }
+                buf += len;
+                nbytes -= len;
+        }
+
+        d[n].vd_addr = pt_virt_to_phys((uintptr_t)&req->vr_status);
+        d[n].vd_len = 1;
+        d[n].vd_flags = VRING_DESC_F_WRITE;
+        d[n].vd_next = 0;
+        n++;
+
+        vb->vb_desc[id].vd_len = n * sizeof(vring_desc_t);
+        vb->vb_avail->va_ring[vb->vb_next_avail % vb->vb_qsize] = id;
+        vb->vb_next_avail++;
+
+        KASSERT(!(vb->vb_issued & (1U << id)));
+        vb->vb_issued |= 1U << id;
+}
+
+/* Publishes everything queued since the last kick, and notifies the device
+ * if it wants to be. */
+static void
+virtio_blk_kick(virtio_blk_t *vb)
+{
+        uint16_t old = vb->vb_avail->va_idx;
+        uint16_t new = vb->vb_next_avail;
+        int notify;
+
+        if (old == new)
+                return;
+
+        virtio_wmb();
+        *(volatile uint16_t *)&vb->vb_avail->va_idx = new;
+        virtio_mb();
+
+        if (vb->vb_features & VIRTIO_RING_F_EVENT_IDX)
+                notify = vring_need_event(vring_avail_event(vb), new, old);
+        else
+                notify = !(*(volatile uint16_t *)&vb->vb_used->vu_flags
+                           & VRING_USED_F_NO_NOTIFY);
+        if (notify)
+                outw(vb->vb_iobase + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+}
+
+/* Completes every request the device has put in the used ring. */
+static void
+virtio_blk_collect(virtio_blk_t *vb)
+{
+        do {
+                while (vb->vb_last_used
+                       != *(volatile uint16_t *)&vb->vb_used->vu_idx) {
+                        uint32_t id, bit;
+
+                        virtio_rmb();
+                        id = vb->vb_used->vu_ring[vb->vb_last_used
+                                                  % vb->vb_qsize].vu_id;
+                        bit = 1U << id;
+                        KASSERT(vb->vb_issued & bit);
+
+                        if (VIRTIO_BLK_S_OK != vb->vb_reqs[id].vr_status)
+                                vb->vb_failed |= bit;
+                        vb->vb_issued &= ~bit;
+                        sched_wakeup_on(&vb->vb_waitq[id]);
+                        vb->vb_last_used++;
+                }
+                if (!(vb->vb_features & VIRTIO_RING_F_EVENT_IDX))
+                        break;
+                /* interrupt at the next completion; one that came in
+                 * before the device saw this is picked up here */
+                vring_used_event(vb) = vb->vb_last_used;
+                virtio_mb();
+        } while (vb->vb_last_used != *(volatile uint16_t *)&vb->vb_used->vu_idx);
+}
+
+static void
+virtio_blk_intr(regs_t *regs)
+{
+        virtio_blk_t *vb = virtio_blk_dev;
+
+        /* reading the ISR acknowledges the interrupt */
+        if (inb(vb->vb_iobase + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE)
+                virtio_blk_collect(vb);
+}
+
+/* Takes a free request slot. */
+static int
+virtio_blk_get_req(virtio_blk_t *vb)
+{
+        uint32_t free = vb->vb_allreqs & ~vb->vb_busy;
+        int id = 0;
+
+        KASSERT(0 != free);
+        while (!(free & 1)) {
+                free >>= 1;
+                id++;
+        }
+        vb->vb_busy |= 1U << id;
+        return id;
+}
+
+/*
+ * Waits for the requests in the given slots to complete and gives the
+ * slots back.
+ *
+ * @return 0 if they all succeeded, -EIO otherwise
+ */
+static int
+virtio_blk_reap(virtio_blk_t *vb, uint32_t ids)
+{
+        int id, ret = 0;
+
+        for (id = 0; ids; id++, ids >>= 1) {
+                uint32_t bit = 1U << id;
+                if (!(ids & 1))
+                        continue;
+                while (vb->vb_issued & bit)
+                        sched_sleep_on(&vb->vb_waitq[id]);
+                if (vb->vb_failed & bit)
+                        ret = -EIO;
+                vb->vb_failed &= ~bit;
+                vb->vb_busy &= ~bit;
+                sched_wakeup_on(&vb->vb_slotq);
+        }
+        return ret;
+}
+
+static int
+virtio_blk_do_io(virtio_blk_t *vb, char *buf, blocknum_t blocknum,
+                 unsigned int count, int write)
+{
+        uint32_t mine = 0;
+        int ret = 0, err;
+
+        if (write && (vb->vb_features & VIRTIO_BLK_F_RO))
+                return -EROFS;
+
+        uint8_t oldipl = intr_getipl();
+        intr_setipl(INTR_DISK_VIRTIO);
+
+        while (count > 0 && 0 == ret) {
+                unsigned int n = MIN(count, vb->vb_maxsegs);
+
+                /* A thread waiting for a free slot must not hold any,
+                 * or every thread could end up waiting for each other */
+                while (vb->vb_busy == vb->vb_allreqs) {
+                        if (0 != mine) {
+                                virtio_blk_kick(vb);
+                                ret = virtio_blk_reap(vb, mine);
+                                mine = 0;
+                        } else {
+                                sched_sleep_on(&vb->vb_slotq);
+                        }
+                }
+                if (0 != ret)
+                        break;
+
+                int id = virtio_blk_get_req(vb);
+                virtio_blk_queue(vb, id,
+                                 blocknum * VIRTIO_BLK_SECTORS_PER_BLOCK,
+                                 buf, n * BLOCK_SIZE, write);
+                mine |= 1U << id;
+
+                buf += n * BLOCK_SIZE;
+                blocknum += n;
+                count -= n;
+        }
+
+        virtio_blk_kick(vb);
+        if (0 != (err = virtio_blk_reap(vb, mine)) && 0 == ret)
+                ret = err;
+
+        intr_setipl(oldipl);
+        return ret;
+}
+
+static int
+virtio_blk_read(blockdev_t *bdev, char *data, blocknum_t blocknum,
+                unsigned int count)
+{
+        return virtio_blk_do_io(bd_to_virtio(bdev), data, blocknum, count, 0);
+}
+
+static int
+virtio_blk_write(blockdev_t *bdev, const char *data, blocknum_t blocknum,
+                 unsigned int count)
+{
+        return virtio_blk_do_io(bd_to_virtio(bdev), (char *)data, blocknum,
+                                count, 1);
+}
+
+void
+virtio_blk_init()
+{
+        pcidev_t *dev;
+        virtio_blk_t *vb;
+        uint32_t command, pages;
+        int i, minor = 0;
+        char *ring;
+
+        KASSERT(VIRTIO_BLK_REQ_SIZE == sizeof(virtio_blk_req_t));
+
+        if (NULL == (dev = pci_lookup_id(VIRTIO_PCI_VENDOR, VIRTIO_PCI_BLK)))
+                return;
+
+        command = pci_read_config(dev, PCI_COMMAND, 2);
+        command |= PCI_CMD_IO | PCI_CMD_BUSMASTER;
+        command &= ~PCI_CMD_INTX_DISABLE;
+        pci_write_config(dev, PCI_COMMAND, command, 2);
+
+        if (NULL == (vb = (virtio_blk_t *)kmalloc(sizeof(virtio_blk_t))))
+                panic("Not enough memory for virtio block device!\n");
+        vb->vb_iobase = dev->pci_bar[0].base_addr;
+
+        /* Reset the device, and tell it we know how to drive it */
+        outb(vb->vb_iobase + VIRTIO_PCI_STATUS, 0);
+        outb(vb->vb_iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+        outb(vb->vb_iobase + VIRTIO_PCI_STATUS,
+             VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+        vb->vb_features = inl(vb->vb_iobase + VIRTIO_PCI_HOST_FEATURES)
+                          & VIRTIO_BLK_FEATURES;
+        outw(vb->vb_iobase + VIRTIO_PCI_QUEUE_SEL, 0);
+        vb->vb_qsize = inw(vb->vb_iobase + VIRTIO_PCI_QUEUE_NUM);
+        if (!(vb->vb_features & VIRTIO_RING_F_INDIRECT_DESC)
+            || 0 == vb->vb_qsize) {
+                dbg(DBG_DISK, "virtio-blk device without indirect "
+                    "descriptors or a queue, ignoring it\n");
+                outb(vb->vb_iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+                kfree(vb);
+                return;
+        }
+        outl(vb->vb_iobase + VIRTIO_PCI_GUEST_FEATURES, vb->vb_features);
+
+        vb->vb_size = inl(vb->vb_iobase + VIRTIO_PCI_CONFIG
+                          + VIRTIO_BLK_CFG_CAPACITY);
+        vb->vb_maxsegs = VIRTIO_BLK_MAX_SEGS;
+        if (vb->vb_features & VIRTIO_BLK_F_SEG_MAX) {
+                uint32_t segmax = inl(vb->vb_iobase + VIRTIO_PCI_CONFIG
+                                      + VIRTIO_BLK_CFG_SEG_MAX);
+                if (0 != segmax)
+                        vb->vb_maxsegs = MIN(vb->vb_maxsegs, segmax);
+        }
+
+        /* Set up the virtqueue */
+        pages = VRING_SIZE(vb->vb_qsize) / PAGE_SIZE;
+        if (NULL == (ring = (char *)page_alloc_n(pages))
+            || NULL == (vb->vb_reqs = (virtio_blk_req_t *)
+                        page_alloc_n(VIRTIO_BLK_REQ_PAGES)))
+                panic("Not enough memory for virtqueue!\n");
+        memset(ring, 0, pages * PAGE_SIZE);
+        memset(vb->vb_reqs, 0, VIRTIO_BLK_REQ_PAGES * PAGE_SIZE);
+        vb->vb_desc = (vring_desc_t *)ring;
+        vb->vb_avail = (vring_avail_t *)(ring + VRING_AVAIL_OFF(vb->vb_qsize));
+        vb->vb_used = (vring_used_t *)(ring + VRING_USED_OFF(vb->vb_qsize));
+        vb->vb_next_avail = 0;
+        vb->vb_last_used = 0;
+
+        /* Request slot i always uses ring descriptor i */
+        vb->vb_allreqs = 0;
+        for (i = 0; i < VIRTIO_BLK_NREQS && i < vb->vb_qsize; i++) {
+                vb->vb_desc[i].vd_addr =
+                        pt_virt_to_phys((uintptr_t)vb->vb_reqs[i].vr_desc);
+                vb->vb_desc[i].vd_flags = VRING_DESC_F_INDIRECT;
+                vb->vb_allreqs |= 1U << i;
+        }
+        vb->vb_busy = 0;
+        vb->vb_issued = 0;
+        vb->vb_failed = 0;
+        sched_queue_init(&vb->vb_slotq);
+        for (i = 0; i < VIRTIO_BLK_NREQS; i++)
+                sched_queue_init(&vb->vb_waitq[i]);
+
+        outl(vb->vb_iobase + VIRTIO_PCI_QUEUE_PFN,
+             pt_virt_to_phys((uintptr_t)ring) >> PAGE_SHIFT);
+
+        while (NULL != blockdev_lookup(MKDEVID(DISK_MAJOR, minor)))
+                minor++;
+        vb->vb_bdev.bd_id = MKDEVID(DISK_MAJOR, minor);
+        vb->vb_bdev.bd_ops = &virtio_blk_ops;
+        vb->vb_bdev.bd_nblocks = vb->vb_size / VIRTIO_BLK_SECTORS_PER_BLOCK;
+        blockdev_register(&vb->vb_bdev);
+        virtio_blk_dev = vb;
+
+        intr_map(dev->pci_irq, INTR_DISK_VIRTIO);
+        intr_register(INTR_DISK_VIRTIO, virtio_blk_intr);
+        outb(vb->vb_iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE
+             | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+        dbg(DBG_DISK, "Initialized virtio-blk device, disk %d, size %d, "
+            "queue size %d, features 0x%x\n", minor, vb->vb_size,
+            vb->vb_qsize, vb->vb_features);
+}
@@ -11,6 +11,7 @@
 #include "mm/pframe.h"
 
 #include "drivers/bytedev.h"
+#include "drivers/blockdev.h"
 
 #include "vm/anon.h"
 
@@ -22,6 +23,9 @@ static int null_write(bytedev_t *dev, int offset, const void *buf, int count);
 static int zero_read(bytedev_t *dev, int offset, void *buf, int count);
 static int zero_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
 
+static int iostat_read(bytedev_t *dev, int offset, void *buf, int count);
+static int iostat_write(bytedev_t *dev, int offset, const void *buf, int count);
+
 bytedev_ops_t null_dev_ops = {
         null_read,
         null_write,
@@ -40,6 +44,15 @@ bytedev_ops_t zero_dev_ops = {
         NULL
 };
 
+bytedev_ops_t iostat_dev_ops = {
+        iostat_read,
+        iostat_write,
+        NULL,
+        NULL,
+        NULL,
+        NULL
+};
+
 /*
  * The byte device code needs to know about these mem devices, so create
  * bytedev_t's for null and zero, fill them in, and register them.
@@ -67,6 +80,17 @@ memdevs_init() {
     list_link_init(&zd->cd_link);
 
     bytedev_register(zd);
+
+    /* initialize iostat dev */
+    bytedev_t *sd = (bytedev_t *) kmalloc(sizeof(bytedev_t));
+
+    KASSERT(sd != NULL && "unable to create iostat device");
+
+    sd->cd_id = MEM_IOSTAT_DEVID;
+    sd->cd_ops = &iostat_dev_ops;
+    list_link_init(&sd->cd_link);
+
+    bytedev_register(sd);
 }
 
 /**
@@ -124,6 +148,51 @@ zero_read(bytedev_t *dev, int offset, void *buf, int count)
     return count;
 }
 
+/**
+ * Reads the I/O statistics of the block devices (see blockdev_info),
+ * as text, starting at the given offset.
+ *
+ * @param dev the iostat device
+ * @param offset the offset into the text to read from
+ * @param buf the buffer to write to
+ * @param count the maximum number of bytes to read
+ * @return the number of bytes read, 0 at the end of the text
+ */
+static int
+iostat_read(bytedev_t *dev, int offset, void *buf, int count)
+{
+    char *info;
+    int len;
+
+    if (NULL == (info = (char *) kmalloc(BLOCKDEV_INFO_SIZE))){
+        return -ENOMEM;
+    }
+
+    blockdev_info(NULL, info, BLOCKDEV_INFO_SIZE);
+    len = strlen(info);
+
+    if (offset >= len){
+        count = 0;
+    } else {
+        count = MIN(count, len - offset);
+        memcpy(buf, info + offset, count);
+    }
+
+    kfree(info);
+    return count;
+}
+
+/**
+ * The iostat device cannot be written to.
+ *
+ * @return -EINVAL
+ */
+static int
+iostat_write(bytedev_t *dev, int offset, const void *buf, int count)
+{
+    return -EINVAL;
+}
+
 /* Don't worry about these until VM. Once you're there, they shouldn't be hard. */
 
 static int
@@ -169,6 +169,21 @@ pcidev_t* pci_lookup(uint8_t class, uint8_t subclass, uint8_t interface) {
 	return NULL;
 }
 
+/*
+ * Given a vendor and device id, return a pointer to the proper device struct
+ * if one exists, otherwise return NULL
+ */
+pcidev_t* pci_lookup_id(uint16_t vendor, uint16_t device) {
+	pcidev_t* dev = NULL;
+	list_iterate_begin(&pci_list, dev, pcidev_t, pci_link) {
+		if (dev->pci_vendorid == vendor && dev->pci_deviceid == device) {
+			return dev;
+		}
+	} list_iterate_end();
+
+	return NULL;
+}
+
 /*
  * High level interface to reading from the PCI Tables
  */
@@ -0,0 +1,253 @@
+/*
+ *  FILE: dcache.c
+ *  DESC: cache of path name component lookups
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#include "mm/slab.h"
+
+#include "fs/dcache.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+typedef struct dcache_entry {
+        struct fs       *de_fs;
+        ino_t           de_dir;         /* vno of the directory */
+        ino_t           de_vno;         /* vno the name refers to */
+        int             de_negative;    /* the name does not exist */
+        size_t          de_namelen;
+        char            de_name[NAME_LEN];
+        list_link_t     de_hash_link;   /* on a dcache_table bucket */
+        list_link_t     de_lru_link;    /* on dcache_lru */
+} dcache_entry_t;
+
+static slab_allocator_t *dcache_allocator;
+
+static list_t dcache_table[DCACHE_HASH_SIZE];
+/* All entries, least recently used first */
+static list_t dcache_lru;
+static int dcache_nentries;
+
+/* Bumped by every invalidation, so that lookups that raced with one do
+ * not cache what they found */
+static uint32_t dcache_gen;
+
+static uint32_t dcache_nhits;
+static uint32_t dcache_nneghits;
+static uint32_t dcache_nmisses;
+static uint32_t dcache_nreclaimed;
+
+static list_t *
+dcache_bucket(struct fs *fs, ino_t dir, const char *name, size_t len)
+{
+        uint32_t hash = (uint32_t) fs * 31 + dir;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                hash = hash * 31 + (unsigned char) name[i];
+        }
+        return &dcache_table[hash % DCACHE_HASH_SIZE];
+}
+
+static dcache_entry_t *
+dcache_find(struct fs *fs, ino_t dir, const char *name, size_t len)
+{
+        dcache_entry_t *de;
+
+        list_iterate_begin(dcache_bucket(fs, dir, name, len), de,
+                           dcache_entry_t, de_hash_link) {
+                if (de->de_fs == fs && de->de_dir == dir
+                    && de->de_namelen == len
+                    && 0 == strncmp(de->de_name, name, len)) {
+                        return de;
+                }
+        } list_iterate_end();
+
+        return NULL;
+}
+
+static void
+dcache_free(dcache_entry_t *de)
+{
+        list_remove(&de->de_hash_link);
+        list_remove(&de->de_lru_link);
+        slab_obj_free(dcache_allocator, de);
+        dcache_nentries--;
+}
+
+uint32_t
+dcache_generation(void)
+{
+        return dcache_gen;
+}
+
+int
+dcache_lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
+{
+        dcache_entry_t *de = NULL;
+
+        if (len <= NAME_LEN) {
+                de = dcache_find(dir->vn_fs, dir->vn_vno, name, len);
+        }
+
+        if (NULL == de) {
+                dcache_nmisses++;
+                return 1;
+        }
+
+        list_remove(&de->de_lru_link);
+        list_insert_tail(&dcache_lru, &de->de_lru_link);
+
+        if (de->de_negative) {
+                dcache_nneghits++;
+                return -ENOENT;
+        }
+
+        dcache_nhits++;
+        /* may block, after which de may be gone */
+        *result = vget(dir->vn_fs, de->de_vno);
+        return 0;
+}
+
+void
+dcache_enter(vnode_t *dir, const char *name, size_t len, vnode_t *vn,
+             uint32_t gen)
+{
+        dcache_entry_t *de;
+
+        if (len > NAME_LEN || gen != dcache_gen) {
+                return;
+        }
+        /* a mount point looks up as the root of what is mounted on it,
+         * which is not a vno of dir's file system */
+        if (NULL != vn && vn->vn_fs != dir->vn_fs) {
+                return;
+        }
+
+        if (NULL == (de = dcache_find(dir->vn_fs, dir->vn_vno, name, len))) {
+                if (dcache_nentries >= DCACHE_MAX_ENTRIES) {
+                        dcache_free(list_head(&dcache_lru, dcache_entry_t,
+                                              de_lru_link));
+                }
+
+                /* allocating may block, or reclaim entries */
+                if (NULL == (de = slab_obj_alloc(dcache_allocator))) {
+                        return;
+                }
+                if (gen != dcache_gen
+                    || NULL != dcache_find(dir->vn_fs, dir->vn_vno, name, len)) {
+                        slab_obj_free(dcache_allocator, de);
+                        return;
+                }
+
+                de->de_fs = dir->vn_fs;
+                de->de_dir = dir->vn_vno;
+                de->de_namelen = len;
+                memcpy(de->de_name, name, len);
+                list_insert_head(dcache_bucket(dir->vn_fs, dir->vn_vno, name, len),
+                                 &de->de_hash_link);
+                list_insert_tail(&dcache_lru, &de->de_lru_link);
+                dcache_nentries++;
+        }
+
+        de->de_negative = (NULL == vn);
+        de->de_vno = (NULL == vn) ? 0 : vn->vn_vno;
+}
+
+void
+dcache_invalidate(vnode_t *dir, const char *name, size_t len)
+{
+        dcache_entry_t *de;
+
+        dcache_gen++;
+        if (len <= NAME_LEN
+            && NULL != (de = dcache_find(dir->vn_fs, dir->vn_vno, name, len))) {
+                dcache_free(de);
+        }
+}
+
+void
+dcache_purge_dir(vnode_t *dir)
+{
+        dcache_entry_t *de;
+
+        dcache_gen++;
+        list_iterate_begin(&dcache_lru, de, dcache_entry_t, de_lru_link) {
+                if (de->de_fs == dir->vn_fs && de->de_dir == dir->vn_vno) {
+                        dcache_free(de);
+                }
+        } list_iterate_end();
+}
+
+void
+dcache_purge(struct fs *fs)
+{
+        dcache_entry_t *de;
+
+        dcache_gen++;
+        list_iterate_begin(&dcache_lru, de, dcache_entry_t, de_lru_link) {
+                if (NULL == fs || de->de_fs == fs) {
+                        dcache_free(de);
+                }
+        } list_iterate_end();
+}
+
+int
+dcache_reclaim(int target)
+{
+        int nfreed = 0;
+
+        while (!list_empty(&dcache_lru) && (target < 0 || nfreed < target)) {
+                dcache_free(list_head(&dcache_lru, dcache_entry_t, de_lru_link));
+                nfreed++;
+        }
+
+        dcache_nreclaimed += nfreed;
+        return nfreed;
+}
+
+size_t
+dcache_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        uint32_t nlookups = dcache_nhits + dcache_nneghits + dcache_nmisses;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "entries:        %d of %d\n",
+                dcache_nentries, DCACHE_MAX_ENTRIES);
+        iprintf(&buf, &size, "lookups:        %u\n", nlookups);
+        iprintf(&buf, &size, "hits:           %u (%u%%)\n", dcache_nhits,
+                nlookups ? dcache_nhits * 100 / nlookups : 0);
+        iprintf(&buf, &size, "negative hits:  %u (%u%%)\n", dcache_nneghits,
+                nlookups ? dcache_nneghits * 100 / nlookups : 0);
+        iprintf(&buf, &size, "misses:         %u\n", dcache_nmisses);
+        iprintf(&buf, &size, "reclaimed:      %u\n", dcache_nreclaimed);
+
+        return size;
+}
+
+static __attribute__((unused)) void
+dcache_init(void)
+{
+        int i;
+
+        dcache_allocator = slab_allocator_create("dcache", sizeof(dcache_entry_t));
+        KASSERT(NULL != dcache_allocator);
+
+        for (i = 0; i < DCACHE_HASH_SIZE; ++i) {
+                list_init(&dcache_table[i]);
+        }
+        list_init(&dcache_lru);
+}
+init_func(dcache_init);
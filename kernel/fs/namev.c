@@ -12,6 +12,7 @@
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
+#include "fs/dcache.h"
 
 /*kmutex_t lookup_mutex;*/
 
@@ -23,6 +24,12 @@
  * specific lookup() function, but you may want to special case
  * "." and/or ".." here depnding on your implementation.
  *
+ * Results (including names that do not exist) are kept in the name
+ * cache, which is consulted first.
+ *
+ * ".." of the root of a mounted file system is looked up in the directory
+ * it is mounted on, so that paths can climb back out of it.
+ *
  * If dir has no lookup(), return -ENOTDIR.
  *
  * Note: returns with the vnode refcount on *result incremented.
@@ -36,8 +43,28 @@ lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
 
     KASSERT(name != NULL);
 
+#ifdef __MOUNTING__
+    if (len == 2 && name[0] == '.' && name[1] == '.'
+            && dir == dir->vn_fs->fs_root && dir != vfs_root_vn){
+        dir = dir->vn_fs->fs_mtpt;
+    }
+#endif
+
+    uint32_t gen = dcache_generation();
+    int cache_result = dcache_lookup(dir, name, len, result);
+
+    if (cache_result <= 0){
+        return cache_result;
+    }
+
     int lookup_result = dir->vn_ops->lookup(dir, name, len, result);
-    
+
+    if (lookup_result == 0){
+        dcache_enter(dir, name, len, *result, gen);
+    } else if (lookup_result == -ENOENT){
+        dcache_enter(dir, name, len, NULL, gen);
+    }
+
     return lookup_result;
 }
 
@@ -205,6 +232,7 @@ open_namev(const char *pathname, int flag, vnode_t **res_vnode, vnode_t *base)
     if (lookup_res == -ENOENT){
        if (flag & O_CREAT){
            ret_val = dir->vn_ops->create(dir, name, namelen, res_vnode);
+           dcache_invalidate(dir, name, namelen);
        } else {
            ret_val = -ENOENT;
        }
@@ -68,6 +68,9 @@ get_empty_fd(proc_t *p)
  *      o ENXIO (7)
  *        pathname refers to a device special file and no corresponding device
  *        exists.
+ *      o EINVAL (8)
+ *        O_DIRECT is set and the file does not support it (its vnode has no
+ *        read_direct operation).
  */
 
 int
@@ -100,6 +103,9 @@ do_open(const char *filename, int oflags)
     /* step 4: Set the file_t->f-mode */
     f->f_mode = 0;
 
+    int direct = oflags & O_DIRECT;
+    oflags &= ~O_DIRECT;
+
     if (oflags & O_APPEND){
         f->f_mode = FMODE_APPEND;
     }
@@ -126,6 +132,10 @@ do_open(const char *filename, int oflags)
             || f->f_mode == (FMODE_WRITE | FMODE_APPEND)
             || f->f_mode == (FMODE_READ | FMODE_WRITE | FMODE_APPEND));
 
+    if (direct){
+        f->f_mode |= FMODE_DIRECT;
+    }
+
     /* step 5: use open_namev to get the vnode for the file_t */
     int open_result = open_namev(filename, oflags, &f->f_vnode, NULL);
 
@@ -135,6 +145,13 @@ do_open(const char *filename, int oflags)
         return open_result;
     }
 
+    /* error case 8 */
+    if (direct && f->f_vnode->vn_ops->read_direct == NULL){
+        curproc->p_files[fd] = NULL;
+        fput(f);
+        return -EINVAL;
+    }
+
     dbg(DBG_VFS, "found the vnode with id %d. Current refcount is %d\n",
             f->f_vnode->vn_vno, f->f_vnode->vn_mmobj.mmo_refcount);
 
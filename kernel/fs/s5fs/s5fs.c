@@ -17,6 +17,7 @@
 
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
 #include "fs/dirent.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
@@ -38,6 +39,8 @@
 
 /* Diagnostic/Utility: */
 static int s5_check_super(s5_super_t *super);
+static int s5fs_load_bitmap(s5fs_t *s5);
+static void s5fs_release_bitmap(s5fs_t *s5, uint32_t nblocks);
 static int s5fs_check_refcounts(fs_t *fs);
 
 /* fs_t entry points: */
@@ -45,6 +48,7 @@ static void s5fs_read_vnode(vnode_t *vnode);
 static void s5fs_delete_vnode(vnode_t *vnode);
 static int  s5fs_query_vnode(vnode_t *vnode);
 static int  s5fs_umount(fs_t *fs);
+static int  s5fs_sync(fs_t *fs);
 
 /* vnode_t entry points: */
 static int  s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
@@ -60,6 +64,10 @@ static int  s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen);
 static int  s5fs_readdir(vnode_t *vnode, int offset, struct dirent *d);
 static int  s5fs_stat(vnode_t *vnode, struct stat *ss);
 static int  s5fs_release(vnode_t *vnode, file_t *file);
+static int  s5fs_fsync(vnode_t *vnode);
+static int  s5fs_fallocate(vnode_t *vnode, off_t offset, off_t len);
+static int  s5fs_read_direct(vnode_t *vnode, off_t offset, void **pages, uint32_t npages);
+static int  s5fs_write_direct(vnode_t *vnode, off_t offset, void **pages, uint32_t npages);
 static int  s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf);
 static int  s5fs_dirtypage(vnode_t *vnode, off_t offset);
 static int  s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf);
@@ -68,7 +76,8 @@ fs_ops_t s5fs_fsops = {
         s5fs_read_vnode,
         s5fs_delete_vnode,
         s5fs_query_vnode,
-        s5fs_umount
+        s5fs_umount,
+        s5fs_sync
 };
 
 /* vnode operations table for directory files: */
@@ -87,6 +96,10 @@ static vnode_ops_t s5fs_dir_vops = {
         .stat = s5fs_stat,
         .acquire = NULL,
         .release = NULL,
+        .fsync = s5fs_fsync,
+        .fallocate = NULL,
+        .read_direct = NULL,
+        .write_direct = NULL,
         .fillpage = s5fs_fillpage,
         .dirtypage = s5fs_dirtypage,
         .cleanpage = s5fs_cleanpage
@@ -108,6 +121,10 @@ static vnode_ops_t s5fs_file_vops = {
         .stat = s5fs_stat,
         .acquire = NULL,
         .release = NULL,
+        .fsync = s5fs_fsync,
+        .fallocate = s5fs_fallocate,
+        .read_direct = s5fs_read_direct,
+        .write_direct = s5fs_write_direct,
         .fillpage = s5fs_fillpage,
         .dirtypage = s5fs_dirtypage,
         .cleanpage = s5fs_cleanpage
@@ -125,7 +142,7 @@ static vnode_ops_t s5fs_file_vops = {
 int
 s5fs_mount(struct fs *fs)
 {
-        int num;
+        int num, ret;
         blockdev_t *dev;
         s5fs_t *s5;
         pframe_t *vp;
@@ -149,6 +166,15 @@ s5fs_mount(struct fs *fs)
         /*     init s5f_disk: */
         s5->s5f_bdev  = dev;
 
+        /*     init the locks (converting old disks below allocates): */
+        kmutex_init(&s5->s5f_block_mutex);
+        kmutex_init(&s5->s5f_inode_mutex);
+        memset(&s5->s5f_block_stat, 0, sizeof(s5->s5f_block_stat));
+        memset(&s5->s5f_inode_stat, 0, sizeof(s5->s5f_inode_stat));
+        memset(&s5->s5f_vnode_stat, 0, sizeof(s5->s5f_vnode_stat));
+        s5->s5f_nreserved = 0;
+        s5->s5f_journal = NULL;
+
         /*     init s5f_super: */
         pframe_get(S5FS_TO_VMOBJ(s5), S5_SUPER_BLOCK, &vp);
 
@@ -156,16 +182,69 @@ s5fs_mount(struct fs *fs)
 
         s5->s5f_super = (s5_super_t *)(vp->pf_addr);
 
+        pframe_pin(vp);
+
+        /* disks from before the free-space bitmap get one now */
+        if (S5_MAGIC == s5->s5f_super->s5s_magic
+            && S5_FREE_LIST_VERSION == s5->s5f_super->s5s_version
+            && (ret = s5_convert_free_list(s5)) < 0) {
+                pframe_unpin(vp);
+                kfree(s5);
+                return ret;
+        }
+
+        /* finish what was committed before the disk was last unmounted */
+        if (S5_MAGIC == s5->s5f_super->s5s_magic
+            && S5_CURRENT_VERSION == s5->s5f_super->s5s_version
+            && (ret = s5_journal_recover(s5)) < 0) {
+                pframe_unpin(vp);
+                kfree(s5);
+                return ret;
+        }
+
         if (s5_check_super(s5->s5f_super)) {
                 /* corrupt */
+                pframe_unpin(vp);
                 kfree(s5);
                 return -EINVAL;
         }
 
-        pframe_pin(vp);
+        /*     init s5f_bitmap: */
+        if ((ret = s5fs_load_bitmap(s5)) < 0) {
+                pframe_unpin(vp);
+                kfree(s5);
+                return ret;
+        }
+
+        /* and disks from before double and triple indirect blocks get
+         * their inodes rearranged */
+        if (S5_SINGLE_INDIRECT_VERSION == s5->s5f_super->s5s_version
+            && (ret = s5_convert_indirect_blocks(s5)) < 0) {
+                s5fs_release_bitmap(s5, s5->s5f_super->s5s_bitmap_nblocks);
+                pframe_unpin(vp);
+                kfree(s5);
+                return ret;
+        }
 
-        /*     init s5f_mutex: */
-        kmutex_init(&s5->s5f_mutex);
+        /* and disks from before the journal get one, once everything
+         * converted so far is safely on disk */
+        if (S5_NO_JOURNAL_VERSION == s5->s5f_super->s5s_version
+            && ((ret = s5_convert_journal(s5)) < 0
+                || (ret = pframe_clean_range(S5FS_TO_VMOBJ(s5), 0,
+                                             s5->s5f_super->s5s_nblocks)) < 0)) {
+                s5fs_release_bitmap(s5, s5->s5f_super->s5s_bitmap_nblocks);
+                pframe_unpin(vp);
+                kfree(s5);
+                return ret;
+        }
+
+        /*     init s5f_journal: */
+        if ((ret = s5_journal_init(s5)) < 0) {
+                s5fs_release_bitmap(s5, s5->s5f_super->s5s_bitmap_nblocks);
+                pframe_unpin(vp);
+                kfree(s5);
+                return ret;
+        }
 
         /*     init s5f_fs: */
         s5->s5f_fs = fs;
@@ -229,6 +308,7 @@ s5fs_read_vnode(vnode_t *vnode)
     /* generic initializations */
     vnode->vn_len = inode->s5_size;
     vnode->vn_i = (void *) inode;
+    vnode->vn_nreserved = 0;
     inode->s5_linkcount++;
 
     /* type-specific initializations */
@@ -279,6 +359,11 @@ s5fs_delete_vnode(vnode_t *vnode)
 
     s5_inode_t *inode = ((s5_inode_t *) p->pf_addr) + S5_INODE_OFFSET(vnode->vn_vno);
 
+    s5_journal_join(VNODE_TO_S5FS(vnode));
+
+    /* dirty pages of an unlinked file are thrown away, not written back */
+    s5_unreserve_blocks(vnode);
+
     dbg(DBG_S5FS, "decrementing link count on inode %d from %d to %d\n",
             inode->s5_number, inode->s5_linkcount,inode->s5_linkcount - 1);
 
@@ -290,6 +375,8 @@ s5fs_delete_vnode(vnode_t *vnode)
         s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
     }
 
+    s5_journal_leave(VNODE_TO_S5FS(vnode));
+
     pframe_unpin(p);
 }
 
@@ -299,11 +386,18 @@ s5fs_delete_vnode(vnode_t *vnode)
  * The vnode still exists on disk if it has a linkcount greater than 1.
  * (Remember, VFS takes a reference on the inode as long as it uses it.)
  *
+ * If it does not, its pages are about to be thrown away, so those of a
+ * directory are taken out of the journal.
  */
 static int
 s5fs_query_vnode(vnode_t *vnode)
 {
-    return (VNODE_TO_S5INODE(vnode)->s5_linkcount > 1);
+    if (VNODE_TO_S5INODE(vnode)->s5_linkcount > 1){
+        return 1;
+    }
+
+    s5_journal_forget(VNODE_TO_S5FS(vnode), &vnode->vn_mmobj);
+    return 0;
 }
 
 /*
@@ -329,10 +423,18 @@ s5fs_umount(fs_t *fs)
                     "and minor %d!!\n", MAJOR(bd->bd_id), MINOR(bd->bd_id));
         }
 
+        /* directory pages stay pinned until they are committed */
+        if (0 > (ret = s5_journal_commit(s5))) {
+                dbg(DBG_PRINT, "s5fs_umount: WARNING: failed to commit the "
+                    "journal: %d\n", ret);
+        }
+
         vnode_flush_all(fs);
 
         vput(fs->fs_root);
 
+        s5_journal_shutdown(s5);
+
         if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(s5), S5_SUPER_BLOCK, &sbp))) {
                 panic("s5fs_umount: failed to pframe_get super block. "
                       "This should never happen (the page should already "
@@ -345,6 +447,8 @@ s5fs_umount(fs_t *fs)
 
         pframe_unpin(sbp);
 
+        s5fs_release_bitmap(s5, s5->s5f_super->s5s_bitmap_nblocks);
+
         kfree(s5);
 
         blockdev_flush_all(bd);
@@ -352,6 +456,45 @@ s5fs_umount(fs_t *fs)
         return 0;
 }
 
+/*
+ * Commits the journal, so that every change to the file system's metadata
+ * made so far survives a crash.
+ */
+static int
+s5fs_sync(fs_t *fs)
+{
+        return s5_journal_commit(FS_TO_S5FS(fs));
+}
+
+static void
+s5fs_lockstat_info(char **buf, size_t *size, const char *name,
+                   s5_lockstat_t *stat)
+{
+        iprintf(buf, size, "%-16s%u taken, %u contended\n", name,
+                stat->ls_acquired, stat->ls_contended);
+}
+
+size_t
+s5fs_info(const void *arg, char *buf, size_t osize)
+{
+        const fs_t *fs = (const fs_t *)arg;
+        s5fs_t *s5 = FS_TO_S5FS(fs);
+        size_t size = osize;
+
+        KASSERT(NULL != fs);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "free blocks:    %u of %u, %u reserved\n",
+                s5->s5f_super->s5s_nfree_blocks, s5->s5f_super->s5s_nblocks,
+                s5->s5f_nreserved);
+        s5fs_lockstat_info(&buf, &size, "block allocator:", &s5->s5f_block_stat);
+        s5fs_lockstat_info(&buf, &size, "inode allocator:", &s5->s5f_inode_stat);
+        s5fs_lockstat_info(&buf, &size, "inodes:", &s5->s5f_vnode_stat);
+        s5_journal_info(s5, &buf, &size);
+
+        return size;
+}
+
 
 
 
@@ -384,9 +527,9 @@ s5fs_umount(fs_t *fs)
 static int
 s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
 {
-    kmutex_lock(&vnode->vn_mutex);
+    s5_lock_vnode(vnode);
     int ret = s5_read_file(vnode, offset, buf, len);
-    kmutex_unlock(&vnode->vn_mutex);
+    s5_unlock_vnode(vnode);
     return ret;
 }
 
@@ -394,9 +537,44 @@ s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
 static int
 s5fs_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
 {
-    kmutex_lock(&vnode->vn_mutex);
+    s5_journal_begin(VNODE_TO_S5FS(vnode));
+    s5_lock_vnode(vnode);
     int ret = s5_write_file(vnode, offset, buf, len);
-    kmutex_unlock(&vnode->vn_mutex);
+    s5_unlock_vnode(vnode);
+    s5_journal_end(VNODE_TO_S5FS(vnode));
+    return ret;
+}
+
+static int
+s5fs_fallocate(vnode_t *vnode, off_t offset, off_t len)
+{
+    s5_journal_begin(VNODE_TO_S5FS(vnode));
+    s5_lock_vnode(vnode);
+    int ret = s5_fallocate(vnode, offset, len);
+    s5_unlock_vnode(vnode);
+    s5_journal_end(VNODE_TO_S5FS(vnode));
+    return ret;
+}
+
+/* Simply call s5_read_direct. */
+static int
+s5fs_read_direct(vnode_t *vnode, off_t offset, void **pages, uint32_t npages)
+{
+    s5_lock_vnode(vnode);
+    int ret = s5_read_direct(vnode, offset, pages, npages);
+    s5_unlock_vnode(vnode);
+    return ret;
+}
+
+/* Simply call s5_write_direct. */
+static int
+s5fs_write_direct(vnode_t *vnode, off_t offset, void **pages, uint32_t npages)
+{
+    s5_journal_begin(VNODE_TO_S5FS(vnode));
+    s5_lock_vnode(vnode);
+    int ret = s5_write_direct(vnode, offset, pages, npages);
+    s5_unlock_vnode(vnode);
+    s5_journal_end(VNODE_TO_S5FS(vnode));
     return ret;
 }
 
@@ -409,9 +587,9 @@ s5fs_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
 static int
 s5fs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret)
 {
-    kmutex_lock(&file->vn_mutex);
+    s5_lock_vnode(file);
     *ret = &file->vn_mmobj;
-    kmutex_unlock(&file->vn_mutex);
+    s5_unlock_vnode(file);
     return 0;
 }
 
@@ -445,7 +623,8 @@ s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
 {
     KASSERT(namelen < NAME_LEN);
 
-    kmutex_lock(&dir->vn_mutex);
+    s5_journal_begin(VNODE_TO_S5FS(dir));
+    s5_lock_vnode(dir);
 
     fs_t *fs = VNODE_TO_S5FS(dir)->s5f_fs;
 
@@ -453,13 +632,14 @@ s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
 
     if (ino < 0){
         dbg(DBG_S5FS, "unable to alloc a new inode\n");
-        kmutex_unlock(&dir->vn_mutex);
+        s5_unlock_vnode(dir);
+        s5_journal_end(VNODE_TO_S5FS(dir));
         return ino;
     }
 
     vnode_t *child = vget(fs, ino);
 
-    kmutex_lock(&child->vn_mutex);
+    s5_lock_vnode(child);
 
     /* make sure the state of the new vnode is correct */
     assert_new_vnode_state(child, ino, S5_TYPE_DATA, 0);
@@ -469,8 +649,9 @@ s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
     if (link_res < 0){
         dbg(DBG_S5FS, "error creating entry for new directory in parent dir\n");
         vput(child);
-        kmutex_unlock(&child->vn_mutex);
-        kmutex_unlock(&dir->vn_mutex);
+        s5_unlock_vnode(child);
+        s5_unlock_vnode(dir);
+        s5_journal_end(VNODE_TO_S5FS(dir));
         /*s5_free_inode(child);*/
         return link_res;
     }
@@ -480,8 +661,9 @@ s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
 
     *result = child;
 
-    kmutex_unlock(&child->vn_mutex);
-    kmutex_unlock(&dir->vn_mutex);
+    s5_unlock_vnode(child);
+    s5_unlock_vnode(dir);
+    s5_journal_end(VNODE_TO_S5FS(dir));
     return 0;
 }
 
@@ -499,7 +681,8 @@ s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t dev
 {
     KASSERT(namelen < NAME_LEN);
 
-    kmutex_lock(&dir->vn_mutex);
+    s5_journal_begin(VNODE_TO_S5FS(dir));
+    s5_lock_vnode(dir);
 
     fs_t *fs = VNODE_TO_S5FS(dir)->s5f_fs;
 
@@ -515,13 +698,14 @@ s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t dev
 
     if (ino < 0){
         dbg(DBG_S5FS, "unable to alloc a new inode\n");
-        kmutex_unlock(&dir->vn_mutex);
+        s5_unlock_vnode(dir);
+        s5_journal_end(VNODE_TO_S5FS(dir));
         return ino;
     }
     
     vnode_t *child = vget(fs, ino);
 
-    kmutex_lock(&child->vn_mutex);
+    s5_lock_vnode(child);
 
     /* make sure the state of the new vnode is correct */
     assert_new_vnode_state(child, ino, S_ISCHR(mode) ? S5_TYPE_CHR : S5_TYPE_BLK,
@@ -532,8 +716,9 @@ s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t dev
     if (link_res < 0){
         dbg(DBG_S5FS, "error creating entry for new directory in parent dir\n");
         vput(child);
-        kmutex_unlock(&child->vn_mutex);
-        kmutex_unlock(&dir->vn_mutex);
+        s5_unlock_vnode(child);
+        s5_unlock_vnode(dir);
+        s5_journal_end(VNODE_TO_S5FS(dir));
         /*s5_free_inode(child);*/
         return link_res;
     }
@@ -543,8 +728,9 @@ s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t dev
     KASSERT(child->vn_refcount == 0);
     KASSERT(VNODE_TO_S5INODE(child)->s5_linkcount == 1);
 
-    kmutex_unlock(&child->vn_mutex);
-    kmutex_unlock(&dir->vn_mutex);
+    s5_unlock_vnode(child);
+    s5_unlock_vnode(dir);
+    s5_journal_end(VNODE_TO_S5FS(dir));
     return 0;
 }
 
@@ -556,11 +742,11 @@ s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t dev
 int
 s5fs_lookup(vnode_t *base, const char *name, size_t namelen, vnode_t **result)
 {
-    kmutex_lock(&base->vn_mutex);
+    s5_lock_vnode(base);
     int ino = s5_find_dirent(base, name, namelen);
 
     if (ino == -ENOENT){
-        kmutex_unlock(&base->vn_mutex);
+        s5_unlock_vnode(base);
         return -ENOENT;
     }
 
@@ -572,7 +758,7 @@ s5fs_lookup(vnode_t *base, const char *name, size_t namelen, vnode_t **result)
 
     *result = child;
 
-    kmutex_unlock(&base->vn_mutex);
+    s5_unlock_vnode(base);
     return 0;
 }
 
@@ -590,13 +776,15 @@ s5fs_link(vnode_t *child, vnode_t *parent, const char *name, size_t namelen)
     KASSERT(parent->vn_ops->mkdir != NULL);
     KASSERT(child->vn_ops->mkdir == NULL);
 
-    kmutex_lock(&parent->vn_mutex);
-    kmutex_lock(&child->vn_mutex);
+    s5_journal_begin(VNODE_TO_S5FS(parent));
+    s5_lock_vnode(parent);
+    s5_lock_vnode(child);
 
     int ret = s5_link(parent, child, name, namelen);
 
-    kmutex_unlock(&child->vn_mutex);
-    kmutex_unlock(&parent->vn_mutex);
+    s5_unlock_vnode(child);
+    s5_unlock_vnode(parent);
+    s5_journal_end(VNODE_TO_S5FS(parent));
 
     return ret;
 }
@@ -614,9 +802,11 @@ s5fs_unlink(vnode_t *dir, const char *name, size_t namelen)
 {
     KASSERT(dir->vn_ops->mkdir != NULL);
 
-    kmutex_lock(&dir->vn_mutex);
+    s5_journal_begin(VNODE_TO_S5FS(dir));
+    s5_lock_vnode(dir);
     int ret = s5_remove_dirent(dir, name, namelen);
-    kmutex_unlock(&dir->vn_mutex);
+    s5_unlock_vnode(dir);
+    s5_journal_end(VNODE_TO_S5FS(dir));
     return ret;
 }
 
@@ -647,7 +837,8 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
     KASSERT(namelen < NAME_LEN);
     KASSERT(dir->vn_ops->mkdir != NULL);
 
-    kmutex_lock(&dir->vn_mutex);
+    s5_journal_begin(VNODE_TO_S5FS(dir));
+    s5_lock_vnode(dir);
 
     fs_t *fs = VNODE_TO_S5FS(dir)->s5f_fs;
 
@@ -655,13 +846,14 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
 
     if (ino < 0){
         dbg(DBG_S5FS, "unable to alloc a new inode\n");
-        kmutex_unlock(&dir->vn_mutex);
+        s5_unlock_vnode(dir);
+        s5_journal_end(VNODE_TO_S5FS(dir));
         return ino;
     }
 
     vnode_t *child = vget(fs, ino);
 
-    kmutex_lock(&child->vn_mutex);
+    s5_lock_vnode(child);
 
     /* make sure the state of the new vnode is correct */
     assert_new_vnode_state(child, ino, S5_TYPE_DIR, 0);
@@ -673,8 +865,9 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
         /* TODO make sure we should be vputting */
         /*s5_free_inode(child);*/
         vput(child);
-        kmutex_unlock(&child->vn_mutex);
-        kmutex_unlock(&dir->vn_mutex);
+        s5_unlock_vnode(child);
+        s5_unlock_vnode(dir);
+        s5_journal_end(VNODE_TO_S5FS(dir));
         return link_res;
     }
 
@@ -686,8 +879,9 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
         dbg(DBG_S5FS, "error creating entry for \'..\' in new directory\n");
         /*s5_free_inode(child);*/
         vput(child);
-        kmutex_unlock(&child->vn_mutex);
-        kmutex_unlock(&dir->vn_mutex);
+        s5_unlock_vnode(child);
+        s5_unlock_vnode(dir);
+        s5_journal_end(VNODE_TO_S5FS(dir));
         return link_res;
     }
 
@@ -697,8 +891,9 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
         dbg(DBG_S5FS, "error creating entry for new directory in parent dir\n");
         /*s5_free_inode(child);*/
         vput(child);
-        kmutex_unlock(&child->vn_mutex);
-        kmutex_unlock(&dir->vn_mutex);
+        s5_unlock_vnode(child);
+        s5_unlock_vnode(dir);
+        s5_journal_end(VNODE_TO_S5FS(dir));
         return link_res;
     }
 
@@ -708,8 +903,9 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
 
     KASSERT(child->vn_refcount - child->vn_nrespages == 0);
 
-    kmutex_unlock(&child->vn_mutex);
-    kmutex_unlock(&dir->vn_mutex);
+    s5_unlock_vnode(child);
+    s5_unlock_vnode(dir);
+    s5_journal_end(VNODE_TO_S5FS(dir));
     return 0;
 }
 
@@ -730,7 +926,8 @@ s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
     KASSERT(!(namelen == 2 && name[0] == '.' && name[1] == '.'));
     KASSERT(parent->vn_ops->rmdir != NULL);
 
-    kmutex_lock(&parent->vn_mutex);
+    s5_journal_begin(VNODE_TO_S5FS(parent));
+    s5_lock_vnode(parent);
 
     int ino = s5_find_dirent(parent, name, namelen);
 
@@ -739,12 +936,13 @@ s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
 
     if (ino < 0){
         dbg(DBG_S5FS, "error finding child dir to delete\n");
-        kmutex_unlock(&parent->vn_mutex);
+        s5_unlock_vnode(parent);
+        s5_journal_end(VNODE_TO_S5FS(parent));
         return ino;
     }
 
     vnode_t *child = vget(VNODE_TO_S5FS(parent)->s5f_fs, ino);
-    kmutex_lock(&child->vn_mutex);
+    s5_lock_vnode(child);
 
     int dot_lookup_res = s5_find_dirent(child, ".", 1);
     int dotdot_lookup_res = s5_find_dirent(child, "..", 2);
@@ -753,8 +951,9 @@ s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
 
     if (dot_lookup_res < 0 || dotdot_lookup_res < 0){
         dbg(DBG_S5FS, "error reading dirents of directory to delete\n");
-        kmutex_unlock(&child->vn_mutex);
-        kmutex_unlock(&parent->vn_mutex);
+        s5_unlock_vnode(child);
+        s5_unlock_vnode(parent);
+        s5_journal_end(VNODE_TO_S5FS(parent));
         return (dot_lookup_res < 0) ? dot_lookup_res : dotdot_lookup_res;
     }
 
@@ -762,8 +961,9 @@ s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
 
     if ((unsigned) child->vn_len > 2 * sizeof(s5_dirent_t)){
         vput(child);
-        kmutex_unlock(&child->vn_mutex);
-        kmutex_unlock(&parent->vn_mutex);
+        s5_unlock_vnode(child);
+        s5_unlock_vnode(parent);
+        s5_journal_end(VNODE_TO_S5FS(parent));
         return -ENOTEMPTY;
     }
 
@@ -772,9 +972,12 @@ s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
     VNODE_TO_S5INODE(parent)->s5_linkcount--;
     s5_dirty_inode(VNODE_TO_S5FS(parent), VNODE_TO_S5INODE(parent));
 
-    kmutex_unlock(&child->vn_mutex);
-    kmutex_unlock(&parent->vn_mutex);
-    return s5_remove_dirent(parent, name, namelen);
+    s5_unlock_vnode(child);
+    s5_unlock_vnode(parent);
+
+    int ret = s5_remove_dirent(parent, name, namelen);
+    s5_journal_end(VNODE_TO_S5FS(parent));
+    return ret;
 }
 
 
@@ -798,7 +1001,7 @@ static int s5fs_readdir(vnode_t *vnode, off_t offset, struct dirent *d)
         return 0;
     }    
 
-    kmutex_lock(&vnode->vn_mutex);
+    s5_lock_vnode(vnode);
 
     s5_dirent_t s5d;
 
@@ -815,7 +1018,7 @@ static int s5fs_readdir(vnode_t *vnode, off_t offset, struct dirent *d)
         dbg(DBG_S5FS, "error reading dirent from file\n");
     }
 
-    kmutex_unlock(&vnode->vn_mutex);
+    s5_unlock_vnode(vnode);
     return read_res;
 }
 
@@ -832,13 +1035,13 @@ static int s5fs_readdir(vnode_t *vnode, off_t offset, struct dirent *d)
 static int
 s5fs_stat(vnode_t *vnode, struct stat *ss)
 {
-    kmutex_lock(&vnode->vn_mutex);
+    s5_lock_vnode(vnode);
     int allocated_blocks = s5_inode_blocks(vnode);
     s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
 
     if (allocated_blocks < 0){
         dbg(DBG_S5FS, "error calculating number of allocated blocks\n");
-        kmutex_unlock(&vnode->vn_mutex);
+        s5_unlock_vnode(vnode);
         return allocated_blocks;
     }
 
@@ -849,10 +1052,54 @@ s5fs_stat(vnode_t *vnode, struct stat *ss)
     ss->st_blksize = BLOCK_SIZE;
     ss->st_blocks = allocated_blocks;
 
-    kmutex_unlock(&vnode->vn_mutex);
+    s5_unlock_vnode(vnode);
     return 0;
 }
 
+/*
+ * Write back the blocks holding the inode, its indirect blocks, the
+ * superblock (which holds the head of the inode free list) and the
+ * free-space bitmap. The file's data pages have already been written by
+ * the caller, so any blocks that allocated are accounted for here.
+ *
+ * If the file system has a journal, committing it does all that, and
+ * more: it takes along the metadata changes everyone else has made too.
+ */
+static int
+s5fs_fsync(vnode_t *vnode)
+{
+    if (VNODE_TO_S5FS(vnode)->s5f_journal != NULL){
+        return s5_journal_commit(VNODE_TO_S5FS(vnode));
+    }
+
+    s5_lock_vnode(vnode);
+
+    mmobj_t *fs_mmobj = S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode));
+    uint32_t inode_block = S5_INODE_BLOCK(vnode->vn_vno);
+    int ret, err;
+
+    ret = pframe_clean_range(fs_mmobj, inode_block, inode_block + 1);
+
+    if ((err = s5_clean_indirect_blocks(vnode)) < 0 && ret == 0){
+        ret = err;
+    }
+
+    if ((err = pframe_clean_range(fs_mmobj, S5_SUPER_BLOCK, S5_SUPER_BLOCK + 1)) < 0
+        && ret == 0){
+        ret = err;
+    }
+
+    s5_super_t *super = VNODE_TO_S5FS(vnode)->s5f_super;
+    if ((err = pframe_clean_range(fs_mmobj, super->s5s_bitmap_block,
+                    super->s5s_bitmap_block + super->s5s_bitmap_nblocks)) < 0
+        && ret == 0){
+        ret = err;
+    }
+
+    s5_unlock_vnode(vnode);
+    return ret;
+}
+
 
 /*
  * See the comment in vnode.h for what is expected of this function.
@@ -863,7 +1110,7 @@ s5fs_stat(vnode_t *vnode, struct stat *ss)
 static int
 s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
 {
-    int blocknum = s5_seek_to_block(vnode, offset, 0);
+    int blocknum = s5_seek_to_block(vnode, offset, S5_SEEK_DATA);
 
     switch (blocknum){
         case -EFBIG:
@@ -880,29 +1127,58 @@ s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
         return bd->cd_ops->read(bd, 0, pagebuf, S5_BLOCK_SIZE);
     } else {
         blockdev_t *bd = ((s5fs_t *) vnode->vn_fs->fs_i)->s5f_bdev;
-        return bd->bd_ops->read_block(bd, (char *) pagebuf, blocknum, 1/*S5_BLOCK_SIZE*/);
+        return blockdev_read(bd, (char *) pagebuf, blocknum, 1/*S5_BLOCK_SIZE*/);
     }
 }
 
 
 /*
- * if this offset is NOT within a sparse region of the file
+ * if this offset is NOT within a sparse region of the file, or its page
+ * is dirty already
  *     return 0;
  *
- * attempt to make the region containing this offset no longer
- * sparse
- *     - attempt to allocate a free block
+ * make sure the region containing this offset can be made no longer
+ * sparse when its page is written back
+ *     - allocate the indirect blocks on the way to it
+ *     - reserve a free block for it (see s5fs_cleanpage())
  *     - if no free blocks available, return -ENOSPC
- *     - associate this block with the inode; alter the inode as
- *       appropriate
- *         - dirty the page containing this inode
  *
  * Much of this can be done with s5_seek_to_block()
+ *
+ * Directory blocks are metadata, which goes through the journal if there
+ * is one: they are allocated right away, so that the journal knows where
+ * they go, and every change to them is added to the running transaction.
  */
 static int
 s5fs_dirtypage(vnode_t *vnode, off_t offset)
 {
-    int blocknum = s5_seek_to_block(vnode, offset, 0);
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    pframe_t *pf = pframe_get_resident(&vnode->vn_mmobj, S5_DATA_BLOCK(offset));
+
+    if (fs->s5f_journal != NULL && S_ISDIR(vnode->vn_mode)){
+        KASSERT(pf != NULL);
+        s5_journal_join(fs);
+
+        int ret = s5_seek_to_block(vnode, offset, 0);
+        if (ret == 0 && (ret = s5_reserve_block(vnode)) == 0){
+            ret = s5_seek_to_block(vnode, offset, 1);
+        }
+        if (ret > 0){
+            s5_journal_dirty(fs, pf, ret);
+            ret = 0;
+        }
+
+        s5_journal_leave(fs);
+        return ret;
+    }
+
+    if (pf != NULL && pframe_is_dirty(pf)){
+        return 0;
+    }
+
+    s5_journal_join(fs);
+    int blocknum = s5_seek_to_block(vnode, offset, S5_ALLOC_INDIRECT);
+    s5_journal_leave(fs);
 
     switch (blocknum){
         case -EFBIG:
@@ -914,20 +1190,60 @@ s5fs_dirtypage(vnode_t *vnode, off_t offset)
 
     KASSERT(blocknum >= 0 && "forgot to handle an error case");
 
-    return (blocknum == 0) ? s5_seek_to_block(vnode, offset, 1) : 0;
+    return (blocknum == 0) ? s5_reserve_block(vnode) : 0;
+}
+
+/*
+ * Returns the number of pages of the file, starting with pagenum and
+ * going no further than S5_ALLOC_BATCH, that are resident and dirty.
+ */
+static uint32_t
+s5fs_dirty_run(vnode_t *vnode, uint32_t pagenum)
+{
+    uint32_t n = 1;
+    pframe_t *pf;
+
+    while (n < S5_ALLOC_BATCH
+           && (pf = pframe_get_resident(&vnode->vn_mmobj, pagenum + n)) != NULL
+           && pframe_is_dirty(pf)){
+        n++;
+    }
+
+    return n;
 }
 
 /*
  * Like fillpage, but for writing.
+ *
+ * A page that was sparse when it was dirtied only gets its block now, out
+ * of the one reserved for it. The dirty pages right after it that are
+ * waiting for theirs get them too, next to it on disk if there is room,
+ * so that they are laid out in file order however they were written.
+ *
+ * A directory block must not be written in place before the changes to
+ * it are committed to the journal, so that is done first.
  */
 static int
 s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf)
 {
-    int blocknum = s5_seek_to_block(vnode, offset, 1);
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    uint32_t run;
+    int ret;
+
+    if (S_ISDIR(vnode->vn_mode)
+        && s5_journal_pending(fs, s5_seek_to_block(vnode, offset, 0))
+        && (ret = s5_journal_commit(fs)) < 0){
+        return ret;
+    }
+
+    s5_journal_join(fs);
+    int blocknum = s5_seek_to_run(vnode, offset, 1,
+            s5fs_dirty_run(vnode, S5_DATA_BLOCK(offset)), &run);
 
     switch (blocknum){
         case -EFBIG:
         case -ENOSPC:
+            s5_journal_leave(fs);
             return blocknum;
         default:
             /* do nothing */;
@@ -935,8 +1251,10 @@ s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf)
 
     KASSERT(blocknum > 0 && "forgot to handle an error case");
 
-    blockdev_t *bd = ((s5fs_t *) vnode->vn_fs->fs_i)->s5f_bdev;
-    return bd->bd_ops->write_block(bd, (char *) pagebuf, blocknum, 1/*S5_BLOCK_SIZE*/);
+    blockdev_t *bd = fs->s5f_bdev;
+    ret = blockdev_write(bd, (char *) pagebuf, blocknum, 1/*S5_BLOCK_SIZE*/);
+    s5_journal_leave(fs);
+    return ret;
 }
 
 /* Diagnostic/Utility: */
@@ -953,15 +1271,71 @@ s5_check_super(s5_super_t *super)
                   || super->s5s_free_inode == (uint32_t) - 1)
               && super->s5s_root_inode < super->s5s_num_inodes))
                 return -1;
-        if (super->s5s_version != S5_CURRENT_VERSION) {
+        if (super->s5s_version != S5_CURRENT_VERSION
+            && super->s5s_version != S5_NO_JOURNAL_VERSION
+            && super->s5s_version != S5_SINGLE_INDIRECT_VERSION) {
                 dbg(DBG_PRINT, "Filesystem is version %d; "
-                    "only version %d is supported.\n",
-                    super->s5s_version, S5_CURRENT_VERSION);
+                    "only versions %d to %d are supported.\n",
+                    super->s5s_version, S5_FREE_LIST_VERSION,
+                    S5_CURRENT_VERSION);
                 return -1;
         }
+        if (!(super->s5s_bitmap_block > S5_INODE_BLOCK(super->s5s_num_inodes - 1)
+              && super->s5s_bitmap_nblocks == S5_BITMAP_NBLOCKS(super->s5s_nblocks)
+              && super->s5s_bitmap_block + super->s5s_bitmap_nblocks <= super->s5s_nblocks
+              && super->s5s_nfree_blocks < super->s5s_nblocks))
+                return -1;
+        if (super->s5s_version == S5_CURRENT_VERSION
+            && super->s5s_journal_nblocks != 0
+            && !(super->s5s_journal_block > S5_INODE_BLOCK(super->s5s_num_inodes - 1)
+                 && super->s5s_journal_nblocks >= S5_JOURNAL_MIN_NBLOCKS
+                 && super->s5s_journal_block + super->s5s_journal_nblocks <= super->s5s_nblocks))
+                return -1;
+        return 0;
+}
+
+/*
+ * Reads in the blocks of the free-space bitmap and keeps them pinned for
+ * as long as the file system is mounted, like the superblock.
+ * Returns 0 on success, -errno on failure.
+ */
+static int
+s5fs_load_bitmap(s5fs_t *s5)
+{
+        s5_super_t *super = s5->s5f_super;
+        uint32_t i;
+        int ret;
+
+        s5->s5f_bitmap = kmalloc(super->s5s_bitmap_nblocks * sizeof(pframe_t *));
+        if (!s5->s5f_bitmap)
+                return -ENOMEM;
+
+        for (i = 0; i < super->s5s_bitmap_nblocks; i++) {
+                if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(s5),
+                                          super->s5s_bitmap_block + i,
+                                          &s5->s5f_bitmap[i]))) {
+                        s5fs_release_bitmap(s5, i);
+                        return ret;
+                }
+                pframe_pin(s5->s5f_bitmap[i]);
+        }
         return 0;
 }
 
+/*
+ * Unpins the first nblocks bitmap blocks and frees s5f_bitmap.
+ */
+static void
+s5fs_release_bitmap(s5fs_t *s5, uint32_t nblocks)
+{
+        uint32_t i;
+
+        for (i = 0; i < nblocks; i++)
+                pframe_unpin(s5->s5f_bitmap[i]);
+        kfree(s5->s5f_bitmap);
+        s5->s5f_bitmap = NULL;
+}
+
 static void
 calculate_refcounts(int *counts, vnode_t *vnode)
 {
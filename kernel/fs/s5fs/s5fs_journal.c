@@ -0,0 +1,820 @@
+/*
+ *   FILE: s5fs_journal.c
+ *  DESCR: S5 metadata journal, see s5fs_journal.h
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#include "proc/sched.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/mmobj.h"
+
+#include "drivers/blockdev.h"
+
+#include "fs/s5fs/s5fs_subr.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+
+#define dprintf(...) dbg(DBG_S5FS, __VA_ARGS__)
+
+/* The largest number of blocks a transaction can hold: the journal's
+ * first block, a descriptor and a commit block take the rest */
+#define JOURNAL_TXN_MAX(j)      ((j)->j_nblocks - 3)
+
+/*
+ * Reads or writes count blocks of the disk, bypassing the page cache.
+ */
+static int
+s5_journal_io(s5fs_t *fs, void *buf, uint32_t blockno, uint32_t count,
+              int write)
+{
+        blockdev_t *bd = fs->s5f_bdev;
+
+        if (write)
+                return blockdev_write(bd, buf, blockno, count);
+        return blockdev_read(bd, buf, blockno, count);
+}
+
+static int
+s5_journal_valid(s5_journal_block_t *jb, uint32_t type, uint32_t seq)
+{
+        return S5_JOURNAL_MAGIC == jb->s5j_magic && type == jb->s5j_type
+               && seq == jb->s5j_seq
+               && jb->s5j_nentries <= S5_JOURNAL_MAX_ENTRIES;
+}
+
+/*
+ * Fills in jb as a journal block of the given type.
+ */
+static void
+s5_journal_header(s5_journal_block_t *jb, uint32_t type, uint32_t seq)
+{
+        memset(jb, 0, S5_BLOCK_SIZE);
+        jb->s5j_magic = S5_JOURNAL_MAGIC;
+        jb->s5j_type = type;
+        jb->s5j_seq = seq;
+}
+
+/*
+ * Writes the first block of the journal starting at block, which makes
+ * seq the first sequence number expected, and so empties the journal.
+ * jb is a page to build it in.
+ */
+static int
+s5_journal_write_super(s5fs_t *fs, uint32_t block, uint32_t seq,
+                       s5_journal_block_t *jb)
+{
+        s5_journal_header(jb, S5_JOURNAL_SUPER, seq);
+        return s5_journal_io(fs, jb, block, 1, 1);
+}
+
+/*
+ * Returns the number of block images that follow the descriptor desc.
+ */
+static uint32_t
+s5_journal_nimages(s5_journal_block_t *desc)
+{
+        uint32_t i, n = 0;
+
+        for (i = 0; i < desc->s5j_nentries; i++)
+                if (!(desc->s5j_entries[i] & S5_JOURNAL_REVOKE))
+                        n++;
+        return n;
+}
+
+static int
+s5_journal_seen(uint32_t *blocks, uint32_t n, uint32_t blockno)
+{
+        uint32_t i;
+
+        for (i = 0; i < n; i++)
+                if (blocks[i] == blockno)
+                        return 1;
+        return 0;
+}
+
+/*
+ * Transactions are replayed newest first, so that the newest contents of
+ * each block win, and a block revoked by a transaction is left alone by
+ * the ones before it (but not by the one revoking it, which can only
+ * have logged the block after it was allocated again). Blocks are
+ * replayed through the page cache, so that the superblock, which is
+ * already in memory, sees the changes too.
+ */
+int
+s5_journal_recover(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        uint32_t block = s->s5s_journal_block;
+        uint32_t nblocks = s->s5s_journal_nblocks;
+        s5_journal_block_t *jb = NULL, *desc = NULL;
+        uint32_t *txns = NULL, *done = NULL;
+        uint32_t ntxns = 0, ndone = 0, nentries = 0, nreplayed = 0;
+        uint32_t seq, pos, nimages, t, i;
+        pframe_t *pf;
+        int ret;
+
+        if (0 == nblocks)
+                return 0;
+        if (nblocks < S5_JOURNAL_MIN_NBLOCKS
+            || block <= S5_INODE_BLOCK(s->s5s_num_inodes - 1)
+            || block + nblocks > fs->s5f_bdev->bd_nblocks)
+                return -EINVAL;
+
+        jb = page_alloc();
+        desc = page_alloc();
+        txns = kmalloc(nblocks * sizeof(uint32_t));
+        if (NULL == jb || NULL == desc || NULL == txns) {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        if ((ret = s5_journal_io(fs, jb, block, 1, 0)) < 0)
+                goto out;
+        if (S5_JOURNAL_MAGIC != jb->s5j_magic
+            || S5_JOURNAL_SUPER != jb->s5j_type) {
+                ret = -EINVAL;
+                goto out;
+        }
+
+        /* find the transactions that were committed */
+        seq = jb->s5j_seq;
+        for (pos = 1; pos + 2 <= nblocks; pos += nimages + 2) {
+                if ((ret = s5_journal_io(fs, desc, block + pos, 1, 0)) < 0)
+                        goto out;
+                if (!s5_journal_valid(desc, S5_JOURNAL_DESCRIPTOR, seq))
+                        break;
+                nimages = s5_journal_nimages(desc);
+                if (pos + nimages + 2 > nblocks)
+                        break;
+                if ((ret = s5_journal_io(fs, jb, block + pos + nimages + 1,
+                                         1, 0)) < 0)
+                        goto out;
+                if (!s5_journal_valid(jb, S5_JOURNAL_COMMIT, seq))
+                        break;
+                txns[ntxns++] = pos;
+                nentries += desc->s5j_nentries;
+                seq++;
+        }
+
+        if (0 == ntxns)
+                goto out;
+
+        if (NULL == (done = kmalloc(nentries * sizeof(uint32_t)))) {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        for (t = ntxns; t-- > 0;) {
+                uint32_t first = ndone;
+
+                if ((ret = s5_journal_io(fs, desc, block + txns[t], 1, 0)) < 0)
+                        goto out;
+
+                nimages = 0;
+                for (i = 0; i < desc->s5j_nentries; i++) {
+                        uint32_t blockno = desc->s5j_entries[i];
+
+                        if (blockno & S5_JOURNAL_REVOKE)
+                                continue;
+                        nimages++;
+                        if (s5_journal_seen(done, first, blockno))
+                                continue;
+                        if (blockno >= s->s5s_nblocks
+                            || (blockno >= block && blockno < block + nblocks)) {
+                                ret = -EINVAL;
+                                goto out;
+                        }
+
+                        if ((ret = s5_journal_io(fs, jb, block + txns[t] + nimages,
+                                                 1, 0)) < 0
+                            || (ret = pframe_get(S5FS_TO_VMOBJ(fs), blockno, &pf)) < 0)
+                                goto out;
+                        memcpy(pf->pf_addr, jb, S5_BLOCK_SIZE);
+                        if ((ret = pframe_dirty(pf)) < 0)
+                                goto out;
+                        done[ndone++] = blockno;
+                        nreplayed++;
+                }
+
+                for (i = 0; i < desc->s5j_nentries; i++) {
+                        uint32_t blockno = desc->s5j_entries[i];
+
+                        if ((blockno & S5_JOURNAL_REVOKE)
+                            && !s5_journal_seen(done, ndone,
+                                                blockno & ~S5_JOURNAL_REVOKE))
+                                done[ndone++] = blockno & ~S5_JOURNAL_REVOKE;
+                }
+        }
+
+        /* the blocks must be in place before the journal is emptied */
+        if ((ret = pframe_clean_range(S5FS_TO_VMOBJ(fs), 0, s->s5s_nblocks)) < 0
+            || (ret = s5_journal_write_super(fs, block, seq, jb)) < 0)
+                goto out;
+
+        dbg(DBG_PRINT, "s5fs: replayed %u transactions (%u blocks) from the "
+            "journal\n", ntxns, nreplayed);
+
+out:
+        if (NULL != done)
+                kfree(done);
+        if (NULL != txns)
+                kfree(txns);
+        if (NULL != desc)
+                page_free(desc);
+        if (NULL != jb)
+                page_free(jb);
+        return ret;
+}
+
+/*
+ * Sets up an empty journal where the superblock says it goes.
+ */
+int
+s5_journal_format(s5fs_t *fs)
+{
+        s5_journal_block_t *jb;
+        int ret;
+
+        if (NULL == (jb = page_alloc()))
+                return -ENOMEM;
+        ret = s5_journal_write_super(fs, fs->s5f_super->s5s_journal_block, 1, jb);
+        page_free(jb);
+        return ret;
+}
+
+int
+s5_journal_init(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        s5_journal_block_t *jb;
+        s5_journal_t *j;
+        uint32_t seq;
+        int ret;
+
+        fs->s5f_journal = NULL;
+        if (0 == s->s5s_journal_nblocks)
+                return 0;
+
+        if (NULL == (jb = page_alloc()))
+                return -ENOMEM;
+        if (0 == (ret = s5_journal_io(fs, jb, s->s5s_journal_block, 1, 0))
+            && (S5_JOURNAL_MAGIC != jb->s5j_magic
+                || S5_JOURNAL_SUPER != jb->s5j_type))
+                ret = -EINVAL;
+        seq = jb->s5j_seq;
+        page_free(jb);
+        if (ret < 0)
+                return ret;
+
+        if (NULL == (j = kmalloc(sizeof(s5_journal_t))))
+                return -ENOMEM;
+        memset(j, 0, sizeof(s5_journal_t));
+        j->j_block = s->s5s_journal_block;
+        j->j_nblocks = s->s5s_journal_nblocks;
+        j->j_head = 1;
+        j->j_seq = seq;
+        j->j_commit_blocks = JOURNAL_TXN_MAX(j) / 4;
+        sched_queue_init(&j->j_waitq);
+
+        fs->s5f_journal = j;
+        return 0;
+}
+
+/*
+ * Waits until there are no open handles and no commit is being written,
+ * and keeps new handles from being opened until s5_journal_unlock().
+ * Handles joined with s5_journal_join() can still be opened.
+ */
+static void
+s5_journal_lock(s5_journal_t *j)
+{
+        j->j_commit_wanted++;
+        while (j->j_committing || j->j_updates > 0)
+                sched_sleep_on(&j->j_waitq);
+        j->j_commit_wanted--;
+        j->j_committing = 1;
+}
+
+static void
+s5_journal_unlock(s5_journal_t *j)
+{
+        j->j_committing = 0;
+        sched_broadcast_on(&j->j_waitq);
+}
+
+/*
+ * Copies the committed blocks from the journal to where they belong,
+ * and empties the journal. The journal must be locked.
+ *
+ * The blocks are copied from the journal rather than written from their
+ * pages, since those may have changed since they were committed. Blocks
+ * freed meanwhile are left alone, as they may hold something else by now.
+ */
+static int
+s5_journal_checkpoint(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        s5_jentry_t *e;
+        void *buf;
+        uint32_t i;
+        int ret = 0;
+
+        KASSERT(j->j_committing && 0 == j->j_ncommit);
+
+        if (NULL == (buf = page_alloc()))
+                return -ENOMEM;
+
+        for (i = 0; 0 == ret && i < j->j_ncheckpoint; i++) {
+                e = &j->j_checkpoint[i];
+                if (0 == e->je_blockno)
+                        continue;
+                ret = s5_journal_io(fs, buf, j->j_block + e->je_logblock, 1, 0);
+                /* it may have been freed while we were reading it */
+                if (0 == ret && 0 != e->je_blockno)
+                        ret = s5_journal_io(fs, buf, e->je_blockno, 1, 1);
+        }
+
+        if (0 == ret)
+                ret = s5_journal_write_super(fs, j->j_block, j->j_seq, buf);
+        page_free(buf);
+        if (ret < 0)
+                return ret;
+
+        /* revoke records are only needed while the journal holds what
+         * they revoke */
+        j->j_head = 1;
+        j->j_ncheckpoint = 0;
+        j->j_nrevoked = 0;
+        j->j_ncheckpoints++;
+        return 0;
+}
+
+/*
+ * Notes that the latest committed contents of blockno are at logblock.
+ */
+static void
+s5_journal_checkpoint_add(s5_journal_t *j, uint32_t blockno, uint32_t logblock)
+{
+        uint32_t i;
+
+        for (i = 0; i < j->j_ncheckpoint; i++) {
+                if (j->j_checkpoint[i].je_blockno == blockno) {
+                        j->j_checkpoint[i].je_logblock = logblock;
+                        return;
+                }
+        }
+
+        KASSERT(j->j_ncheckpoint < S5_JOURNAL_NBLOCKS);
+        j->j_checkpoint[j->j_ncheckpoint].je_pf = NULL;
+        j->j_checkpoint[j->j_ncheckpoint].je_blockno = blockno;
+        j->j_checkpoint[j->j_ncheckpoint].je_logblock = logblock;
+        j->j_ncheckpoint++;
+}
+
+static void
+s5_journal_add_revoke(s5_journal_t *j, uint32_t blockno)
+{
+        if (!s5_journal_seen(j->j_revoked, j->j_nrevoked, blockno)) {
+                KASSERT(j->j_nrevoked < 2 * S5_JOURNAL_NBLOCKS);
+                j->j_revoked[j->j_nrevoked++] = blockno;
+        }
+}
+
+/*
+ * Puts the blocks of a transaction that could not be written back into
+ * the running transaction, along with its revoke records (found in its
+ * descriptor desc).
+ */
+static void
+s5_journal_requeue(s5fs_t *fs, s5_journal_block_t *desc)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        uint32_t i, k;
+
+        for (i = 0; i < j->j_ncommit; i++) {
+                s5_jentry_t *e = &j->j_commit[i];
+
+                if (NULL == e->je_pf)
+                        continue;
+                for (k = 0; k < j->j_nrunning; k++)
+                        if (j->j_running[k].je_blockno == e->je_blockno)
+                                break;
+                if (0 == e->je_blockno || k < j->j_nrunning) {
+                        pframe_unpin(e->je_pf);
+                } else if (j->j_nrunning >= JOURNAL_TXN_MAX(j)) {
+                        pframe_unpin(e->je_pf);
+                        j->j_noverflows++;
+                        s5_journal_revoke(fs, e->je_blockno);
+                } else {
+                        j->j_running[j->j_nrunning++] = *e;
+                }
+        }
+
+        for (i = 0; i < desc->s5j_nentries; i++)
+                if (desc->s5j_entries[i] & S5_JOURNAL_REVOKE)
+                        s5_journal_add_revoke(j, desc->s5j_entries[i]
+                                              & ~S5_JOURNAL_REVOKE);
+}
+
+/*
+ * Writes the running transaction to the journal. The journal must be
+ * locked.
+ *
+ * The blocks are copied into one buffer along with the descriptor before
+ * anything is written, so that what is committed is what they held when
+ * the transaction was closed, and the descriptor and the blocks go to
+ * disk in one write; the commit block follows once they are there. If
+ * there is no memory for the buffer, the blocks are written straight from
+ * their pages.
+ */
+static int
+s5_journal_write(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        s5_journal_block_t *desc;
+        char *images;
+        uint32_t start, n, i;
+        int ret;
+
+        /* make room; the transaction may grow meanwhile, but never past
+         * what fits in an empty journal */
+        if (j->j_head + j->j_nrunning + 2 > j->j_nblocks
+            && (ret = s5_journal_checkpoint(fs)) < 0)
+                return ret;
+
+        n = j->j_nrunning;
+        KASSERT(j->j_head + n + 2 <= j->j_nblocks);
+
+        if (NULL != (images = page_alloc_n(n + 1)))
+                desc = (s5_journal_block_t *)images;
+        else if (NULL == (desc = page_alloc()))
+                return -ENOMEM;
+
+        s5_journal_header(desc, S5_JOURNAL_DESCRIPTOR, j->j_seq);
+        for (i = 0; i < n; i++) {
+                desc->s5j_entries[i] = j->j_running[i].je_blockno;
+                if (NULL != images)
+                        memcpy(images + (i + 1) * S5_BLOCK_SIZE,
+                               j->j_running[i].je_pf->pf_addr, S5_BLOCK_SIZE);
+        }
+        KASSERT(n + j->j_nrevoked <= S5_JOURNAL_MAX_ENTRIES);
+        for (i = 0; i < j->j_nrevoked; i++)
+                desc->s5j_entries[n + i] = j->j_revoked[i] | S5_JOURNAL_REVOKE;
+        desc->s5j_nentries = n + j->j_nrevoked;
+
+        /* from here on, changes go to the next transaction */
+        memcpy(j->j_commit, j->j_running, n * sizeof(s5_jentry_t));
+        j->j_ncommit = n;
+        j->j_nrunning = 0;
+        j->j_nrevoked = 0;
+
+        start = j->j_block + j->j_head;
+        if (NULL != images) {
+                ret = s5_journal_io(fs, images, start, n + 1, 1);
+        } else {
+                ret = s5_journal_io(fs, desc, start, 1, 1);
+                for (i = 0; 0 == ret && i < n; i++) {
+                        /* a page forgotten meanwhile belongs to a removed
+                         * directory, whose block is revoked next */
+                        pframe_t *pf = j->j_commit[i].je_pf;
+                        ret = s5_journal_io(fs, NULL != pf ? pf->pf_addr
+                                            : (void *)desc, start + 1 + i, 1, 1);
+                }
+        }
+
+        if (ret < 0) {
+                s5_journal_requeue(fs, desc);
+        } else {
+                /* the commit block is the descriptor with its type
+                 * changed, which is as good as any */
+                desc->s5j_type = S5_JOURNAL_COMMIT;
+                ret = s5_journal_io(fs, desc, start + n + 1, 1, 1);
+                desc->s5j_type = S5_JOURNAL_DESCRIPTOR;
+                if (ret < 0)
+                        s5_journal_requeue(fs, desc);
+        }
+
+        if (NULL != images)
+                page_free_n(images, n + 1);
+        else
+                page_free(desc);
+
+        if (0 == ret) {
+                for (i = 0; i < n; i++) {
+                        s5_jentry_t *e = &j->j_commit[i];
+
+                        if (0 != e->je_blockno)
+                                s5_journal_checkpoint_add(j, e->je_blockno,
+                                                          j->j_head + 1 + i);
+                        if (NULL != e->je_pf)
+                                pframe_unpin(e->je_pf);
+                }
+                j->j_head += n + 2;
+                j->j_seq++;
+                j->j_ncommits++;
+                j->j_nlogged += n;
+        } else {
+                dbg(DBG_PRINT, "s5fs: WARNING: failed to commit journal "
+                    "transaction %u: %d\n", j->j_seq, ret);
+        }
+        j->j_ncommit = 0;
+
+        return ret;
+}
+
+int
+s5_journal_commit(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        int ret = 0;
+
+        if (NULL == j)
+                return 0;
+
+        s5_journal_lock(j);
+        if (0 != j->j_nrunning || 0 != j->j_nrevoked)
+                ret = s5_journal_write(fs);
+        s5_journal_unlock(j);
+
+        return ret;
+}
+
+int
+s5_journal_flush(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        int ret;
+
+        if (NULL == j)
+                return 0;
+
+        if ((ret = s5_journal_commit(fs)) < 0)
+                return ret;
+
+        s5_journal_lock(j);
+        ret = s5_journal_checkpoint(fs);
+        s5_journal_unlock(j);
+
+        return ret;
+}
+
+void
+s5_journal_shutdown(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+
+        if (NULL == j)
+                return;
+
+        if (s5_journal_flush(fs) < 0) {
+                dbg(DBG_PRINT, "s5fs: WARNING: failed to flush the journal, "
+                    "its metadata is written in place\n");
+        }
+
+        KASSERT(0 == j->j_updates && !j->j_committing);
+        while (j->j_nrunning > 0)
+                pframe_unpin(j->j_running[--j->j_nrunning].je_pf);
+
+        fs->s5f_journal = NULL;
+        kfree(j);
+}
+
+void
+s5_journal_begin(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+
+        if (NULL == j)
+                return;
+
+        if (j->j_nrunning >= j->j_commit_blocks)
+                s5_journal_commit(fs);
+        while (j->j_commit_wanted || j->j_committing)
+                sched_sleep_on(&j->j_waitq);
+
+        j->j_updates++;
+        j->j_nhandles++;
+}
+
+void
+s5_journal_end(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+
+        if (NULL == j)
+                return;
+
+        KASSERT(j->j_updates > 0);
+        if (0 == --j->j_updates) {
+                sched_broadcast_on(&j->j_waitq);
+                if (j->j_nrunning >= j->j_commit_blocks && !j->j_commit_wanted)
+                        s5_journal_commit(fs);
+        }
+}
+
+void
+s5_journal_join(s5fs_t *fs)
+{
+        if (NULL != fs->s5f_journal)
+                fs->s5f_journal->j_updates++;
+}
+
+void
+s5_journal_leave(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+
+        if (NULL == j)
+                return;
+
+        KASSERT(j->j_updates > 0);
+        if (0 == --j->j_updates)
+                sched_broadcast_on(&j->j_waitq);
+}
+
+/*
+ * Commits the running transaction although handles are still open on it,
+ * because it is full. The changes of the system calls that are halfway
+ * through are split between it and the next transaction, so a crash
+ * between the two commits can find them half done; but no block reaches
+ * the disk before it is committed, as one written in place could.
+ *
+ * A commit being written is waited for first: it has taken the blocks
+ * of the running transaction already, and never waits for handles itself.
+ */
+static int
+s5_journal_force(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        int ret;
+
+        while (j->j_committing)
+                sched_sleep_on(&j->j_waitq);
+        if (j->j_nrunning < JOURNAL_TXN_MAX(j))
+                return 0;
+
+        j->j_committing = 1;
+        ret = s5_journal_write(fs);
+        s5_journal_unlock(j);
+        j->j_nforced++;
+
+        return ret;
+}
+
+/*
+ * If the running transaction is full, it is committed first, which may
+ * block. Only if that fails is the block left out of it, to be written in
+ * place whenever its page is cleaned; it is revoked, so that what the
+ * journal holds of it does not overwrite what is written.
+ */
+void
+s5_journal_dirty(s5fs_t *fs, pframe_t *pf, uint32_t blockno)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        s5_jentry_t *e;
+        uint32_t i;
+
+        if (NULL == j)
+                return;
+
+        KASSERT(0 != blockno);
+
+        /* others may add it, or fill the transaction again, while a
+         * forced commit is written */
+        while (1) {
+                for (i = 0; i < j->j_nrunning; i++) {
+                        if (j->j_running[i].je_blockno == blockno) {
+                                KASSERT(j->j_running[i].je_pf == pf);
+                                return;
+                        }
+                }
+                if (j->j_nrunning < JOURNAL_TXN_MAX(j))
+                        break;
+                if (s5_journal_force(fs) < 0) {
+                        j->j_noverflows++;
+                        s5_journal_revoke(fs, blockno);
+                        return;
+                }
+        }
+
+        pframe_pin(pf);
+        e = &j->j_running[j->j_nrunning++];
+        e->je_pf = pf;
+        e->je_blockno = blockno;
+        e->je_logblock = 0;
+}
+
+void
+s5_journal_revoke(s5fs_t *fs, uint32_t blockno)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        int logged = 0;
+        uint32_t i;
+
+        if (NULL == j)
+                return;
+
+        for (i = 0; i < j->j_nrunning; i++) {
+                if (j->j_running[i].je_blockno == blockno) {
+                        pframe_unpin(j->j_running[i].je_pf);
+                        j->j_running[i] = j->j_running[--j->j_nrunning];
+                        break;
+                }
+        }
+
+        /* the journal may hold it already, if it was committed earlier or
+         * is being committed now */
+        for (i = 0; i < j->j_ncommit; i++) {
+                if (j->j_commit[i].je_blockno == blockno) {
+                        j->j_commit[i].je_blockno = 0;
+                        logged = 1;
+                }
+        }
+        for (i = 0; i < j->j_ncheckpoint; i++) {
+                if (j->j_checkpoint[i].je_blockno == blockno) {
+                        j->j_checkpoint[i].je_blockno = 0;
+                        logged = 1;
+                }
+        }
+
+        if (logged)
+                s5_journal_add_revoke(j, blockno);
+}
+
+void
+s5_journal_forget(s5fs_t *fs, mmobj_t *obj)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        uint32_t i;
+
+        if (NULL == j)
+                return;
+
+        for (i = 0; i < j->j_nrunning;) {
+                if (j->j_running[i].je_pf->pf_obj == obj) {
+                        pframe_unpin(j->j_running[i].je_pf);
+                        j->j_running[i] = j->j_running[--j->j_nrunning];
+                } else {
+                        i++;
+                }
+        }
+
+        for (i = 0; i < j->j_ncommit; i++) {
+                pframe_t *pf = j->j_commit[i].je_pf;
+
+                if (NULL != pf && pf->pf_obj == obj) {
+                        pframe_unpin(pf);
+                        j->j_commit[i].je_pf = NULL;
+                }
+        }
+}
+
+int
+s5_journal_pending(s5fs_t *fs, uint32_t blockno)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        uint32_t i;
+
+        if (NULL == j || 0 == blockno)
+                return 0;
+
+        for (i = 0; i < j->j_nrunning; i++)
+                if (j->j_running[i].je_blockno == blockno)
+                        return 1;
+        for (i = 0; i < j->j_ncommit; i++)
+                if (j->j_commit[i].je_blockno == blockno)
+                        return 1;
+        return 0;
+}
+
+void
+s5_journal_info(s5fs_t *fs, char **buf, size_t *size)
+{
+        s5_journal_t *j = fs->s5f_journal;
+
+        if (NULL == j) {
+                iprintf(buf, size, "journal:        none\n");
+                return;
+        }
+
+        iprintf(buf, size, "journal:        blocks %u-%u, %u in use\n",
+                j->j_block, j->j_block + j->j_nblocks - 1, j->j_head);
+        iprintf(buf, size, "commits:        %u (%u blocks, %u handles)\n",
+                j->j_ncommits, j->j_nlogged, j->j_nhandles);
+        iprintf(buf, size, "running:        %u blocks, %u revoked, "
+                "%d handles open\n", j->j_nrunning, j->j_nrevoked,
+                j->j_updates);
+        iprintf(buf, size, "checkpoints:    %u\n", j->j_ncheckpoints);
+        iprintf(buf, size, "forced commits: %u\n", j->j_nforced);
+        iprintf(buf, size, "overflows:      %u\n", j->j_noverflows);
+}
@@ -23,6 +23,7 @@
 #include "fs/vnode.h"
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
 #include "mm/mm.h"
 #include "mm/page.h"
 
@@ -38,56 +39,131 @@
                 KASSERT(!err                                         \
                         && "shouldn\'t fail for a page belonging "   \
                         "to a block device");                        \
+                s5_journal_dirty((fs), p, S5_SUPER_BLOCK);           \
         } while (0)
 
 #define NDIRENTS 10
 
 static void s5_free_block(s5fs_t *fs, int block);
-static int s5_alloc_block(s5fs_t *);
+static int s5_alloc_blocks(s5fs_t *fs, uint32_t goal, uint32_t *count,
+        int reserved);
+static int s5_alloc_block(s5fs_t *, uint32_t goal);
 
-/* allocated an indirect block for a vnode who's indirect block is currently sparse */
-static int alloc_indirect_block(vnode_t *v){
+/*
+ * Allocates a disk block for a file, preferably goal. Blocks that will
+ * hold block pointers (indirect is true) are zeroed; the contents of data
+ * blocks are undefined. Returns the block number or -errno.
+ */
+static int
+s5_alloc_file_block(s5fs_t *fs, uint32_t goal, int indirect)
+{
+    int blocknum = s5_alloc_block(fs, goal);
+
+    if (blocknum < 0 || !indirect){
+        return blocknum;
+    }
+
+    pframe_t *p;
+    int get_res = pframe_get(S5FS_TO_VMOBJ(fs), blocknum, &p);
 
-    /* an array of 0's that we'll use to quickly create blocks of zeros */
-    static int zero_array[BLOCK_SIZE] = {};
+    if (get_res < 0){
+        s5_free_block(fs, blocknum);
+        return get_res;
+    }
 
-    s5_inode_t *inode = VNODE_TO_S5INODE(v);
+    memset(p->pf_addr, 0, S5_BLOCK_SIZE);
 
-    KASSERT(inode->s5_indirect_block == 0);
+    int dirty_res = pframe_dirty(p);
+    KASSERT(!dirty_res && "shouldn't fail for a page belonging to a block device");
+    s5_journal_dirty(fs, p, blocknum);
 
-    /* first, get an indirect block */
-    int indirect_block = s5_alloc_block(VNODE_TO_S5FS(v));
+    return blocknum;
+}
 
-    if (indirect_block == -ENOSPC){
-        dbg(DBG_S5FS, "couldn't alloc a new block\n");
-        return -ENOSPC;
+/*
+ * Finds the slot in the inode that the pointer to the given block of the
+ * file is reached from. Returns the number of levels of indirect blocks
+ * between that slot and the block (0 for a direct block), and sets *index
+ * to the position of the block among those reached from the slot.
+ */
+static int
+s5_block_path(s5_inode_t *inode, uint32_t block_index, uint32_t **slot,
+        uint32_t *index)
+{
+    if (block_index < S5_NDIRECT_BLOCKS){
+        *slot = &inode->s5_direct_blocks[block_index];
+        *index = 0;
+        return 0;
     }
 
-    KASSERT(indirect_block > 0 && "forgot to handle an error case");
+    uint32_t span = S5_NIDIRECT_BLOCKS;
+    int level = 1;
 
-    /* then, zero it */
-    pframe_t *ind_page;
-    mmobj_t *mmo = S5FS_TO_VMOBJ(VNODE_TO_S5FS(v));
+    block_index -= S5_NDIRECT_BLOCKS;
+    while (block_index >= span){
+        KASSERT(level < S5_INDIRECT_LEVELS);
+        block_index -= span;
+        span *= S5_NIDIRECT_BLOCKS;
+        level++;
+    }
 
-    int get_res = pframe_get(mmo, indirect_block, &ind_page);
+    *slot = &inode->s5_indirect_blocks[level - 1];
+    *index = block_index;
+    return level;
+}
 
-    if (get_res < 0){
-        return get_res;
+/*
+ * Returns the number of block pointers, starting at slot and going no
+ * further than max or end, that continue the run started by *slot: that
+ * point to the blocks right after it on disk, or are all 0.
+ */
+static uint32_t
+s5_run_length(uint32_t *slot, uint32_t *end, uint32_t max)
+{
+    uint32_t n = 1;
+
+    while (n < max && slot + n < end
+           && slot[n] == (slot[0] ? slot[0] + n : 0)){
+        n++;
     }
 
-    memcpy(ind_page->pf_addr, zero_array, BLOCK_SIZE);
+    return n;
+}
 
-    int dirty_res = pframe_dirty(ind_page);
+/*
+ * Returns the number of block pointers, starting at slot (the pointer to
+ * block block_index of the file) and going no further than max or end,
+ * that are 0 and whose pages are not resident either. A page that is
+ * resident may be dirty, and so have a block reserved for it already.
+ */
+static uint32_t
+s5_unmapped_run(vnode_t *vnode, uint32_t block_index, uint32_t *slot,
+        uint32_t *end, uint32_t max)
+{
+    uint32_t n = 0;
 
-    if (dirty_res < 0){
-        return dirty_res;
+    while (n < max && slot + n < end && slot[n] == 0
+           && pframe_get_resident(&vnode->vn_mmobj, block_index + n) == NULL){
+        n++;
     }
 
-    /* finally, set this block to be the indirect block of the inode */
-    inode->s5_indirect_block = indirect_block;
-    s5_dirty_inode(VNODE_TO_S5FS(v), inode);
+    return n;
+}
 
-    return 0;
+/*
+ * Dirties what a block pointer changed by s5_seek_to_run() is stored in:
+ * the block of pointers parent, or the inode if parent is NULL.
+ */
+static void
+s5_dirty_slot(s5fs_t *fs, s5_inode_t *inode, pframe_t *parent)
+{
+    if (parent != NULL){
+        int ret = pframe_dirty(parent);
+        KASSERT(!ret && "shouldn't fail for a page belonging to a block device");
+        s5_journal_dirty(fs, parent, parent->pf_pagenum);
+    } else {
+        s5_dirty_inode(fs, inode);
+    }
 }
 
 /*
@@ -97,118 +173,244 @@ static int alloc_indirect_block(vnode_t *v){
  * If the seek pointer refers to a sparse block, and alloc is false,
  * then return 0. If the seek pointer refers to a sparse block, and
  * alloc is true, then allocate a new disk block (and make the inode
- * point to it) and return it.
+ * point to it) and return it. Missing indirect blocks on the way are
+ * allocated too; new blocks go right after the file's previous block
+ * on disk if they can. If alloc is S5_ALLOC_INDIRECT, only the
+ * indirect blocks are allocated, and 0 is returned for a sparse block.
  *
- * Be sure to handle indirect blocks!
+ * Data blocks are allocated when their pages are written back, and come
+ * out of the blocks reserved for the file by s5_reserve_block() when the
+ * pages were dirtied. If run is not NULL, the sparse blocks right after
+ * this one, going no further than max, are allocated along with it, as
+ * one run if there is room; the caller must know that their pages are
+ * dirty.
  *
- * If there is an error, return -errno.
+ * Blocks allocated by fallocate(2) are unwritten (S5_BLOCK_UNWRITTEN)
+ * until alloc is 1 for them, which means that their page is being
+ * written back. They are reported as sparse if alloc is S5_SEEK_DATA,
+ * and as the block they are otherwise. If alloc is S5_ALLOC_UNWRITTEN,
+ * sparse blocks are allocated as unwritten ones, along with the sparse
+ * blocks after them (up to max if run is not NULL) whose pages are not
+ * resident; the blocks of resident pages are left sparse.
  *
- * You probably want to use pframe_get, pframe_pin, pframe_unpin, pframe_dirty.
+ * If run is not NULL, *run is set to the number of blocks of the file,
+ * starting with this one and going no further than max, that follow it
+ * on disk (or are sparse too, if 0 is returned), so that callers can
+ * read or write all of them in one go. Runs do not extend past the
+ * block of pointers that maps this block.
+ *
+ * If there is an error, return -errno.
  */
 int
-s5_seek_to_block(vnode_t *vnode, off_t seekptr, int alloc)
+s5_seek_to_run(vnode_t *vnode, off_t seekptr, int alloc, uint32_t max,
+        uint32_t *run)
 {
-    int block_index = S5_DATA_BLOCK(seekptr);
+    uint32_t block_index = S5_DATA_BLOCK(seekptr);
+
+    KASSERT(run == NULL || max > 0);
 
-    if ((unsigned) block_index >= S5_MAX_FILE_BLOCKS){
+    if (seekptr < 0 || block_index >= S5_MAX_FILE_BLOCKS){
         dbg(DBG_S5FS, "file too large");
         return -EFBIG;
     }
 
-    if (seekptr > vnode->vn_len && !alloc){
-        return 0;
-    }
-
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
     s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+    pframe_t *pinned[S5_INDIRECT_LEVELS];
+    pframe_t *parent = NULL;    /* NULL while slot is in the inode */
+    int npinned = 0;
+    int goal = -1;
+    int ret;
+
+    uint32_t *slot, index;
+    int level = s5_block_path(inode, block_index, &slot, &index);
+    uint32_t *end = inode->s5_direct_blocks + S5_NDIRECT_BLOCKS;
+
+    /* the number of blocks of the file reached from slot */
+    uint32_t span = 1;
+    int i;
+    for (i = 0; i < level; i++){
+        span *= S5_NIDIRECT_BLOCKS;
+    }
 
-    uint32_t block_num;
-
-    if (block_index >= S5_NDIRECT_BLOCKS){
-        pframe_t *ind_page;
-
-        mmobj_t *mmo = S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode));
-
-        if (inode->s5_indirect_block == 0){
-            if (!alloc){
-                return 0;
+    for (;;){
+        if (*slot == 0){
+            if (!alloc || alloc == S5_SEEK_DATA
+                || (alloc == S5_ALLOC_INDIRECT && level == 0)){
+                if (run != NULL){
+                    *run = level ? MIN(max, span - index)
+                                 : s5_run_length(slot, end, max);
+                }
+                ret = 0;
+                break;
             }
 
-            int alloc_res = alloc_indirect_block(vnode);
-            if (alloc_res < 0){
-                dbg(DBG_S5FS, "error allocating indirect block\n");
-                return alloc_res;
+            if (goal < 0){
+                int prev = block_index > 0
+                    ? s5_seek_to_block(vnode, seekptr - S5_BLOCK_SIZE, 0) : 0;
+                goal = prev > 0 ? prev + 1 : 0;
             }
-        }
 
-        if (pframe_get(mmo, inode->s5_indirect_block, &ind_page) < 0){
-            panic("an indirect block is messed up\n");
-        }
-
-        block_num = ((uint32_t *) ind_page->pf_addr)[block_index - S5_NDIRECT_BLOCKS];
-
-        /* case where we've found a sparse block and need to allocate*/
-        if (block_num == 0 && alloc){
-
-            pframe_pin(ind_page);
-            int block_num = s5_alloc_block(VNODE_TO_S5FS(vnode));
-            pframe_unpin(ind_page);
+            uint32_t count = 1;
+
+            if (level > 0){
+                ret = s5_alloc_file_block(fs, goal, 1);
+            } else if (alloc == S5_ALLOC_UNWRITTEN){
+                count = s5_unmapped_run(vnode, block_index, slot, end,
+                        run != NULL ? max : 1);
+                if (count == 0){
+                    if (run != NULL){
+                        *run = 1;
+                    }
+                    ret = 0;
+                    break;
+                }
+                ret = s5_alloc_blocks(fs, goal, &count, 0);
+            } else {
+                if (run != NULL){
+                    count = s5_run_length(slot, end, max);
+                }
+                KASSERT((uint32_t) vnode->vn_nreserved >= count
+                        && "dirty page without a reserved block");
+                ret = s5_alloc_blocks(fs, goal, &count, 1);
+            }
 
-            if (block_num == -ENOSPC){
+            if (ret < 0){
                 dbg(DBG_S5FS, "couldn't alloc a new block\n");
-                return -ENOSPC;
+                break;
             }
 
-            KASSERT(block_num > 0 && "forgot to handle an error case");
-
-            ((uint32_t *) ind_page->pf_addr)[block_index - S5_NDIRECT_BLOCKS] = block_num;
+            for (i = 0; i < (int) count; i++){
+                if (level > 0 || alloc != S5_ALLOC_UNWRITTEN){
+                    slot[i] = ret + i;
+                } else if (slot[i] == 0 && pframe_get_resident(&vnode->vn_mmobj,
+                            block_index + i) == NULL){
+                    slot[i] = (ret + i) | S5_BLOCK_UNWRITTEN;
+                } else {
+                    /* its page came in while we were allocating */
+                    s5_free_block(fs, ret + i);
+                }
+            }
+            if (level == 0 && alloc != S5_ALLOC_UNWRITTEN){
+                vnode->vn_nreserved -= count;
+            }
+            goal = ret + count;
 
-            int dirty_res = pframe_dirty(ind_page);
+            s5_dirty_slot(fs, inode, parent);
+        }
 
-            if (dirty_res < 0){
-                return dirty_res;
+        if (level == 0){
+            if (*slot & S5_BLOCK_UNWRITTEN){
+                if (alloc == S5_SEEK_DATA){
+                    if (run != NULL){
+                        *run = s5_run_length(slot, end, max);
+                    }
+                    ret = 0;
+                    break;
+                }
+                if (alloc == 1){
+                    *slot &= ~S5_BLOCK_UNWRITTEN;
+                    s5_dirty_slot(fs, inode, parent);
+                }
+            }
+            if (run != NULL){
+                *run = s5_run_length(slot, end, max);
             }
+            ret = *slot & ~S5_BLOCK_UNWRITTEN;
+            break;
+        }
 
+        pframe_t *p;
+        if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), *slot, &p)) < 0){
+            break;
         }
+        pframe_pin(p);
+        pinned[npinned++] = p;
+        parent = p;
+
+        span /= S5_NIDIRECT_BLOCKS;
+        slot = (uint32_t *) p->pf_addr + index / span;
+        end = (uint32_t *) p->pf_addr + S5_NIDIRECT_BLOCKS;
+        index %= span;
+        level--;
+    }
 
-    } else {
-        block_num = inode->s5_direct_blocks[block_index];
+    while (npinned > 0){
+        pframe_unpin(pinned[--npinned]);
+    }
 
-        /* case where we've found a sparse block and need to allocate*/
-        if (block_num == 0 && alloc){
-            int block_num = s5_alloc_block(VNODE_TO_S5FS(vnode));
+    return ret;
+}
 
-            if (block_num == -ENOSPC){
-                dbg(DBG_S5FS, "couldn't alloc a new block\n");
-                return -ENOSPC;
-            }
+/*
+ * Return the disk-block number for the given seek pointer, allocating it
+ * if alloc is true and it is sparse; see s5_seek_to_run().
+ */
+int
+s5_seek_to_block(vnode_t *vnode, off_t seekptr, int alloc)
+{
+    return s5_seek_to_run(vnode, seekptr, alloc, 1, NULL);
+}
 
-            KASSERT(block_num > 0 && "forgot to handle an error case");
 
-            inode->s5_direct_blocks[block_index] = block_num;
-            s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
-        }
-    }
+/*
+ * Locks mtx, counting whether it had to be waited for in stat.
+ */
+static void
+s5_lock(kmutex_t *mtx, s5_lockstat_t *stat)
+{
+        stat->ls_acquired++;
+        if (NULL != mtx->km_holder)
+                stat->ls_contended++;
+        kmutex_lock(mtx);
+}
 
-    return block_num;
+/*
+ * Locks the block allocator. It must not be held across anything that
+ * can block on I/O; the bitmap it protects is always resident.
+ */
+static void
+lock_blocks(s5fs_t *fs)
+{
+        s5_lock(&fs->s5f_block_mutex, &fs->s5f_block_stat);
 }
 
+static void
+unlock_blocks(s5fs_t *fs)
+{
+        kmutex_unlock(&fs->s5f_block_mutex);
+}
 
 /*
- * Locks the mutex for the whole file system
+ * Locks the inode allocator. It must not be held across anything that can
+ * block on I/O either.
  */
 static void
-lock_s5(s5fs_t *fs)
+lock_inodes(s5fs_t *fs)
+{
+        s5_lock(&fs->s5f_inode_mutex, &fs->s5f_inode_stat);
+}
+
+static void
+unlock_inodes(s5fs_t *fs)
 {
-        kmutex_lock(&fs->s5f_mutex);
+        kmutex_unlock(&fs->s5f_inode_mutex);
 }
 
 /*
- * Unlocks the mutex for the whole file system
+ * Locks the inode of the given vnode, which protects its contents and
+ * block pointers.
  */
-static void
-unlock_s5(s5fs_t *fs)
+void
+s5_lock_vnode(vnode_t *vnode)
+{
+        s5_lock(&vnode->vn_mutex, &VNODE_TO_S5FS(vnode)->s5f_vnode_stat);
+}
+
+void
+s5_unlock_vnode(vnode_t *vnode)
 {
-        kmutex_unlock(&fs->s5f_mutex);
+        kmutex_unlock(&vnode->vn_mutex);
 }
 
 static off_t max(off_t a, off_t b){
@@ -237,6 +439,11 @@ static off_t min(off_t a, off_t b){
  * use the vnode's pframe functions, which will eventually result in a
  * call to s5_seek_to_block().
  *
+ * Pages that are not resident are only read in from disk if part of what
+ * they hold survives the write: pages that are overwritten entirely, and
+ * pages that start at or past the end of the file, are set up in memory
+ * without any I/O.
+ *
  * You will need pframe_dirty(), pframe_get(), memcpy().
  */
 int
@@ -247,8 +454,12 @@ s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
         return -EINVAL;
     }
 
-    if (seek + len >= S5_MAX_FILE_SIZE){
-        len = S5_MAX_FILE_SIZE - seek - 1;
+    if (seek >= S5_MAX_FILE_SIZE){
+        return -EFBIG;
+    }
+
+    if (seek + len > S5_MAX_FILE_SIZE){
+        len = S5_MAX_FILE_SIZE - seek;
     }
 
     /* extend file size, if necessary */
@@ -272,8 +483,19 @@ s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
 
     while (srcpos < len){
         int data_offset = S5_DATA_OFFSET(seek);
+        uint32_t pagenum = S5_DATA_BLOCK(seek);
 
-        get_res = pframe_get(&vnode->vn_mmobj, S5_DATA_BLOCK(seek), &p);
+        write_size = min(PAGE_SIZE - data_offset, end_pos - seek);
+
+        KASSERT(write_size >= 0 && "write size is negative");
+
+        if (write_size == PAGE_SIZE){
+            get_res = pframe_get_nofill(&vnode->vn_mmobj, pagenum, 0, &p);
+        } else if ((off_t) pagenum * S5_BLOCK_SIZE >= vnode->vn_len){
+            get_res = pframe_get_nofill(&vnode->vn_mmobj, pagenum, 1, &p);
+        } else {
+            get_res = pframe_get(&vnode->vn_mmobj, pagenum, &p);
+        }
 
         if (get_res < 0){
             dbg(DBG_S5FS, "error getting page\n");
@@ -281,10 +503,7 @@ s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
             break;
         }
 
-        write_size = min(PAGE_SIZE - data_offset, end_pos - seek);
-
-        KASSERT(write_size >= 0 && "write size is negative");
-        memcpy((char *) p->pf_addr + data_offset, (void *) bytes, write_size);
+        memcpy((char *) p->pf_addr + data_offset, bytes + srcpos, write_size);
         int dirty_res = pframe_dirty(p);
 
         if (dirty_res < 0){
@@ -305,6 +524,51 @@ s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
     return err ? err : srcpos;
 }
 
+/*
+ * Allocate disk blocks for the len bytes of the file starting at offset,
+ * for fallocate(2), and extend the file to cover them if it is shorter.
+ * The blocks are taken in runs as long as there is room for, and are
+ * marked unwritten so that they still read as zeros; writing to them
+ * later needs no allocation. Blocks the file has already, and those of
+ * pages that are in memory, are left alone.
+ *
+ * Returns 0 on success, -EFBIG if the range goes past the largest file
+ * size, or -ENOSPC (possibly after allocating part of the range).
+ */
+int
+s5_fallocate(vnode_t *vnode, off_t offset, off_t len)
+{
+    KASSERT(offset >= 0 && len > 0);
+
+    if (len > S5_MAX_FILE_SIZE - offset){
+        return -EFBIG;
+    }
+
+    uint32_t block = S5_DATA_BLOCK(offset);
+    uint32_t end = S5_DATA_BLOCK(offset + len - 1) + 1;
+
+    while (block < end){
+        uint32_t run;
+        int ret = s5_seek_to_run(vnode, (off_t) block * S5_BLOCK_SIZE,
+                S5_ALLOC_UNWRITTEN, end - block, &run);
+
+        if (ret < 0){
+            return ret;
+        }
+        block += run;
+    }
+
+    if (offset + len > vnode->vn_len){
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+
+        vnode->vn_len = offset + len;
+        inode->s5_size = vnode->vn_len;
+        s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
+    }
+
+    return 0;
+}
+
 /*
  * Read up to len bytes from the given inode, starting at seek bytes
  * from the beginning of the inode. On success, return the number of
@@ -346,271 +610,1376 @@ s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len)
     while (start_pos + destpos < end_pos){
         int data_offset = S5_DATA_OFFSET(seek);
 
-        get_res = pframe_get(&vnode->vn_mmobj, S5_DATA_BLOCK(seek), &p);
+        get_res = pframe_get(&vnode->vn_mmobj, S5_DATA_BLOCK(seek), &p);
+
+        if (get_res < 0){
+            dbg(DBG_S5FS, "error getting page\n");
+            return get_res;
+        }
+       
+        read_size = min(PAGE_SIZE - data_offset, end_pos - seek);
+
+        memcpy(dest + destpos, (char *) p->pf_addr + data_offset, read_size);
+
+        destpos += read_size;
+        seek += read_size;
+    }
+
+    return destpos;
+}
+
+/*
+ * Returns the resident page of block index of the file, once it is not
+ * busy, or NULL if it is not resident.
+ */
+static pframe_t *
+s5_resident_page(vnode_t *vnode, uint32_t index)
+{
+    pframe_t *p;
+    while ((p = pframe_get_resident(&vnode->vn_mmobj, index)) != NULL
+           && pframe_is_busy(p)){
+        sched_sleep_on(&p->pf_waitq);
+    }
+    return p;
+}
+
+/*
+ * Returns how many of the n blocks of the file starting with block index,
+ * which is on disk at blocknum, can be read into pages with one request:
+ * they follow each other both on disk and in memory, and none of their
+ * pages is resident.
+ */
+static uint32_t
+s5_direct_run(vnode_t *vnode, uint32_t index, int blocknum, void **pages,
+        uint32_t n)
+{
+    uint32_t i;
+    for (i = 1; i < n; i++){
+        if ((char *) pages[i] != (char *) pages[i - 1] + S5_BLOCK_SIZE
+            || pframe_get_resident(&vnode->vn_mmobj, index + i) != NULL
+            || s5_seek_to_block(vnode, (off_t) (index + i) * S5_BLOCK_SIZE,
+                S5_SEEK_DATA) != blocknum + (int) i){
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Read the npages blocks of the file starting at the block-aligned seek
+ * pointer into the given pages, for O_DIRECT. The blocks are read from
+ * the disk straight into the pages, a run of them at a time, without
+ * bringing them into the file's pages. Blocks whose page is resident are
+ * copied from it instead, as it may hold data that has not been written
+ * back. Sparse and unwritten blocks read as zeros.
+ *
+ * On success, return the number of bytes read, which stops at the end of
+ * the file, or 0 if the end of the file has been reached; on failure,
+ * return -errno.
+ */
+int
+s5_read_direct(vnode_t *vnode, off_t seek, void **pages, uint32_t npages)
+{
+    KASSERT(S5_DATA_OFFSET(seek) == 0);
+
+    if (seek < 0){
+        dbg(DBG_S5FS, "invalid seek value\n");
+        return -EINVAL;
+    } else if (seek >= vnode->vn_len){
+        return 0;
+    }
+
+    blockdev_t *bd = VNODE_TO_S5FS(vnode)->s5f_bdev;
+    uint32_t first = S5_DATA_BLOCK(seek);
+    uint32_t nblocks = MIN(npages, S5_DATA_BLOCK(vnode->vn_len - 1) - first + 1);
+    uint32_t i = 0;
+    int ret = 0;
+
+    while (i < nblocks){
+        uint32_t index = first + i;
+        uint32_t run = 1;
+        pframe_t *p = s5_resident_page(vnode, index);
+
+        if (p != NULL){
+            memcpy(pages[i], p->pf_addr, S5_BLOCK_SIZE);
+        } else {
+            int blocknum = s5_seek_to_block(vnode,
+                    (off_t) index * S5_BLOCK_SIZE, S5_SEEK_DATA);
+
+            if (blocknum < 0){
+                ret = blocknum;
+                break;
+            } else if (blocknum == 0){
+                memset(pages[i], 0, S5_BLOCK_SIZE);
+            } else {
+                run = s5_direct_run(vnode, index, blocknum, pages + i,
+                        nblocks - i);
+                if ((ret = blockdev_read(bd, pages[i], blocknum, run)) < 0){
+                    break;
+                }
+            }
+        }
+
+        i += run;
+    }
+
+    if (i == 0){
+        return ret;
+    }
+    return min((off_t) i * S5_BLOCK_SIZE, vnode->vn_len - seek);
+}
+
+/*
+ * Write the given pages to the npages blocks of the file starting at the
+ * block-aligned seek pointer, for O_DIRECT. Sparse and unwritten blocks
+ * are allocated first, and the pages are then written to the disk
+ * straight from where they are, a run of blocks at a time. A resident
+ * page of a block being written gets the new data as well, so that it
+ * never holds anything older than the disk does, and writing it back
+ * later (if it was dirty) writes the new data once more.
+ *
+ * Writing past the end of the file increases the size of the file. On
+ * success, return the number of bytes written, which is short if only
+ * some of the blocks could be allocated; on failure, return -errno.
+ */
+int
+s5_write_direct(vnode_t *vnode, off_t seek, void **pages, uint32_t npages)
+{
+    KASSERT(S5_DATA_OFFSET(seek) == 0);
+
+    if (seek < 0){
+        dbg(DBG_S5FS, "invalid seek value\n");
+        return -EINVAL;
+    } else if (seek >= S5_MAX_FILE_SIZE){
+        return -EFBIG;
+    }
+
+    blockdev_t *bd = VNODE_TO_S5FS(vnode)->s5f_bdev;
+    uint32_t first = S5_DATA_BLOCK(seek);
+    uint32_t nblocks = MIN(npages, S5_MAX_FILE_BLOCKS - first);
+    uint32_t written = 0;       /* blocks on disk so far */
+    uint32_t run = 0;           /* blocks after those, waiting to be */
+    int runstart = 0;
+    int ret = 0;
+
+    while (written + run < nblocks){
+        uint32_t i = written + run;
+        off_t pos = (off_t) (first + i) * S5_BLOCK_SIZE;
+        pframe_t *p;
+
+        int blocknum = s5_seek_to_block(vnode, pos, 0);
+
+        /* a dirty page has a block reserved for it already */
+        if (blocknum == 0
+            && ((p = pframe_get_resident(&vnode->vn_mmobj, first + i)) == NULL
+                || !pframe_is_dirty(p))){
+            blocknum = s5_reserve_block(vnode);
+        }
+        if (blocknum >= 0){
+            blocknum = s5_seek_to_block(vnode, pos, 1);
+        }
+        if (blocknum < 0){
+            ret = blocknum;
+            break;
+        }
+
+        if ((p = s5_resident_page(vnode, first + i)) != NULL){
+            memcpy(p->pf_addr, pages[i], S5_BLOCK_SIZE);
+        }
+
+        if (run > 0 && (blocknum != runstart + (int) run
+                || (char *) pages[i] != (char *) pages[i - 1] + S5_BLOCK_SIZE)){
+            if ((ret = blockdev_write(bd, pages[written], runstart, run)) < 0){
+                run = 0;
+                break;
+            }
+            written += run;
+            run = 0;
+        }
+        if (run == 0){
+            runstart = blocknum;
+        }
+        run++;
+    }
+
+    if (run > 0){
+        int err = blockdev_write(bd, pages[written], runstart, run);
+        if (err < 0){
+            ret = err;
+        } else {
+            written += run;
+        }
+    }
+
+    if (written == 0){
+        return ret;
+    }
+
+    off_t end = seek + (off_t) written * S5_BLOCK_SIZE;
+    if (end > vnode->vn_len){
+        vnode->vn_len = end;
+        VNODE_TO_S5INODE(vnode)->s5_size = vnode->vn_len;
+        s5_dirty_inode(VNODE_TO_S5FS(vnode), VNODE_TO_S5INODE(vnode));
+    }
+
+    return (off_t) written * S5_BLOCK_SIZE;
+}
+
+/*
+ * Returns the word of the free-space bitmap that holds the bit of the
+ * given block.
+ */
+static uint32_t *
+s5_bitmap_word(s5fs_t *fs, uint32_t blockno)
+{
+        pframe_t *pf = fs->s5f_bitmap[blockno / S5_BITS_PER_BLOCK];
+
+        return (uint32_t *)pf->pf_addr + (blockno % S5_BITS_PER_BLOCK) / 32;
+}
+
+static int
+s5_block_is_free(s5fs_t *fs, uint32_t blockno)
+{
+        return !(*s5_bitmap_word(fs, blockno) & (1U << (blockno % 32)));
+}
+
+/*
+ * Marks the given block as in use or free in the bitmap, and dirties the
+ * bitmap block.
+ */
+static void
+s5_bitmap_set(s5fs_t *fs, uint32_t blockno, int used)
+{
+        uint32_t *word = s5_bitmap_word(fs, blockno);
+        int err;
+
+        if (used)
+                *word |= 1U << (blockno % 32);
+        else
+                *word &= ~(1U << (blockno % 32));
+
+        err = pframe_dirty(fs->s5f_bitmap[blockno / S5_BITS_PER_BLOCK]);
+        KASSERT(!err && "shouldn\'t fail for a page belonging to a block device");
+        s5_journal_dirty(fs, fs->s5f_bitmap[blockno / S5_BITS_PER_BLOCK],
+                         fs->s5f_super->s5s_bitmap_block + blockno / S5_BITS_PER_BLOCK);
+}
+
+/*
+ * Returns the first free block in [from, to), or to if there is none.
+ * Words of the bitmap that are all in use are skipped whole.
+ */
+static uint32_t
+s5_find_free(s5fs_t *fs, uint32_t from, uint32_t to)
+{
+        while (from < to) {
+                if (0 == from % 32 && 0xffffffff == *s5_bitmap_word(fs, from)) {
+                        from += 32;
+                } else if (s5_block_is_free(fs, from)) {
+                        return from;
+                } else {
+                        from++;
+                }
+        }
+        return to;
+}
+
+/*
+ * Returns the number of free blocks starting at start, counting no
+ * further than max.
+ */
+static uint32_t
+s5_free_run(s5fs_t *fs, uint32_t start, uint32_t max)
+{
+        uint32_t n = 0;
+
+        while (n < max && start + n < fs->s5f_super->s5s_nblocks
+               && s5_block_is_free(fs, start + n))
+                n++;
+        return n;
+}
+
+/*
+ * Returns the first block in [from, to) that starts a run of at least len
+ * free blocks, or to if there is none.
+ */
+static uint32_t
+s5_find_free_run(s5fs_t *fs, uint32_t from, uint32_t to, uint32_t len)
+{
+        uint32_t run;
+
+        while ((from = s5_find_free(fs, from, to)) < to) {
+                if ((run = s5_free_run(fs, from, len)) >= len)
+                        return from;
+                from += run;
+        }
+        return to;
+}
+
+/*
+ * Allocates a run of up to *count contiguous disk blocks and returns the
+ * first of them, setting *count to the number of blocks actually
+ * allocated (at least one). If there are no free blocks, returns -ENOSPC.
+ *
+ * The run starts at goal if that block is free, or else at the first free
+ * block shortly after it. Failing that, it is taken from the first free
+ * stretch of at least max(*count, S5_ALLOC_RUN) blocks past goal (wrapping
+ * around to the start of the disk), and as a last resort from the first
+ * free block. A goal of 0 means there is no preference.
+ *
+ * If reserved is true, the blocks are taken out of those set aside by
+ * s5_reserve_block(), of which there must be enough. Otherwise the
+ * reserved blocks are left alone, and -ENOSPC is returned if only they
+ * are left.
+ *
+ * This will not initialize the contents of the allocated blocks; these
+ * contents are undefined.
+ */
+static int
+s5_alloc_blocks(s5fs_t *fs, uint32_t goal, uint32_t *count, int reserved)
+{
+        s5_super_t *s = fs->s5f_super;
+        uint32_t nblocks = s->s5s_nblocks;
+        uint32_t want = MAX(*count, S5_ALLOC_RUN);
+        uint32_t start = nblocks;
+        uint32_t i;
+
+        KASSERT(*count > 0);
+
+        lock_blocks(fs);
+
+        if (reserved) {
+                KASSERT(fs->s5f_nreserved >= *count);
+        } else if (s->s5s_nfree_blocks <= fs->s5f_nreserved) {
+                unlock_blocks(fs);
+                return -ENOSPC;
+        }
+
+        if (goal >= nblocks)
+                goal = 0;
+
+        if (0 != goal)
+                start = s5_find_free(fs, goal, MIN(goal + S5_ALLOC_RUN, nblocks));
+        if (nblocks == start)
+                start = s5_find_free_run(fs, goal, nblocks, want);
+        if (nblocks == start
+            && goal == (start = s5_find_free_run(fs, 0, goal, want)))
+                start = s5_find_free(fs, 0, nblocks);
+
+        KASSERT(start < nblocks && "free block count is off");
+
+        *count = s5_free_run(fs, start, *count);
+        for (i = 0; i < *count; i++)
+                s5_bitmap_set(fs, start + i, 1);
+        s->s5s_nfree_blocks -= *count;
+        if (reserved)
+                fs->s5f_nreserved -= *count;
+
+        s5_dirty_super(fs);
+
+        unlock_blocks(fs);
+
+        return start;
+}
+
+/*
+ * Allocate a new disk block, preferably goal (see s5_alloc_blocks()), and
+ * return it. If there are no free blocks that are not reserved, return
+ * -ENOSPC.
+ */
+static int
+s5_alloc_block(s5fs_t *fs, uint32_t goal)
+{
+        uint32_t count = 1;
+
+        return s5_alloc_blocks(fs, goal, &count, 0);
+}
+
+/*
+ * Sets a free block aside for a page of the file that is being dirtied
+ * and has no block yet, so that it is sure to get one when it is written
+ * back. Returns 0 on success, or -ENOSPC if every free block is taken or
+ * reserved already.
+ */
+int
+s5_reserve_block(vnode_t *vnode)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        int ret = 0;
+
+        lock_blocks(fs);
+
+        if (fs->s5f_super->s5s_nfree_blocks <= fs->s5f_nreserved) {
+                ret = -ENOSPC;
+        } else {
+                fs->s5f_nreserved++;
+                vnode->vn_nreserved++;
+        }
+
+        unlock_blocks(fs);
+
+        return ret;
+}
+
+/*
+ * Gives back the blocks reserved for the file, whose dirty pages have been
+ * thrown away without being written back.
+ */
+void
+s5_unreserve_blocks(vnode_t *vnode)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+
+        lock_blocks(fs);
+
+        KASSERT(fs->s5f_nreserved >= (uint32_t)vnode->vn_nreserved);
+        fs->s5f_nreserved -= vnode->vn_nreserved;
+        vnode->vn_nreserved = 0;
+
+        unlock_blocks(fs);
+}
+
+
+/*
+ * Given a filesystem and a block number, frees the given block in the
+ * filesystem.
+ *
+ * This function may potentially block.
+ *
+ * The caller is responsible for ensuring that the block being freed is
+ * actually free and is not resident.
+ */
+static void
+s5_free_block(s5fs_t *fs, int blockno)
+{
+        s5_super_t *s = fs->s5f_super;
+
+        KASSERT((uint32_t)blockno > S5_INODE_BLOCK(s->s5s_num_inodes - 1)
+                && (uint32_t)blockno < s->s5s_nblocks);
+        KASSERT(((uint32_t)blockno < s->s5s_bitmap_block
+                 || (uint32_t)blockno >= s->s5s_bitmap_block + s->s5s_bitmap_nblocks)
+                && "freeing a bitmap block");
+
+        lock_blocks(fs);
+
+        KASSERT(!s5_block_is_free(fs, blockno) && "double free");
+
+        s5_bitmap_set(fs, blockno, 0);
+        s->s5s_nfree_blocks++;
+        s5_journal_revoke(fs, blockno);
+
+        s5_dirty_super(fs);
+
+        unlock_blocks(fs);
+}
+
+/*
+ * Converts a version 3 file system, which keeps its free blocks on a list
+ * threaded through the superblock and free blocks, to version 4, which
+ * keeps them in a bitmap. The bitmap is built in memory from the
+ * free list and then written to the first free stretch of disk long enough
+ * to hold it, right after the inode blocks on a freshly formatted disk.
+ *
+ * This is called at mount time, before the superblock is checked.
+ *
+ * Returns 0 on success, -EINVAL if the free list is corrupt, -ENOSPC if
+ * there is no room for the bitmap, or -ENOMEM.
+ */
+int
+s5_convert_free_list(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        uint32_t nblocks = fs->s5f_bdev->bd_nblocks;
+        uint32_t nbitmap = S5_BITMAP_NBLOCKS(nblocks);
+        uint32_t first_data = S5_INODE_BLOCK(s->s5s_num_inodes - 1) + 1;
+        uint32_t free_blocks[S5_NBLKS_PER_FNODE];
+        uint32_t nfree, node, nfound = 0, bitmap_block, run, i;
+        pframe_t *pf;
+        uint32_t *bitmap;
+        int ret = 0;
+
+        KASSERT(S5_FREE_LIST_VERSION == s->s5s_version);
+
+        if (first_data >= nblocks)
+                return -EINVAL;
+        if (NULL == (bitmap = page_alloc_n(nbitmap)))
+                return -ENOMEM;
+        memset(bitmap, 0xff, nbitmap * S5_BLOCK_SIZE);
+
+#define MARK_FREE(b)                                                    \
+        do {                                                            \
+                if ((b) < first_data || (b) >= nblocks                  \
+                    || !(bitmap[(b) / 32] & (1U << ((b) % 32)))) {      \
+                        ret = -EINVAL;                                  \
+                        goto out;                                       \
+                }                                                       \
+                bitmap[(b) / 32] &= ~(1U << ((b) % 32));                \
+                nfound++;                                               \
+        } while (0)
+
+        /* The free list: the superblock holds the first nfree free blocks
+         * and the block number of the next node, which is itself free and
+         * holds S5_NBLKS_PER_FNODE - 1 more, and so on. */
+        nfree = s->s5s_nfree;
+        memcpy(free_blocks, s->s5s_free_blocks, sizeof(free_blocks));
+        for (;;) {
+                if (nfree >= S5_NBLKS_PER_FNODE) {
+                        ret = -EINVAL;
+                        goto out;
+                }
+                for (i = 0; i < nfree; i++)
+                        MARK_FREE(free_blocks[i]);
+
+                if ((uint32_t) -1 == (node = free_blocks[S5_NBLKS_PER_FNODE - 1]))
+                        break;
+                MARK_FREE(node);
+                if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), node, &pf)) < 0)
+                        goto out;
+                memcpy(free_blocks, pf->pf_addr, sizeof(free_blocks));
+                nfree = S5_NBLKS_PER_FNODE - 1;
+        }
+
+#undef MARK_FREE
+
+        /* Find room for the bitmap */
+        for (bitmap_block = first_data; bitmap_block < nblocks; bitmap_block += run + 1) {
+                for (run = 0; run < nbitmap && bitmap_block + run < nblocks; run++)
+                        if (bitmap[(bitmap_block + run) / 32] & (1U << ((bitmap_block + run) % 32)))
+                                break;
+                if (run == nbitmap)
+                        break;
+        }
+        if (bitmap_block >= nblocks) {
+                ret = -ENOSPC;
+                goto out;
+        }
+        for (i = bitmap_block; i < bitmap_block + nbitmap; i++)
+                bitmap[i / 32] |= 1U << (i % 32);
+
+        for (i = 0; i < nbitmap; i++) {
+                if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), bitmap_block + i, &pf)) < 0)
+                        goto out;
+                memcpy(pf->pf_addr, (char *)bitmap + i * S5_BLOCK_SIZE, S5_BLOCK_SIZE);
+                if ((ret = pframe_dirty(pf)) < 0)
+                        goto out;
+        }
+
+        s->s5s_nblocks = nblocks;
+        s->s5s_bitmap_block = bitmap_block;
+        s->s5s_bitmap_nblocks = nbitmap;
+        s->s5s_nfree_blocks = nfound - nbitmap;
+        s->s5s_nfree = 0;
+        memset(s->s5s_free_blocks, 0, sizeof(s->s5s_free_blocks));
+        s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] = (uint32_t) -1;
+        /* version 3 inodes are laid out like version 4 ones */
+        s->s5s_version = S5_SINGLE_INDIRECT_VERSION;
+        s5_dirty_super(fs);
+
+        dbg(DBG_PRINT, "s5fs: converted free list of %u blocks to a bitmap "
+            "at block %u\n", nfound, bitmap_block);
+
+out:
+        page_free_n(bitmap, nbitmap);
+        return ret;
+}
+
+/*
+ * Moves one inode from the version 4 layout (28 direct blocks, then the
+ * indirect block) to the current one; see s5_convert_indirect_blocks().
+ */
+static int
+s5_convert_inode(s5fs_t *fs, s5_inode_t *inode)
+{
+        /* the old layout, where the new indirect blocks are */
+        uint32_t *old = inode->s5_direct_blocks;
+        uint32_t tail[2] = { old[S5_NDIRECT_BLOCKS], old[S5_NDIRECT_BLOCKS + 1] };
+        uint32_t indirect = old[S5_NDIRECT_BLOCKS + 2];
+        uint32_t pushed[2] = { 0, 0 };
+        int dindirect = 0, child = 0, new_indirect = 0;
+        uint32_t *b, i;
+        pframe_t *p;
+        int ret;
+
+        memset(inode->s5_indirect_blocks, 0, sizeof(inode->s5_indirect_blocks));
+
+        if ((S5_TYPE_CHR == inode->s5_type) || (S5_TYPE_BLK == inode->s5_type))
+                inode->s5_indirect_block = indirect;    /* the device id */
+        if (((S5_TYPE_DATA != inode->s5_type) && (S5_TYPE_DIR != inode->s5_type))
+            || (!tail[0] && !tail[1] && !indirect))
+                goto done;
+
+        /* allocate everything first, so that failing leaves no trace */
+        if (indirect) {
+                if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), indirect, &p)) < 0)
+                        goto fail;
+                b = (uint32_t *)p->pf_addr;
+                pushed[0] = b[S5_NIDIRECT_BLOCKS - 2];
+                pushed[1] = b[S5_NIDIRECT_BLOCKS - 1];
+        } else {
+                if ((ret = new_indirect = s5_alloc_file_block(fs, 0, 1)) < 0)
+                        goto fail;
+                indirect = new_indirect;
+        }
+        if (pushed[0] || pushed[1]) {
+                if ((ret = dindirect = s5_alloc_file_block(fs, indirect + 1, 1)) < 0
+                    || (ret = child = s5_alloc_file_block(fs, dindirect + 1, 1)) < 0)
+                        goto fail;
+        }
+
+        if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), indirect, &p)) < 0)
+                goto fail;
+        b = (uint32_t *)p->pf_addr;
+        for (i = S5_NIDIRECT_BLOCKS - 1; i >= 2; i--)
+                b[i] = b[i - 2];
+        b[0] = tail[0];
+        b[1] = tail[1];
+        pframe_dirty(p);
+        inode->s5_indirect_blocks[0] = indirect;
+
+        if (dindirect) {
+                if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), child, &p)) < 0)
+                        goto fail;
+                b = (uint32_t *)p->pf_addr;
+                b[0] = pushed[0];
+                b[1] = pushed[1];
+                pframe_dirty(p);
+
+                if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), dindirect, &p)) < 0)
+                        goto fail;
+                ((uint32_t *)p->pf_addr)[0] = child;
+                pframe_dirty(p);
+                inode->s5_indirect_blocks[1] = dindirect;
+        }
+
+done:
+        s5_dirty_inode(fs, inode);
+        return 0;
+
+fail:
+        if (child > 0)
+                s5_free_block(fs, child);
+        if (dindirect > 0)
+                s5_free_block(fs, dindirect);
+        if (new_indirect > 0)
+                s5_free_block(fs, new_indirect);
+        return ret;
+}
+
+/*
+ * Converts a version 4 file system, whose inodes have 28 direct blocks and
+ * a single indirect block, to version 5, whose inodes have 26
+ * direct blocks followed by single, double and triple indirect blocks. The
+ * last two direct blocks of each file move to the front of its single
+ * indirect block, and the two block pointers that pushes off its end go
+ * to a new double indirect block.
+ *
+ * This is called at mount time, once the bitmap has been loaded, since
+ * blocks may have to be allocated.
+ *
+ * Returns 0 on success, -ENOSPC if there may not be enough free blocks
+ * (in which case nothing has been changed), or -errno.
+ */
+int
+s5_convert_indirect_blocks(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        uint32_t needed = 0;
+        s5_inode_t *inode;
+        uint32_t *old;
+        pframe_t *ip;
+        uint32_t ino;
+        int ret;
+
+        KASSERT(S5_SINGLE_INDIRECT_VERSION == s->s5s_version);
+
+        /* at most two blocks per file with an indirect block, one per file
+         * using its last two direct blocks but no indirect block (see
+         * s5_convert_inode() for the old layout) */
+        for (ino = 0; ino < s->s5s_num_inodes; ino++) {
+                if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(ino), &ip)) < 0)
+                        return ret;
+                inode = (s5_inode_t *)ip->pf_addr + S5_INODE_OFFSET(ino);
+                old = inode->s5_direct_blocks;
+                if ((S5_TYPE_DATA != inode->s5_type) && (S5_TYPE_DIR != inode->s5_type))
+                        continue;
+                if (old[S5_NDIRECT_BLOCKS + 2])
+                        needed += 2;
+                else if (old[S5_NDIRECT_BLOCKS] || old[S5_NDIRECT_BLOCKS + 1])
+                        needed += 1;
+        }
+        if (needed > s->s5s_nfree_blocks)
+                return -ENOSPC;
+
+        for (ino = 0; ino < s->s5s_num_inodes; ino++) {
+                if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(ino), &ip)) < 0)
+                        return ret;
+                pframe_pin(ip);
+                ret = s5_convert_inode(fs, (s5_inode_t *)ip->pf_addr + S5_INODE_OFFSET(ino));
+                pframe_unpin(ip);
+                if (ret < 0)
+                        return ret;
+        }
+
+        s->s5s_version = S5_NO_JOURNAL_VERSION;
+        s5_dirty_super(fs);
+
+        dbg(DBG_PRINT, "s5fs: converted %u inodes to double and triple "
+            "indirect blocks\n", s->s5s_num_inodes);
+        return 0;
+}
+
+/*
+ * Converts a version 5 file system to the current version by giving it a
+ * journal, in the first free stretch of disk long enough to hold it. A
+ * disk too small or too full for one is converted all the same, and goes
+ * without.
+ *
+ * This is called at mount time, once the bitmap has been loaded.
+ *
+ * Returns 0 on success, or -errno.
+ */
+int
+s5_convert_journal(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        uint32_t nblocks = S5_JOURNAL_SIZE(s->s5s_nblocks);
+        uint32_t block = s->s5s_nblocks, i;
+        int ret;
+
+        KASSERT(S5_NO_JOURNAL_VERSION == s->s5s_version);
+
+        if (nblocks > 0 && nblocks <= s->s5s_nfree_blocks)
+                block = s5_find_free_run(fs, 0, s->s5s_nblocks, nblocks);
+
+        s->s5s_journal_block = 0;
+        s->s5s_journal_nblocks = 0;
+        if (block < s->s5s_nblocks) {
+                /* the blocks are still free if this fails */
+                s->s5s_journal_block = block;
+                if ((ret = s5_journal_format(fs)) < 0) {
+                        s->s5s_journal_block = 0;
+                        return ret;
+                }
+                for (i = block; i < block + nblocks; i++)
+                        s5_bitmap_set(fs, i, 1);
+                s->s5s_nfree_blocks -= nblocks;
+                s->s5s_journal_nblocks = nblocks;
+        }
+
+        s->s5s_version = S5_CURRENT_VERSION;
+        s5_dirty_super(fs);
+
+        if (0 == s->s5s_journal_nblocks) {
+                dbg(DBG_PRINT, "s5fs: no room for a journal\n");
+        } else {
+                dbg(DBG_PRINT, "s5fs: added a journal of %u blocks at "
+                    "block %u\n", nblocks, block);
+        }
+        return 0;
+}
+
+/*
+ * Creates a new inode from the free list and initializes its fields.
+ * Uses S5_INODE_BLOCK to get the page from which to create the inode
+ *
+ * This function may block, but not while holding the inode allocator's
+ * lock: the block of the inode at the head of the free list is brought
+ * in first, and the inode is only taken if it is still at the head then.
+ */
+int
+s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
+{
+        s5fs_t *s5fs = FS_TO_S5FS(fs);
+        pframe_t *inodep;
+        s5_inode_t *inode;
+        uint32_t ino;
+        int ret = -1;
+
+        KASSERT((S5_TYPE_DATA == type)
+                || (S5_TYPE_DIR == type)
+                || (S5_TYPE_CHR == type)
+                || (S5_TYPE_BLK == type));
+
+        while (1) {
+                lock_inodes(s5fs);
+                ino = s5fs->s5f_super->s5s_free_inode;
+                unlock_inodes(s5fs);
+
+                if (ino == (uint32_t) -1)
+                        return -ENOSPC;
+
+                if ((ret = pframe_get(&s5fs->s5f_bdev->bd_mmobj,
+                                      S5_INODE_BLOCK(ino), &inodep)) < 0)
+                        return ret;
+                pframe_pin(inodep);
+
+                lock_inodes(s5fs);
+                if (s5fs->s5f_super->s5s_free_inode == ino)
+                        break;
+
+                /* someone else took it while we were blocked */
+                unlock_inodes(s5fs);
+                pframe_unpin(inodep);
+        }
+
+        inode = (s5_inode_t *)(inodep->pf_addr) + S5_INODE_OFFSET(ino);
+
+        KASSERT(inode->s5_number == ino);
+
+        ret = inode->s5_number;
+
+        /* reset s5s_free_inode; remove the inode from the inode free list: */
+        s5fs->s5f_super->s5s_free_inode = inode->s5_next_free;
+        s5_dirty_super(s5fs);
+
+        unlock_inodes(s5fs);
+
+
+        /* init the newly-allocated inode: */
+        inode->s5_size = 0;
+        inode->s5_type = type;
+        inode->s5_linkcount = 0;
+        memset(inode->s5_direct_blocks, 0, S5_NDIRECT_BLOCKS * sizeof(int));
+        if ((S5_TYPE_CHR == type) || (S5_TYPE_BLK == type))
+                inode->s5_indirect_block = devid;
+        else
+                inode->s5_indirect_block = 0;
+
+        s5_dirty_inode(s5fs, inode);
+
+        pframe_unpin(inodep);
+
+        return ret;
+}
+
+
+/*
+ * Frees the indirect block blockno, which is at the given level (1 for a
+ * single indirect block), along with all the blocks reached from it.
+ */
+static void
+s5_free_tree(s5fs_t *fs, uint32_t blockno, int level)
+{
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), blockno, &ibp);
+        KASSERT(ibp
+                && "because never fails for block_device "
+                "vm_objects");
+        pframe_pin(ibp);
+
+        b = (uint32_t *)(ibp->pf_addr);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                KASSERT(b[i] != blockno);
+                if (!b[i])
+                        continue;
+                if (level > 1)
+                        s5_free_tree(fs, b[i], level - 1);
+                else
+                        s5_free_block(fs, b[i] & ~S5_BLOCK_UNWRITTEN);
+        }
+
+        pframe_unpin(ibp);
+
+        s5_free_block(fs, blockno);
+}
+
+/*
+ * Free an inode by freeing its disk blocks and putting it back on the
+ * inode free list.
+ *
+ * You should also reset the inode to an unused state (eg. zero-ing its
+ * list of blocks and setting its type to S5_FREE_TYPE).
+ *
+ * Don't forget to free the indirect blocks if they exist.
+ *
+ * You probably want to use s5_free_block().
+ */
+void
+s5_free_inode(vnode_t *vnode)
+{
+        uint32_t i;
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+
+        KASSERT((S5_TYPE_DATA == inode->s5_type)
+                || (S5_TYPE_DIR == inode->s5_type)
+                || (S5_TYPE_CHR == inode->s5_type)
+                || (S5_TYPE_BLK == inode->s5_type));
+
+        /* free any direct blocks */
+        for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
+                if (inode->s5_direct_blocks[i]) {
+                        dprintf("freeing block %d\n", inode->s5_direct_blocks[i]);
+                        s5_free_block(fs, inode->s5_direct_blocks[i]
+                                      & ~S5_BLOCK_UNWRITTEN);
+
+                        s5_dirty_inode(fs, inode);
+                        inode->s5_direct_blocks[i] = 0;
+                }
+        }
+
+        if ((S5_TYPE_DATA == inode->s5_type)
+            || (S5_TYPE_DIR == inode->s5_type)) {
+                for (i = 0; i < S5_INDIRECT_LEVELS; ++i) {
+                        if (inode->s5_indirect_blocks[i])
+                                s5_free_tree(fs, inode->s5_indirect_blocks[i], i + 1);
+                }
+        }
+
+        memset(inode->s5_indirect_blocks, 0, sizeof(inode->s5_indirect_blocks));
+        inode->s5_type = S5_TYPE_FREE;
+        s5_dirty_inode(fs, inode);
+
+        lock_inodes(fs);
+        inode->s5_next_free = fs->s5f_super->s5s_free_inode;
+        fs->s5f_super->s5s_free_inode = inode->s5_number;
+        unlock_inodes(fs);
+
+        s5_dirty_inode(fs, inode);
+        s5_dirty_super(fs);
+}
+
+/*
+ * Returns the hash the directory index files the given name under.
+ */
+static uint32_t
+s5_dirhash(const char *name, size_t namelen)
+{
+    uint32_t hash = 2166136261u;    /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < namelen && i < S5_NAME_LEN && name[i] != '\0'; i++){
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Gets the given block of the directory's index and pins it.
+ */
+static int
+s5_dirindex_page(vnode_t *dir, uint32_t iblock, pframe_t **pf)
+{
+    int ret = pframe_get(&dir->vn_mmobj, S5_DIR_INDEX_BLOCK + iblock, pf);
+
+    if (ret == 0){
+        pframe_pin(*pf);
+    }
+    return ret;
+}
+
+/*
+ * Reads the header of the directory's index into h. Returns 1 if the
+ * index is valid for a directory of length dirsize, 0 if the directory
+ * has no index or one that is out of date, or -errno.
+ */
+static int
+s5_dirindex_read_header(vnode_t *dir, s5_dirindex_t *h, off_t dirsize)
+{
+    h->s5di_magic = 0;
+
+    /* Don't bring in a page of zeros for every small directory. The
+     * block of an index that has not been written back yet may only be
+     * reserved, so a resident page counts as well. */
+    int ret = s5_seek_to_block(dir, S5_DIR_INDEX_BLOCK * S5_BLOCK_SIZE, 0);
+    if (ret < 0){
+        return ret;
+    } else if (ret == 0
+               && pframe_get_resident(&dir->vn_mmobj, S5_DIR_INDEX_BLOCK) == NULL){
+        return 0;
+    }
+
+    pframe_t *pf;
+    if ((ret = s5_dirindex_page(dir, 0, &pf)) < 0){
+        return ret;
+    }
+
+    memcpy(h, pf->pf_addr, sizeof(*h));
+    pframe_unpin(pf);
+
+    return h->s5di_magic == S5_DIR_INDEX_MAGIC
+        && h->s5di_dirsize == (uint32_t) dirsize;
+}
+
+static int
+s5_dirindex_write_header(vnode_t *dir, s5_dirindex_t *h)
+{
+    pframe_t *pf;
+    int ret = s5_dirindex_page(dir, 0, &pf);
+
+    if (ret < 0){
+        return ret;
+    }
+
+    memcpy(pf->pf_addr, h, sizeof(*h));
+    ret = pframe_dirty(pf);
+    pframe_unpin(pf);
+    return ret;
+}
+
+/*
+ * Marks the directory's index, if it has one, as invalid, so that it is
+ * rebuilt the next time the directory grows.
+ */
+static void
+s5_dirindex_invalidate(vnode_t *dir)
+{
+    s5_dirindex_t h;
+
+    if (s5_dirindex_read_header(dir, &h, dir->vn_len) < 0
+        || h.s5di_magic != S5_DIR_INDEX_MAGIC){
+        return;
+    }
 
-        if (get_res < 0){
-            dbg(DBG_S5FS, "error getting page\n");
-            return get_res;
-        }
-       
-        read_size = min(PAGE_SIZE - data_offset, end_pos - seek);
+    h.s5di_magic = 0;
+    if (s5_dirindex_write_header(dir, &h) < 0){
+        panic("could not invalidate the index of directory %d\n",
+              VNODE_TO_S5INODE(dir)->s5_number);
+    }
+}
 
-        memcpy((void *) dest, (char *) p->pf_addr + data_offset, read_size);
+static int
+s5_dirindex_get(vnode_t *dir, uint32_t pos, s5_dirindex_entry_t *e)
+{
+    pframe_t *pf;
+    int ret = s5_dirindex_page(dir, 1 + pos / S5_DIR_INDEX_PER_BLOCK, &pf);
 
-        destpos += read_size;
-        seek += read_size;
+    if (ret < 0){
+        return ret;
     }
 
-    return destpos;
+    *e = ((s5_dirindex_entry_t *) pf->pf_addr)[pos % S5_DIR_INDEX_PER_BLOCK];
+    pframe_unpin(pf);
+    return 0;
 }
 
-/*
- * Allocate a new disk-block off the block free list and return it. If
- * there are no free blocks, return -ENOSPC.
- *
- * This will not initialize the contents of an allocated block; these
- * contents are undefined.
- *
- * If the super block's s5s_nfree is 0, you need to refill 
- * s5s_free_blocks and reset s5s_nfree.  You need to read the contents 
- * of this page using the pframe system in order to obtain the next set of
- * free block numbers.
- *
- * Don't forget to dirty the appropriate blocks!
- *
- * You'll probably want to use lock_s5(), unlock_s5(), pframe_get(),
- * and s5_dirty_super()
- */
 static int
-s5_alloc_block(s5fs_t *fs)
+s5_dirindex_set(vnode_t *dir, uint32_t pos, const s5_dirindex_entry_t *e)
 {
-    s5_super_t *s = fs->s5f_super;
+    pframe_t *pf;
+    int ret = s5_dirindex_page(dir, 1 + pos / S5_DIR_INDEX_PER_BLOCK, &pf);
 
-    lock_s5(fs);
+    if (ret < 0){
+        return ret;
+    }
 
-    KASSERT(S5_NBLKS_PER_FNODE > s->s5s_nfree);
+    ((s5_dirindex_entry_t *) pf->pf_addr)[pos % S5_DIR_INDEX_PER_BLOCK] = *e;
+    ret = pframe_dirty(pf);
+    pframe_unpin(pf);
+    return ret;
+}
 
-    int free_block_num;
+/*
+ * Probes the index table for the entry of the dirent with the given name
+ * (if name is not NULL) or the given slot (otherwise), whose name hashes
+ * to hash. On success returns 0 and sets *pos to the entry's position in
+ * the table and *slot to its dirent number, and *ino to the dirent's
+ * inode number if it was looked up by name. Returns -ENOENT if there is
+ * no such entry, or -errno.
+ */
+static int
+s5_dirindex_probe(vnode_t *dir, s5_dirindex_t *h, uint32_t hash,
+        const char *name, size_t namelen, uint32_t *slot, uint32_t *pos,
+        int *ino)
+{
+    uint32_t mask = h->s5di_size - 1;
+    uint32_t p = hash & mask;
+    uint32_t n;
 
-    if (s->s5s_nfree == 0){
-        free_block_num = s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1];
+    for (n = 0; n < h->s5di_size; n++, p = (p + 1) & mask){
+        s5_dirindex_entry_t e;
+        int ret = s5_dirindex_get(dir, p, &e);
 
-        if (free_block_num == -1){
-            unlock_s5(fs);
-            return -ENOSPC;
+        if (ret < 0){
+            return ret;
+        }
+        if (e.s5de_slot == 0){
+            break;
+        }
+        if (e.s5de_hash != hash){
+            continue;
         }
 
-        /* get the pframe from which we'll replenish our list of free block nums */
-        pframe_t *next_free_blocks;
-        KASSERT(fs->s5f_bdev);
-        int get_res = pframe_get(&fs->s5f_bdev->bd_mmobj, free_block_num,
-                &next_free_blocks);
+        if (name == NULL){
+            if (e.s5de_slot - 1 != *slot){
+                continue;
+            }
+        } else {
+            s5_dirent_t d;
+            ret = s5_read_file(dir, (e.s5de_slot - 1) * sizeof(s5_dirent_t),
+                    (char *) &d, sizeof(s5_dirent_t));
 
-        if (get_res < 0){
-            dbg(DBG_S5FS, "error in pframe_get\n");
-            unlock_s5(fs);
-            return get_res;
+            if (ret < 0){
+                return ret;
+            }
+            if (ret != sizeof(s5_dirent_t)){
+                return -EINVAL;
+            }
+            if (!name_match(d.s5d_name, name, namelen)){
+                continue;
+            }
+            *slot = e.s5de_slot - 1;
+            *ino = d.s5d_inode;
         }
 
-        memcpy((void *)(s->s5s_free_blocks), next_free_blocks->pf_addr, 
-                S5_NBLKS_PER_FNODE * sizeof(int));
-
-        s->s5s_nfree = S5_NBLKS_PER_FNODE - 1;
-    } else {
-        free_block_num = s->s5s_free_blocks[--s->s5s_nfree];
+        *pos = p;
+        return 0;
     }
 
-    s5_dirty_super(fs);
-
-    unlock_s5(fs);
-
-    return free_block_num;
+    return -ENOENT;
 }
 
-
 /*
- * Given a filesystem and a block number, frees the given block in the
- * filesystem.
- *
- * This function may potentially block.
- *
- * The caller is responsible for ensuring that the block being placed on
- * the free list is actually free and is not resident.
+ * Adds an entry for the given dirent to the index table. The table must
+ * have room for it.
  */
-static void
-s5_free_block(s5fs_t *fs, int blockno)
+static int
+s5_dirindex_insert(vnode_t *dir, s5_dirindex_t *h, uint32_t hash,
+        uint32_t slot)
 {
-        s5_super_t *s = fs->s5f_super;
-
+    uint32_t mask = h->s5di_size - 1;
+    uint32_t p = hash & mask;
 
-        lock_s5(fs);
+    for (;; p = (p + 1) & mask){
+        s5_dirindex_entry_t e;
+        int ret = s5_dirindex_get(dir, p, &e);
 
-        KASSERT(S5_NBLKS_PER_FNODE > s->s5s_nfree);
+        if (ret < 0){
+            return ret;
+        }
+        if (e.s5de_slot == 0){
+            e.s5de_hash = hash;
+            e.s5de_slot = slot + 1;
+            return s5_dirindex_set(dir, p, &e);
+        }
+    }
+}
 
-        if ((S5_NBLKS_PER_FNODE - 1) == s->s5s_nfree) {
-                /* get the pframe where we will store the free block nums */
-                pframe_t *prev_free_blocks = NULL;
-                KASSERT(fs->s5f_bdev);
-                pframe_get(&fs->s5f_bdev->bd_mmobj, blockno, &prev_free_blocks);
-                KASSERT(prev_free_blocks->pf_addr);
+/*
+ * Removes the entry at position pos from the index table, moving back
+ * the entries after it that would no longer be found past the hole.
+ */
+static int
+s5_dirindex_delete(vnode_t *dir, s5_dirindex_t *h, uint32_t pos)
+{
+    uint32_t mask = h->s5di_size - 1;
+    uint32_t p = pos;
+    s5_dirindex_entry_t e;
+    int ret;
 
-                /* copy from the superblock to the new block on disk */
-                memcpy(prev_free_blocks->pf_addr, (void *)(s->s5s_free_blocks),
-                       S5_NBLKS_PER_FNODE * sizeof(int));
-                pframe_dirty(prev_free_blocks);
+    for (;;){
+        p = (p + 1) & mask;
 
-                /* reset s->s5s_nfree and s->s5s_free_blocks */
-                s->s5s_nfree = 0;
-                s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] = blockno;
-        } else {
-                s->s5s_free_blocks[s->s5s_nfree++] = blockno;
+        if ((ret = s5_dirindex_get(dir, p, &e)) < 0){
+            return ret;
+        }
+        if (e.s5de_slot == 0){
+            break;
         }
 
-        s5_dirty_super(fs);
+        /* the entry can fill the hole unless its home lies after the hole
+         * (cyclically), up to its position */
+        uint32_t home = e.s5de_hash & mask;
+        if (((p - home) & mask) >= ((p - pos) & mask)){
+            if ((ret = s5_dirindex_set(dir, pos, &e)) < 0){
+                return ret;
+            }
+            pos = p;
+        }
+    }
 
-        unlock_s5(fs);
+    e.s5de_hash = 0;
+    e.s5de_slot = 0;
+    return s5_dirindex_set(dir, pos, &e);
 }
 
 /*
- * Creates a new inode from the free list and initializes its fields.
- * Uses S5_INODE_BLOCK to get the page from which to create the inode
- *
- * This function may block.
+ * (Re)builds the index of the directory from its entries, with a table
+ * large enough for them to take up at most half of it.
  */
-int
-s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
+static int
+s5_dirindex_build(vnode_t *dir)
 {
-        s5fs_t *s5fs = FS_TO_S5FS(fs);
-        pframe_t *inodep;
-        s5_inode_t *inode;
-        int ret = -1;
-
-        KASSERT((S5_TYPE_DATA == type)
-                || (S5_TYPE_DIR == type)
-                || (S5_TYPE_CHR == type)
-                || (S5_TYPE_BLK == type));
-
+    uint32_t ndirents = dir->vn_len / sizeof(s5_dirent_t);
+    s5_dirindex_t h;
+    uint32_t i;
+    int ret;
+
+    h.s5di_magic = 0;
+    h.s5di_dirsize = 0;
+    h.s5di_nentries = 0;
+    h.s5di_size = S5_DIR_INDEX_MIN_SIZE;
+    while (h.s5di_size < 2 * (ndirents + 1)){
+        h.s5di_size *= 2;
+    }
 
-        lock_s5(s5fs);
+    /* Write the header while the index is still invalid, and allocate all
+     * of the table now, so that updating it never has to */
+    if ((ret = s5_dirindex_write_header(dir, &h)) < 0){
+        return ret;
+    }
+    for (i = 0; i < h.s5di_size / S5_DIR_INDEX_PER_BLOCK; i++){
+        pframe_t *pf;
 
-        if (s5fs->s5f_super->s5s_free_inode == (uint32_t) -1) {
-                unlock_s5(s5fs);
-                return -ENOSPC;
+        if ((ret = s5_dirindex_page(dir, 1 + i, &pf)) < 0){
+            return ret;
+        }
+        memset(pf->pf_addr, 0, S5_BLOCK_SIZE);
+        ret = pframe_dirty(pf);
+        pframe_unpin(pf);
+        if (ret < 0){
+            return ret;
         }
+    }
 
-        pframe_get(&s5fs->s5f_bdev->bd_mmobj,
-                   S5_INODE_BLOCK(s5fs->s5f_super->s5s_free_inode),
-                   &inodep);
-        KASSERT(inodep);
+    s5_dirent_t dirents[NDIRENTS];
+    off_t seek = 0;
+    uint32_t slot = 0;
 
-        inode = (s5_inode_t *)(inodep->pf_addr)
-                + S5_INODE_OFFSET(s5fs->s5f_super->s5s_free_inode);
+    while (seek < dir->vn_len){
+        int read_res = s5_read_file(dir, seek, (char *) dirents,
+                NDIRENTS * sizeof(s5_dirent_t));
 
-        KASSERT(inode->s5_number == s5fs->s5f_super->s5s_free_inode);
+        if (read_res < 0){
+            return read_res;
+        }
 
-        ret = inode->s5_number;
+        int j;
+        for (j = 0; j < read_res / (int) sizeof(s5_dirent_t); j++, slot++){
+            /* fsmaker leaves holes of nameless entries */
+            if (dirents[j].s5d_name[0] == '\0'){
+                continue;
+            }
 
-        /* reset s5s_free_inode; remove the inode from the inode free list: */
-        s5fs->s5f_super->s5s_free_inode = inode->s5_next_free;
-        pframe_pin(inodep);
-        s5_dirty_super(s5fs);
-        pframe_unpin(inodep);
+            ret = s5_dirindex_insert(dir, &h,
+                    s5_dirhash(dirents[j].s5d_name, S5_NAME_LEN), slot);
+            if (ret < 0){
+                return ret;
+            }
+            h.s5di_nentries++;
+        }
+        seek += read_res;
+    }
 
+    h.s5di_magic = S5_DIR_INDEX_MAGIC;
+    h.s5di_dirsize = dir->vn_len;
+    return s5_dirindex_write_header(dir, &h);
+}
 
-        /* init the newly-allocated inode: */
-        inode->s5_size = 0;
-        inode->s5_type = type;
-        inode->s5_linkcount = 0;
-        memset(inode->s5_direct_blocks, 0, S5_NDIRECT_BLOCKS * sizeof(int));
-        if ((S5_TYPE_CHR == type) || (S5_TYPE_BLK == type))
-                inode->s5_indirect_block = devid;
-        else
-                inode->s5_indirect_block = 0;
+/*
+ * Adds the dirent just appended to the directory to its index, building
+ * the index if the directory has just become large enough for one or
+ * outgrown the one it has.
+ */
+static int
+s5_dirindex_add(vnode_t *dir, const char *name, size_t namelen)
+{
+    uint32_t slot = dir->vn_len / sizeof(s5_dirent_t) - 1;
+    s5_dirindex_t h;
+    int ret = s5_dirindex_read_header(dir, &h, dir->vn_len - sizeof(s5_dirent_t));
 
-        s5_dirty_inode(s5fs, inode);
+    if (ret < 0){
+        return ret;
+    }
 
-        unlock_s5(s5fs);
+    if (ret == 0 || 2 * (h.s5di_nentries + 1) > h.s5di_size){
+        if (slot + 1 < S5_DIR_INDEX_MIN){
+            return 0;
+        }
+        dbg(DBG_S5FS, "building the index of directory %d\n",
+            VNODE_TO_S5INODE(dir)->s5_number);
+        return s5_dirindex_build(dir);
+    }
 
+    if ((ret = s5_dirindex_insert(dir, &h, s5_dirhash(name, namelen), slot)) < 0){
         return ret;
-}
+    }
 
+    h.s5di_nentries++;
+    h.s5di_dirsize = dir->vn_len;
+    return s5_dirindex_write_header(dir, &h);
+}
 
 /*
- * Free an inode by freeing its disk blocks and putting it back on the
- * inode free list.
- *
- * You should also reset the inode to an unused state (eg. zero-ing its
- * list of blocks and setting its type to S5_FREE_TYPE).
- *
- * Don't forget to free the indirect block if it exists.
- *
- * You probably want to use s5_free_block().
+ * Updates the directory's index after the dirent with the given name was
+ * removed from slot, and the last dirent, moved, was moved into its place
+ * (unless moved is NULL). dirsize is the length of the directory before
+ * the removal.
  */
-void
-s5_free_inode(vnode_t *vnode)
+static int
+s5_dirindex_remove(vnode_t *dir, const char *name, size_t namelen,
+        uint32_t slot, s5_dirent_t *moved, off_t dirsize)
 {
-        uint32_t i;
-        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
-        s5fs_t *fs = VNODE_TO_S5FS(vnode);
-
-        KASSERT((S5_TYPE_DATA == inode->s5_type)
-                || (S5_TYPE_DIR == inode->s5_type)
-                || (S5_TYPE_CHR == inode->s5_type)
-                || (S5_TYPE_BLK == inode->s5_type));
-
-        /* free any direct blocks */
-        for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
-                if (inode->s5_direct_blocks[i]) {
-                        dprintf("freeing block %d\n", inode->s5_direct_blocks[i]);
-                        s5_free_block(fs, inode->s5_direct_blocks[i]);
+    s5_dirindex_t h;
+    uint32_t pos;
+    int ret = s5_dirindex_read_header(dir, &h, dirsize);
 
-                        s5_dirty_inode(fs, inode);
-                        inode->s5_direct_blocks[i] = 0;
-                }
-        }
+    if (ret <= 0){
+        return ret;
+    }
 
-        if (((S5_TYPE_DATA == inode->s5_type)
-             || (S5_TYPE_DIR == inode->s5_type))
-            && inode->s5_indirect_block) {
-                pframe_t *ibp;
-                uint32_t *b;
-
-                pframe_get(S5FS_TO_VMOBJ(fs),
-                           (unsigned)inode->s5_indirect_block,
-                           &ibp);
-                KASSERT(ibp
-                        && "because never fails for block_device "
-                        "vm_objects");
-                pframe_pin(ibp);
-
-                b = (uint32_t *)(ibp->pf_addr);
-                for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
-                        KASSERT(b[i] != inode->s5_indirect_block);
-                        if (b[i])
-                                s5_free_block(fs, b[i]);
-                }
+    ret = s5_dirindex_probe(dir, &h, s5_dirhash(name, namelen), NULL, 0,
+            &slot, &pos, NULL);
+    if (ret < 0 || (ret = s5_dirindex_delete(dir, &h, pos)) < 0){
+        return ret;
+    }
 
-                pframe_unpin(ibp);
+    if (moved != NULL){
+        uint32_t last = dirsize / sizeof(s5_dirent_t) - 1;
+        uint32_t hash = s5_dirhash(moved->s5d_name, S5_NAME_LEN);
+        s5_dirindex_entry_t e;
 
-                s5_free_block(fs, inode->s5_indirect_block);
+        ret = s5_dirindex_probe(dir, &h, hash, NULL, 0, &last, &pos, NULL);
+        if (ret < 0){
+            return ret;
         }
 
-        inode->s5_indirect_block = 0;
-        inode->s5_type = S5_TYPE_FREE;
-        s5_dirty_inode(fs, inode);
-
-        lock_s5(fs);
-        inode->s5_next_free = fs->s5f_super->s5s_free_inode;
-        fs->s5f_super->s5s_free_inode = inode->s5_number;
-        unlock_s5(fs);
+        e.s5de_hash = hash;
+        e.s5de_slot = slot + 1;
+        if ((ret = s5_dirindex_set(dir, pos, &e)) < 0){
+            return ret;
+        }
+    }
 
-        s5_dirty_inode(fs, inode);
-        s5_dirty_super(fs);
+    h.s5di_nentries--;
+    h.s5di_dirsize = dir->vn_len;
+    return s5_dirindex_write_header(dir, &h);
 }
 
 static int s5_find_dirent_helper(vnode_t *vnode, const char *name, size_t namelen,
         off_t *offset, int *ino){
     s5_dirent_t dirents[NDIRENTS];
+    s5_dirindex_t h;
+
+    int index_res = s5_dirindex_read_header(vnode, &h, vnode->vn_len);
+
+    if (index_res < 0){
+        return index_res;
+    }
+
+    if (index_res > 0){
+        uint32_t slot, pos;
+        int found_ino;
+
+        int probe_res = s5_dirindex_probe(vnode, &h, s5_dirhash(name, namelen),
+                name, namelen, &slot, &pos, &found_ino);
+
+        if (probe_res < 0){
+            return probe_res;
+        }
+
+        if (offset != NULL){
+            *offset = slot * sizeof(s5_dirent_t);
+        }
+
+        if (ino != NULL){
+            *ino = found_ino;
+        }
+
+        return 0;
+    }
 
     off_t seek = 0;
 
@@ -711,12 +2080,15 @@ s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
     KASSERT(find_res == 0 && "you missed an error case");
     KASSERT((unsigned) vnode->vn_len >= dir_offset + dirent_size);
 
+    off_t old_len = vnode->vn_len;
+    s5_dirent_t to_move;
+    s5_dirent_t *moved = NULL;
+
     /* if the dirent to remove isn't the last dirent, we need to
      * copy the last dirent into its place */
     if ((unsigned) vnode->vn_len > dir_offset + dirent_size){
         KASSERT((unsigned) vnode->vn_len >= dir_offset + (2 * dirent_size));
 
-        s5_dirent_t to_move;
 
         int read_res = s5_read_file(vnode, vnode->vn_len - dirent_size,
                 (char *) &to_move, dirent_size);
@@ -733,6 +2105,7 @@ s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
             dbg(DBG_S5FS, "error overwriting dirent to remove with last dirent\n");
             return write_res;
         }
+        moved = &to_move;
     }
 
     s5fs_t *fs = VNODE_TO_S5FS(vnode);
@@ -745,6 +2118,12 @@ s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
     dir_inode->s5_size -= dirent_size;
     s5_dirty_inode(fs, dir_inode);
 
+    if (s5_dirindex_remove(vnode, name, namelen, dir_offset / dirent_size,
+                moved, old_len) < 0){
+        dbg(DBG_S5FS, "error updating directory index, dropping it\n");
+        s5_dirindex_invalidate(vnode);
+    }
+
     /* decrement the linkcount on the unlinked file */
     vnode_t *deleted_vnode = vget(fs->s5f_fs, deleted_ino);
     s5_inode_t *deleted_inode = VNODE_TO_S5INODE(deleted_vnode);
@@ -790,6 +2169,12 @@ s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
         dbg(DBG_S5FS, "error finding dirent to write to\n");
     }
 
+    /* the directory's index lives past its entries */
+    if (write_offset + sizeof(s5_dirent_t) > S5_DIR_INDEX_BLOCK * S5_BLOCK_SIZE){
+        dbg(DBG_S5FS, "directory is full\n");
+        return -ENOSPC;
+    }
+
     int res = s5_write_file(parent, write_offset, (char *) &d,
             sizeof(s5_dirent_t));
 
@@ -800,6 +2185,11 @@ s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
 
     s5_dirty_inode(VNODE_TO_S5FS(parent), VNODE_TO_S5INODE(parent));
 
+    if (s5_dirindex_add(parent, name, namelen) < 0){
+        dbg(DBG_S5FS, "error updating directory index, dropping it\n");
+        s5_dirindex_invalidate(parent);
+    }
+
     if (parent != child){
         dbg(DBG_S5FS, "incrementing link count on inode %d from %d to %d\n",
             VNODE_TO_S5INODE(child)->s5_number, VNODE_TO_S5INODE(child)->s5_linkcount,
@@ -815,14 +2205,52 @@ s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
     return 0;
 }
 
+/*
+ * Returns the number of blocks in the tree of indirect blocks rooted at
+ * blockno, which is at the given level, including blockno itself, or
+ * -errno.
+ */
+static int
+s5_tree_blocks(s5fs_t *fs, uint32_t blockno, int level)
+{
+    pframe_t *p;
+    int get_res = pframe_get(S5FS_TO_VMOBJ(fs), blockno, &p);
+
+    if (get_res < 0){
+        return get_res;
+    }
+
+    pframe_pin(p);
+
+    int allocated_blocks = 1;
+    uint32_t *b = (uint32_t *) p->pf_addr;
+    uint32_t i;
+
+    for (i = 0; i < S5_NIDIRECT_BLOCKS; i++){
+        if (b[i] == 0){
+            continue;
+        }
+
+        int res = level > 1 ? s5_tree_blocks(fs, b[i], level - 1) : 1;
+
+        if (res < 0){
+            allocated_blocks = res;
+            break;
+        }
+        allocated_blocks += res;
+    }
+
+    pframe_unpin(p);
+
+    return allocated_blocks;
+}
+
 /*
  * Return the number of blocks that this inode has allocated on disk.
- * This should include the indirect block, but not include sparse
+ * This should include the indirect blocks, but not include sparse
  * blocks.
  *
  * This is only used by s5fs_stat().
- *
- * You'll probably want to use pframe_get().
  */
 int
 s5_inode_blocks(vnode_t *vnode)
@@ -837,29 +2265,79 @@ s5_inode_blocks(vnode_t *vnode)
         }
     }
 
-    if (inode->s5_indirect_block == 0){
-        return allocated_blocks;
+    for (i = 0; i < S5_INDIRECT_LEVELS; i++){
+        if (inode->s5_indirect_blocks[i] == 0){
+            continue;
+        }
+
+        int res = s5_tree_blocks(VNODE_TO_S5FS(vnode), inode->s5_indirect_blocks[i], i + 1);
+
+        if (res < 0){
+            return res;
+        }
+        allocated_blocks += res;
     }
 
-    /* count the indirect block as an allocated block */
-    allocated_blocks++;
+    return allocated_blocks;
+}
 
-    pframe_t *p;
-    mmobj_t *mmobj = S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode));
+/*
+ * Writes back the indirect blocks below the tree rooted at blockno, which
+ * is at the given level, and blockno itself.
+ */
+static int
+s5_clean_tree(s5fs_t *fs, uint32_t blockno, int level)
+{
+    mmobj_t *mmo = S5FS_TO_VMOBJ(fs);
+    int ret = 0;
 
-    int get_res = pframe_get(mmobj, inode->s5_indirect_block, &p);
+    if (level > 1){
+        pframe_t *p;
 
-    if (get_res < 0){
-        return get_res;
-    }
+        if ((ret = pframe_get(mmo, blockno, &p)) < 0){
+            return ret;
+        }
 
-    int j;
-    for (j = 0; j < S5_NDIRECT_BLOCKS; j++){
-        if (((int *)p->pf_addr)[j] != 0){
-            allocated_blocks++;
+        pframe_pin(p);
+
+        uint32_t *b = (uint32_t *) p->pf_addr;
+        uint32_t i;
+        for (i = 0; i < S5_NIDIRECT_BLOCKS && ret == 0; i++){
+            if (b[i] != 0){
+                ret = s5_clean_tree(fs, b[i], level - 1);
+            }
         }
+
+        pframe_unpin(p);
     }
 
-    return allocated_blocks;
+    int err = pframe_clean_range(mmo, blockno, blockno + 1);
+
+    return ret ? ret : err;
 }
 
+/*
+ * Writes back all the indirect blocks of a file, for fsync. Returns 0 or
+ * -errno.
+ */
+int
+s5_clean_indirect_blocks(vnode_t *vnode)
+{
+    s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < S5_INDIRECT_LEVELS; i++){
+        if (inode->s5_indirect_blocks[i] == 0){
+            continue;
+        }
+
+        int err = s5_clean_tree(VNODE_TO_S5FS(vnode), inode->s5_indirect_blocks[i], i + 1);
+
+        if (err < 0 && ret == 0){
+            ret = err;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,703 @@
+/*
+ * An in-memory filesystem for scratch files, meant to be mounted on /tmp.
+ * Unlike ramfs it has no limits on the size or number of files:
+ *
+ *    o The contents of a regular file are the pages of an anonymous object,
+ *      so a file can be any size, pages that were never written take no
+ *      memory, mmap() maps the object itself, and pageoutd can reclaim the
+ *      pages by swapping them out like any other anonymous memory.
+ *
+ *    o Directories keep their entries on a list, in the order they were
+ *      created, for readdir, and in a hash table by name, for lookups.
+ *
+ * Nothing survives an unmount.
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "types.h"
+#include "errno.h"
+
+#include "util/string.h"
+#include "util/printf.h"
+#include "util/debug.h"
+#include "util/list.h"
+
+#include "fs/dirent.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "fs/tmpfs/tmpfs.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "vm/anon.h"
+#include "vm/swap.h"
+#include "vm/vmmap.h"
+
+/*
+ * Filesystem operations
+ */
+static void tmpfs_read_vnode(vnode_t *vn);
+static void tmpfs_delete_vnode(vnode_t *vn);
+static int tmpfs_query_vnode(vnode_t *vn);
+static int tmpfs_umount(fs_t *fs);
+
+static fs_ops_t tmpfs_ops = {
+        .read_vnode   = tmpfs_read_vnode,
+        .delete_vnode = tmpfs_delete_vnode,
+        .query_vnode  = tmpfs_query_vnode,
+        .umount       = tmpfs_umount,
+        .sync         = NULL
+};
+
+/*
+ * vnode operations
+ */
+static int tmpfs_read(vnode_t *file, off_t offset, void *buf, size_t count);
+static int tmpfs_write(vnode_t *file, off_t offset, const void *buf, size_t count);
+static int tmpfs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
+static int tmpfs_create(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result);
+static int tmpfs_mknod(struct vnode *dir, const char *name, size_t name_len,
+                       int mode, devid_t devid);
+static int tmpfs_lookup(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result);
+static int tmpfs_link(vnode_t *oldvnode, vnode_t *dir,
+                      const char *name, size_t name_len);
+static int tmpfs_unlink(vnode_t *dir, const char *name, size_t name_len);
+static int tmpfs_mkdir(vnode_t *dir, const char *name, size_t name_len);
+static int tmpfs_rmdir(vnode_t *dir, const char *name, size_t name_len);
+static int tmpfs_readdir(vnode_t *dir, off_t offset, struct dirent *d);
+static int tmpfs_stat(vnode_t *file, struct stat *buf);
+
+static vnode_ops_t tmpfs_dir_vops = {
+        .read = NULL,
+        .write = NULL,
+        .mmap = NULL,
+        .create = tmpfs_create,
+        .mknod = tmpfs_mknod,
+        .lookup = tmpfs_lookup,
+        .link = tmpfs_link,
+        .unlink = tmpfs_unlink,
+        .mkdir = tmpfs_mkdir,
+        .rmdir = tmpfs_rmdir,
+        .readdir = tmpfs_readdir,
+        .stat = tmpfs_stat,
+        .acquire = NULL,
+        .release = NULL,
+        .fsync = NULL,
+        .fallocate = NULL,
+        .read_direct = NULL,
+        .write_direct = NULL,
+        .fillpage = NULL,
+        .dirtypage = NULL,
+        .cleanpage = NULL
+};
+
+static vnode_ops_t tmpfs_file_vops = {
+        .read = tmpfs_read,
+        .write = tmpfs_write,
+        .mmap = tmpfs_mmap,
+        .create = NULL,
+        .mknod = NULL,
+        .lookup = NULL,
+        .link = NULL,
+        .unlink = NULL,
+        .mkdir = NULL,
+        .rmdir = NULL,
+        .readdir = NULL,
+        .stat = tmpfs_stat,
+        .acquire = NULL,
+        .release = NULL,
+        .fsync = NULL,
+        .fallocate = NULL,
+        .read_direct = NULL,
+        .write_direct = NULL,
+        .fillpage = NULL,
+        .dirtypage = NULL,
+        .cleanpage = NULL
+};
+
+/*
+ * A directory entry
+ */
+typedef struct tmpfs_dirent {
+        ino_t           td_ino;         /* Inode number of this entry */
+        off_t           td_off;         /* Its place in the directory, which
+                                         * readdir goes through in order */
+        size_t          td_namelen;
+        char            td_name[NAME_LEN]; /* Name of this entry */
+        list_link_t     td_link;        /* On ti_dirents */
+        list_link_t     td_hash_link;   /* On a ti_dirhash bucket */
+} tmpfs_dirent_t;
+
+/*
+ * The tmpfs 'inode' structure
+ */
+typedef struct tmpfs_inode {
+        ino_t           ti_ino;         /* Inode number */
+        int             ti_mode;        /* Type of file */
+        off_t           ti_size;        /* File size, or number of entries
+                                         * of a directory */
+        int             ti_linkcount;   /* Number of links to this file,
+                                         * plus one while it has a vnode */
+        devid_t         ti_devid;       /* Device files: the device */
+        mmobj_t        *ti_data;        /* Regular files: the contents */
+        list_t          ti_dirents;     /* Directories: entries by td_off */
+        list_t         *ti_dirhash;     /* Directories: entries by name */
+        off_t           ti_nextoff;     /* Directories: td_off of the next
+                                         * entry */
+        list_link_t     ti_hash_link;   /* On a tfs_inodes bucket */
+} tmpfs_inode_t;
+
+/*
+ * tmpfs filesystem structure
+ */
+typedef struct tmpfs {
+        list_t          tfs_inodes[TMPFS_HASH_SIZE]; /* All inodes, by number */
+        ino_t           tfs_nextino;    /* Number of the next inode */
+} tmpfs_t;
+
+#define VNODE_TO_TMPFSINODE(vn) \
+        ((tmpfs_inode_t *)(vn)->vn_i)
+#define VNODE_TO_TMPFS(vn) \
+        ((tmpfs_t *)(vn)->vn_fs->fs_i)
+
+/* Helper functions */
+static tmpfs_inode_t *
+tmpfs_find_inode(tmpfs_t *tfs, ino_t ino)
+{
+        tmpfs_inode_t *inode;
+
+        list_iterate_begin(&tfs->tfs_inodes[ino % TMPFS_HASH_SIZE], inode,
+                           tmpfs_inode_t, ti_hash_link) {
+                if (inode->ti_ino == ino) {
+                        return inode;
+                }
+        } list_iterate_end();
+
+        return NULL;
+}
+
+static tmpfs_inode_t *
+tmpfs_alloc_inode(fs_t *fs, int mode, devid_t devid)
+{
+        tmpfs_t *tfs = (tmpfs_t *) fs->fs_i;
+        tmpfs_inode_t *inode;
+        int i;
+
+        KASSERT(S_ISREG(mode) || S_ISDIR(mode)
+                || S_ISCHR(mode) || S_ISBLK(mode));
+
+        if (NULL == (inode = kmalloc(sizeof(tmpfs_inode_t)))) {
+                return NULL;
+        }
+        memset(inode, 0, sizeof(tmpfs_inode_t));
+
+        if (S_ISREG(mode)) {
+                if (NULL == (inode->ti_data = anon_create())) {
+                        kfree(inode);
+                        return NULL;
+                }
+                inode->ti_data->mmo_ops->ref(inode->ti_data);
+        } else if (S_ISDIR(mode)) {
+                if (NULL == (inode->ti_dirhash =
+                                     kmalloc(TMPFS_DIR_HASH_SIZE * sizeof(list_t)))) {
+                        kfree(inode);
+                        return NULL;
+                }
+                for (i = 0; i < TMPFS_DIR_HASH_SIZE; i++) {
+                        list_init(&inode->ti_dirhash[i]);
+                }
+                list_init(&inode->ti_dirents);
+        }
+
+        inode->ti_ino = tfs->tfs_nextino++;
+        inode->ti_mode = mode;
+        inode->ti_devid = devid;
+        inode->ti_linkcount = 1;
+
+        list_insert_head(&tfs->tfs_inodes[inode->ti_ino % TMPFS_HASH_SIZE],
+                         &inode->ti_hash_link);
+        return inode;
+}
+
+static void
+tmpfs_free_inode(tmpfs_inode_t *inode)
+{
+        tmpfs_dirent_t *entry;
+
+        list_remove(&inode->ti_hash_link);
+
+        if (S_ISREG(inode->ti_mode)) {
+                /* mappings of the file keep their own references */
+                inode->ti_data->mmo_ops->put(inode->ti_data);
+        } else if (S_ISDIR(inode->ti_mode)) {
+                list_iterate_begin(&inode->ti_dirents, entry,
+                                   tmpfs_dirent_t, td_link) {
+                        kfree(entry);
+                } list_iterate_end();
+                kfree(inode->ti_dirhash);
+        }
+
+        kfree(inode);
+}
+
+static list_t *
+tmpfs_dir_bucket(tmpfs_inode_t *dir, const char *name, size_t len)
+{
+        uint32_t hash = 0;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                hash = hash * 31 + (unsigned char) name[i];
+        }
+        return &dir->ti_dirhash[hash % TMPFS_DIR_HASH_SIZE];
+}
+
+static tmpfs_dirent_t *
+tmpfs_dir_find(tmpfs_inode_t *dir, const char *name, size_t len)
+{
+        tmpfs_dirent_t *entry;
+
+        list_iterate_begin(tmpfs_dir_bucket(dir, name, len), entry,
+                           tmpfs_dirent_t, td_hash_link) {
+                if (entry->td_namelen == len
+                    && 0 == strncmp(entry->td_name, name, len)) {
+                        return entry;
+                }
+        } list_iterate_end();
+
+        return NULL;
+}
+
+/*
+ * Adds an entry for inode number ino to the directory. Nothing here
+ * blocks, so the caller's check that the name is free still holds.
+ */
+static int
+tmpfs_dir_add(tmpfs_inode_t *dir, const char *name, size_t len, ino_t ino)
+{
+        tmpfs_dirent_t *entry;
+
+        if (len >= NAME_LEN) {
+                return -ENAMETOOLONG;
+        }
+        if (NULL != tmpfs_dir_find(dir, name, len)) {
+                return -EEXIST;
+        }
+        if (NULL == (entry = kmalloc(sizeof(tmpfs_dirent_t)))) {
+                return -ENOSPC;
+        }
+
+        entry->td_ino = ino;
+        entry->td_off = dir->ti_nextoff++;
+        entry->td_namelen = len;
+        memcpy(entry->td_name, name, len);
+        entry->td_name[len] = '\0';
+
+        list_insert_tail(&dir->ti_dirents, &entry->td_link);
+        list_insert_head(tmpfs_dir_bucket(dir, name, len), &entry->td_hash_link);
+        dir->ti_size++;
+
+        return 0;
+}
+
+static void
+tmpfs_dir_remove(tmpfs_inode_t *dir, tmpfs_dirent_t *entry)
+{
+        list_remove(&entry->td_link);
+        list_remove(&entry->td_hash_link);
+        kfree(entry);
+        dir->ti_size--;
+}
+
+/*
+ * Drops a link to the inode, freeing it if it was the last one and the
+ * inode has no vnode.
+ */
+static void
+tmpfs_drop_link(tmpfs_inode_t *inode)
+{
+        if (0 == --inode->ti_linkcount) {
+                tmpfs_free_inode(inode);
+        }
+}
+
+/*
+ * Function implementations
+ */
+
+int
+tmpfs_mount(struct fs *fs)
+{
+        tmpfs_t *tfs;
+        tmpfs_inode_t *root;
+        int i, err;
+
+        /* Allocate filesystem */
+        if (NULL == (tfs = kmalloc(sizeof(tmpfs_t)))) {
+                return -ENOMEM;
+        }
+        for (i = 0; i < TMPFS_HASH_SIZE; i++) {
+                list_init(&tfs->tfs_inodes[i]);
+        }
+        tfs->tfs_nextino = 0;
+
+        fs->fs_i = tfs;
+        fs->fs_op = &tmpfs_ops;
+
+        /* Set up the root directory, with '.' and '..' in it */
+        if (NULL == (root = tmpfs_alloc_inode(fs, S_IFDIR, 0))) {
+                kfree(tfs);
+                return -ENOMEM;
+        }
+        if (0 > (err = tmpfs_dir_add(root, ".", 1, root->ti_ino))
+            || 0 > (err = tmpfs_dir_add(root, "..", 2, root->ti_ino))) {
+                tmpfs_free_inode(root);
+                kfree(tfs);
+                return err;
+        }
+
+        fs->fs_root = vget(fs, root->ti_ino);
+
+        return 0;
+}
+
+static void
+tmpfs_read_vnode(vnode_t *vn)
+{
+        tmpfs_inode_t *inode = tmpfs_find_inode(VNODE_TO_TMPFS(vn), vn->vn_vno);
+        KASSERT(NULL != inode);
+
+        inode->ti_linkcount++;
+
+        vn->vn_i = inode;
+        vn->vn_mode = inode->ti_mode;
+        vn->vn_len = inode->ti_size;
+
+        if (S_ISREG(inode->ti_mode)) {
+                vn->vn_ops = &tmpfs_file_vops;
+        } else if (S_ISDIR(inode->ti_mode)) {
+                vn->vn_ops = &tmpfs_dir_vops;
+        } else {
+                vn->vn_ops = NULL;
+                vn->vn_devid = inode->ti_devid;
+        }
+}
+
+static void
+tmpfs_delete_vnode(vnode_t *vn)
+{
+        tmpfs_drop_link(VNODE_TO_TMPFSINODE(vn));
+}
+
+static int
+tmpfs_query_vnode(vnode_t *vn)
+{
+        return VNODE_TO_TMPFSINODE(vn)->ti_linkcount > 1;
+}
+
+static int
+tmpfs_umount(fs_t *fs)
+{
+        tmpfs_t *tfs = (tmpfs_t *) fs->fs_i;
+        int i;
+
+        vput(fs->fs_root);
+
+        /* Everything is in memory, so just free it all */
+        for (i = 0; i < TMPFS_HASH_SIZE; i++) {
+                while (!list_empty(&tfs->tfs_inodes[i])) {
+                        tmpfs_free_inode(list_head(&tfs->tfs_inodes[i],
+                                                   tmpfs_inode_t, ti_hash_link));
+                }
+        }
+        kfree(tfs);
+
+        return 0;
+}
+
+static int
+tmpfs_create(vnode_t *dir, const char *name, size_t name_len, vnode_t **result)
+{
+        tmpfs_inode_t *inode;
+        int err;
+
+        if (NULL == (inode = tmpfs_alloc_inode(dir->vn_fs, S_IFREG, 0))) {
+                return -ENOSPC;
+        }
+        if (0 > (err = tmpfs_dir_add(VNODE_TO_TMPFSINODE(dir), name, name_len,
+                                     inode->ti_ino))) {
+                tmpfs_free_inode(inode);
+                return err;
+        }
+
+        *result = vget(dir->vn_fs, inode->ti_ino);
+
+        return 0;
+}
+
+static int
+tmpfs_mknod(struct vnode *dir, const char *name, size_t name_len, int mode, devid_t devid)
+{
+        tmpfs_inode_t *inode;
+        int err;
+
+        if (!S_ISCHR(mode) && !S_ISBLK(mode)) {
+                return -EINVAL;
+        }
+
+        if (NULL == (inode = tmpfs_alloc_inode(dir->vn_fs, mode, devid))) {
+                return -ENOSPC;
+        }
+        if (0 > (err = tmpfs_dir_add(VNODE_TO_TMPFSINODE(dir), name, name_len,
+                                     inode->ti_ino))) {
+                tmpfs_free_inode(inode);
+                return err;
+        }
+
+        return 0;
+}
+
+static int
+tmpfs_lookup(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
+{
+        tmpfs_dirent_t *entry;
+
+        if (NULL == (entry = tmpfs_dir_find(VNODE_TO_TMPFSINODE(dir), name, namelen))) {
+                return -ENOENT;
+        }
+
+        *result = vget(dir->vn_fs, entry->td_ino);
+        return 0;
+}
+
+static int
+tmpfs_link(vnode_t *oldvnode, vnode_t *dir,
+           const char *name, size_t name_len)
+{
+        int err;
+
+        KASSERT(oldvnode->vn_fs == dir->vn_fs);
+
+        if (S_ISDIR(oldvnode->vn_mode)) {
+                return -EPERM;
+        }
+
+        if (0 > (err = tmpfs_dir_add(VNODE_TO_TMPFSINODE(dir), name, name_len,
+                                     oldvnode->vn_vno))) {
+                return err;
+        }
+
+        VNODE_TO_TMPFSINODE(oldvnode)->ti_linkcount++;
+        return 0;
+}
+
+static int
+tmpfs_unlink(vnode_t *dir, const char *name, size_t namelen)
+{
+        tmpfs_inode_t *dirinode = VNODE_TO_TMPFSINODE(dir);
+        tmpfs_dirent_t *entry;
+        tmpfs_inode_t *inode;
+
+        if (NULL == (entry = tmpfs_dir_find(dirinode, name, namelen))) {
+                return -ENOENT;
+        }
+
+        inode = tmpfs_find_inode(VNODE_TO_TMPFS(dir), entry->td_ino);
+        KASSERT(NULL != inode);
+
+        if (S_ISDIR(inode->ti_mode)) {
+                return -EISDIR;
+        }
+
+        tmpfs_dir_remove(dirinode, entry);
+        tmpfs_drop_link(inode);
+
+        return 0;
+}
+
+static int
+tmpfs_mkdir(vnode_t *dir, const char *name, size_t name_len)
+{
+        tmpfs_inode_t *inode;
+        int err;
+
+        if (NULL == (inode = tmpfs_alloc_inode(dir->vn_fs, S_IFDIR, 0))) {
+                return -ENOSPC;
+        }
+
+        if (0 > (err = tmpfs_dir_add(inode, ".", 1, inode->ti_ino))
+            || 0 > (err = tmpfs_dir_add(inode, "..", 2, dir->vn_vno))
+            || 0 > (err = tmpfs_dir_add(VNODE_TO_TMPFSINODE(dir), name, name_len,
+                                        inode->ti_ino))) {
+                tmpfs_free_inode(inode);
+                return err;
+        }
+
+        return 0;
+}
+
+static int
+tmpfs_rmdir(vnode_t *dir, const char *name, size_t name_len)
+{
+        tmpfs_inode_t *dirinode = VNODE_TO_TMPFSINODE(dir);
+        tmpfs_dirent_t *entry;
+        tmpfs_inode_t *inode;
+
+        KASSERT(!name_match(".", name, name_len) &&
+                !name_match("..", name, name_len));
+
+        if (NULL == (entry = tmpfs_dir_find(dirinode, name, name_len))) {
+                return -ENOENT;
+        }
+
+        inode = tmpfs_find_inode(VNODE_TO_TMPFS(dir), entry->td_ino);
+        KASSERT(NULL != inode);
+
+        if (!S_ISDIR(inode->ti_mode)) {
+                return -ENOTDIR;
+        }
+        /* '.' and '..' are all that may be left */
+        if (inode->ti_size > 2) {
+                return -ENOTEMPTY;
+        }
+
+        tmpfs_dir_remove(dirinode, entry);
+        tmpfs_drop_link(inode);
+
+        return 0;
+}
+
+static int
+tmpfs_read(vnode_t *file, off_t offset, void *buf, size_t count)
+{
+        tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(file);
+        size_t done = 0;
+        pframe_t *pf;
+        int err;
+
+        KASSERT(S_ISREG(file->vn_mode));
+
+        if (offset >= inode->ti_size) {
+                return 0;
+        }
+        count = MIN(count, (size_t)(inode->ti_size - offset));
+
+        while (done < count) {
+                off_t pos = offset + done;
+                size_t n = MIN(PAGE_SIZE - PAGE_OFFSET(pos), count - done);
+
+                /* a hole reads as zeros without being given a page */
+                if (NULL == pframe_get_resident(inode->ti_data, ADDR_TO_PN(pos))
+                    && !swap_has_page(inode->ti_data, ADDR_TO_PN(pos))) {
+                        memset((char *) buf + done, 0, n);
+                        done += n;
+                        continue;
+                }
+
+                if (0 > (err = pframe_lookup(inode->ti_data, ADDR_TO_PN(pos),
+                                             0, &pf))) {
+                        return done ? (int) done : err;
+                }
+                memcpy((char *) buf + done, (char *) pf->pf_addr + PAGE_OFFSET(pos), n);
+                done += n;
+        }
+
+        return done;
+}
+
+static int
+tmpfs_write(vnode_t *file, off_t offset, const void *buf, size_t count)
+{
+        tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(file);
+        size_t done = 0;
+        pframe_t *pf;
+        int err = 0;
+
+        KASSERT(S_ISREG(file->vn_mode));
+
+        if ((off_t)(offset + count) < offset) {
+                return -EFBIG;
+        }
+
+        while (done < count) {
+                off_t pos = offset + done;
+                size_t n = MIN(PAGE_SIZE - PAGE_OFFSET(pos), count - done);
+
+                if (0 > (err = pframe_lookup(inode->ti_data, ADDR_TO_PN(pos),
+                                             1, &pf))) {
+                        break;
+                }
+
+                /* dirty it first, which unshares a merged page */
+                pframe_pin(pf);
+                if (0 > (err = pframe_dirty(pf))) {
+                        pframe_unpin(pf);
+                        break;
+                }
+                memcpy((char *) pf->pf_addr + PAGE_OFFSET(pos), (const char *) buf + done, n);
+                pframe_unpin(pf);
+
+                done += n;
+                if (pos + (off_t) n > inode->ti_size) {
+                        inode->ti_size = pos + n;
+                        file->vn_len = inode->ti_size;
+                }
+        }
+
+        return done ? (int) done : err;
+}
+
+static int
+tmpfs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret)
+{
+        *ret = VNODE_TO_TMPFSINODE(file)->ti_data;
+        return 0;
+}
+
+static int
+tmpfs_readdir(vnode_t *dir, off_t offset, struct dirent *d)
+{
+        tmpfs_dirent_t *entry;
+
+        KASSERT(S_ISDIR(dir->vn_mode));
+
+        /* the offset is the td_off of the next entry to return, or of an
+         * entry that has since been removed */
+        list_iterate_begin(&VNODE_TO_TMPFSINODE(dir)->ti_dirents, entry,
+                           tmpfs_dirent_t, td_link) {
+                if (entry->td_off >= offset) {
+                        d->d_ino = entry->td_ino;
+                        d->d_off = entry->td_off + 1;
+                        strcpy(d->d_name, entry->td_name);
+                        return entry->td_off + 1 - offset;
+                }
+        } list_iterate_end();
+
+        return 0;
+}
+
+static int
+tmpfs_stat(vnode_t *file, struct stat *buf)
+{
+        tmpfs_inode_t *i = VNODE_TO_TMPFSINODE(file);
+        memset(buf, 0, sizeof(struct stat));
+        buf->st_mode    = file->vn_mode;
+        buf->st_ino     = (int) file->vn_vno;
+        buf->st_dev     = 0;
+        if (S_ISCHR(file->vn_mode) || S_ISBLK(file->vn_mode)) {
+                buf->st_rdev  = (int) i->ti_devid;
+        }
+        buf->st_nlink   = i->ti_linkcount - 1;
+        buf->st_size    = (int) i->ti_size;
+        buf->st_blksize = (int) PAGE_SIZE;
+        buf->st_blocks  = S_ISREG(file->vn_mode) ? i->ti_data->mmo_nrespages : 0;
+
+        return 0;
+}
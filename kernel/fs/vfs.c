@@ -16,10 +16,12 @@
 #include "fs/s5fs/s5fs.h"
 #endif
 #include "fs/vfs.h"
+#include "fs/dcache.h"
 #include "fs/file.h"
 #include "fs/vnode.h"
 #include "fs/vfs_syscall.h"
 #include "fs/ramfs/ramfs.h"
+#include "fs/tmpfs/tmpfs.h"
 
 #include "fs/stat.h"
 #include "fs/fcntl.h"
@@ -56,8 +58,25 @@ list_t mounted_fs_list;
 int
 vfs_mount(struct vnode *mtpt, fs_t *fs)
 {
-        NOT_YET_IMPLEMENTED("MOUNTING: vfs_mount");
-        return -EINVAL;
+        KASSERT(NULL != fs->fs_root);
+
+        if (!S_ISDIR(mtpt->vn_mode)) {
+                return -ENOTDIR;
+        }
+        /* nothing may be mounted on it already, and the roots of file
+         * systems (including "/") cannot be mounted on */
+        if (mtpt->vn_mount != mtpt || mtpt == mtpt->vn_fs->fs_root) {
+                return -EBUSY;
+        }
+
+        vref(mtpt);
+        fs->fs_mtpt = mtpt;
+        mtpt->vn_mount = fs->fs_root;
+        list_insert_tail(&mounted_fs_list, &fs->fs_link);
+
+        /* names under mtpt now refer to fs */
+        dcache_purge(NULL);
+        return 0;
 }
 
 /*
@@ -76,8 +95,45 @@ vfs_mount(struct vnode *mtpt, fs_t *fs)
 int
 vfs_umount(fs_t *fs)
 {
-        NOT_YET_IMPLEMENTED("MOUNTING: vfs_umount");
-        return -EINVAL;
+        vnode_t *mtpt = fs->fs_mtpt;
+        fs_t *mtfs;
+        int ret = 0;
+
+        KASSERT(fs != vfs_root_vn->vn_fs);
+
+        /* a file system mounted on this one has to go first */
+        list_iterate_begin(&mounted_fs_list, mtfs, fs_t, fs_link) {
+                if (mtfs->fs_mtpt->vn_fs == fs) {
+                        return -EBUSY;
+                }
+        } list_iterate_end();
+
+        dcache_purge(fs);
+        vnode_uncache_all(fs);
+
+        if (0 > vfs_is_in_use(fs)) {
+                return -EBUSY;
+        }
+
+        /* no new lookups can reach fs from here on */
+        mtpt->vn_mount = mtpt;
+        list_remove(&fs->fs_link);
+        dcache_purge(NULL);
+
+        if (fs->fs_op->umount) {
+                ret = fs->fs_op->umount(fs);
+        } else {
+                vput(fs->fs_root);
+        }
+
+        KASSERT((!vnode_inuse(fs))
+                && "should have been taken care of by unmount entry point "
+                "or by the above vput of the root vnode");
+
+        vput(mtpt);
+        kfree(fs);
+
+        return ret;
 }
 #endif /* __MOUNTING__ */
 
@@ -146,17 +202,21 @@ vfs_shutdown()
         KASSERT(vfs_root_vn);
 
 #ifdef __MOUNTING__
-        fs_t *mtfs;
-        list_iterate_begin(&mounted_fs_list, mtfs, fs_t, fs_link) {
-                int ret = vfs_umount(mtfs);
+        /* the most recently mounted first, so that file systems
+         * mounted on other mounted file systems go before them */
+        while (!list_empty(&mounted_fs_list)) {
+                int ret = vfs_umount(list_tail(&mounted_fs_list, fs_t, fs_link));
                 KASSERT(0 <= ret);
-        } list_iterate_end();
+        }
 #endif
 
 
         vn = vfs_root_vn;
         fs = vn->vn_fs;
 
+        dcache_purge(fs);
+        vnode_uncache_all(fs);
+
         /* 'vfs_shutdown' is called after there are no processes other than
          * idleproc running. idleproc does not have a p_cwd. Thus, there
          * should be no live vnodes */
@@ -183,6 +243,32 @@ vfs_shutdown()
         return ret;
 }
 
+static void
+vfs_sync_fs(fs_t *fs)
+{
+        int err;
+
+        if (NULL != fs->fs_op->sync && 0 > (err = fs->fs_op->sync(fs))) {
+                dbg(DBG_VFS, "vfs_sync: WARNING: failed to sync fs of type "
+                    "%s on %s: %d\n", fs->fs_type, fs->fs_dev, err);
+        }
+}
+
+void
+vfs_sync(void)
+{
+        KASSERT(vfs_root_vn);
+
+        vfs_sync_fs(vfs_root_vn->vn_fs);
+
+#ifdef __MOUNTING__
+        fs_t *mtfs;
+        list_iterate_begin(&mounted_fs_list, mtfs, fs_t, fs_link) {
+                vfs_sync_fs(mtfs);
+        } list_iterate_end();
+#endif
+}
+
 /*
  * Given an fs_t, we search through the list of known file systems
  * and call the proper mount function.
@@ -198,6 +284,7 @@ mountfunc(fs_t *fs)
                 { "s5fs", s5fs_mount },
 #endif
                 { "ramfs", ramfs_mount },
+                { "tmpfs", tmpfs_mount },
         };
         unsigned i;
 
@@ -13,6 +13,7 @@
 #include "fs/file.h"
 #include "fs/vnode.h"
 #include "fs/vfs_syscall.h"
+#include "fs/dcache.h"
 #include "fs/open.h"
 #include "fs/fcntl.h"
 #include "fs/lseek.h"
@@ -20,6 +21,7 @@
 #include "util/string.h"
 #include "util/printf.h"
 #include "fs/stat.h"
+#include "mm/page.h"
 #include "util/debug.h"
 
 #define KMUTEX_STATIC_INITIALIZER(name) {{{&name.km_waitq.tq_list,\
@@ -27,6 +29,124 @@
 
 static kmutex_t lookup_mutex = KMUTEX_STATIC_INITIALIZER(lookup_mutex);
 
+/*
+ * Does the I/O of an O_DIRECT file: calls the read_direct or write_direct
+ * vnode operation for npages whole pages at the current position of fd,
+ * which must be page aligned, and moves the position past what was
+ * transferred. See do_read_pages() and do_write_pages().
+ */
+static int
+direct_io(int fd, void **pages, uint32_t npages, int forwrite)
+{
+    file_t *f = fget(fd);
+
+    if (f == NULL){
+        return -EBADF;
+    } else if (!(f->f_mode & (forwrite ? FMODE_WRITE : FMODE_READ))){
+        fput(f);
+        return -EBADF;
+    } else if (!(f->f_mode & FMODE_DIRECT)){
+        fput(f);
+        return -EINVAL;
+    }
+
+    if (forwrite && (f->f_mode & FMODE_APPEND)){
+        do_lseek(fd, 0, SEEK_END);
+    }
+
+    if (!PAGE_ALIGNED(f->f_pos)){
+        fput(f);
+        return -EINVAL;
+    }
+
+    vnode_t *vn = f->f_vnode;
+    int ret = forwrite ? vn->vn_ops->write_direct(vn, f->f_pos, pages, npages)
+                       : vn->vn_ops->read_direct(vn, f->f_pos, pages, npages);
+
+    if (ret > 0){
+        int seek_val = do_lseek(fd, ret, SEEK_CUR);
+
+        if (seek_val < 0){
+            ret = seek_val;
+        }
+    }
+
+    fput(f);
+    return ret;
+}
+
+/*
+ * Reads npages whole pages of the O_DIRECT file fd, starting at its
+ * current position, straight from the disk into the given page frames
+ * (see read_direct in vnode.h). This is how read(2) reaches the pinned
+ * pages of a user buffer without copying them.
+ *
+ * Error cases you must handle for this function at the VFS level:
+ *      o EBADF
+ *        fd is not a valid file descriptor or is not open for reading.
+ *      o EINVAL
+ *        fd was not opened with O_DIRECT, or its position is not page
+ *        aligned.
+ */
+int
+do_read_pages(int fd, void **pages, uint32_t npages)
+{
+    if (fd < 0 || fd >= NFILES){
+        return -EBADF;
+    }
+    return direct_io(fd, pages, npages, 0);
+}
+
+/*
+ * Like do_read_pages(), but writes the pages to the file.
+ */
+int
+do_write_pages(int fd, void **pages, uint32_t npages)
+{
+    if (fd < 0 || fd >= NFILES){
+        return -EBADF;
+    }
+    return direct_io(fd, pages, npages, 1);
+}
+
+/*
+ * do_read() and do_write() of an O_DIRECT file, with a page-aligned
+ * kernel buffer whose size is a multiple of the page size.
+ */
+static int
+direct_buf_io(int fd, char *buf, size_t nbytes, int forwrite)
+{
+    if (!PAGE_ALIGNED(buf) || !PAGE_ALIGNED(nbytes)){
+        return -EINVAL;
+    }
+
+    void *pages[DIRECT_IO_PAGES];
+    size_t total = 0;
+
+    while (total < nbytes){
+        uint32_t npages = MIN((nbytes - total) / PAGE_SIZE, DIRECT_IO_PAGES);
+        uint32_t i;
+
+        for (i = 0; i < npages; i++){
+            pages[i] = buf + total + i * PAGE_SIZE;
+        }
+
+        int ret = direct_io(fd, pages, npages, forwrite);
+
+        if (ret < 0){
+            return total > 0 ? (int) total : ret;
+        }
+
+        total += ret;
+
+        if ((uint32_t) ret < npages * PAGE_SIZE){
+            break;
+        }
+    }
+
+    return total;
+}
+
 /* To read a file:
  *      o fget(fd)
  *      o call its virtual read f_op
@@ -39,6 +159,9 @@ static kmutex_t lookup_mutex = KMUTEX_STATIC_INITIALIZER(lookup_mutex);
  *        fd is not a valid file descriptor or is not open for reading.
  *      o EISDIR
  *        fd refers to a directory.
+ *      o EINVAL
+ *        fd was opened with O_DIRECT, and buf, nbytes or the position of
+ *        fd is not page aligned.
  *
  * In all cases, be sure you do not leak file refcounts by returning before
  * you fput() a file that you fget()'ed.
@@ -64,6 +187,11 @@ do_read(int fd, void *buf, size_t nbytes)
         return -EISDIR;
     }
 
+    if (f->f_mode & FMODE_DIRECT){
+        fput(f);
+        return direct_buf_io(fd, buf, nbytes, 0);
+    }
+
     int bytes_read = f->f_vnode->vn_ops->read(f->f_vnode, f->f_pos, buf, nbytes);
 
     int ret_val = bytes_read;
@@ -94,6 +222,8 @@ do_read(int fd, void *buf, size_t nbytes)
  * Error cases you must handle for this function at the VFS level:
  *      o EBADF
  *        fd is not a valid file descriptor or is not open for writing.
+ *      o EINVAL
+ *        As for do_read(), with O_DIRECT.
  */
 int
 do_write(int fd, const void *buf, size_t nbytes)
@@ -116,6 +246,11 @@ do_write(int fd, const void *buf, size_t nbytes)
         return -EISDIR;
     }
 
+    if (f->f_mode & FMODE_DIRECT){
+        fput(f);
+        return direct_buf_io(fd, (char *) buf, nbytes, 1);
+    }
+
     if (f->f_mode & FMODE_APPEND){
         do_lseek(fd, 0, SEEK_END);
     }
@@ -299,6 +434,7 @@ do_mknod(const char *path, int mode, unsigned devid)
         ret_code = -EEXIST;
     } else {
         ret_code = dir->vn_ops->mknod(dir, name, namelen, mode, devid);
+        dcache_invalidate(dir, name, namelen);
     }
 
     vput(dir);
@@ -352,6 +488,7 @@ do_mkdir(const char *path)
     } else {
         KASSERT(lookup_result == -ENOENT);
         ret_code = dir->vn_ops->mkdir(dir, name, namelen);
+        dcache_invalidate(dir, name, namelen);
     } 
     vput(dir);
     return ret_code;
@@ -374,6 +511,8 @@ do_mkdir(const char *path)
  *        A component used as a directory in path is not, in fact, a directory.
  *      o ENAMETOOLONG
  *        A component of path was too long.
+ *      o EBUSY
+ *        path is a mount point.
  */
 int
 do_rmdir(const char *path)
@@ -405,8 +544,16 @@ do_rmdir(const char *path)
     } else if (lookup_vn->vn_ops->rmdir == NULL){
         to_ret = -ENOTDIR;
         vput(lookup_vn);
+#ifdef __MOUNTING__
+    } else if (lookup_vn->vn_fs != dir->vn_fs){
+        /* something is mounted on it */
+        to_ret = -EBUSY;
+        vput(lookup_vn);
+#endif
     } else {
         to_ret = dir->vn_ops->rmdir(dir, name, namelen);
+        dcache_invalidate(dir, name, namelen);
+        dcache_purge_dir(lookup_vn);
         vput(lookup_vn);
     }
 
@@ -456,6 +603,7 @@ do_unlink(const char *path)
         vput(lookup_vn);
     } else {
         to_ret = dir->vn_ops->unlink(dir, name, namelen);
+        dcache_invalidate(dir, name, namelen);
         vput(lookup_vn);
     }
 
@@ -481,6 +629,8 @@ do_unlink(const char *path)
  *        directory.
  *      o ENAMETOOLONG
  *        A component of from or to was too long.
+ *      o EXDEV
+ *        from and to are on different file systems.
  */
 int
 do_link(const char *from, const char *to)
@@ -511,11 +661,14 @@ do_link(const char *from, const char *to)
 
     if (to_vn->vn_ops->link == NULL){
         return -ENOTDIR;
+    } else if (from_vn->vn_fs != to_vn->vn_fs){
+        to_ret = -EXDEV;
     } else if (lookup(to_vn, name, namelen, &lookup_vn) == 0){
         vput(lookup_vn);
         to_ret = -EEXIST;
     } else {
         to_ret = to_vn->vn_ops->link(from_vn, to_vn, name, namelen);
+        dcache_invalidate(to_vn, name, namelen);
     }
 
     vput(to_vn);
@@ -668,6 +821,88 @@ do_lseek(int fd, int offset, int whence)
     return ret_val;
 }
 
+/*
+ * Write back the dirty resident pages of the file open on fd, then call the
+ * fsync() vnode operation (if there is one) so that the filesystem writes
+ * back the file's metadata. Unlike sync(2), only this file is written.
+ *
+ * Error cases you must handle for this function at the VFS level:
+ *      o EBADF
+ *        fd is not an open file descriptor.
+ */
+int
+do_fsync(int fd)
+{
+    if (fd < 0 || fd >= NFILES){
+        return -EBADF;
+    }
+
+    file_t *f = fget(fd);
+
+    if (f == NULL){
+        return -EBADF;
+    }
+
+    vnode_t *vn = f->f_vnode;
+    int ret = pframe_clean_range(&vn->vn_mmobj, 0, (uint32_t) -1);
+
+    if (ret == 0 && vn->vn_ops->fsync != NULL){
+        ret = vn->vn_ops->fsync(vn);
+    }
+
+    fput(f);
+    return ret;
+}
+
+/*
+ * Allocate storage for len bytes of the file open on fd, starting at
+ * offset, by calling the fallocate() vnode operation.
+ *
+ * Error cases you must handle for this function at the VFS level:
+ *      o EBADF
+ *        fd is not an open file descriptor, or is not open for writing.
+ *      o EINVAL
+ *        offset is negative, or len is not positive.
+ *      o ENODEV
+ *        fd does not refer to a regular file.
+ *      o EOPNOTSUPP
+ *        The file system does not support fallocate.
+ */
+int
+do_fallocate(int fd, off_t offset, off_t len)
+{
+    if (fd < 0 || fd >= NFILES){
+        return -EBADF;
+    }
+
+    if (offset < 0 || len <= 0){
+        return -EINVAL;
+    }
+
+    file_t *f = fget(fd);
+
+    if (f == NULL){
+        return -EBADF;
+    } else if (!(f->f_mode & FMODE_WRITE)){
+        fput(f);
+        return -EBADF;
+    }
+
+    vnode_t *vn = f->f_vnode;
+    int ret;
+
+    if (!S_ISREG(vn->vn_mode)){
+        ret = -ENODEV;
+    } else if (vn->vn_ops->fallocate == NULL){
+        ret = -EOPNOTSUPP;
+    } else {
+        ret = vn->vn_ops->fallocate(vn, offset, len);
+    }
+
+    fput(f);
+    return ret;
+}
+
 /*
  * Find the vnode associated with the path, and call the stat() vnode operation.
  *
@@ -717,8 +952,51 @@ do_stat(const char *path, struct stat *buf)
 int
 do_mount(const char *source, const char *target, const char *type)
 {
-        NOT_YET_IMPLEMENTED("MOUNTING: do_mount");
-        return -EINVAL;
+        vnode_t *mtpt;
+        fs_t *fs;
+        int ret;
+
+        if (NULL == source) {
+                source = "";
+        }
+        if (strlen(source) >= STR_MAX || strlen(type) >= STR_MAX) {
+                return -ENAMETOOLONG;
+        }
+
+        if (0 > (ret = open_namev(target, 0, &mtpt, NULL))) {
+                return ret;
+        }
+        if (!S_ISDIR(mtpt->vn_mode)) {
+                vput(mtpt);
+                return -ENOTDIR;
+        }
+
+        if (NULL == (fs = kmalloc(sizeof(fs_t)))) {
+                vput(mtpt);
+                return -ENOMEM;
+        }
+        memset(fs, 0, sizeof(fs_t));
+        strcpy(fs->fs_dev, source);
+        strcpy(fs->fs_type, type);
+
+        if (0 > (ret = mountfunc(fs))) {
+                kfree(fs);
+                vput(mtpt);
+                return ret;
+        }
+
+        if (0 > (ret = vfs_mount(mtpt, fs))) {
+                if (fs->fs_op->umount) {
+                        fs->fs_op->umount(fs);
+                } else {
+                        vput(fs->fs_root);
+                }
+                kfree(fs);
+        }
+
+        /* vfs_mount() keeps its own reference */
+        vput(mtpt);
+        return ret;
 }
 
 /*
@@ -733,7 +1011,23 @@ do_mount(const char *source, const char *target, const char *type)
 int
 do_umount(const char *target)
 {
-        NOT_YET_IMPLEMENTED("MOUNTING: do_umount");
-        return -EINVAL;
+        vnode_t *vn;
+        fs_t *fs;
+        int ret;
+
+        if (0 > (ret = open_namev(target, 0, &vn, NULL))) {
+                return ret;
+        }
+
+        /* target has to be where a file system is mounted, which looks
+         * up as that file system's root */
+        fs = vn->vn_fs;
+        if (vn != fs->fs_root || vn == vfs_root_vn) {
+                vput(vn);
+                return -EINVAL;
+        }
+        vput(vn);
+
+        return vfs_umount(fs);
 }
 #endif
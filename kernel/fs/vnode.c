@@ -23,6 +23,17 @@ static slab_allocator_t *vnode_allocator;
 
 static list_t vnode_inuse_list;
 
+static list_t vnode_hash[VNODE_HASH_SIZE];
+#define vnode_bucket(fs, vno) \
+        (&vnode_hash[((uint32_t)(fs) + (uint32_t)(vno)) % VNODE_HASH_SIZE])
+
+/* Unreferenced vnodes kept for reuse, least recently released first */
+static list_t vnode_lru;
+static int vnode_ncached;
+
+static void vnode_free(vnode_t *vn);
+static void vnode_evict(vnode_t *vn);
+
 /* Related to vnodes representing special files: */
 static void init_special_vnode(vnode_t *vn);
 static int special_file_read(vnode_t *file, off_t offset, void *buf, size_t count);
@@ -93,7 +104,12 @@ static vnode_ops_t blockdev_spec_vops = {
 static __attribute__((unused)) void
 vnode_init(void)
 {
+        int i;
+
         list_init(&vnode_inuse_list);
+        for (i = 0; i < VNODE_HASH_SIZE; i++)
+                list_init(&vnode_hash[i]);
+        list_init(&vnode_lru);
         vnode_allocator = slab_allocator_create("vnode", sizeof(vnode_t));
 }
 init_func(vnode_init);
@@ -120,7 +136,7 @@ vget(struct fs *fs, ino_t vno)
 
         /* look for inuse vnode */
 find:
-        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
+        list_iterate_begin(vnode_bucket(fs, vno), vn, vnode_t, vn_hash_link) {
                 if ((vn->vn_fs == fs) && (vn->vn_vno == vno)) {
                         /* found it... */
                         if (VN_BUSY & vn->vn_flags) {
@@ -135,6 +151,17 @@ find:
                                 goto find;
                         }
 
+                        if (0 == vn->vn_refcount) {
+                                /* it is in the cache of unreferenced vnodes
+                                 * (so it is not a mount point either) */
+                                list_remove(&vn->vn_lru_link);
+                                vnode_ncached--;
+                                vn->vn_refcount = 1;
+                                dbg(DBG_VNREF, "vget: 0x%p, 0x%p ino %ld found unreferenced\n",
+                                    vn, vn->vn_fs, (long)vn->vn_vno);
+                                return vn;
+                        }
+
 #ifndef __MOUNTING__
                         /* If we are implementing mountpoint support
                            then we should get the mounted vnode,
@@ -185,6 +212,7 @@ find:
          */
         vn->vn_flags |= VN_BUSY;
         list_insert_head(&vnode_inuse_list, &vn->vn_link);
+        list_insert_head(vnode_bucket(fs, vno), &vn->vn_hash_link);
 
         KASSERT(vn->vn_fs->fs_op && vn->vn_fs->fs_op->read_vnode);
         /*       this is where we might block (depending on the underlying
@@ -276,7 +304,28 @@ vput(struct vnode *vn)
         KASSERT(vn->vn_mount == vn);
 #endif
 
-        /* no res pages and no more active references; free the vnode */
+        /* no res pages and no more active references */
+        KASSERT(0 == vn->vn_refcount);
+        KASSERT(0 == vn->vn_nrespages);
+
+        /* keep it around if it can be looked up again (the root of a file
+         * system is only let go of when the file system is unmounted) */
+        if (vn != vn->vn_fs->fs_root && vn->vn_fs->fs_op->query_vnode(vn)) {
+                list_insert_tail(&vnode_lru, &vn->vn_lru_link);
+                if (++vnode_ncached > VNODE_CACHE_SIZE)
+                        vnode_evict(list_head(&vnode_lru, vnode_t, vn_lru_link));
+                return;
+        }
+
+        vnode_free(vn);
+}
+
+/*
+ * Frees the unreferenced vnode vn.
+ */
+static void
+vnode_free(vnode_t *vn)
+{
         KASSERT(0 == vn->vn_refcount);
         KASSERT(0 == vn->vn_nrespages);
 
@@ -299,9 +348,51 @@ vput(struct vnode *vn)
         sched_broadcast_on(&vn->vn_waitq);
 
         list_remove(&vn->vn_link); /* remove from vn_inuse_list */
+        list_remove(&vn->vn_hash_link);
         slab_obj_free(vnode_allocator, vn);
 }
 
+/*
+ * Takes vn out of the cache of unreferenced vnodes and frees it.
+ */
+static void
+vnode_evict(vnode_t *vn)
+{
+        KASSERT(0 == vn->vn_refcount);
+
+        list_remove(&vn->vn_lru_link);
+        vnode_ncached--;
+        vnode_free(vn);
+}
+
+void
+vnode_uncache_all(struct fs *fs)
+{
+        vnode_t *vn;
+
+again:
+        list_iterate_begin(&vnode_lru, vn, vnode_t, vn_lru_link) {
+                if (NULL == fs || vn->vn_fs == fs) {
+                        /* this may have blocked */
+                        vnode_evict(vn);
+                        goto again;
+                }
+        } list_iterate_end();
+}
+
+int
+vnode_reclaim(int target)
+{
+        int nfreed = 0;
+
+        while (!list_empty(&vnode_lru) && (target < 0 || nfreed < target)) {
+                vnode_evict(list_head(&vnode_lru, vnode_t, vn_lru_link));
+                nfreed++;
+        }
+
+        return nfreed;
+}
+
 int
 vfs_is_in_use(fs_t *fs)
 {
@@ -385,13 +476,20 @@ clean:
 
         /* all pages of all vnodes belonging to this fs have been cleaned.
          * Now, uncache all of them: */
+uncache:
         list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
                 list_iterate_begin(&v->vn_mmobj.mmo_respages,
                                    p, pframe_t, pf_olink) {
                         KASSERT(!pframe_is_dirty(p));
                         pframe_free(p);
+                        /* This may have evicted other vnodes from the
+                         * cache of unreferenced ones, and blocked. */
+                        goto uncache;
                 } list_iterate_end();
         } list_iterate_end();
+
+        /* freeing their pages may have left vnodes unreferenced */
+        vnode_uncache_all(fs);
 }
 
 
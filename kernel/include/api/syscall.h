@@ -49,13 +49,19 @@
 #define SYS_getpid              35
 #define SYS_errno               39
 #define SYS_halt                40
-#define SYS_get_free_mem        41 /* NYI */
+#define SYS_get_free_mem        41
 #define SYS_set_errno           42
 #define SYS_dup2                43
 #define SYS_brk                 44
 #define SYS_mount               45
 #define SYS_umount              46
 #define SYS_stat                47
+#define SYS_madvise             48
+#define SYS_mlock               49
+#define SYS_munlock             50
+#define SYS_msync               51
+#define SYS_fsync               52
+#define SYS_fallocate           53
 
 /*
  * ... what does the scouter say about his syscall?
@@ -98,6 +104,23 @@ typedef struct munmap_args {
         size_t  len;
 } munmap_args_t;
 
+typedef struct mlock_args {
+        void   *addr;
+        size_t  len;
+} mlock_args_t;
+
+typedef struct msync_args {
+        void   *addr;
+        size_t  len;
+        int     flags;
+} msync_args_t;
+
+typedef struct madvise_args {
+        void   *addr;
+        size_t  len;
+        int     advice;
+} madvise_args_t;
+
 typedef struct open_args {
         argstr_t filename;
         int      flags;
@@ -149,6 +172,12 @@ typedef struct lseek_args {
         int whence;
 } lseek_args_t;
 
+typedef struct fallocate_args {
+        int fd;
+        off_t offset;
+        off_t len;
+} fallocate_args_t;
+
 typedef struct dup2_args {
         int ofd;
         int nfd;
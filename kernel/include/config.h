@@ -11,7 +11,12 @@
 /*
  * kernel configuration parameters
  */
-#define DEFAULT_STACK_SIZE      (56*1024) /* size of stacks */
+#define DEFAULT_STACK_SIZE      (56*1024) /* size of user stacks */
+#define KSTACK_SIZE             (60*1024) /* size of kernel thread stacks; with
+                                           * the guard page below each one this
+                                           * should add up to a power-of-two
+                                           * number of pages */
+#define KSTACK_CACHE_SIZE       8         /* free kernel stacks kept for reuse */
 #define TICK_MSECS              10        /* msecs between clock interrupts */
 
 /*
@@ -29,6 +34,24 @@
 /*         Pageout-related: */
 #define PAGEOUTD_FREE_TARGET_SHIFT     5 /* 3.125% */
 #define PAGEOUTD_FREE_MIN_SHIFT        4 /* 6.25% */
+/*         Swap-related: */
+#define SWAP_HASH_SIZE                67 /* Number of buckets in pn/mmobj->swap entry hash */
+#define SWAP_MAX_SLOTS             65536 /* use at most this many pages (256MB) of swap */
+#define SWAP_CLUSTER                   8 /* pages pageoutd picks for swap-out at a time,
+                                          * and read or written in one request */
+#define ZPOOL_FRAC(x)           ((x)>>2) /* at most 25% of memory holds
+                                          * compressed swapped out pages */
+/*         Shadow objects: */
+#define SHADOW_MAX_DEPTH               8 /* collapse right away at fork time
+                                          * when a chain is longer than this */
+/*         Same-page merging (pagemerged): */
+#define PAGEMERGE_SCAN_PAGES         256 /* pages pagemerged hashes per run */
+#define PAGEMERGE_FORK_INTERVAL        4 /* run pagemerged every this many forks */
+#define PAGEMERGE_HASH_SIZE           67 /* Number of buckets in contents->page hashes */
+/*     mlock(2)/exec-related: */
+#define MLOCK_MAX_PAGES              256 /* max pages a process may mlock */
+#define EXEC_POPULATE_PAGES           16 /* prefault executables up to this
+                                          * many pages at exec time (0: never) */
 
 
 /*
@@ -39,8 +62,15 @@
 #define MAX_FILES               1024    /* max number of files */
 #define MAX_VFS                 8       /* max # of vfses */
 #define MAX_VNODES              1024    /* max number of in-core vnodes */
+#define VNODE_HASH_SIZE         67      /* Number of buckets in (fs, vno)->vnode hash */
+#define VNODE_CACHE_SIZE        64      /* unreferenced vnodes kept for reuse */
 #define NAME_LEN                28      /* maximum directory entry length */
 #define NFILES                  32      /* maximum number of open files */
+#define DCACHE_HASH_SIZE        67      /* Number of buckets in the name cache */
+#define DCACHE_MAX_ENTRIES      512     /* max number of cached names */
+#define TMPFS_HASH_SIZE         67      /* Number of buckets in a tmpfs's ino->inode hash */
+#define TMPFS_DIR_HASH_SIZE     17      /* Number of buckets in a tmpfs directory's name hash */
+#define DIRECT_IO_PAGES         16      /* pages pinned at a time for O_DIRECT I/O */
 
 /* Note: if rootfs is ramfs, this is completely ignored */
 #define VFS_ROOTFS_DEV  "disk0" /* device containing root filesystem */
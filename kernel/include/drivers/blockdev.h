@@ -17,6 +17,47 @@
 
 struct blockdev_ops;
 
+/* Kinds of block device operation, for statistics */
+#define BLOCKDEV_READ           0
+#define BLOCKDEV_WRITE          1
+#define BLOCKDEV_FLUSH          2
+#define BLOCKDEV_NOPS           3
+
+#define BLOCKDEV_HIST_BUCKETS   20      /* bucket i: latencies of 2^i to
+                                         * 2^(i+1)-1 usecs */
+#define BLOCKDEV_INFO_SIZE      8192    /* enough for blockdev_info() of a
+                                         * few devices */
+
+typedef struct blockdev_opstats {
+        uint32_t        bo_ops;
+        uint32_t        bo_blocks;
+        uint32_t        bo_errors;
+        uint64_t        bo_usecs;       /* total latency */
+        uint32_t        bo_maxusecs;
+        uint32_t        bo_hist[BLOCKDEV_HIST_BUCKETS];
+} blockdev_opstats_t;
+
+typedef struct blockdev_stats {
+        blockdev_opstats_t bs_op[BLOCKDEV_NOPS];
+
+        /* blocks read and written through the device's own page cache,
+         * which is where file systems keep their metadata */
+        uint32_t        bs_cached[2];
+
+        uint32_t        bs_inflight;    /* requests being served */
+        uint32_t        bs_maxinflight;
+        uint64_t        bs_depthsum;    /* bs_inflight as each request
+                                         * was issued, summed */
+
+        uint32_t        bs_seeks;       /* requests that did not start
+                                         * where the last one ended */
+        uint64_t        bs_seekblocks;  /* how far they were, summed */
+        blocknum_t      bs_nextblock;
+
+        uint64_t        bs_busysince;   /* TSC when the device got busy */
+        uint64_t        bs_busycycles;  /* time with requests in flight */
+} blockdev_stats_t;
+
 /*
  * Represents a Weenix block device.
  */
@@ -26,11 +67,15 @@ typedef struct blockdev {
 
         struct blockdev_ops  *bd_ops;
 
+        blocknum_t bd_nblocks;          /* size of the device in blocks */
+
         /* Fields that should be ignored by drivers: */
         struct mmobj bd_mmobj;
 
         /* Link on the list of block-oriented devices */
         list_link_t bd_link;
+
+        blockdev_stats_t bd_stats;
 } blockdev_t;
 
 typedef struct blockdev_ops {
@@ -82,6 +127,34 @@ int blockdev_register(blockdev_t *dev);
  */
 blockdev_t *blockdev_lookup(devid_t id);
 
+/**
+ * Reads count blocks, starting at block loc, from the block device into
+ * buf (which must be page-aligned), and accounts for the read in the
+ * device's statistics. Everything but driver tests goes through this,
+ * rather than the read_block operation.
+ *
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_read(blockdev_t *dev, char *buf, blocknum_t loc, size_t count);
+
+/**
+ * Like blockdev_read(), but writes.
+ */
+int blockdev_write(blockdev_t *dev, const char *buf, blocknum_t loc,
+                   size_t count);
+
+/**
+ * Provides I/O statistics of a block device, or of every block device if
+ * arg is NULL: operation counts, latency histograms, queue depth and
+ * seeks.
+ *
+ * @param arg the block device, or NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t blockdev_info(const void *arg, char *buf, size_t osize);
+
 /**
  * Cleans and frees all resident pages belonging to a given block
  * device.
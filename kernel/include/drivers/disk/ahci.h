@@ -0,0 +1,8 @@
+#pragma once
+
+/**
+ * Initialize the AHCI subsystem: finds the AHCI controller on the PCI bus,
+ * if there is one, and registers a block device for every SATA disk
+ * attached to it. The disks are numbered after the ATA disks.
+ */
+void ahci_init(void);
@@ -0,0 +1,8 @@
+#pragma once
+
+/**
+ * Initialize the virtio block driver: finds a virtio-blk device on the PCI
+ * bus, if there is one, and registers it as a block device numbered after
+ * the ATA and AHCI disks.
+ */
+void virtio_blk_init(void);
@@ -33,6 +33,7 @@
 #define PCI_CMD_IO		BIT(0)
 #define PCI_CMD_MMIO		BIT(1)
 #define PCI_CMD_BUSMASTER	BIT(2)
+#define PCI_CMD_INTX_DISABLE	BIT(10)
 
 enum {
 	PCI_MMIO, PCI_IO, PCI_INVALIDBAR
@@ -67,6 +68,8 @@ void pci_init(void);
 
 pcidev_t* pci_lookup(uint8_t class, uint8_t subclass, uint8_t interface);
 
+pcidev_t* pci_lookup_id(uint16_t vendor, uint16_t device);
+
 uint32_t pci_read_config(pcidev_t* dev, uint8_t reg_off, uint8_t length);
 
 void pci_write_config(pcidev_t* dev, uint8_t reg_off, uint32_t val, uint8_t length);
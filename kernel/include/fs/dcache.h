@@ -0,0 +1,78 @@
+#pragma once
+
+#include "types.h"
+
+struct fs;
+struct vnode;
+
+/*
+ * The name cache remembers what path name components looked up in which
+ * directories resolved to, so that resolving them again does not have to
+ * go to the file system. It also remembers names that do not exist, which
+ * makes repeated failing lookups (such as those of a PATH search) cheap.
+ * Entries are keyed by (file system, directory vno, name) and hold no
+ * references: a positive entry holds the vno the name refers to.
+ *
+ * Anything that changes a directory has to invalidate the names it
+ * changes, before returning to its caller.
+ */
+
+/**
+ * @return the current invalidation generation, to be passed to
+ * dcache_enter() for a lookup that is about to be made
+ */
+uint32_t dcache_generation(void);
+
+/**
+ * Looks the given name up in the cache.
+ *
+ * @return 0 with *result set (and referenced) if the name was found, -ENOENT
+ * if the name is known not to exist, 1 if the name is not cached
+ */
+int dcache_lookup(struct vnode *dir, const char *name, size_t len,
+                  struct vnode **result);
+
+/**
+ * Caches the result of looking up name in dir: it refers to vn, or does not
+ * exist if vn is NULL. Nothing is cached if the directory may have changed
+ * since gen was obtained from dcache_generation(), or if vn is on another
+ * file system (name is a mount point).
+ */
+void dcache_enter(struct vnode *dir, const char *name, size_t len,
+                  struct vnode *vn, uint32_t gen);
+
+/**
+ * Forgets what the given name in dir refers to. Called whenever the name is
+ * created or removed.
+ */
+void dcache_invalidate(struct vnode *dir, const char *name, size_t len);
+
+/**
+ * Forgets all names in the directory dir. Called when dir is removed.
+ */
+void dcache_purge_dir(struct vnode *dir);
+
+/**
+ * Forgets all names in the file system fs, or in all file systems if fs is
+ * NULL. Called when file systems are mounted and unmounted.
+ */
+void dcache_purge(struct fs *fs);
+
+/**
+ * Frees up to target of the least recently used entries, or all of them if
+ * target is negative. Called when the kernel runs out of memory.
+ *
+ * @return the number of entries freed
+ */
+int dcache_reclaim(int target);
+
+/**
+ * Provides debug information about the name cache: its size and its hit
+ * rate, for names that exist and names that do not.
+ *
+ * @param arg must be NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t dcache_info(const void *arg, char *buf, size_t osize);
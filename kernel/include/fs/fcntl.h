@@ -15,3 +15,6 @@
 #define O_CREAT         0x100   /* Create file if non-existent. */
 #define O_TRUNC         0x200   /* Truncate to zero length. */
 #define O_APPEND        0x400   /* Append to file. */
+#define O_DIRECT        0x800   /* Transfer whole pages straight to and
+                                 * from the disk, bypassing the page
+                                 * cache. */
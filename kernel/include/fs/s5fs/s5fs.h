@@ -21,10 +21,13 @@
 #define S5_IS_SUPER(blkno)      ( (blkno) == S5_SUPER_BLOCK )
 #define S5_NBLKS_PER_FNODE      30
 #define S5_BLOCK_SIZE           4096
-#define S5_NDIRECT_BLOCKS       28
+#define S5_NDIRECT_BLOCKS       26
+#define S5_INDIRECT_LEVELS      3       /* single, double and triple */
 #define S5_INODES_PER_BLOCK     (S5_BLOCK_SIZE /  sizeof(s5_inode_t))
 #define S5_DIRENTS_PER_BLOCK    (S5_BLOCK_SIZE / sizeof(s5_dirent_t))
-#define S5_MAX_FILE_BLOCKS      (S5_NDIRECT_BLOCKS + (S5_BLOCK_SIZE / sizeof(uint32_t)))
+/* The triple indirect block could address far more than this, but file
+ * offsets are 32 bits wide */
+#define S5_MAX_FILE_BLOCKS      (0x7fffffff / S5_BLOCK_SIZE)
 #define S5_MAX_FILE_SIZE        (S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE)
 #define S5_NAME_LEN             28
 
@@ -35,11 +38,89 @@
 #define S5_TYPE_BLK             0x8
 
 #define S5_MAGIC                071177
-#define S5_CURRENT_VERSION      3
+#define S5_CURRENT_VERSION      6
+#define S5_FREE_LIST_VERSION    3       /* last version keeping free blocks
+                                         * on a list, converted at mount */
+#define S5_SINGLE_INDIRECT_VERSION 4    /* last version with 28 direct
+                                         * blocks and only a single indirect
+                                         * block, converted at mount */
+#define S5_NO_JOURNAL_VERSION   5       /* last version without a journal,
+                                         * which disks get one of at mount */
 
-/* Number of blocks stored in the indirect block */
+/* Number of blocks whose state one block of the free-space bitmap holds */
+#define S5_BITS_PER_BLOCK       (S5_BLOCK_SIZE * 8)
+
+/* Number of bitmap blocks a disk of the given number of blocks needs */
+#define S5_BITMAP_NBLOCKS(nblocks) \
+        (((nblocks) + S5_BITS_PER_BLOCK - 1) / S5_BITS_PER_BLOCK)
+
+/*
+ * Length of the free run a block is taken from when it cannot go right
+ * after the previous block of its file, so that the file has room to grow
+ * contiguously.
+ */
+#define S5_ALLOC_RUN            8
+
+/*
+ * Data blocks are only allocated when their pages are written back; a
+ * page that is written back takes along the dirty pages right after it
+ * that are still waiting for a block, up to this many pages in all.
+ */
+#define S5_ALLOC_BATCH          64
+
+/*
+ * Set in the pointer to a data block that was allocated ahead of time by
+ * fallocate(2) and has not been written yet, so reads it as zeros; the
+ * pointer only loses it when the block's page is first written back.
+ */
+#define S5_BLOCK_UNWRITTEN      0x80000000
+
+/*
+ * Since version 6, changes to the superblock, inodes, the bitmap, indirect
+ * blocks and directories are written to a journal before they are written
+ * in place, so that a crash leaves either all or none of the changes a
+ * system call made. The journal takes up s5s_journal_nblocks contiguous
+ * blocks (none if the disk is too small for one). Its first block is an
+ * s5_journal_block_t of type S5_JOURNAL_SUPER giving the sequence number
+ * of the first transaction; the transactions follow it back to back, each
+ * made of a descriptor block listing the blocks the transaction changes,
+ * their new contents, and a commit block. A transaction whose commit block
+ * did not make it to disk is ignored. Descriptor entries with
+ * S5_JOURNAL_REVOKE set list blocks that were freed, whose contents in
+ * earlier transactions must not be replayed.
+ */
+#define S5_JOURNAL_NBLOCKS      128
+#define S5_JOURNAL_MIN_NBLOCKS  8
+#define S5_JOURNAL_MAGIC        0x4a524e4c
+#define S5_JOURNAL_SUPER        1
+#define S5_JOURNAL_DESCRIPTOR   2
+#define S5_JOURNAL_COMMIT       3
+#define S5_JOURNAL_REVOKE       0x80000000
+#define S5_JOURNAL_MAX_ENTRIES  (S5_BLOCK_SIZE / sizeof(uint32_t) - 4)
+
+/* Number of journal blocks a disk of the given number of blocks gets */
+#define S5_JOURNAL_SIZE(nblocks) \
+        ((nblocks) / 16 < S5_JOURNAL_MIN_NBLOCKS ? 0 \
+         : (nblocks) / 16 < S5_JOURNAL_NBLOCKS ? (nblocks) / 16 \
+         : S5_JOURNAL_NBLOCKS)
+
+/* Number of blocks stored in an indirect block */
 #define S5_NIDIRECT_BLOCKS      (S5_BLOCK_SIZE / sizeof(uint32_t))
 
+/*
+ * Directories that reach S5_DIR_INDEX_MIN entries get a hash index of
+ * their entries, stored in the directory file itself starting at block
+ * S5_DIR_INDEX_BLOCK, which its entries never reach. The first block of
+ * the index holds an s5_dirindex_t, the following ones an open-addressed
+ * table of s5_dirindex_entry_t's. Directories without one, such as those
+ * on older disks, are searched entry by entry.
+ */
+#define S5_DIR_INDEX_BLOCK      (S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS)
+#define S5_DIR_INDEX_MIN        S5_DIRENTS_PER_BLOCK
+#define S5_DIR_INDEX_MAGIC      0x5d1ec7
+#define S5_DIR_INDEX_MIN_SIZE   1024    /* initial number of table entries */
+#define S5_DIR_INDEX_PER_BLOCK  (S5_BLOCK_SIZE / sizeof(s5_dirindex_entry_t))
+
 /* Given a file offset, returns the block number that it is in */
 #define S5_DATA_BLOCK(seekptr)  ((seekptr) / S5_BLOCK_SIZE)
 
@@ -69,6 +150,16 @@ typedef struct s5_fbl_node {
 /* Note that all on-disk types need to have hard-coded sizes (to ensure
  * inter-machine compatibility of s5 disks) */
 
+/*
+ * Since version 4, free blocks are tracked by a bitmap rather than by the
+ * free block list: bit b (bit b % 32 of word b / 32) is set if block b is
+ * in use. The bitmap takes up s5s_bitmap_nblocks contiguous blocks, right
+ * after the inode blocks unless the disk was converted from version 3, in
+ * which case they can be anywhere past them. The superblock, the inode
+ * blocks, the bitmap itself and the bits past the end of the disk are always
+ * set. s5s_nfree and s5s_free_blocks are only used by version 3 disks.
+ */
+
 /* The contents of the superblock, as stored on disk. */
 typedef struct s5_super {
         uint32_t s5s_magic;              /* the magic number */
@@ -81,8 +172,27 @@ typedef struct s5_super {
         uint32_t s5s_root_inode;         /* root inode */
         uint32_t s5s_num_inodes;         /* number of inodes */
         uint32_t s5s_version;            /* version of this disk format */
+
+        uint32_t s5s_nblocks;            /* size of the disk in blocks */
+        uint32_t s5s_bitmap_block;       /* first block of the bitmap */
+        uint32_t s5s_bitmap_nblocks;     /* number of bitmap blocks */
+        uint32_t s5s_nfree_blocks;       /* number of free blocks */
+
+        uint32_t s5s_journal_block;      /* first block of the journal */
+        uint32_t s5s_journal_nblocks;    /* number of journal blocks, 0 if
+                                          * there is no journal */
 } s5_super_t;
 
+/* A journal header, descriptor or commit block, as stored on disk. */
+typedef struct s5_journal_block {
+        uint32_t s5j_magic;              /* S5_JOURNAL_MAGIC */
+        uint32_t s5j_type;               /* S5_JOURNAL_{SUPER,DESCRIPTOR,COMMIT} */
+        uint32_t s5j_seq;                /* sequence number of the
+                                          * transaction */
+        uint32_t s5j_nentries;           /* number of s5j_entries used */
+        uint32_t s5j_entries[S5_JOURNAL_MAX_ENTRIES]; /* descriptors only */
+} s5_journal_block_t;
+
 /* The contents of an inode, as stored on disk. */
 typedef struct s5_inode {
         union {
@@ -95,7 +205,14 @@ typedef struct s5_inode {
         uint16_t   s5_type;         /* one of S5_TYPE_{FREE,DATA,DIR} */
         int16_t    s5_linkcount;    /* link count of this inode */
         uint32_t   s5_direct_blocks[S5_NDIRECT_BLOCKS];
-        uint32_t   s5_indirect_block;
+        /*
+         * The roots of the trees of indirect blocks mapping the rest of
+         * the file: s5_indirect_blocks[0] points to blocks, [1] to single
+         * indirect blocks and [2] to double indirect blocks. Device
+         * inodes keep their device id in s5_indirect_block instead.
+         */
+        uint32_t   s5_indirect_blocks[S5_INDIRECT_LEVELS];
+#define        s5_indirect_block s5_indirect_blocks[0]
 } s5_inode_t;
 
 /* The contents of a directory entry, as stored on disk. */
@@ -104,14 +221,60 @@ typedef struct s5_dirent {
         char       s5d_name[S5_NAME_LEN];
 } s5_dirent_t;
 
+/* The header of a directory's index, as stored on disk. */
+typedef struct s5_dirindex {
+        uint32_t   s5di_magic;          /* S5_DIR_INDEX_MAGIC while valid */
+        uint32_t   s5di_dirsize;        /* length of the directory the
+                                         * index was last updated for */
+        uint32_t   s5di_size;           /* number of table entries, a power
+                                         * of two */
+        uint32_t   s5di_nentries;       /* number of entries in use */
+} s5_dirindex_t;
+
+/* An entry of a directory index's table, as stored on disk. */
+typedef struct s5_dirindex_entry {
+        uint32_t   s5de_hash;           /* hash of the dirent's name */
+        uint32_t   s5de_slot;           /* number of the dirent in the
+                                         * directory plus one, 0 if unused */
+} s5_dirindex_entry_t;
+
 #ifndef __FSMAKER__
+/* How often a kind of lock was taken, and how often it had to be waited for */
+typedef struct s5_lockstat {
+        uint32_t                ls_acquired;
+        uint32_t                ls_contended;
+} s5_lockstat_t;
+
 /* Our in-memory representation of a s5fs filesytem (fs_i points to this) */
 typedef struct s5fs {
         blockdev_t              *s5f_bdev;
         s5_super_t              *s5f_super;
-        kmutex_t                s5f_mutex;
+        struct pframe           **s5f_bitmap;   /* pinned bitmap blocks */
+        kmutex_t                s5f_block_mutex; /* protects the bitmap and
+                                                  * free block count */
+        kmutex_t                s5f_inode_mutex; /* protects the free inode
+                                                  * list */
+        s5_lockstat_t           s5f_block_stat;
+        s5_lockstat_t           s5f_inode_stat;
+        s5_lockstat_t           s5f_vnode_stat; /* of the vnodes' vn_mutex */
+        uint32_t                s5f_nreserved;  /* free blocks set aside for
+                                                 * dirty pages that have no
+                                                 * block yet */
+        struct s5_journal       *s5f_journal;   /* NULL if the disk has none */
         fs_t                    *s5f_fs;
 } s5fs_t;
 
 int s5fs_mount(struct fs *fs);
+
+/**
+ * Provides debug information about a s5fs file system: its free and
+ * reserved blocks, its journal, and how often its block allocator, inode
+ * allocator and inode locks were taken and how often they were contended.
+ *
+ * @param arg the fs_t of the file system
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t s5fs_info(const void *arg, char *buf, size_t osize);
 #endif
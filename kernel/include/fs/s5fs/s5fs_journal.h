@@ -0,0 +1,175 @@
+/*
+ *   FILE: s5fs_journal.h
+ *  DESCR: S5 metadata journal
+ */
+
+#pragma once
+
+#include "types.h"
+
+#include "proc/sched.h"
+#include "fs/s5fs/s5fs.h"
+
+struct pframe;
+struct mmobj;
+
+/*
+ * Changes to metadata blocks are collected into the running transaction
+ * until it is committed: written to the journal in one go, as a
+ * descriptor block, the new contents of the blocks and a commit block (see
+ * s5fs.h for the layout). Blocks stay pinned while they are in the running
+ * transaction, so that nothing writes them in place before the
+ * transaction is committed. Once committed they are written in place in
+ * the usual way, whenever their pages are cleaned; the journal is only
+ * checkpointed -- its committed blocks copied to where they belong, and
+ * the journal emptied -- when it runs out of room, or at unmount.
+ *
+ * System calls that change metadata in several steps do so between
+ * s5_journal_begin() and s5_journal_end(), so that a transaction is only
+ * committed between system calls, never halfway through one -- unless it
+ * fills up while some are open, when it is committed anyway. Many system
+ * calls share a transaction: it is committed when it holds a quarter of
+ * the journal, or when fsync(2), sync(2) or unmount ask for it.
+ */
+
+typedef struct s5_jentry {
+        struct pframe   *je_pf;         /* the page, pinned until committed */
+        uint32_t        je_blockno;     /* its block, 0 once it is freed */
+        uint32_t        je_logblock;    /* where its last committed contents
+                                         * are in the journal */
+} s5_jentry_t;
+
+typedef struct s5_journal {
+        uint32_t        j_block;        /* first block of the journal */
+        uint32_t        j_nblocks;      /* number of journal blocks */
+        uint32_t        j_head;         /* next unused journal block,
+                                         * counting from j_block */
+        uint32_t        j_seq;          /* sequence number of the running
+                                         * transaction */
+        uint32_t        j_commit_blocks; /* size at which the running
+                                          * transaction is committed */
+
+        int             j_updates;      /* open handles */
+        int             j_commit_wanted; /* threads waiting to commit */
+        int             j_committing;   /* a commit is being written */
+        ktqueue_t       j_waitq;
+
+        /* the running transaction: its blocks, and the blocks freed since
+         * they were last committed */
+        uint32_t        j_nrunning;
+        s5_jentry_t     j_running[S5_JOURNAL_NBLOCKS];
+        uint32_t        j_nrevoked;
+        uint32_t        j_revoked[2 * S5_JOURNAL_NBLOCKS];
+
+        /* the transaction being committed */
+        uint32_t        j_ncommit;
+        s5_jentry_t     j_commit[S5_JOURNAL_NBLOCKS];
+
+        /* the blocks committed since the last checkpoint */
+        uint32_t        j_ncheckpoint;
+        s5_jentry_t     j_checkpoint[S5_JOURNAL_NBLOCKS];
+
+        uint32_t        j_ncommits;
+        uint32_t        j_nlogged;      /* blocks written by commits */
+        uint32_t        j_nhandles;
+        uint32_t        j_ncheckpoints;
+        uint32_t        j_nforced;      /* commits forced because the
+                                         * running transaction was full */
+        uint32_t        j_noverflows;   /* blocks written in place because
+                                         * the running transaction was
+                                         * full and could not be committed */
+} s5_journal_t;
+
+/**
+ * Replays the transactions committed to the journal of the file system,
+ * if it has one, and empties the journal. This is called at mount time,
+ * before anything but the superblock has been read.
+ *
+ * @return 0 on success, -EINVAL if the journal is corrupt, -errno
+ */
+int s5_journal_recover(struct s5fs *fs);
+
+/**
+ * Writes an empty journal where the superblock says the journal goes, for
+ * a disk that is getting one.
+ *
+ * @return 0 on success, -errno
+ */
+int s5_journal_format(struct s5fs *fs);
+
+/**
+ * Starts journaling the metadata of the file system, if it has a journal.
+ *
+ * @return 0 on success, -errno
+ */
+int s5_journal_init(struct s5fs *fs);
+
+/**
+ * Commits and checkpoints the journal, and stops journaling. Called at
+ * unmount.
+ */
+void s5_journal_shutdown(struct s5fs *fs);
+
+/**
+ * Opens a handle on the running transaction, for a system call that is
+ * about to change metadata, waiting for the transaction to be committed
+ * first if it is full or someone asked for it. Must not be called with an
+ * inode locked, or with a handle open already.
+ */
+void s5_journal_begin(struct s5fs *fs);
+void s5_journal_end(struct s5fs *fs);
+
+/**
+ * Like s5_journal_begin() and s5_journal_end(), but never waits, and never
+ * commits: for changes made on behalf of whatever happens to be running,
+ * such as writing back or dirtying a page.
+ */
+void s5_journal_join(struct s5fs *fs);
+void s5_journal_leave(struct s5fs *fs);
+
+/**
+ * Adds the given page, which holds block blockno and was just dirtied, to
+ * the running transaction. If that is full, it is committed first, which
+ * may block.
+ */
+void s5_journal_dirty(struct s5fs *fs, struct pframe *pf, uint32_t blockno);
+
+/**
+ * Called when the given block is freed, so that whatever the journal holds
+ * of it is not written in place or replayed.
+ */
+void s5_journal_revoke(struct s5fs *fs, uint32_t blockno);
+
+/**
+ * Takes the pages of the given object out of the running transaction.
+ * Called when a directory is removed and its pages are about to be thrown
+ * away.
+ */
+void s5_journal_forget(struct s5fs *fs, struct mmobj *obj);
+
+/**
+ * @return 1 if the given block is in a transaction that has not been
+ * committed yet, 0 otherwise
+ */
+int s5_journal_pending(struct s5fs *fs, uint32_t blockno);
+
+/**
+ * Commits the running transaction, along with everything other threads
+ * have added to it, once their handles are closed. Must not be called
+ * with a handle open.
+ *
+ * @return 0 on success, -errno
+ */
+int s5_journal_commit(struct s5fs *fs);
+
+/**
+ * Commits the running transaction and checkpoints the journal.
+ *
+ * @return 0 on success, -errno
+ */
+int s5_journal_flush(struct s5fs *fs);
+
+/**
+ * Appends the journal's statistics to buf, for s5fs_info().
+ */
+void s5_journal_info(struct s5fs *fs, char **buf, size_t *size);
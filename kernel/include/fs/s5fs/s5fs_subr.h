@@ -10,6 +10,7 @@
 
 struct fs;
 struct vnode;
+struct s5fs;
 
 int s5_alloc_inode(struct fs *fs, uint16_t type, devid_t devid);
 void s5_free_inode(struct vnode *vnode);
@@ -18,6 +19,10 @@ void s5_free_inode(struct vnode *vnode);
 int s5_read_file(struct vnode *vn, off_t seek, char *dest, size_t len);
 int s5_write_file(struct vnode *vn, off_t seek, const char *bytes,
                   size_t len);
+int s5_read_direct(struct vnode *vn, off_t seek, void **pages,
+                   uint32_t npages);
+int s5_write_direct(struct vnode *vn, off_t seek, void **pages,
+                    uint32_t npages);
 
 /* TA BLANK {{{ */
 /* TODO: perhaps change the order of the arguments 'parent' and 'child' to
@@ -27,8 +32,27 @@ int s5_link(struct vnode *parent, struct vnode *child,
             const char *name, size_t namelen);
 int s5_find_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_remove_dirent(struct vnode *vnode, const char *name, size_t namelen);
+/* alloc arguments of s5_seek_to_run() other than 0 and 1: */
+#define S5_ALLOC_INDIRECT       2       /* only allocate indirect blocks */
+#define S5_SEEK_DATA            3       /* like 0, but unwritten blocks
+                                         * are reported as sparse */
+#define S5_ALLOC_UNWRITTEN      4       /* allocate sparse blocks as
+                                         * unwritten */
+
 int s5_seek_to_block(struct vnode *vnode, off_t seekptr, int alloc);
+int s5_seek_to_run(struct vnode *vnode, off_t seekptr, int alloc,
+                   uint32_t max, uint32_t *run);
+int s5_fallocate(struct vnode *vnode, off_t offset, off_t len);
+int s5_reserve_block(struct vnode *vnode);
+void s5_unreserve_blocks(struct vnode *vnode);
 int s5_inode_blocks(struct vnode *vnode);
+int s5_clean_indirect_blocks(struct vnode *vnode);
+int s5_convert_free_list(struct s5fs *fs);
+int s5_convert_indirect_blocks(struct s5fs *fs);
+int s5_convert_journal(struct s5fs *fs);
+
+void s5_lock_vnode(struct vnode *vnode);
+void s5_unlock_vnode(struct vnode *vnode);
 
 #define VNODE_TO_S5FS(vn)       ( (s5fs_t *)((vn)->vn_fs->fs_i))
 #define VNODE_TO_S5INODE(vn)    ( (s5_inode_t *)(vn)->vn_i )
@@ -49,6 +73,7 @@ int s5_inode_blocks(struct vnode *vnode);
                 KASSERT(!err                                            \
                         && "shouldn\'t fail for a page belonging "      \
                         "to a block device");                           \
+                s5_journal_dirty((fs), p, p->pf_pagenum);               \
         } while (0)
 
 /*
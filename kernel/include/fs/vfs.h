@@ -58,6 +58,16 @@ typedef struct fs_ops {
          * This entry point is ALLOWED TO BLOCK.
          */
         int (*umount)(struct fs *fs);
+
+        /*
+         * Make the file system's own state, such as metadata it keeps in
+         * a journal, durable. Called by sync(2) once all dirty pages have
+         * been written back. Returns 0 on success, negative number on
+         * error. May be NULL if there is nothing to do.
+         *
+         * This entry point is ALLOWED TO BLOCK.
+         */
+        int (*sync)(struct fs *fs);
 } fs_ops_t;
 
 #ifndef STR_MAX
@@ -141,6 +151,11 @@ extern struct vnode *vfs_root_vn;
  */
 int vfs_shutdown();
 
+/*
+ *     Calls the sync entry point of every mounted file system.
+ */
+void vfs_sync(void);
+
 /* Pathname resolution: */
 /* (the corresponding definitions live in namev.c) */
 int lookup(struct vnode *dir, const char *name, size_t len,
@@ -11,6 +11,8 @@
 int do_close(int fd);
 int do_read(int fd, void *buf, size_t nbytes);
 int do_write(int fd, const void *buf, size_t nbytes);
+int do_read_pages(int fd, void **pages, uint32_t npages);
+int do_write_pages(int fd, void **pages, uint32_t npages);
 int do_dup(int fd);
 int do_dup2(int ofd, int nfd);
 int do_mknod(const char *path, int mode, unsigned devid);
@@ -22,6 +24,8 @@ int do_rename(const char *oldname, const char *newname);
 int do_chdir(const char *path);
 int do_getdent(int fd, struct dirent *dirp);
 int do_lseek(int fd, int offset, int whence);
+int do_fsync(int fd);
+int do_fallocate(int fd, off_t offset, off_t len);
 int do_stat(const char *path, struct stat *uf);
 
 #ifdef __MOUNTING__
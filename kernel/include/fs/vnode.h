@@ -128,6 +128,37 @@ typedef struct vnode_ops {
          * same file that was passed to acquire.
          */
         int (*release)(struct vnode *vnode, struct file *file);
+        /*
+         * fsync is called by fsync(2) after the file's dirty pages have
+         * been written back. It should write back whatever metadata the
+         * filesystem keeps for the file (the inode, its indirect block and
+         * so on) so that the file can be found again after a crash. It may
+         * be NULL if there is nothing to write.
+         */
+        int (*fsync)(struct vnode *vnode);
+        /*
+         * fallocate allocates storage for the len bytes of the file
+         * starting at offset, which then read as zeros unless they held
+         * data already, and extends the file to cover them. Later writes
+         * to the range need not allocate anything. It may be NULL if the
+         * filesystem cannot do this.
+         */
+        int (*fallocate)(struct vnode *vnode, off_t offset, off_t len);
+        /*
+         * read_direct and write_direct do the I/O of files opened with
+         * O_DIRECT. They transfer npages whole pages of the file, starting
+         * at the page-aligned offset, between the disk and the given page
+         * frames without caching them in the file's own pages, which are
+         * nevertheless kept coherent with what is read and written. They
+         * return the number of bytes transferred; read_direct stops at the
+         * end of the file, and write_direct extends the file if needed.
+         * Both may be NULL, in which case the file cannot be opened with
+         * O_DIRECT.
+         */
+        int (*read_direct)(struct vnode *file, off_t offset, void **pages,
+                           uint32_t npages);
+        int (*write_direct)(struct vnode *file, off_t offset, void **pages,
+                            uint32_t npages);
 
         /*
          * Used by vnode vm_object entry points (and by no one else):
@@ -233,6 +264,13 @@ typedef struct vnode {
          */
         kmutex_t           vn_mutex;
 
+        /*
+         * The number of free disk blocks set aside for dirty pages of this
+         * file that do not have a block yet. This is only used by the
+         * underlying filesystem implementation.
+         */
+        int                vn_nreserved;
+
         /*
          * A generic pointer which the file system can use to store any extra
          * data it needs.
@@ -262,6 +300,9 @@ typedef struct vnode {
 
         /* Used (only) by the v{get,ref,put} facilities (vfs/vnode.c): */
         list_link_t        vn_link;        /* link on system vnode list */
+        list_link_t        vn_hash_link;   /* link on (fs, vno) hash bucket */
+        list_link_t        vn_lru_link;    /* link on list of unreferenced
+                                              vnodes, while unreferenced */
         int                vn_flags;       /* VN_BUSY */
         ktqueue_t          vn_waitq;       /* queue of threads waiting for vnode
                                               to become not busy */
@@ -322,9 +363,12 @@ void vref(vnode_t *vn);
 /*
  *     This function decrements the reference count on this vnode.
  *
- *     If, as a result of this, vn_refcount reaches zero, the underlying
- *     fs's 'delete_vnode' entry point will be called and the vnode will be
- *     freed.
+ *     If, as a result of this, vn_refcount reaches zero, the vnode is kept
+ *     in a cache of unreferenced vnodes if it is still linked in the
+ *     underlying fs, so that vget() can hand it out again without reading
+ *     it in. Otherwise, or when it is evicted from the cache, the
+ *     underlying fs's 'delete_vnode' entry point will be called and the
+ *     vnode will be freed.
  *
  *     If, as a result of this, vn_refcount reaches vn_respages and
  *     vn_nrespages is > 0 (meaning only passive references exist) and
@@ -357,10 +401,28 @@ int vfs_is_in_use(struct fs *fs);
 
 /*
  *         Clean and uncache all resident pages of all vnodes belonging to
- *         the specified fs.
+ *         the specified fs, then free its vnodes that are unreferenced.
  */
 void vnode_flush_all(struct fs *fs);
 
+/*
+ *         Frees the vnodes of the specified fs (or of all file systems, if
+ *         it is NULL) that are kept in the cache of unreferenced vnodes.
+ *
+ *         MAY BLOCK.
+ */
+void vnode_uncache_all(struct fs *fs);
+
+/*
+ *         Frees up to target of the least recently used unreferenced
+ *         vnodes (or all of them, if target is negative), which lets go of
+ *         the memory they keep pinned in the underlying fs. Called by
+ *         pageoutd when it runs out of pages to reclaim.
+ *
+ *         MAY BLOCK. Returns the number of vnodes freed.
+ */
+int vnode_reclaim(int target);
+
 /*
  *         Returns the number of vnodes from this filesystem that are in
  *         use.
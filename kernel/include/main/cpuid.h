@@ -87,7 +87,7 @@ enum cpuid_requests {
 
 static inline void cpuid(int request, uint32_t *a, uint32_t *d)
 {
-        __asm__ volatile("cpuid":"=a"(*a), "=d"(*d):"0"(request));
+        __asm__ volatile("cpuid":"=a"(*a), "=d"(*d):"0"(request):"ebx", "ecx");
 }
 
 static inline void cpuid_get_msr(uint32_t msr, uint32_t* lo, uint32_t* hi)
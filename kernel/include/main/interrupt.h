@@ -15,6 +15,8 @@
 #define INTR_KEYBOARD 0xe0
 #define INTR_DISK_PRIMARY 0xd0
 #define INTR_DISK_SECONDARY 0xd1
+#define INTR_DISK_AHCI 0xd2
+#define INTR_DISK_VIRTIO 0xd3
 
 /* NOTE: INTR_SYSCALL is not defined here, but is in syscall.h (it must be
  * in a userland-accessible header) */
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "types.h"
+
+/* The rate of the time stamp counter, in kHz; 0 until tsc_init() has
+ * measured it */
+extern uint32_t tsc_khz;
+
+/* Reads the time stamp counter, which counts processor cycles. */
+static inline uint64_t rdtsc(void)
+{
+        uint64_t ret;
+        __asm__ volatile("rdtsc" : "=A"(ret));
+        return ret;
+}
+
+/* Measures the rate of the time stamp counter against the PIT. */
+void tsc_init(void);
+
+/* Converts a number of time stamp counter cycles to microseconds. */
+uint32_t tsc_to_usecs(uint64_t cycles);
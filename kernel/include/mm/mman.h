@@ -23,3 +23,20 @@
 */
 #define MAP_FIXED       4
 #define MAP_ANON        8
+#define MAP_POPULATE    16    /* Fill and map the whole range up front. */
+#define MAP_LARGEPAGE   32    /* Back private anonymous memory with 4mb pages
+                               * where possible. */
+
+/* Advice to madvise(2).
+*/
+#define MADV_NORMAL     0     /* No special treatment. */
+#define MADV_RANDOM     1     /* Expect random page references. */
+#define MADV_SEQUENTIAL 2     /* Expect sequential page references. */
+#define MADV_WILLNEED   3     /* Will need these pages. */
+#define MADV_DONTNEED   4     /* Don't need these pages. */
+
+/* Flags to msync(2).
+*/
+#define MS_ASYNC        1     /* Schedule the write back and return. */
+#define MS_INVALIDATE   2     /* Invalidate other cached copies. */
+#define MS_SYNC         4     /* Write back before returning. */
@@ -33,6 +33,15 @@ typedef struct mmobj {
          */
         /* Members relevant only to shadow objects: */
         struct mmobj       *mmo_shadowed;   /* the object that we shadow */
+        list_link_t         mmo_shadower_link; /* link on mmo_shadowed's
+                                                * mmo_shadowers */
+        list_link_t         mmo_collapse_link; /* link on shadowd's queue */
+
+        /* The shadow objects whose mmo_shadowed is this object */
+        list_t              mmo_shadowers;
+
+        /* Swap entries of this object's swapped out pages (see vm/swap.c) */
+        list_t              mmo_swapents;
 } mmobj_t;
 
 struct mmobj_ops {
@@ -101,6 +110,10 @@ static inline void mmobj_init(mmobj_t *o, mmobj_ops_t *ops)
         list_init(&(o)->mmo_respages);
         list_init(&(o)->mmo_un.mmo_vmas);
         (o)->mmo_shadowed = NULL;
+        list_link_init(&(o)->mmo_shadower_link);
+        list_link_init(&(o)->mmo_collapse_link);
+        list_init(&(o)->mmo_shadowers);
+        list_init(&(o)->mmo_swapents);
 }
 
 #define mmobj_bottom_obj(o) \
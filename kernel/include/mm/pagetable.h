@@ -6,6 +6,7 @@
 #define PD_WRITE_THROUGH  0x008
 #define PD_CACHE_DISABLED 0x010
 #define PD_ACCESSED       0x020
+#define PD_SIZE           0x080 /* maps a 4mb page instead of a page table */
 
 #define PT_PRESENT        0x001
 #define PT_WRITE          0x002
@@ -17,6 +18,12 @@
 #define PT_SIZE           0x080
 #define PT_GLOBAL         0x100
 
+/* Size of the pages mapped by page directory entries with PD_SIZE set. These
+ * are only used if the processor supports PSE, see pt_large_pages() */
+#define LARGE_PAGE_SIZE   0x400000
+#define LARGE_PAGE_NPAGES (LARGE_PAGE_SIZE / PAGE_SIZE)
+#define LARGE_PAGE_ALIGNED(x) (0 == ((uintptr_t)(x)) % LARGE_PAGE_SIZE)
+
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
 
@@ -49,15 +56,39 @@ uintptr_t pt_virt_to_phys(uintptr_t vaddr);
  * Note that the TLB is not flushed by this function. */
 int pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32_t ptflags);
 
+/* Returns 1 if the processor supports 4mb pages and they are in use, 0
+ * otherwise. */
+int pt_large_pages(void);
+
+/* Maps the 4mb of physical memory starting at paddr at vaddr in the
+ * given page directory with a single page directory entry, replacing any
+ * page table there (whose mappings, if any, must be for the same pages).
+ * Both vaddr and paddr must be aligned to LARGE_PAGE_SIZE, and the
+ * whole range must be in the user address space. Only valid if
+ * pt_large_pages(). Note that the TLB is not flushed by this function. */
+void pt_map_large(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags);
+
 /* Unmaps the page for the given virtual page from the given page
  * directory. vaddr must be in the user address space. vaddr must
- * be page aligned. Note that the TLB is not flushed by this function. */
+ * be page aligned. If the page is part of a 4mb mapping, the whole
+ * 4mb mapping is removed; its other pages fault back in one at a time.
+ * Note that the TLB is not flushed by this function. */
 void pt_unmap(pagedir_t *pd, uintptr_t vaddr);
 
 /* Unmaps the given range of addresses [low, high). As with pt_unmap,
  * the addresses must be page aligned in the user address space */
 void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh);
 
+/* Sets (present != 0) or clears the present bit of the kernel page
+ * at vaddr. The kernel's page tables are shared by every page
+ * directory, so this changes the kernel mapping in all address
+ * spaces. If vaddr is mapped by a 4mb page, that mapping is first
+ * replaced by a page table in every page directory, which may block.
+ * vaddr must be a page aligned kernel address. The TLB entry for vaddr
+ * is flushed. Returns 0 on success, -ENOMEM if no page table could be
+ * allocated. */
+int pt_kernel_set_present(uintptr_t vaddr, int present);
+
 /* Creates a new page directory which is initialized to contain
  * mappings for all kernel memory. If there is not enough memory
  * to allocate the directory NULL is returned. Note that destroying
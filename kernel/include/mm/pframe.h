@@ -11,6 +11,8 @@ struct mmobj;
 
 #define PF_BUSY                 0x01
 #define PF_DIRTY                0x02
+#define PF_LARGE                0x04 /* page of a 4mb block backing a large
+                                      * page mapping (see vm/pagefault.c) */
 
 #define pframe_is_busy(pf)          ((pf)->pf_flags & PF_BUSY)
 #define pframe_set_busy(pf)         do { (pf)->pf_flags |= PF_BUSY; } while (0)
@@ -44,6 +46,8 @@ typedef struct pframe {
         list_link_t         pf_link;     /* link on {free,allocated,pinned}_list */
         list_link_t         pf_hlink;    /* link on hash chain of resident page hash */
         list_link_t         pf_olink;    /* link on object's list of resident pages */
+        struct pmframe     *pf_merged;   /* if pf_addr is shared with identical
+                                          * pages (see vm/pagemerged.c) */
 } pframe_t;
 
 void pframe_init(void);
@@ -55,16 +59,25 @@ void pframe_shutdown(void);
 pframe_t *pframe_get_resident(struct mmobj *o, uint32_t pagenum);
 
 int pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result);
+int pframe_get_nofill(struct mmobj *o, uint32_t pagenum, int zero,
+                      pframe_t **result);
 int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result);
+int pframe_adopt(struct mmobj *o, uint32_t pagenum, void *addr, pframe_t **result);
 void pframe_migrate(pframe_t *pf, mmobj_t *dest);
 
+void pframe_deactivate(struct mmobj *o, uint32_t pagenum);
+int  pframe_wait_busy(struct mmobj *o);
+
 void pframe_pin(pframe_t *pf);
 void pframe_unpin(pframe_t *pf);
 
 int  pframe_dirty(pframe_t *pf);
 int  pframe_clean(pframe_t *pf);
+void pframe_writeback_begin(pframe_t *pf);
+void pframe_writeback_end(pframe_t *pf, int err);
 void pframe_free(pframe_t *pf);
 
 void pframe_clean_all(void);
+int  pframe_clean_range(struct mmobj *o, uint32_t lopage, uint32_t hipage);
 
 void pframe_remove_from_pts(pframe_t *pf);
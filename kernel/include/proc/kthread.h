@@ -59,6 +59,17 @@ kthread_t *kthread_create(struct proc *p, kthread_func_t func, long arg1, void *
  */
 void kthread_destroy(kthread_t *t);
 
+/**
+ * Provides debug information about kernel stacks: their size, the
+ * most stack any destroyed thread has used, and the stack cache.
+ *
+ * @param arg must be NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t kthread_stack_info(const void *arg, char *buf, size_t osize);
+
 /**
  * Cancel a thread.
  *
@@ -39,6 +39,11 @@ ksyscall(lseek, (int fd, int offset, int whence), (fd, offset, whence))
 ksyscall(getdent, (int fd, struct dirent *dirp), (fd, dirp))
 ksyscall(stat, (const char *path, struct stat *uf), (path, uf))
 ksyscall(open, (const char *filename, int flags), (filename, flags))
+#ifdef __MOUNTING__
+ksyscall(mount, (const char *source, const char *target, const char *type),
+         (source, target, type))
+ksyscall(umount, (const char *target), (target))
+#endif
 #define ksys_exit do_exit
 
 /* Kill me now */
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A small LZ77 compressor in the style of LZ4: the output is a sequence of
+ * (literal run, back-reference) pairs and is cheap enough to produce and
+ * expand for compressing whole pages on the paging path.
+ */
+
+/**
+ * Compresses srclen bytes at src into dst.
+ *
+ * The compressor uses a static hash table, so it must not be entered
+ * concurrently; as it never blocks, this holds for any kernel caller.
+ *
+ * @param src the data to compress, at most 65535 bytes
+ * @param srclen the length of src
+ * @param dst the buffer for the compressed data
+ * @param dstcap the size of dst
+ * @return the compressed length, or 0 if it would not fit in dstcap bytes
+ */
+size_t lz_compress(const void *src, size_t srclen, void *dst, size_t dstcap);
+
+/**
+ * Expands data produced by lz_compress().
+ *
+ * @param src the compressed data
+ * @param srclen the length of src
+ * @param dst the buffer for the expanded data
+ * @param dstcap the size of dst
+ * @return the expanded length, or -1 if src is malformed or does not
+ * expand into dstcap bytes
+ */
+int lz_decompress(const void *src, size_t srclen, void *dst, size_t dstcap);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "types.h"
+
+struct pframe;
+
+void pagemerged_wakeup(void);
+void pagemerged_shutdown(void);
+
+/**
+ * Gives the merged page pf a private copy of its frame, so that it can be
+ * written to. Called by pframe_dirty() with pf busy. May block.
+ *
+ * @return 0 on success, -ENOMEM
+ */
+int pagemerge_unshare(struct pframe *pf);
+
+/**
+ * Drops the merged page pf's reference on its frame. Called by
+ * pframe_free() in place of freeing pf's page.
+ */
+void pagemerge_release(struct pframe *pf);
+
+/**
+ * Provides debug information about same-page merging: the number of
+ * merged frames and of pages sharing them, and how far scanning has got.
+ *
+ * @param arg must be NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t pagemerge_info(const void *arg, char *buf, size_t osize);
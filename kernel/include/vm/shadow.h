@@ -4,6 +4,10 @@ struct mmobj;
 
 void shadow_init();
 struct mmobj *shadow_create(void);
+int shadow_is_shadow(struct mmobj *o);
+void shadow_set_shadowed(struct mmobj *o, struct mmobj *shadowed);
+int shadow_is_collapsible(struct mmobj *o);
+int shadow_chain_depth(struct mmobj *o);
 
 extern int shadow_count;
 
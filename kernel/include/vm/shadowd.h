@@ -1,5 +1,48 @@
 #pragma once
 
+#include "types.h"
+
+struct mmobj;
+struct vmarea;
+
 void shadowd_wakeup(void);
 void shadowd_alloc_sleep(void);
 void shadowd_shutdown(void);
+
+/**
+ * Hands a shadow object that has just become collapsible to shadowd, and
+ * wakes shadowd up. Does nothing if it is queued already. This does not
+ * block.
+ */
+void shadowd_enqueue(struct mmobj *o);
+
+/**
+ * Takes an object off shadowd's queue, if it is there. Called when the
+ * object dies.
+ */
+void shadowd_dequeue(struct mmobj *o);
+
+/**
+ * Makes the shadow chain of a private vmarea no longer than
+ * SHADOW_MAX_DEPTH, if it has grown longer. The collapsible objects in the
+ * chain are collapsed right away; if the chain is still too long, the top
+ * object is given its own copies of the pages it sees through the chain
+ * and made to shadow the bottom object directly. This may block.
+ *
+ * @param vma the vmarea
+ * @return 0 on success, -ENOMEM if the pages could not be copied, or
+ * -EBUSY if the top object is shared with another vmarea
+ */
+int shadowd_limit_depth(struct vmarea *vma);
+
+/**
+ * Provides debug information about shadowd: the number of objects it has
+ * collapsed, and a histogram of the lengths of the shadow chains of all
+ * vmareas.
+ *
+ * @param arg must be NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t shadowd_info(const void *arg, char *buf, size_t osize);
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "types.h"
+
+struct mmobj;
+struct pframe;
+
+/*
+ * Swap lets pageoutd evict pages of anonymous and shadow objects, which
+ * have no file to be written back to. Pages that are all zeros are only
+ * remembered as such, pages that compress well go to an in-memory
+ * compressed pool, and the rest go to the swap device, if there is one: a
+ * single block device every block of which is one swap slot holding one
+ * page. A page that has been swapped out is remembered by a swap entry
+ * until it is read back in or its object dies.
+ */
+
+void swap_init(void);
+
+/**
+ * Starts swapping to the given block device. The whole device is used, so
+ * it must not hold a file system.
+ *
+ * @param dev the device id of the block device
+ * @return 0 on success, -EBUSY if swap is already on or the device holds
+ * the root file system, -ENODEV if there is no such device, -ENOMEM
+ */
+int swap_on(devid_t dev);
+
+/**
+ * Stops swapping to the swap device: reads every page on it back into
+ * memory and lets go of the device. The compressed pool stays in use.
+ *
+ * @return 0 on success, -EINVAL if swap is off, or -errno if some page
+ * could not be read back (swap is then left on)
+ */
+int swap_off(void);
+
+/**
+ * @return a lower bound on the number of pages that can still be swapped
+ * out: the free slots on the swap device plus the room left in the
+ * compressed pool. Zero pages can always be swapped out.
+ */
+uint32_t swap_room(void);
+
+/**
+ * @return 1 if pages of 'o' can be swapped out (anonymous and shadow
+ * objects), 0 otherwise
+ */
+int swap_is_swappable(struct mmobj *o);
+
+/**
+ * @return 1 if the given page of 'o' is on swap, 0 otherwise
+ */
+int swap_has_page(struct mmobj *o, uint32_t pagenum);
+
+/**
+ * Reads the page pf back from swap if it is there, and releases its swap
+ * slot. Called from the fillpage entry point of swappable objects. The
+ * pages after it whose slots follow its own are read in the same request,
+ * and made resident too.
+ *
+ * @return 1 if pf was filled from swap, 0 if it is not on swap, -errno
+ */
+int swap_readpage(struct mmobj *o, struct pframe *pf);
+
+/**
+ * Swaps the page pf out, to the first tier that takes it. Called from the
+ * cleanpage entry point of swappable objects. Once the zpool is full, the
+ * pages after it that pageoutd has picked too are written to the swap
+ * device in the same request. If the page cannot be
+ * swapped out it is pinned again, so that pageoutd does not keep trying to
+ * reclaim it.
+ *
+ * @return 0 on success, -ENOSPC if there is no room for it, -errno
+ */
+int swap_writepage(struct mmobj *o, struct pframe *pf);
+
+/**
+ * Called whenever a page of a swappable object is looked up: pins the page
+ * again if pageoutd had unpinned it to swap it out, and forgets its swap
+ * entry, which the caller may be about to make stale.
+ */
+void swap_keep_resident(struct pframe *pf);
+
+/**
+ * Forgets the swap entry of the given page, if any, and frees its slot.
+ */
+void swap_drop_page(struct mmobj *o, uint32_t pagenum);
+
+/**
+ * Forgets all swap entries of 'o'. Called when 'o' dies.
+ */
+void swap_drop_obj(struct mmobj *o);
+
+/**
+ * Moves the swap entries of 'src' to 'dest' when shadowd collapses 'src'
+ * into 'dest'. Entries for pages that 'dest' already has (resident or on
+ * swap) are dropped.
+ */
+void swap_migrate(struct mmobj *src, struct mmobj *dest);
+
+/**
+ * Provides debug information about swap: the device and its slot usage,
+ * the size and compression ratio of the compressed pool, and the number of
+ * pages swapped in and out.
+ *
+ * @param arg must be NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t swap_info(const void *arg, char *buf, size_t osize);
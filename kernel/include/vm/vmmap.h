@@ -8,12 +8,15 @@
 #define VMMAP_DIR_HILO 2
 
 struct mmobj;
+struct pframe;
 struct proc;
 struct vnode;
 
 typedef struct vmmap {
         list_t       vmm_list;
         struct proc *vmm_proc;
+        list_t       vmm_locked;     /* pages pinned by mlock(2) */
+        uint32_t     vmm_nlocked;    /* length of vmm_locked */
 } vmmap_t;
 
 /* make sure you understand why mapping boundaries are in terms of frame
@@ -25,6 +28,7 @@ typedef struct vmarea {
 
         int            vma_prot;     /* permissions on mapping */
         int            vma_flags;    /* either MAP_SHARED or MAP_PRIVATE */
+        int            vma_advice;   /* madvise(2) access pattern hint */
 
         struct vmmap  *vma_vmmap;    /* address space that this area belongs to */
         struct mmobj  *vma_obj;      /* the vm object to read pages from */
@@ -44,6 +48,12 @@ int vmmap_map(vmmap_t *map, struct vnode *file, uint32_t lopage, uint32_t npages
 int vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages);
 int vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages);
 int vmmap_find_range(vmmap_t *map, uint32_t npages, int dir);
+int vmmap_advise(vmmap_t *map, uint32_t lopage, uint32_t npages, int advice);
+int vmmap_populate(vmmap_t *map, uint32_t lopage, uint32_t npages, int forwrite);
+int vmmap_lock(vmmap_t *map, uint32_t lopage, uint32_t npages);
+int vmmap_unlock(vmmap_t *map, uint32_t lopage, uint32_t npages);
+int vmmap_pin(vmmap_t *map, const void *vaddr, int forwrite, struct pframe **result);
+int vmmap_sync(vmmap_t *map, uint32_t lopage, uint32_t npages, int flags);
 
 int vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count);
 int vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count);
@@ -18,11 +18,14 @@
 #include "vm/shadowd.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/swap.h"
+#include "vm/pagemerged.h"
 
 #include "main/acpi.h"
 #include "main/apic.h"
 #include "main/interrupt.h"
 #include "main/gdt.h"
+#include "main/tsc.h"
 
 #include "proc/sched.h"
 #include "proc/proc.h"
@@ -97,6 +100,7 @@ kmain()
         apic_init();
 	      pci_init();
         intr_init();
+        tsc_init();
 
         gdt_init();
 
@@ -104,6 +108,7 @@ kmain()
 #ifdef __VM__
         anon_init();
         shadow_init();
+        swap_init();
 #endif
         vmmap_init();
         proc_init();
@@ -253,11 +258,24 @@ idleproc_run(int arg1, void *arg2)
         KASSERT(mkdir_res == -EEXIST && "wrong type of error when making /dev");
     }
 
+    /* newer than the other devices, so it may be missing from an existing /dev */
+    int mkiostat_res = do_mknod("/dev/iostat", S_IFCHR, MEM_IOSTAT_DEVID);
+
+    KASSERT((mkiostat_res == 0 || mkiostat_res == -EEXIST) && "wrong type of \
+            error making /dev/iostat");
+
     int mktmp_res = do_mkdir("/tmp");
 
-    KASSERT((mkdir_res == 0 || mkdir_res == -EEXIST) && "wront type of error \
+    KASSERT((mktmp_res == 0 || mktmp_res == -EEXIST) && "wront type of error \
             making /tmp");
 
+#ifdef __MOUNTING__
+    /* scratch files live in memory */
+    if (do_mount("tmpfs", "/tmp", "tmpfs") < 0){
+        panic("unable to mount tmpfs on /tmp\n");
+    }
+#endif
+
     /*kmutex_init(&lookup_mutex);*/
 
 #endif
@@ -285,6 +303,10 @@ idleproc_run(int arg1, void *arg2)
     shadowd_shutdown();
 #endif
 
+#ifdef __PAGEMERGE__
+    pagemerged_shutdown();
+#endif
+
 #ifdef __VFS__
     /* Shutdown the vfs: */
     dbg_print("weenix: vfs shutdown...\n");
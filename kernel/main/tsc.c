@@ -0,0 +1,51 @@
+#include "types.h"
+#include "kernel.h"
+
+#include "main/io.h"
+#include "main/tsc.h"
+
+#include "util/debug.h"
+
+/* PIT channel 2, whose gate and output are wired to the keyboard
+ * controller's port B rather than to an interrupt */
+#define PIT_CH2         0x42
+#define PIT_CMD         0x43
+#define PIT_PORTB       0x61
+#define PIT_PORTB_GATE2 0x01
+#define PIT_PORTB_SPKR  0x02
+#define PIT_PORTB_OUT2  0x20
+
+#define PIT_HZ          1193182
+#define TSC_CALIBRATE_MS 10
+
+uint32_t tsc_khz = 0;
+
+void
+tsc_init()
+{
+        uint32_t latch = PIT_HZ * TSC_CALIBRATE_MS / 1000;
+        uint64_t start, end;
+
+        /* Count down once on channel 2 (mode 0), with the speaker off;
+         * its output goes high when the count runs out */
+        outb(PIT_PORTB, (inb(PIT_PORTB) & ~PIT_PORTB_SPKR) | PIT_PORTB_GATE2);
+        outb(PIT_CMD, 0xb0);
+        outb(PIT_CH2, latch & 0xff);
+        outb(PIT_CH2, latch >> 8);
+
+        start = rdtsc();
+        while (!(inb(PIT_PORTB) & PIT_PORTB_OUT2))
+                ;
+        end = rdtsc();
+
+        tsc_khz = (uint32_t)((end - start) / TSC_CALIBRATE_MS);
+        dbg(DBG_CORE, "TSC runs at %u kHz\n", tsc_khz);
+}
+
+uint32_t
+tsc_to_usecs(uint64_t cycles)
+{
+        if (0 == tsc_khz)
+                return 0;
+        return (uint32_t)(cycles * 1000 / tsc_khz);
+}
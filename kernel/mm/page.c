@@ -13,6 +13,8 @@
 
 #include "vm/shadowd.h"
 
+#include "fs/dcache.h"
+
 #include "proc/sched.h"
 
 GDB_DEFINE_HOOK(page_alloc, void *addr, int npages)
@@ -216,6 +218,9 @@ _page_split(int order)
                 dbg(DBG_PAGEALLOC, "waking up shadowd\n");
                 shadowd_wakeup();
                 shadowd_alloc_sleep();
+#endif
+#ifdef __VFS__
+                dcache_reclaim(-1);
 #endif
                 int num_freed = slab_allocators_reclaim(0);
                 dbg(DBG_MM, "reclaimed %d pages from slab allocator.\n", num_freed);
@@ -6,6 +6,7 @@
 #include "globals.h"
 
 #include "main/interrupt.h"
+#include "main/cpuid.h"
 
 #include "mm/mm.h"
 #include "mm/page.h"
@@ -18,6 +19,8 @@
 #include "util/string.h"
 #include "util/printf.h"
 
+#include "proc/proc.h"
+
 #include "vm/pagefault.h"
 
 #include "boot/config.h"
@@ -41,6 +44,12 @@ struct pagedir {
 #define vaddr_to_offset(vaddr) \
         (((uint32_t)(vaddr)) & (~PAGE_MASK))
 
+#define LARGE_PAGE_MASK   (~(LARGE_PAGE_SIZE - 1))
+#define LARGE_PAGE_ALIGN_UP(x) \
+        ((((uintptr_t)(x)) + LARGE_PAGE_SIZE - 1) & LARGE_PAGE_MASK)
+
+#define CR4_PSE           0x010
+
 /* the virtual address of the page directory in cr3 */
 static pagedir_t *current_pagedir = NULL;
 static pagedir_t *template_pagedir = NULL;
@@ -48,6 +57,9 @@ static pagedir_t *template_pagedir = NULL;
 static uint32_t phys_map_count = 1;
 static pte_t *final_page;
 
+/* whether the processor supports 4mb pages, see pt_init() */
+static int pse_enabled = 0;
+
 uintptr_t
 pt_phys_tmp_map(uintptr_t paddr)
 {
@@ -85,6 +97,11 @@ pt_virt_to_phys(uintptr_t vaddr)
         uint32_t entry = vaddr_to_ptindex(vaddr);
         uint32_t offset = vaddr_to_offset(vaddr);
 
+        if (PD_SIZE & current_pagedir->pd_physical[table]) {
+                return (current_pagedir->pd_physical[table] & LARGE_PAGE_MASK)
+                       + (vaddr & ~LARGE_PAGE_MASK);
+        }
+
         pte_t *pagetable = (pte_t *)pt_phys_tmp_map(current_pagedir->pd_physical[table] & PAGE_MASK);
         uintptr_t page = pagetable[entry] & PAGE_MASK;
         return page + offset;
@@ -113,7 +130,9 @@ pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32
         int index = vaddr_to_pdindex(vaddr);
 
         pte_t *pt;
-        if (!(PT_PRESENT & pd->pd_physical[index])) {
+        /* a 4mb mapping here is replaced by a page table in which only this
+         * page is mapped; the others fault back in */
+        if (!(PT_PRESENT & pd->pd_physical[index]) || (PD_SIZE & pd->pd_physical[index])) {
                 if (NULL == (pt = page_alloc())) {
                         return -ENOMEM;
                 } else {
@@ -136,6 +155,38 @@ pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32
         return 0;
 }
 
+int
+pt_large_pages(void)
+{
+        return pse_enabled;
+}
+
+void
+pt_map_large(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags)
+{
+        KASSERT(pse_enabled);
+        KASSERT(LARGE_PAGE_ALIGNED(vaddr) && LARGE_PAGE_ALIGNED(paddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH - LARGE_PAGE_SIZE >= vaddr);
+        KASSERT((pdflags & ~PAGE_MASK) == pdflags);
+
+        int index = vaddr_to_pdindex(vaddr);
+
+        if ((PT_PRESENT & pd->pd_physical[index]) && !(PD_SIZE & pd->pd_physical[index])) {
+                page_free(pd->pd_virtual[index]);
+        }
+        pd->pd_physical[index] = paddr | pdflags | PD_SIZE;
+        pd->pd_virtual[index] = NULL;
+}
+
+/* Removes the 4mb mapping at the given index of the page directory */
+static void
+_pt_unmap_large(pagedir_t *pd, uint32_t index)
+{
+        KASSERT(PD_SIZE & pd->pd_physical[index]);
+        pd->pd_physical[index] = 0;
+        pd->pd_virtual[index] = NULL;
+}
+
 void
 pt_unmap(pagedir_t *pd, uintptr_t vaddr)
 {
@@ -144,7 +195,9 @@ pt_unmap(pagedir_t *pd, uintptr_t vaddr)
 
         int index = vaddr_to_pdindex(vaddr);
 
-        if (PT_PRESENT & pd->pd_physical[index]) {
+        if (PD_SIZE & pd->pd_physical[index]) {
+                _pt_unmap_large(pd, index);
+        } else if (PT_PRESENT & pd->pd_physical[index]) {
                 pte_t *pt = (pte_t *)pd->pd_virtual[index];
 
                 index = vaddr_to_ptindex(vaddr);
@@ -162,7 +215,9 @@ pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
         KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
 
         index = vaddr_to_ptindex(vlow);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vlow)] && index != 0) {
+        if (PD_SIZE & pd->pd_physical[vaddr_to_pdindex(vlow)]) {
+                _pt_unmap_large(pd, vaddr_to_pdindex(vlow));
+        } else if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vlow)] && index != 0) {
                 pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vlow)];
                 size_t size = (PT_ENTRY_COUNT - index) * sizeof(*pt);
                 memset(&pt[index], 0, size);
@@ -170,7 +225,9 @@ pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
         vlow += PAGE_SIZE * ((PT_ENTRY_COUNT - index) % PT_ENTRY_COUNT);
 
         index = vaddr_to_ptindex(vhigh);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vhigh)] && index != 0) {
+        if (index != 0 && (PD_SIZE & pd->pd_physical[vaddr_to_pdindex(vhigh)])) {
+                _pt_unmap_large(pd, vaddr_to_pdindex(vhigh));
+        } else if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vhigh)] && index != 0) {
                 pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vhigh)];
                 size_t size = index * sizeof(*pt);
                 memset(&pt[0], 0, size);
@@ -180,7 +237,9 @@ pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
         uint32_t i;
         for (i = vaddr_to_pdindex(vlow); i < vaddr_to_pdindex(vhigh); ++i) {
                 if (PT_PRESENT & pd->pd_physical[i]) {
-                        page_free(pd->pd_virtual[i]);
+                        if (!(PD_SIZE & pd->pd_physical[i])) {
+                                page_free(pd->pd_virtual[i]);
+                        }
                         pd->pd_virtual[i] = NULL;
                         pd->pd_physical[i] = 0;
                 }
@@ -188,6 +247,92 @@ pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
 }
 
 
+/*
+ * Every page directory has a copy of the kernel's page directory entries,
+ * so changing one means changing it in all of them: the template new ones
+ * are copied from, the one in use, and those of all processes.
+ */
+static void
+_pt_kernel_set_pde(uint32_t index, pde_t pde, uintptr_t *pt)
+{
+        proc_t *p;
+
+        current_pagedir->pd_physical[index] = pde;
+        current_pagedir->pd_virtual[index] = pt;
+        if (NULL != template_pagedir) {
+                template_pagedir->pd_physical[index] = pde;
+                template_pagedir->pd_virtual[index] = pt;
+        }
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if (NULL != p->p_pagedir) {
+                        p->p_pagedir->pd_physical[index] = pde;
+                        p->p_pagedir->pd_virtual[index] = pt;
+                }
+        } list_iterate_end();
+}
+
+/*
+ * Replaces the 4mb mapping of the kernel at the given index of the page
+ * directories by a page table with the same mappings. May block.
+ */
+static int
+_pt_kernel_split(uint32_t index)
+{
+        pte_t *pt;
+        uint32_t i;
+
+        if (NULL == (pt = page_alloc())) {
+                return -ENOMEM;
+        }
+        if (!(PD_SIZE & current_pagedir->pd_physical[index])) {
+                /* split while we were asleep */
+                page_free(pt);
+                return 0;
+        }
+
+        uintptr_t pstart = current_pagedir->pd_physical[index] & LARGE_PAGE_MASK;
+        for (i = 0; i < PT_ENTRY_COUNT; ++i) {
+                pt[i] = (pstart + i * PAGE_SIZE) | PT_PRESENT | PT_WRITE;
+        }
+        _pt_kernel_set_pde(index, pt_virt_to_phys((uintptr_t)pt) | PD_PRESENT | PD_WRITE,
+                           (uintptr_t *)pt);
+        tlb_flush_all();
+
+        return 0;
+}
+
+int
+pt_kernel_set_present(uintptr_t vaddr, int present)
+{
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(USER_MEM_HIGH <= vaddr);
+
+        int index = vaddr_to_pdindex(vaddr);
+        KASSERT(PT_PRESENT & current_pagedir->pd_physical[index]);
+
+        if (PD_SIZE & current_pagedir->pd_physical[index]) {
+                if (present) {
+                        /* all of a 4mb page is present */
+                        return 0;
+                }
+                int err = _pt_kernel_split(index);
+                if (err < 0) {
+                        return err;
+                }
+        }
+
+        pte_t *pt = (pte_t *)current_pagedir->pd_virtual[index];
+        index = vaddr_to_ptindex(vaddr);
+        if (present) {
+                pt[index] |= PT_PRESENT;
+        } else {
+                pt[index] &= ~PT_PRESENT;
+        }
+        tlb_flush(vaddr);
+
+        return 0;
+}
+
 pagedir_t *
 pt_create_pagedir()
 {
@@ -213,7 +358,7 @@ pt_destroy_pagedir(pagedir_t *pdir)
 
         uint32_t i;
         for (i = begin; i <= end; ++i) {
-                if (PT_PRESENT & pdir->pd_physical[i]) {
+                if ((PT_PRESENT & pdir->pd_physical[i]) && !(PD_SIZE & pdir->pd_physical[i])) {
                         page_free(pdir->pd_virtual[i]);
                 }
         }
@@ -275,6 +420,17 @@ pt_init(void)
         pde_t *temppdir;
         __asm__ volatile("movl %%cr3, %0" : "=r"(temppdir));
 
+        /* use 4mb pages for the kernel's mapping of physical memory if
+         * the processor supports them */
+        uint32_t eax, edx;
+        cpuid(CPUID_GETFEATURES, &eax, &edx);
+        if (edx & CPUID_FEAT_EDX_PSE) {
+                uint32_t cr4;
+                __asm__ volatile("movl %%cr4, %0" : "=r"(cr4));
+                __asm__ volatile("movl %0, %%cr4" :: "r"(cr4 | CR4_PSE));
+                pse_enabled = 1;
+        }
+
         pagedir_t *pagedir = (pagedir_t *)&kernel_end;
         /* The kernel ending address should be page aligned by the linker script */
         KASSERT(PAGE_ALIGNED(pagedir));
@@ -311,14 +467,52 @@ pt_init(void)
 
         uintptr_t vaddr = ((uintptr_t)&kernel_start);
         uintptr_t paddr = KERNEL_PHYS_BASE;
+        if (!pse_enabled) {
+                do {
+                        pagetable += PT_ENTRY_COUNT;
+                        vaddr += PT_VADDR_SIZE;
+                        paddr += PT_VADDR_SIZE;
+                        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, vaddr, paddr);
+                } while (paddr < physmax);
+
+                page_add_range((uintptr_t) pagetable + PT_ENTRY_COUNT, physmax + ((uintptr_t)&kernel_start) - KERNEL_PHYS_BASE);
+                return;
+        }
+
+        /* The kernel is at KERNEL_PHYS_BASE, which is not 4mb aligned, so
+         * physical memory cannot be mapped with 4mb pages at the same
+         * offset. Instead, memory up to the first 4mb boundary past the
+         * kernel and its page tables is mapped with page tables as above,
+         * and memory from there on at kernel_start plus its physical
+         * address, with 4mb pages. The two are KERNEL_PHYS_BASE bytes apart
+         * in the kernel's address space. */
+        uintptr_t offset = (uintptr_t)&kernel_start - KERNEL_PHYS_BASE;
+        uintptr_t large_base;
         do {
-                pagetable += PT_ENTRY_COUNT;
-                vaddr += PT_VADDR_SIZE;
-                paddr += PT_VADDR_SIZE;
-                _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, vaddr, paddr);
-        } while (paddr < physmax);
+                large_base = LARGE_PAGE_ALIGN_UP((uintptr_t)(pagetable + PT_ENTRY_COUNT) - offset);
+                while (vaddr + PT_VADDR_SIZE < large_base + offset) {
+                        pagetable += PT_ENTRY_COUNT;
+                        vaddr += PT_VADDR_SIZE;
+                        paddr += PT_VADDR_SIZE;
+                        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, vaddr, paddr);
+                }
+                /* unless the new page tables took us past the boundary */
+        } while ((uintptr_t)(pagetable + PT_ENTRY_COUNT) - offset > large_base);
+
+        for (paddr = large_base; paddr < physmax; paddr += LARGE_PAGE_SIZE) {
+                uint32_t index = vaddr_to_pdindex(paddr + (uintptr_t)&kernel_start);
+                KASSERT(PT_ENTRY_COUNT - 1 > index && "too much physical memory");
+                pagedir->pd_physical[index] = paddr | PD_PRESENT | PD_WRITE | PD_SIZE;
+                pagedir->pd_virtual[index] = NULL;
+        }
+        dbgq(DBG_MM, "Using 4mb pages for physical memory from 0x%08x\n", large_base);
 
-        page_add_range((uintptr_t) pagetable + PT_ENTRY_COUNT, physmax + ((uintptr_t)&kernel_start) - KERNEL_PHYS_BASE);
+        if ((uintptr_t)(pagetable + 2 * PT_ENTRY_COUNT) < MIN(large_base, physmax) + offset) {
+                page_add_range((uintptr_t)(pagetable + PT_ENTRY_COUNT), MIN(large_base, physmax) + offset);
+        }
+        if (large_base < physmax) {
+                page_add_range(large_base + (uintptr_t)&kernel_start, physmax + (uintptr_t)&kernel_start);
+        }
 }
 
 void
@@ -357,8 +551,13 @@ pt_mapping_info(const void *pt, char *buf, size_t osize)
 
         while (PT_ENTRY_COUNT > pdi) {
                 pte_t *entry = NULL;
+                pte_t large_entry;
                 if (PD_PRESENT & pagedir->pd_physical[pdi]) {
-                        if (PT_PRESENT & pagedir->pd_virtual[pdi][pti]) {
+                        if (PD_SIZE & pagedir->pd_physical[pdi]) {
+                                large_entry = ((pagedir->pd_physical[pdi] & LARGE_PAGE_MASK)
+                                               + pti * PAGE_SIZE) | PT_PRESENT;
+                                entry = &large_entry;
+                        } else if (PT_PRESENT & pagedir->pd_virtual[pdi][pti]) {
                                 entry = &pagedir->pd_virtual[pdi][pti];
                         }
                 } else {
@@ -16,6 +16,10 @@
 #include "mm/pagetable.h"
 
 #include "vm/vmmap.h"
+#include "vm/swap.h"
+
+#include "fs/vnode.h"
+#include "vm/pagemerged.h"
 
 /*
  * In this file, physical pages (as represented by pframes) will be
@@ -104,12 +108,16 @@ static ktqueue_t pageoutd_waitq;
 /* threads waiting for pageoutd to run sleep on this queue */
 static ktqueue_t alloc_waitq;
 
+static int pframe_writeback(pframe_t *pf);
+
 /* Pageout daemon functions */
 static void *pageoutd_run(int arg1, void *arg2);
 static void pageoutd_exit(void);
+static int pageoutd_swapout(int max);
 #define pageoutd_wakeup()        (sched_broadcast_on(&pageoutd_waitq))
 #define pageoutd_needed()        \
-	((page_free_count() <= nfreepages_min) && (!list_empty(&alloc_list)))
+	((page_free_count() <= nfreepages_min) \
+	 && (!list_empty(&alloc_list) || swap_room() > 0))
 #define pageoutd_target_met()    (page_free_count() >= nfreepages_target)
 
 
@@ -214,24 +222,25 @@ pframe_get_resident(struct mmobj *o, uint32_t pagenum)
  * Allocate a pframe to hold the page identified by the object and page number.
  * The given page should not already be resident.
  *
- * We allocate a page from the free list. We then initialize the newly allocated
- * page's object, pagenum, and flags, pin count, and links. We also update the
- * object's nrespages.
+ * We allocate a page from the free list, unless one is given. We then
+ * initialize the newly allocated page's object, pagenum, and flags, pin
+ * count, and links. We also update the object's nrespages.
  *
  * @param o the mmobj identifying this page
  * @param pagenum the page number of this page in the object
+ * @param addr the page to use, or NULL to allocate one
  *
  * @return a new pframe
  */
 static pframe_t *
-pframe_alloc(mmobj_t *o, uint32_t pagenum)
+pframe_alloc(mmobj_t *o, uint32_t pagenum, void *addr)
 {
         pframe_t *pf;
         if (NULL == (pf = slab_obj_alloc(pframe_allocator))) {
                 dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
                 return NULL;
         }
-        if (NULL == (pf->pf_addr = page_alloc())) {
+        if (NULL == (pf->pf_addr = (NULL != addr) ? addr : page_alloc())) {
                 dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
                 slab_obj_free(pframe_allocator, pf);
                 return NULL;
@@ -245,6 +254,7 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
         pf->pf_flags = 0;
         sched_queue_init(&pf->pf_waitq);
         pf->pf_pincount = 0;
+        pf->pf_merged = NULL;
 
         list_insert_head(&pframe_hash[hash_page(o, pagenum)], &pf->pf_hlink);
 
@@ -282,7 +292,8 @@ pframe_fill(pframe_t *pf)
  * see if we need to call pageoutd and wake it up if necessary.
  *
  * If the page is found (resident) but busy, then we will wait for it to become
- * unbusy and then try again (since it may have been freed after that). Thus,
+ * unbusy and then try again (since it may have been freed after that, e.g. by
+ * pageoutd after writing it out to swap). Thus,
  * as long as this routine returns successfully, the returned page will be a
  * non-busy page that will be guaranteed to remain resident until the calling
  * context blocks without first pinning the page.
@@ -297,10 +308,13 @@ pframe_fill(pframe_t *pf)
 int
 pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 {
-    *result = pframe_get_resident(o, pagenum);
+    while ((*result = pframe_get_resident(o, pagenum)) != NULL
+           && pframe_is_busy(*result)){
+        sched_sleep_on(&(*result)->pf_waitq);
+    }
 
     if (*result == NULL){
-        *result = pframe_alloc(o, pagenum);
+        *result = pframe_alloc(o, pagenum, NULL);
 
         if (*result == NULL){
             dbg(DBG_S5FS, "could not allocate a pframe\n");
@@ -320,16 +334,49 @@ pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 
     } else {
        KASSERT(!pframe_is_free(*result) && "residant page marked as free?!?!?!\n");
-
-       while (pframe_is_busy(*result)){
-           sched_sleep_on(&(*result)->pf_waitq);
-       } 
     }
 
     KASSERT(!pframe_is_busy(*result) && "trying to return a busy pframe. NO!!!\n");
     return 0;
 }
 
+/*
+ * Like pframe_get(), except that a page that is not resident is not filled
+ * from its object: it is for callers that are about to overwrite all of
+ * the page, or that know the object has nothing stored for it (past the
+ * end of a file). The new page holds zeros if zero is set, and undefined
+ * contents otherwise, so the caller must fill it in before blocking.
+ *
+ * @param o the parent object of the page
+ * @param pagenum the page number of this page in the object
+ * @param zero whether a page that is not resident should be zeroed
+ * @param result used to return the pframe (NULL if there's an error)
+ * @return 0 on success, -ENOMEM
+ */
+int
+pframe_get_nofill(struct mmobj *o, uint32_t pagenum, int zero,
+                  pframe_t **result)
+{
+        while (NULL != (*result = pframe_get_resident(o, pagenum))
+               && pframe_is_busy(*result)) {
+                sched_sleep_on(&(*result)->pf_waitq);
+        }
+
+        if (NULL != *result)
+                return 0;
+
+        if (NULL == (*result = pframe_alloc(o, pagenum, NULL)))
+                return -ENOMEM;
+
+        if (zero)
+                memset((*result)->pf_addr, 0, PAGE_SIZE);
+
+        if (pageoutd_needed())
+                pageoutd_wakeup();
+
+        return 0;
+}
+
 int
 pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result)
 {
@@ -339,10 +386,57 @@ pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result
         return o->mmo_ops->lookuppage(o, pagenum, forwrite, result);
 }
 
+/*
+ * Makes the given page, whose contents the caller has already filled in,
+ * the resident page identified by the object and page number, pinned and
+ * dirty, as if it had been looked up and written to. This is how pages of
+ * a 4mb block backing a large page mapping become pages of an anonymous or
+ * shadow object, which pins its resident pages. The pframe is marked
+ * PF_LARGE. This routine may block allocating the pframe.
+ *
+ * @param o the object the page belongs to
+ * @param pagenum the page number of this page in the object
+ * @param addr the page
+ * @param result used to return the pframe (NULL if there's an error)
+ * @return 0 on success, -EEXIST if the page is already resident or on swap
+ * (or became so while we blocked), -ENOMEM
+ */
+int
+pframe_adopt(struct mmobj *o, uint32_t pagenum, void *addr, pframe_t **result)
+{
+        pframe_t *pf;
+
+        KASSERT(NULL != addr && PAGE_ALIGNED(addr));
+
+        *result = NULL;
+        if (NULL != pframe_get_resident(o, pagenum) || swap_has_page(o, pagenum)) {
+                return -EEXIST;
+        }
+        /* Make sure the slab has a free pframe, so that pframe_alloc()
+         * below does not block, then check again: someone may have brought
+         * the page in while we slept */
+        if (NULL == (pf = slab_obj_alloc(pframe_allocator))) {
+                return -ENOMEM;
+        }
+        slab_obj_free(pframe_allocator, pf);
+        if (NULL != pframe_get_resident(o, pagenum) || swap_has_page(o, pagenum)) {
+                return -EEXIST;
+        }
+
+        pf = pframe_alloc(o, pagenum, addr);
+        KASSERT(NULL != pf);
+        pf->pf_flags = PF_DIRTY | PF_LARGE;
+        pframe_pin(pf);
+
+        *result = pf;
+        return 0;
+}
+
 /*
  * Migrate a page frame up the tree. The destination must be on the same
  * branch as the pframe's current object. pf must not be busy. If dest
- * already has a page with the same number as pf clean pf.
+ * already has a page with the same number as pf, resident or swapped out,
+ * just free pf.
  *
  * @param pf page to be migrated
  * @param dest destination vm object
@@ -351,10 +445,12 @@ void
 pframe_migrate(pframe_t *pf, mmobj_t *dest)
 {
         KASSERT(!pframe_is_busy(pf));
-        if (NULL != pframe_get_resident(dest, pf->pf_pagenum)) {
-                /* dest already has a newer version of the page, clean this page */
-                pframe_unpin(pf);
-                pframe_clean(pf);
+        if (NULL != pframe_get_resident(dest, pf->pf_pagenum)
+            || swap_has_page(dest, pf->pf_pagenum)) {
+                /* dest already has a newer version of the page, drop this page */
+                if (pframe_is_pinned(pf)) {
+                        pframe_unpin(pf);
+                }
                 pframe_free(pf);
         } else {
                 mmobj_t *src = pf->pf_obj;
@@ -370,6 +466,53 @@ pframe_migrate(pframe_t *pf, mmobj_t *dest)
         }
 }
 
+/*
+ * Moves the page identified by 'o' and 'pagenum', if it is resident and
+ * not pinned, to the head of the allocated list so that it is the next page
+ * pageoutd reclaims. Unlike pframe_get_resident() this does not count as a
+ * request for the page. Used to drop pages behind a sequential reader.
+ * This routine will not block.
+ *
+ * @param o the mmobj the page is in
+ * @param pagenum the page number identifying this page within the object
+ */
+void
+pframe_deactivate(struct mmobj *o, uint32_t pagenum)
+{
+        pframe_t *pf;
+        list_iterate_begin(&pframe_hash[hash_page(o, pagenum)], pf, pframe_t, pf_hlink) {
+                if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum)) {
+                        if (!pframe_is_pinned(pf)) {
+                                list_remove(&pf->pf_link);
+                                list_insert_head(&alloc_list, &pf->pf_link);
+                        }
+                        return;
+                }
+        } list_iterate_end();
+}
+
+/*
+ * If some page of 'o' is busy, waits for it to become unbusy and returns 1.
+ * The page may have been freed (and 'o' put) meanwhile, so the caller must
+ * re-examine 'o'. Returns 0, without blocking, if no page of 'o' is busy.
+ * Used before tearing down an object whose pages may be busy being swapped
+ * out.
+ *
+ * @param o the object whose pages to check
+ */
+int
+pframe_wait_busy(struct mmobj *o)
+{
+        pframe_t *pf;
+        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                if (pframe_is_busy(pf)) {
+                        sched_sleep_on(&pf->pf_waitq);
+                        return 1;
+                }
+        } list_iterate_end();
+        return 0;
+}
+
 /*
  * Increases the pin count on this page. Pages with a pin count > 0 will not be
  * paged out by pageoutd, so this ensures that the page will remain resident
@@ -434,7 +577,9 @@ pframe_unpin(pframe_t *pf)
  * Indicates that a page is about to be modified. This should be called on a
  * page before any attempt to modify its contents. This marks the page dirty
  * (so that pageoutd knows to clean it before reclaiming the page frame)
- * and calls the dirtypage mmobj entry point.
+ * and calls the dirtypage mmobj entry point. A page that shares its frame
+ * with identical pages (see vm/pagemerged.c) first gets a private copy, so
+ * pf_addr may change.
  * The given page must not be busy.
  *
  * This routine can block at the mmobj operation level.
@@ -451,6 +596,16 @@ pframe_dirty(pframe_t *pf)
 
         pframe_set_busy(pf);
 
+#ifdef __PAGEMERGE__
+        /* A merged page shares its frame with identical pages; copy it
+         * before it is written to */
+        if (NULL != pf->pf_merged && (ret = pagemerge_unshare(pf)) < 0) {
+                pframe_clear_busy(pf);
+                sched_broadcast_on(&pf->pf_waitq);
+                return ret;
+        }
+#endif
+
         if (!(ret = pf->pf_obj->mmo_ops->dirtypage(pf->pf_obj, pf))) {
                 pframe_set_dirty(pf);
         }
@@ -471,14 +626,53 @@ pframe_dirty(pframe_t *pf)
  */
 int
 pframe_clean(pframe_t *pf)
+{
+        KASSERT(pf->pf_pincount == 0 && "Cleaning a pinned page!");
+
+        return pframe_writeback(pf);
+}
+
+/*
+ * Write a dirty page back to its object like pframe_clean(), but allow the
+ * page to be pinned. The page stays pinned (and so resident) throughout; it
+ * is only marked busy while the write is in progress. This is how fsync(2)
+ * and msync(2) reach mlock()ed pages and the pinned inode and superblock
+ * pages, which pageoutd and sync(2) never clean.
+ *
+ * This routine can block at the mmobj operation level.
+ * @param pf the page to write back
+ * @return 0 on success, -errno on failure
+ */
+static int
+pframe_writeback(pframe_t *pf)
 {
         int ret;
 
         KASSERT(pframe_is_dirty(pf) && "Cleaning page that isn't dirty!");
-        KASSERT(pf->pf_pincount == 0 && "Cleaning a pinned page!");
 
         dbg(DBG_PFRAME, "cleaning page %d of obj %p\n", pf->pf_pagenum, pf->pf_obj);
 
+        pframe_writeback_begin(pf);
+        ret = pf->pf_obj->mmo_ops->cleanpage(pf->pf_obj, pf);
+        pframe_writeback_end(pf, ret);
+
+        return ret;
+}
+
+/*
+ * Marks the dirty page pf clean and busy, as it is about to be written
+ * back. Besides pframe_writeback(), this is for the cleanpage entry point
+ * of an object that writes back the pages next to the one it was asked
+ * for in the same request; it must call pframe_writeback_end() for each
+ * once the write is done. This routine will not block.
+ *
+ * @param pf the page about to be written back
+ */
+void
+pframe_writeback_begin(pframe_t *pf)
+{
+        KASSERT(pframe_is_dirty(pf));
+
         /*
          * Clear the dirty bit *before* we potentially (depending on this
          * particular object type's 'dirtypage' implementation) block so
@@ -492,13 +686,23 @@ pframe_clean(pframe_t *pf)
         pframe_remove_from_pts(pf);
 
         pframe_set_busy(pf);
-        if ((ret = pf->pf_obj->mmo_ops->cleanpage(pf->pf_obj, pf)) < 0) {
+}
+
+/*
+ * Ends the write back of pf started by pframe_writeback_begin(). If it
+ * failed (err < 0) the page is marked dirty again.
+ *
+ * @param pf the page that was written back
+ * @param err the result of the write
+ */
+void
+pframe_writeback_end(pframe_t *pf, int err)
+{
+        if (err < 0) {
                 pframe_set_dirty(pf);
         }
         pframe_clear_busy(pf);
         sched_broadcast_on(&pf->pf_waitq);
-
-        return ret;
 }
 
 /*
@@ -532,7 +736,12 @@ pframe_free(pframe_t *pf)
         nallocated--;
         list_remove(&pf->pf_link);
 
-        page_free(pf->pf_addr);
+#ifdef __PAGEMERGE__
+        if (NULL != pf->pf_merged) {
+                pagemerge_release(pf);
+        } else
+#endif
+                page_free(pf->pf_addr);
         slab_obj_free(pframe_allocator, pf);
 
         o->mmo_nrespages--;
@@ -544,6 +753,119 @@ pframe_free(pframe_t *pf)
         o->mmo_ops->put(o);
 }
 
+/* Sorts the n page numbers in a into ascending order (heapsort) */
+static void
+pframe_sort_pagenums(uint32_t *a, uint32_t n)
+{
+        uint32_t i, end, root, child, tmp;
+
+        for (i = n / 2; i-- > 0;) {
+                for (root = i; (child = 2 * root + 1) < n; root = child) {
+                        if (child + 1 < n && a[child] < a[child + 1])
+                                child++;
+                        if (a[root] >= a[child])
+                                break;
+                        tmp = a[root], a[root] = a[child], a[child] = tmp;
+                }
+        }
+        for (end = n; end-- > 1;) {
+                tmp = a[0], a[0] = a[end], a[end] = tmp;
+                for (root = 0; (child = 2 * root + 1) < end; root = child) {
+                        if (child + 1 < end && a[child] < a[child + 1])
+                                child++;
+                        if (a[root] >= a[child])
+                                break;
+                        tmp = a[root], a[root] = a[child], a[child] = tmp;
+                }
+        }
+}
+
+/*
+ * Write back every dirty page of o with a page number in [lopage, hipage),
+ * pinned or not. Pages are written in ascending page order so that the
+ * writes reach the device as runs instead of in LRU order. This is called
+ * by fsync(2) and msync(2).
+ *
+ * The page numbers of the dirty pages are collected in one pass over the
+ * object's pages and sorted; each page is then looked up again, since it
+ * may have been cleaned or freed while we blocked. Pages dirtied after the
+ * pass are left for the next call. If there is no memory for the page
+ * numbers, each page is found by searching the object's pages for the
+ * lowest dirty page left in the range.
+ * All pages are attempted even if one of them fails.
+ *
+ * @return 0 on success, or the first error returned by cleanpage
+ */
+int
+pframe_clean_range(struct mmobj *o, uint32_t lopage, uint32_t hipage)
+{
+        pframe_t *pf, *next;
+        uint32_t *pages, n = 0, i;
+        int ret = 0, err;
+
+        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                if (pf->pf_pagenum >= lopage && pf->pf_pagenum < hipage
+                    && pframe_is_dirty(pf)) {
+                        n++;
+                }
+        } list_iterate_end();
+        if (0 == n) {
+                return 0;
+        }
+
+        if (NULL == (pages = kmalloc(n * sizeof(uint32_t)))) {
+                while (lopage < hipage) {
+                        next = NULL;
+                        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                                if (pf->pf_pagenum >= lopage && pf->pf_pagenum < hipage
+                                    && pframe_is_dirty(pf)
+                                    && (NULL == next || pf->pf_pagenum < next->pf_pagenum)) {
+                                        next = pf;
+                                }
+                        } list_iterate_end();
+
+                        if (NULL == next) {
+                                break;
+                        }
+                        if (pframe_is_busy(next)) {
+                                sched_sleep_on(&next->pf_waitq);
+                                continue;
+                        }
+
+                        lopage = next->pf_pagenum + 1;
+                        if ((err = pframe_writeback(next)) < 0 && 0 == ret) {
+                                ret = err;
+                        }
+                }
+                return ret;
+        }
+
+        /* kmalloc() may have blocked, so look at the pages again */
+        i = 0;
+        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                if (pf->pf_pagenum >= lopage && pf->pf_pagenum < hipage
+                    && pframe_is_dirty(pf) && i < n) {
+                        pages[i++] = pf->pf_pagenum;
+                }
+        } list_iterate_end();
+        n = i;
+        pframe_sort_pagenums(pages, n);
+
+        for (i = 0; i < n; i++) {
+                while (NULL != (pf = pframe_get_resident(o, pages[i]))
+                       && pframe_is_busy(pf)) {
+                        sched_sleep_on(&pf->pf_waitq);
+                }
+                if (NULL != pf && pframe_is_dirty(pf)
+                    && (err = pframe_writeback(pf)) < 0 && 0 == ret) {
+                        ret = err;
+                }
+        }
+
+        kfree(pages);
+        return ret;
+}
+
 /*
  * Clean all allocated pages (that is, all pages that are not pinned and
  * not free). This is called by sync(2).
@@ -642,6 +964,49 @@ pageoutd_exit()
         pageoutd_thr = NULL;
 }
 
+/*
+ * Called by pageoutd once it has run out of unpinned pages to reclaim.
+ * Pages of anonymous and shadow objects stay pinned while resident, as they
+ * have nowhere to be written back to, unless there is room in swap: then
+ * unpin up to SWAP_CLUSTER (and max) of the least recently pinned of them
+ * that nobody else has pinned (mlock(2)) and mark them dirty, so that
+ * pageoutd swaps them out before reclaiming them.
+ *
+ * @return the number of pages made reclaimable
+ */
+static int
+pageoutd_swapout(int max)
+{
+        pframe_t *victims[SWAP_CLUSTER];
+        uint32_t room = swap_room();
+        list_link_t *link;
+        int n = 0;
+
+        max = MIN(max, SWAP_CLUSTER);
+        for (link = pinned_list.l_prev;
+             link != &pinned_list && n < max && (uint32_t)n < room;
+             link = link->l_prev) {
+                pframe_t *pf = list_item(link, pframe_t, pf_link);
+                if (1 == pf->pf_pincount && !pframe_is_busy(pf)
+                    && swap_is_swappable(pf->pf_obj)) {
+                        victims[n++] = pf;
+                }
+        }
+
+        /* Unpinned pages go to the head of alloc_list; unpin them backwards
+         * so that pageoutd writes them out in the order they were found */
+        int i;
+        for (i = n - 1; i >= 0; --i) {
+                pframe_unpin(victims[i]);
+                pframe_set_dirty(victims[i]);
+        }
+
+        if (n > 0) {
+                dbg(DBG_PFRAME, "PAGEOUT DEMAON: swapping out %d pages\n", n);
+        }
+        return n;
+}
+
 /*
  * The pageout daemon, when run, gets the least-recently-requested page from the
  * list of pages which are available to be paged out. Make sure to check if the
@@ -654,10 +1019,30 @@ static void *
 pageoutd_run(int arg1, void *arg2)
 {
         while (1) {
+                /* Pages that fail to swap out are pinned again and may be
+                 * picked again; look at each pinned page at most once */
+                int nswap = npinned;
+
                 KASSERT(nallocated >= 0);
-                while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
+                while (!pageoutd_target_met()) {
                         pframe_t *pf;
 
+                        if (list_empty(&alloc_list)) {
+                                int n = (nswap > 0) ? pageoutd_swapout(nswap) : 0;
+                                if (0 == n) {
+#ifdef __VFS__
+                                        /* unreferenced vnodes that are kept
+                                         * around pin their inode blocks */
+                                        if (0 < vnode_reclaim(-1)
+                                            && !list_empty(&alloc_list)) {
+                                                continue;
+                                        }
+#endif
+                                        break;
+                                }
+                                nswap -= n;
+                        }
+
                         /* obtain least-recently-requested page: */
                         pf = list_head(&alloc_list, pframe_t, pf_link);
 
@@ -20,7 +20,9 @@
 #include "fs/vnode.h"
 
 #include "vm/shadow.h"
+#include "vm/shadowd.h"
 #include "vm/vmmap.h"
+#include "vm/pagemerged.h"
 
 #include "api/exec.h"
 
@@ -36,7 +38,7 @@ fork_setup_stack(const regs_t *regs, void *kstack)
 {
         /* Pointer argument and dummy return address, and userland dummy return
          * address */
-        uint32_t esp = ((uint32_t) kstack) + DEFAULT_STACK_SIZE - (sizeof(regs_t) + 12);
+        uint32_t esp = ((uint32_t) kstack) + KSTACK_SIZE - (sizeof(regs_t) + 12);
         *(void **)(esp + 4) = (void *)(esp + 8); /* Set the argument to point to location of struct on stack */
         memcpy((void *)(esp + 8), regs, sizeof(regs_t)); /* Copy over struct */
         return esp;
@@ -96,7 +98,7 @@ static void setup_shadow_obj(vmarea_t *vma, mmobj_t *shadow_obj){
 
     /* no need to ref() here, since vma->vma_obj has a reference from 
      * being in the vmarea */
-    shadow_obj->mmo_shadowed = vma->vma_obj;
+    shadow_set_shadowed(shadow_obj, vma->vma_obj);
 
     if (list_link_is_linked(&vma->vma_olink)){
         list_remove(&vma->vma_olink);
@@ -274,7 +276,7 @@ static kthread_t *setup_thread(proc_t *p, struct regs *regs){
     newthr->kt_ctx.c_eip = (uint32_t) userland_entry;
     newthr->kt_ctx.c_esp = stack_setup_res;
     newthr->kt_ctx.c_kstack = (uintptr_t) newthr->kt_kstack;
-    newthr->kt_ctx.c_kstacksz = DEFAULT_STACK_SIZE;
+    newthr->kt_ctx.c_kstacksz = KSTACK_SIZE;
 
     return newthr;
 }
@@ -310,6 +312,26 @@ static void cleanup_proc(proc_t *p){
     vmmap_destroy(p->p_vmmap);
 }
 
+#ifdef __SHADOWD__
+/* Every fork makes the shadow chains of private areas one longer. Any
+ * that has grown too long is cut back now, instead of waiting for shadowd,
+ * which cannot shorten chains whose objects are shared. If that fails the
+ * chain just stays long, which is slow but correct. */
+static void limit_shadow_depth(vmmap_t *map){
+    vmarea_t *vma;
+
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink){
+        if ((vma->vma_flags & MAP_TYPE) != MAP_PRIVATE){
+            continue;
+        }
+        if (shadowd_limit_depth(vma) < 0){
+            dbg(DBG_VM, "could not shorten a shadow chain of depth %d\n",
+                shadow_chain_depth(vma->vma_obj));
+        }
+    } list_iterate_end();
+}
+#endif
+
 /*
  * The implementation of fork(2). Once this works,
  * you're practically home free. This is what the
@@ -344,6 +366,13 @@ do_fork(struct regs *regs)
         return -1;
     }
 
+#ifdef __SHADOWD__
+    /* before the parent's mappings are dropped, so that none is left
+     * pointing at pages that this copies; the child has not run yet */
+    limit_shadow_depth(curproc->p_vmmap);
+    limit_shadow_depth(childproc->p_vmmap);
+#endif
+
     copy_filetable(childproc);
     unmap_pagetable();
     set_brk_vals(childproc);
@@ -354,5 +383,13 @@ do_fork(struct regs *regs)
      * new thread with a value of 0 */
     regs->r_eax = childproc->p_pid;
 
+#ifdef __PAGEMERGE__
+    /* new processes bring new candidates for merging */
+    static uint32_t nforks = 0;
+    if (++nforks % PAGEMERGE_FORK_INTERVAL == 0){
+        pagemerged_wakeup();
+    }
+#endif
+
     return childproc->p_pid;
 }
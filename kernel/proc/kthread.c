@@ -7,6 +7,7 @@
 #include "util/debug.h"
 #include "util/list.h"
 #include "util/string.h"
+#include "util/printf.h"
 
 #include "proc/kthread.h"
 #include "proc/proc.h"
@@ -14,10 +15,32 @@
 
 #include "mm/slab.h"
 #include "mm/page.h"
+#include "mm/pagetable.h"
 
 kthread_t *curthr; /* global */
 static slab_allocator_t *kthread_allocator = NULL;
 
+/*
+ * Kernel stacks are KSTACK_SIZE bytes with an unmapped guard page just
+ * below them, so that overflowing a stack faults instead of running into
+ * whatever was allocated next to it.
+ *
+ * Stacks freed by kthread_destroy() are kept (guard page and all) on a
+ * small free list, chained through their first word, and handed out again
+ * by alloc_stack(). Thread churn then doesn't split and merge a high-order
+ * block in the page allocator every time.
+ *
+ * To report how much stack threads actually need, new stacks are filled
+ * with KSTACK_PAINT; when a thread is destroyed the untouched paint tells
+ * how deep its stack went.
+ */
+#define KSTACK_NPAGES   (1 + (KSTACK_SIZE >> PAGE_SHIFT))
+#define KSTACK_PAINT    0xa5a5a5a5
+
+static char *kstack_cache = NULL;
+static int kstack_ncached = 0;
+static size_t kstack_highwater = 0;
+
 #ifdef __MTP__
 /* Stuff for the reaper daemon, which cleans up dead detached threads */
 static proc_t *reapd = NULL;
@@ -33,39 +56,114 @@ kthread_init()
 {
         kthread_allocator = slab_allocator_create("kthread", sizeof(kthread_t));
         KASSERT(NULL != kthread_allocator);
+
+        KASSERT(PAGE_ALIGNED(KSTACK_SIZE));
+        if (KSTACK_NPAGES & (KSTACK_NPAGES - 1)) {
+                dbg(DBG_THR, "kernel stacks take %d pages, not a power of two; "
+                    "each one wastes some memory\n", KSTACK_NPAGES);
+        }
 }
 
 /**
- * Allocates a new kernel stack.
+ * Allocates a new kernel stack, from the stack cache if possible.
  *
- * @return a newly allocated stack, or NULL if there is not enough
- * memory available
+ * @return a stack of KSTACK_SIZE bytes with a guard page below it, or
+ * NULL if there is not enough memory available
  */
 static char *
 alloc_stack(void)
 {
-        /* extra page for "magic" data */
         char *kstack;
-        int npages = 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT);
-        kstack = (char *)page_alloc_n(npages);
+
+        if (NULL != (kstack = kstack_cache)) {
+                kstack_cache = *(char **)kstack;
+                *(uint32_t *)kstack = KSTACK_PAINT;
+                kstack_ncached--;
+                return kstack;
+        }
+
+        char *block = (char *)page_alloc_n(KSTACK_NPAGES);
+        if (NULL == block) {
+                return NULL;
+        }
+
+        if (pt_kernel_set_present((uintptr_t)block, 0) < 0) {
+                page_free_n(block, KSTACK_NPAGES);
+                return NULL;
+        }
+        kstack = block + PAGE_SIZE;
+        memset(kstack, KSTACK_PAINT & 0xff, KSTACK_SIZE);
 
         return kstack;
 }
 
 /**
- * Frees a stack allocated with alloc_stack.
+ * Returns how many bytes of the given stack have been used, judging by
+ * how much of the paint is left.
+ */
+static size_t
+stack_used(char *stack)
+{
+        uint32_t *word = (uint32_t *)stack;
+        uint32_t *top = (uint32_t *)(stack + KSTACK_SIZE);
+
+        while (word < top && KSTACK_PAINT == *word) {
+                word++;
+        }
+
+        return (char *)top - (char *)word;
+}
+
+/**
+ * Frees a stack allocated with alloc_stack, keeping it in the stack
+ * cache if there is room. Also records the stack's high-water mark.
+ * Only a cached stack is repainted, and only down to where it was used.
  *
  * @param stack the stack to free
  */
 static void
 free_stack(char *stack)
 {
-        page_free_n(stack, 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT));
+        size_t used = stack_used(stack);
+
+        if (used > kstack_highwater) {
+                kstack_highwater = used;
+                dbginfo(DBG_THR, kthread_stack_info, NULL);
+        }
+
+        if (kstack_ncached < KSTACK_CACHE_SIZE) {
+                memset(stack + KSTACK_SIZE - used, KSTACK_PAINT & 0xff, used);
+                *(char **)stack = kstack_cache;
+                kstack_cache = stack;
+                kstack_ncached++;
+                return;
+        }
+
+        char *block = stack - PAGE_SIZE;
+        pt_kernel_set_present((uintptr_t)block, 1);
+        page_free_n(block, KSTACK_NPAGES);
+}
+
+size_t
+kthread_stack_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "kernel stack size:  %u bytes (+ %u byte guard)\n",
+                KSTACK_SIZE, PAGE_SIZE);
+        iprintf(&buf, &size, "high-water mark:    %u bytes\n", kstack_highwater);
+        iprintf(&buf, &size, "cached free stacks: %d of %d\n",
+                kstack_ncached, KSTACK_CACHE_SIZE);
+
+        return size;
 }
 
 /*
  * Allocate a new stack with the alloc_stack function. The size of the
- * stack is DEFAULT_STACK_SIZE.
+ * stack is KSTACK_SIZE.
  *
  * Don't forget to initialize the thread context with the
  * context_setup function. The context should have the same pagetable
@@ -101,7 +199,7 @@ kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
     list_insert_head(&p->p_threads, &k->kt_plink);
 
     context_setup(&k->kt_ctx, func, arg1, arg2, k->kt_kstack, 
-            DEFAULT_STACK_SIZE, p->p_pagedir);    
+            KSTACK_SIZE, p->p_pagedir);    
 
     return k;
 }
@@ -93,6 +93,9 @@ proc_create(char *name)
         return NULL;
     }
     
+    /* no page directory yet: others may look at it while we block below */
+    p->p_pagedir = NULL;
+
     /* put this proc in the proc list */
     list_link_init(&p->p_list_link)
 
@@ -114,6 +117,7 @@ proc_create(char *name)
     p->p_pagedir = pt_create_pagedir(); 
 
     if (p->p_pagedir == NULL){
+        list_remove(&p->p_list_link);
         slab_obj_free(proc_allocator, p);
         return NULL;
     }
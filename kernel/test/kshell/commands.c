@@ -9,11 +9,32 @@
 #include "fs/file.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
+#include "fs/dcache.h"
 #endif
+#ifdef __S5FS__
+#include "fs/s5fs/s5fs.h"
+#endif
+
+#ifdef __VM__
+#include "drivers/dev.h"
+#include "vm/swap.h"
+#endif
+#ifdef __SHADOWD__
+#include "vm/shadowd.h"
+#endif
+#ifdef __PAGEMERGE__
+#include "vm/pagemerged.h"
+#endif
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+
+#include "mm/kmalloc.h"
 
 #include "test/kshell/io.h"
 
 #include "util/debug.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 int kshell_help(kshell_t *ksh, int argc, char **argv)
@@ -320,5 +341,151 @@ int kshell_stat(kshell_t *ksh, int argc, char **argv)
 
         return exit_val;
 }
+
+int kshell_dcacheinfo(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        char buf[256];
+
+        dcache_info(NULL, buf, sizeof(buf));
+        kprintf(ksh, "%s", buf);
+
+        return 0;
+}
+#endif
+
+#ifdef __S5FS__
+int kshell_s5fsinfo(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        char buf[256];
+        fs_t *fs = vfs_root_vn->vn_fs;
+
+        if (0 != strcmp(fs->fs_type, "s5fs")) {
+                kprintf(ksh, "The root file system is not s5fs\n");
+                return 1;
+        }
+
+        s5fs_info(fs, buf, sizeof(buf));
+        kprintf(ksh, "%s", buf);
+
+        return 0;
+}
+#endif
+
+
+#ifdef __VM__
+int kshell_swapon(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        int disk;
+        int ret;
+
+        if (argc != 2 || sscanf(argv[1], "%d", &disk) != 1) {
+                kprintf(ksh, "Usage: swapon DISKNUM\n");
+                return 1;
+        }
+
+        if ((ret = swap_on(MKDEVID(DISK_MAJOR, disk))) < 0) {
+                kprintf(ksh, "Cannot swap on disk%d: %s\n",
+                        disk, strerror(-ret));
+                return 1;
+        }
+
+        return 0;
+}
+
+int kshell_swapoff(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        int ret;
+
+        if ((ret = swap_off()) < 0) {
+                kprintf(ksh, "Cannot turn swap off: %s\n", strerror(-ret));
+                return 1;
+        }
+
+        return 0;
+}
+
+int kshell_swapinfo(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        char buf[256];
+
+        swap_info(NULL, buf, sizeof(buf));
+        kprintf(ksh, "%s", buf);
+
+        return 0;
+}
+#endif
+
+#ifdef __SHADOWD__
+int kshell_shadowinfo(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        char buf[512];
+
+        shadowd_info(NULL, buf, sizeof(buf));
+        kprintf(ksh, "%s", buf);
+
+        return 0;
+}
 #endif
 
+#ifdef __PAGEMERGE__
+int kshell_mergeinfo(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        char buf[256];
+
+        pagemerge_info(NULL, buf, sizeof(buf));
+        kprintf(ksh, "%s", buf);
+
+        return 0;
+}
+#endif
+
+int kshell_iostat(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        blockdev_t *bd = NULL;
+        char *buf;
+        int disk;
+
+        if (argc > 2 || (2 == argc && sscanf(argv[1], "%d", &disk) != 1)) {
+                kprintf(ksh, "Usage: iostat [DISKNUM]\n");
+                return 1;
+        }
+        if (2 == argc
+            && NULL == (bd = blockdev_lookup(MKDEVID(DISK_MAJOR, disk)))) {
+                kprintf(ksh, "No such disk: disk%d\n", disk);
+                return 1;
+        }
+
+        if (NULL == (buf = (char *)kmalloc(BLOCKDEV_INFO_SIZE))) {
+                kprintf(ksh, "Out of memory\n");
+                return 1;
+        }
+        blockdev_info(bd, buf, BLOCKDEV_INFO_SIZE);
+        kshell_write_all(ksh, buf, strlen(buf));
+        kfree(buf);
+
+        return 0;
+}
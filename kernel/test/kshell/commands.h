@@ -17,4 +17,20 @@ KSHELL_CMD(link);
 KSHELL_CMD(rmdir);
 KSHELL_CMD(mkdir);
 KSHELL_CMD(stat);
+KSHELL_CMD(dcacheinfo);
 #endif
+#ifdef __S5FS__
+KSHELL_CMD(s5fsinfo);
+#endif
+#ifdef __VM__
+KSHELL_CMD(swapon);
+KSHELL_CMD(swapoff);
+KSHELL_CMD(swapinfo);
+#endif
+#ifdef __SHADOWD__
+KSHELL_CMD(shadowinfo);
+#endif
+#ifdef __PAGEMERGE__
+KSHELL_CMD(mergeinfo);
+#endif
+KSHELL_CMD(iostat);
@@ -46,7 +46,32 @@ static __attribute__((unused)) void kshell_init()
                            "remove empty directories");
         kshell_add_command("mkdir", kshell_mkdir, "make directories");
         kshell_add_command("stat", kshell_stat, "display file status");
+        kshell_add_command("dcacheinfo", kshell_dcacheinfo,
+                           "display name cache statistics");
 #endif
+#ifdef __S5FS__
+        kshell_add_command("s5fsinfo", kshell_s5fsinfo,
+                           "display s5fs lock statistics");
+#endif
+#ifdef __VM__
+        kshell_add_command("swapon", kshell_swapon,
+                           "start swapping to a disk");
+        kshell_add_command("swapoff", kshell_swapoff,
+                           "stop swapping, reading all pages back in");
+        kshell_add_command("swapinfo", kshell_swapinfo,
+                           "display swap usage");
+#endif
+#ifdef __SHADOWD__
+        kshell_add_command("shadowinfo", kshell_shadowinfo,
+                           "display shadow chain statistics");
+#endif
+#ifdef __PAGEMERGE__
+        kshell_add_command("mergeinfo", kshell_mergeinfo,
+                           "display same-page merging statistics");
+#endif
+
+        kshell_add_command("iostat", kshell_iostat,
+                           "display block device I/O statistics");
 
         kshell_add_command("exit", kshell_exit, "exits the shell");
 }
@@ -8,9 +8,13 @@
 
 #include "fs/s5fs/s5fs.h"
 #include "fs/s5fs/s5fs_subr.h"
+#include "fs/s5fs/s5fs_journal.h"
 
 #include "fs/open.h"
 
+#include "mm/page.h"
+#include "util/string.h"
+
 #include "errno.h"
 
 #define READSIZE (S5_NDIRECT_BLOCKS + 1) * S5_BLOCK_SIZE
@@ -101,6 +105,336 @@ static void run_indirect_test(){
     dbg(DBG_TEST, "indirect block tests passed\n"); 
 }
 
+static void test_contiguous_alloc(){
+    dbg(DBG_TEST, "testing contiguous block allocation\n");
+
+    s5_super_t *super = VNODE_TO_S5FS(vfs_root_vn)->s5f_super;
+    uint32_t nfree = super->s5s_nfree_blocks;
+
+    int fd = do_open("/contigfile", O_RDWR|O_CREAT);
+    KASSERT(fd >= 0 && fd < NFILES);
+
+    char writebuf[S5_BLOCK_SIZE];
+
+    int i;
+    for (i = 0; i < S5_BLOCK_SIZE; i++){
+        writebuf[i] = 'c';
+    }
+
+    for (i = 0; i < S5_ALLOC_RUN; i++){
+        KASSERT(do_write(fd, writebuf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    }
+
+    /* blocks are only allocated when the pages are written back */
+    KASSERT(super->s5s_nfree_blocks == nfree);
+    KASSERT(do_fsync(fd) == 0);
+    KASSERT(do_close(fd) == 0);
+
+    /* blocks written one after the other are next to each other on disk */
+    vnode_t *v;
+    KASSERT(open_namev("/contigfile", O_RDONLY, &v, NULL) == 0);
+    s5_inode_t *inode = VNODE_TO_S5INODE(v);
+    for (i = 1; i < S5_ALLOC_RUN; i++){
+        KASSERT(inode->s5_direct_blocks[i] == inode->s5_direct_blocks[0] + i);
+    }
+    vput(v);
+
+    KASSERT(super->s5s_nfree_blocks == nfree - S5_ALLOC_RUN);
+    KASSERT(do_unlink("/contigfile") == 0);
+    KASSERT(super->s5s_nfree_blocks == nfree);
+
+    dbg(DBG_TEST, "contiguous allocation tests passed\n");
+}
+
+/*
+ * Dirty pages only reserve blocks, so a file that is removed before it is
+ * written back never gets any.
+ */
+static void test_delayed_alloc(){
+    dbg(DBG_TEST, "testing delayed block allocation\n");
+
+    s5fs_t *s5 = VNODE_TO_S5FS(vfs_root_vn);
+
+    int fd = do_open("/delayfile", O_RDWR|O_CREAT);
+    KASSERT(fd >= 0 && fd < NFILES);
+
+    uint32_t nfree = s5->s5f_super->s5s_nfree_blocks;
+    uint32_t nreserved = s5->s5f_nreserved;
+
+    char writebuf[S5_BLOCK_SIZE];
+
+    int i;
+    for (i = 0; i < S5_BLOCK_SIZE; i++){
+        writebuf[i] = 'd';
+    }
+
+    /* written out of order, but laid out in order */
+    for (i = S5_ALLOC_RUN - 1; i >= 0; i--){
+        KASSERT(do_lseek(fd, i * S5_BLOCK_SIZE, SEEK_SET) == i * S5_BLOCK_SIZE);
+        KASSERT(do_write(fd, writebuf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    }
+
+    vnode_t *v;
+    KASSERT(open_namev("/delayfile", O_RDONLY, &v, NULL) == 0);
+    KASSERT(v->vn_nreserved == S5_ALLOC_RUN);
+    KASSERT(s5->s5f_nreserved == nreserved + S5_ALLOC_RUN);
+    KASSERT(s5->s5f_super->s5s_nfree_blocks == nfree);
+    for (i = 0; i < S5_ALLOC_RUN; i++){
+        KASSERT(s5_seek_to_block(v, i * S5_BLOCK_SIZE, 0) == 0);
+    }
+
+    KASSERT(do_fsync(fd) == 0);
+    KASSERT(v->vn_nreserved == 0);
+    KASSERT(s5->s5f_nreserved == nreserved);
+    KASSERT(s5->s5f_super->s5s_nfree_blocks == nfree - S5_ALLOC_RUN);
+    int first = s5_seek_to_block(v, 0, 0);
+    for (i = 1; i < S5_ALLOC_RUN; i++){
+        KASSERT(s5_seek_to_block(v, i * S5_BLOCK_SIZE, 0) == first + i);
+    }
+    vput(v);
+
+    KASSERT(do_close(fd) == 0);
+    KASSERT(do_unlink("/delayfile") == 0);
+    KASSERT(s5->s5f_super->s5s_nfree_blocks == nfree);
+
+    /* removed before being written back: no blocks at all */
+    fd = do_open("/delayfile", O_RDWR|O_CREAT);
+    KASSERT(fd >= 0 && fd < NFILES);
+    nfree = s5->s5f_super->s5s_nfree_blocks;
+    nreserved = s5->s5f_nreserved;
+    for (i = 0; i < S5_ALLOC_RUN; i++){
+        KASSERT(do_write(fd, writebuf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    }
+    KASSERT(s5->s5f_nreserved == nreserved + S5_ALLOC_RUN);
+    KASSERT(do_close(fd) == 0);
+    KASSERT(do_unlink("/delayfile") == 0);
+    KASSERT(s5->s5f_nreserved == nreserved);
+    KASSERT(s5->s5f_super->s5s_nfree_blocks == nfree);
+
+    dbg(DBG_TEST, "delayed allocation tests passed\n");
+}
+
+/*
+ * fallocate gives a file one run of unwritten blocks that read as zeros,
+ * and writing to them later takes nothing from the allocator.
+ */
+static void test_fallocate(){
+    dbg(DBG_TEST, "testing fallocate\n");
+
+    s5fs_t *s5 = VNODE_TO_S5FS(vfs_root_vn);
+
+    int fd = do_open("/fallocfile", O_RDWR|O_CREAT);
+    KASSERT(fd >= 0 && fd < NFILES);
+
+    uint32_t nfree = s5->s5f_super->s5s_nfree_blocks;
+    int nblocks = S5_NDIRECT_BLOCKS + 4;
+
+    KASSERT(do_fallocate(fd, 0, 0) == -EINVAL);
+    KASSERT(do_fallocate(fd, -1, S5_BLOCK_SIZE) == -EINVAL);
+    KASSERT(do_fallocate(fd, 0, nblocks * S5_BLOCK_SIZE - 1) == 0);
+
+    vnode_t *v;
+    KASSERT(open_namev("/fallocfile", O_RDONLY, &v, NULL) == 0);
+    KASSERT(v->vn_len == nblocks * S5_BLOCK_SIZE - 1);
+
+    /* the data blocks and one indirect block */
+    KASSERT(s5->s5f_super->s5s_nfree_blocks == nfree - nblocks - 1);
+    int first = s5_seek_to_block(v, 0, 0);
+    KASSERT(first > 0);
+
+    int i;
+    for (i = 0; i < nblocks; i++){
+        KASSERT(s5_seek_to_block(v, i * S5_BLOCK_SIZE, S5_SEEK_DATA) == 0);
+        if (i > 0 && i != S5_NDIRECT_BLOCKS){
+            KASSERT(s5_seek_to_block(v, i * S5_BLOCK_SIZE, 0)
+                    == s5_seek_to_block(v, (i - 1) * S5_BLOCK_SIZE, 0) + 1);
+        }
+    }
+
+    char buf[S5_BLOCK_SIZE];
+    KASSERT(do_read(fd, buf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    for (i = 0; i < S5_BLOCK_SIZE; i++){
+        KASSERT(buf[i] == 0);
+        buf[i] = 'f';
+    }
+
+    /* writing takes no blocks and reserves none */
+    nfree = s5->s5f_super->s5s_nfree_blocks;
+    uint32_t nreserved = s5->s5f_nreserved;
+    KASSERT(do_lseek(fd, S5_BLOCK_SIZE, SEEK_SET) == S5_BLOCK_SIZE);
+    KASSERT(do_write(fd, buf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    KASSERT(s5->s5f_nreserved == nreserved);
+    KASSERT(do_fsync(fd) == 0);
+    KASSERT(s5->s5f_super->s5s_nfree_blocks == nfree);
+    KASSERT(s5_seek_to_block(v, S5_BLOCK_SIZE, S5_SEEK_DATA) == first + 1);
+    KASSERT(s5_seek_to_block(v, 2 * S5_BLOCK_SIZE, S5_SEEK_DATA) == 0);
+    vput(v);
+
+    KASSERT(do_close(fd) == 0);
+
+    fd = do_open("/fallocfile", O_RDONLY);
+    KASSERT(fd >= 0 && fd < NFILES);
+    KASSERT(do_fallocate(fd, 0, S5_BLOCK_SIZE) == -EBADF);
+    KASSERT(do_lseek(fd, S5_BLOCK_SIZE, SEEK_SET) == S5_BLOCK_SIZE);
+    KASSERT(do_read(fd, buf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    for (i = 0; i < S5_BLOCK_SIZE; i++){
+        KASSERT(buf[i] == 'f');
+    }
+    KASSERT(do_close(fd) == 0);
+
+    KASSERT(do_unlink("/fallocfile") == 0);
+
+    dbg(DBG_TEST, "fallocate tests passed\n");
+}
+
+/*
+ * O_DIRECT reads and writes whole blocks straight to and from the disk,
+ * allocating blocks as they are written rather than reserving them, and
+ * stays coherent with pages of the file that are in memory.
+ */
+static void test_direct_io(){
+    dbg(DBG_TEST, "testing O_DIRECT\n");
+
+    s5fs_t *s5 = VNODE_TO_S5FS(vfs_root_vn);
+    int nblocks = 3;
+
+    KASSERT(do_open("/", O_RDONLY|O_DIRECT) == -EINVAL);
+
+    int fd = do_open("/directfile", O_RDWR|O_CREAT|O_DIRECT);
+    KASSERT(fd >= 0 && fd < NFILES);
+    int bfd = do_open("/directfile", O_RDWR);
+    KASSERT(bfd >= 0 && bfd < NFILES);
+
+    char *buf = page_alloc_n(nblocks);
+    KASSERT(buf != NULL);
+    memset(buf, 'd', nblocks * S5_BLOCK_SIZE);
+
+    KASSERT(do_write(fd, buf, S5_BLOCK_SIZE - 1) == -EINVAL);
+    KASSERT(do_write(fd, buf + 1, S5_BLOCK_SIZE) == -EINVAL);
+
+    uint32_t nfree = s5->s5f_super->s5s_nfree_blocks;
+    uint32_t nreserved = s5->s5f_nreserved;
+
+    KASSERT(do_write(fd, buf, nblocks * S5_BLOCK_SIZE) == nblocks * S5_BLOCK_SIZE);
+
+    vnode_t *v;
+    KASSERT(open_namev("/directfile", O_RDONLY, &v, NULL) == 0);
+    KASSERT(v->vn_len == nblocks * S5_BLOCK_SIZE);
+    KASSERT(v->vn_mmobj.mmo_nrespages == 0);
+    KASSERT(s5->s5f_nreserved == nreserved);
+    KASSERT(s5->s5f_super->s5s_nfree_blocks == nfree - nblocks);
+
+    /* what went to the disk is read back through the page cache */
+    char pagebuf[S5_BLOCK_SIZE];
+    int i;
+    KASSERT(do_lseek(bfd, S5_BLOCK_SIZE, SEEK_SET) == S5_BLOCK_SIZE);
+    KASSERT(do_read(bfd, pagebuf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    for (i = 0; i < S5_BLOCK_SIZE; i++){
+        KASSERT(pagebuf[i] == 'd');
+    }
+
+    /* a dirty page is read from memory */
+    memset(pagebuf, 'b', S5_BLOCK_SIZE);
+    KASSERT(do_lseek(bfd, 0, SEEK_SET) == 0);
+    KASSERT(do_write(bfd, pagebuf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    KASSERT(do_lseek(fd, 0, SEEK_SET) == 0);
+    KASSERT(do_read(fd, buf, nblocks * S5_BLOCK_SIZE) == nblocks * S5_BLOCK_SIZE);
+    for (i = 0; i < nblocks * S5_BLOCK_SIZE; i++){
+        KASSERT(buf[i] == (i < S5_BLOCK_SIZE ? 'b' : 'd'));
+    }
+
+    /* and a resident page gets what is written past it */
+    memset(buf, 'e', S5_BLOCK_SIZE);
+    KASSERT(do_lseek(fd, 0, SEEK_SET) == 0);
+    KASSERT(do_write(fd, buf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    KASSERT(do_fsync(bfd) == 0);
+    KASSERT(do_lseek(bfd, 0, SEEK_SET) == 0);
+    KASSERT(do_read(bfd, pagebuf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    for (i = 0; i < S5_BLOCK_SIZE; i++){
+        KASSERT(pagebuf[i] == 'e');
+    }
+
+    /* reads stop at the end of the file */
+    KASSERT(do_lseek(bfd, 0, SEEK_END) == nblocks * S5_BLOCK_SIZE);
+    KASSERT(do_write(bfd, "tail", 4) == 4);
+    KASSERT(do_lseek(fd, nblocks * S5_BLOCK_SIZE, SEEK_SET) == nblocks * S5_BLOCK_SIZE);
+    KASSERT(do_read(fd, buf, nblocks * S5_BLOCK_SIZE) == 4);
+    KASSERT(!memcmp(buf, "tail", 4));
+    KASSERT(do_read(fd, buf, S5_BLOCK_SIZE) == -EINVAL);
+    KASSERT(do_lseek(fd, (nblocks + 1) * S5_BLOCK_SIZE, SEEK_SET)
+            == (nblocks + 1) * S5_BLOCK_SIZE);
+    KASSERT(do_read(fd, buf, S5_BLOCK_SIZE) == 0);
+    vput(v);
+
+    page_free_n(buf, nblocks);
+    KASSERT(do_close(bfd) == 0);
+    KASSERT(do_close(fd) == 0);
+    KASSERT(do_unlink("/directfile") == 0);
+    KASSERT(s5->s5f_nreserved == nreserved);
+    KASSERT(s5->s5f_super->s5s_nfree_blocks == nfree);
+
+    dbg(DBG_TEST, "O_DIRECT tests passed\n");
+}
+
+/*
+ * Metadata changes from several system calls go to the journal as one
+ * transaction, which is written when asked for, and the journal is only
+ * emptied when it is checkpointed.
+ */
+static void test_journal(){
+    dbg(DBG_TEST, "testing the journal\n");
+
+    s5fs_t *s5 = VNODE_TO_S5FS(vfs_root_vn);
+    s5_journal_t *j = s5->s5f_journal;
+
+    if (j == NULL){
+        dbg(DBG_TEST, "no journal, skipping journal tests\n");
+        return;
+    }
+
+    KASSERT(s5_journal_commit(s5) == 0);
+    KASSERT(j->j_nrunning == 0);
+
+    uint32_t ncommits = j->j_ncommits;
+    uint32_t head = j->j_head;
+
+    int i, fd;
+    for (i = 0; i < 4; i++){
+        KASSERT((fd = do_open(filenames[i], O_RDWR|O_CREAT)) >= 0);
+        KASSERT(do_close(fd) == 0);
+    }
+
+    /* the inode block, the superblock and the directory block at least */
+    KASSERT(j->j_nrunning >= 3);
+    KASSERT(j->j_updates == 0);
+    KASSERT(s5_journal_pending(s5, S5_SUPER_BLOCK));
+
+    uint32_t nlogged = j->j_nrunning;
+    fs_t *fs = vfs_root_vn->vn_fs;
+    KASSERT(fs->fs_op->sync(fs) == 0);
+    KASSERT(j->j_nrunning == 0);
+    KASSERT(j->j_ncommits == ncommits + 1);
+    /* unless the journal had to be checkpointed to make room */
+    KASSERT(j->j_head == head + nlogged + 2 || j->j_head == nlogged + 3);
+    KASSERT(!s5_journal_pending(s5, S5_SUPER_BLOCK));
+
+    /* nothing to commit */
+    KASSERT(s5_journal_commit(s5) == 0);
+    KASSERT(j->j_ncommits == ncommits + 1);
+
+    uint32_t ncheckpoints = j->j_ncheckpoints;
+    KASSERT(s5_journal_flush(s5) == 0);
+    KASSERT(j->j_head == 1);
+    KASSERT(j->j_ncheckpoint == 0);
+    KASSERT(j->j_ncheckpoints == ncheckpoints + 1);
+
+    for (i = 0; i < 4; i++){
+        KASSERT(do_unlink(filenames[i]) == 0);
+    }
+
+    dbg(DBG_TEST, "journal tests passed\n");
+}
+
 static void test_max_inodes(){
     dbg(DBG_TEST, "testing hitting max inodes\n");
 
@@ -128,6 +462,55 @@ static void test_max_inodes(){
     dbg(DBG_TEST, "all max inodes tests passed\n");
 }
 
+/*
+ * Fills a directory with as many files as there are inodes, which gets it
+ * a hash index once it has S5_DIR_INDEX_MIN entries, and checks that
+ * lookups keep working while entries are removed out of order.
+ */
+static void test_dir_index(){
+    dbg(DBG_TEST, "testing directory index\n");
+
+    KASSERT(do_mkdir("/indexdir") == 0);
+    KASSERT(do_chdir("/indexdir") == 0);
+
+    int i = 0;
+    int fd;
+    while(i < FREE_INODES && (fd = do_open(filenames[i], O_RDONLY|O_CREAT)) >= 0){
+        do_close(fd);
+        i++;
+    }
+    KASSERT(i > (int) S5_DIR_INDEX_MIN);
+
+    struct stat s;
+    int j;
+    for (j = 0; j < i; j++){
+        KASSERT(do_stat(filenames[j], &s) == 0);
+    }
+    KASSERT(do_stat("nosuchfile", &s) == -ENOENT);
+
+    /* removing entries moves the last one into their place */
+    for (j = 0; j < i; j += 2){
+        KASSERT(do_unlink(filenames[j]) == 0);
+    }
+    for (j = 0; j < i; j++){
+        KASSERT(do_stat(filenames[j], &s) == (j % 2 ? 0 : -ENOENT));
+    }
+    for (j = 0; j < i; j += 2){
+        fd = do_open(filenames[j], O_RDONLY|O_CREAT);
+        KASSERT(fd >= 0);
+        do_close(fd);
+    }
+    for (j = i - 1; j >= 0; j--){
+        KASSERT(do_unlink(filenames[j]) == 0);
+        KASSERT(do_stat(filenames[j], &s) == -ENOENT);
+    }
+
+    KASSERT(do_chdir("/") == 0);
+    KASSERT(do_rmdir("/indexdir") == 0);
+
+    dbg(DBG_TEST, "all directory index tests passed\n");
+}
+
 static void test_max_file_length(){
     dbg(DBG_TEST, "testing max file length\n");
 
@@ -141,17 +524,30 @@ static void test_max_file_length(){
 
     KASSERT(do_write(fd, (void *) writebuf, 1) == 1);
 
-    KASSERT(do_write(fd, (void *) writebuf, 1) == 0);
+    /* writes are cut short at the maximum file size... */
+    KASSERT(do_write(fd, (void *) writebuf, 3) == 1);
+
+    /* ...and fail past it */
+    KASSERT(do_write(fd, (void *) writebuf, 1) == -EFBIG);
 
     do_lseek(fd, S5_MAX_FILE_SIZE - 2, SEEK_SET);
 
-    KASSERT(do_read(fd, (void *) readbuf, 3) == 1);
+    KASSERT(do_read(fd, (void *) readbuf, 3) == 2);
     KASSERT(readbuf[0] == 'a');
-    KASSERT(readbuf[1] == 'b');
+    KASSERT(readbuf[1] == 'a');
     KASSERT(readbuf[2] == 'b');
 
+    /* the end of the file is reached through the double indirect block:
+     * a data block, the double indirect block and the single indirect
+     * block below it. The data block is only allocated when its page is
+     * written back. */
+    KASSERT(do_fsync(fd) == 0);
     KASSERT(do_close(fd) == 0);
 
+    struct stat s;
+    KASSERT(do_stat("/largefile", &s) == 0);
+    KASSERT(s.st_blocks == 3);
+
     KASSERT(do_unlink("/largefile") == 0);
 
     dbg(DBG_TEST, "all max file length tests passed\n");
@@ -172,11 +568,15 @@ static void test_max_data(){
         writebuf[i] = 'a';
     }
 
-    unsigned int j;
-    for (j = 0; j < S5_MAX_FILE_BLOCKS - 1; j++){
-        KASSERT(do_write(fullfd, (void *) writebuf, S5_BLOCK_SIZE) == S5_BLOCK_SIZE);
+    /* files can now be larger than the disk */
+    int write_res;
+    while ((write_res = do_write(fullfd, (void *) writebuf, S5_BLOCK_SIZE))
+            == S5_BLOCK_SIZE){
+        /* do nothing */
     }
 
+    KASSERT(write_res == -ENOSPC);
+
     KASSERT(do_close(fullfd) == 0);
 
     int bigfd = do_open("/bigfile", O_RDWR|O_CREAT);
@@ -208,7 +608,13 @@ static void test_max_data(){
 
 void run_s5fs_tests(){
     run_indirect_test();
+    test_contiguous_alloc();
+    test_delayed_alloc();
+    test_fallocate();
+    test_direct_io();
+    test_journal();
     test_max_inodes();
+    test_dir_index();
     test_max_file_length();
     test_max_data();
 
@@ -0,0 +1,199 @@
+#include "types.h"
+#include "kernel.h"
+
+#include "util/debug.h"
+#include "util/lz.h"
+#include "util/string.h"
+
+/*
+ * Compressed format: a series of sequences, each made of
+ *
+ *     token          literal run length in the high nibble, back-reference
+ *                    length minus LZ_MIN_MATCH in the low nibble; 15 in
+ *                    either means more length bytes follow
+ *     [length bytes] added to the literal run length, while they are 255
+ *     literals
+ *     offset         2 bytes, little endian, how far back the match starts
+ *     [length bytes] added to the match length, while they are 255
+ *
+ * The last sequence stops after its literals.
+ */
+
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_OFFSET   0xffff
+#define LZ_HASH_BITS    12
+
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+static uint32_t
+lz_read32(const uint8_t *p)
+{
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t
+lz_hash(uint32_t seq)
+{
+        return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes an extended length: 255s and then the remainder */
+static uint8_t *
+lz_put_length(uint8_t *op, size_t len)
+{
+        while (len >= 255) {
+                *op++ = 255;
+                len -= 255;
+        }
+        *op++ = (uint8_t)len;
+        return op;
+}
+
+/*
+ * Appends one sequence to *opp: nlit literals from lit, then, unless mlen is
+ * 0, a back-reference of mlen bytes at distance off. Returns 0 if it does
+ * not fit before oend.
+ */
+static int
+lz_emit(uint8_t **opp, uint8_t *oend, const uint8_t *lit, size_t nlit,
+        size_t off, size_t mlen)
+{
+        uint8_t *op = *opp, *token;
+        size_t need = 1 + nlit + nlit / 255 + 1;
+
+        if (0 != mlen) {
+                need += 2 + mlen / 255 + 1;
+        }
+        if (need > (size_t)(oend - op)) {
+                return 0;
+        }
+
+        token = op++;
+        *token = (uint8_t)(MIN(nlit, 15) << 4);
+        if (nlit >= 15) {
+                op = lz_put_length(op, nlit - 15);
+        }
+        memcpy(op, lit, nlit);
+        op += nlit;
+
+        if (0 != mlen) {
+                size_t m = mlen - LZ_MIN_MATCH;
+                *op++ = (uint8_t)(off & 0xff);
+                *op++ = (uint8_t)(off >> 8);
+                *token |= (uint8_t)MIN(m, 15);
+                if (m >= 15) {
+                        op = lz_put_length(op, m - 15);
+                }
+        }
+
+        *opp = op;
+        return 1;
+}
+
+size_t
+lz_compress(const void *src, size_t srclen, void *dst, size_t dstcap)
+{
+        const uint8_t *in = src, *ip = in, *anchor = in, *end = in + srclen;
+        uint8_t *op = dst, *oend = op + dstcap;
+
+        KASSERT(srclen <= LZ_MAX_OFFSET);
+        memset(lz_table, 0, sizeof(lz_table));
+
+        while (ip + LZ_MIN_MATCH <= end) {
+                uint32_t seq = lz_read32(ip);
+                uint32_t h = lz_hash(seq);
+                const uint8_t *ref = in + lz_table[h];
+
+                lz_table[h] = (uint16_t)(ip - in);
+                if (ref >= ip || lz_read32(ref) != seq) {
+                        ip++;
+                        continue;
+                }
+
+                const uint8_t *mp = ip + LZ_MIN_MATCH;
+                const uint8_t *rp = ref + LZ_MIN_MATCH;
+                while (mp < end && *mp == *rp) {
+                        mp++;
+                        rp++;
+                }
+
+                if (!lz_emit(&op, oend, anchor, ip - anchor, ip - ref, mp - ip)) {
+                        return 0;
+                }
+                ip = anchor = mp;
+        }
+
+        if (!lz_emit(&op, oend, anchor, end - anchor, 0, 0)) {
+                return 0;
+        }
+        return op - (uint8_t *)dst;
+}
+
+/* Reads an extended length into *len; returns 0 if src runs out */
+static int
+lz_get_length(const uint8_t **ipp, const uint8_t *iend, size_t *len)
+{
+        const uint8_t *ip = *ipp;
+        uint8_t b;
+
+        do {
+                if (ip >= iend) {
+                        return 0;
+                }
+                b = *ip++;
+                *len += b;
+        } while (255 == b);
+
+        *ipp = ip;
+        return 1;
+}
+
+int
+lz_decompress(const void *src, size_t srclen, void *dst, size_t dstcap)
+{
+        const uint8_t *ip = src, *iend = ip + srclen;
+        uint8_t *op = dst, *oend = op + dstcap;
+
+        while (ip < iend) {
+                uint8_t token = *ip++;
+                size_t n = token >> 4;
+
+                if (15 == n && !lz_get_length(&ip, iend, &n)) {
+                        return -1;
+                }
+                if (n > (size_t)(iend - ip) || n > (size_t)(oend - op)) {
+                        return -1;
+                }
+                memcpy(op, ip, n);
+                op += n;
+                ip += n;
+
+                if (ip >= iend) {
+                        break;
+                }
+
+                if (iend - ip < 2) {
+                        return -1;
+                }
+                size_t off = ip[0] | (ip[1] << 8);
+                ip += 2;
+
+                n = token & 15;
+                if (15 == n && !lz_get_length(&ip, iend, &n)) {
+                        return -1;
+                }
+                n += LZ_MIN_MATCH;
+                if (0 == off || off > (size_t)(op - (uint8_t *)dst)
+                    || n > (size_t)(oend - op)) {
+                        return -1;
+                }
+
+                /* byte by byte, the match may overlap what it produces */
+                const uint8_t *mp = op - off;
+                while (n-- > 0) {
+                        *op++ = *mp++;
+                }
+        }
+
+        return op - (uint8_t *)dst;
+}
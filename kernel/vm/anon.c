@@ -11,6 +11,8 @@
 #include "mm/slab.h"
 #include "mm/tlb.h"
 
+#include "vm/swap.h"
+
 int anon_count = 0; /* for debugging/verification purposes */
 
 static slab_allocator_t *anon_allocator;
@@ -61,6 +63,17 @@ anon_create()
     return newanon;
 }
 
+/*
+ * Returns 1 if 'o' is an anonymous object, 0 otherwise. Pages of an
+ * anonymous object are zero-filled on demand, so callers use this to avoid
+ * doing I/O-motivated work (read-ahead, prefetching) on them.
+ */
+int
+anon_is_anon(mmobj_t *o)
+{
+    return o->mmo_ops == &anon_mmobj_ops;
+}
+
 /* Implementation of mmobj entry points: */
 
 /*
@@ -80,6 +93,8 @@ anon_ref(mmobj_t *o)
  * longer in use and, since it is an anonymous object, it will
  * never be used again. You should unpin and uncache all of the
  * object's pages and then free the object itself.
+ *
+ * Pages being swapped out are busy and unpinned; wait for them first.
  */
 static void
 anon_put(mmobj_t *o)
@@ -87,12 +102,18 @@ anon_put(mmobj_t *o)
     KASSERT(o->mmo_refcount > o->mmo_nrespages && "refcount == nrespages already!");
     KASSERT(o->mmo_nrespages >= 0);
 
+    while (o->mmo_refcount == o->mmo_nrespages + 1 && pframe_wait_busy(o))
+        ;
+
     if (o->mmo_refcount == o->mmo_nrespages + 1){
         pframe_t *p;
         list_iterate_begin(&o->mmo_respages, p, pframe_t, pf_olink){
-            pframe_unpin(p);
+            if (pframe_is_pinned(p)){
+                pframe_unpin(p);
+            }
             pframe_free(p);
         } list_iterate_end();
+        swap_drop_obj(o);
 
         slab_obj_free(anon_allocator, (void *) o);
     } else {
@@ -100,12 +121,20 @@ anon_put(mmobj_t *o)
     }
 }
 
-/* Get the corresponding page from the mmobj. No special handling is
- * required. */
+/* Get the corresponding page from the mmobj. The page is brought back
+ * from swap if it was swapped out, and pinned again if pageoutd had
+ * picked it for swap-out. */
 static int
 anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 {
-    return pframe_get(o, pagenum, pf);
+    int get_res = pframe_get(o, pagenum, pf);
+
+    if (get_res < 0){
+        return get_res;
+    }
+
+    swap_keep_resident(*pf);
+    return 0;
 }
 
 /* The following three functions should not be difficult. */
@@ -113,8 +142,16 @@ anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 static int
 anon_fillpage(mmobj_t *o, pframe_t *pf)
 {
+    int swap_res = swap_readpage(o, pf);
+
+    if (swap_res < 0){
+        return swap_res;
+    }
+
     pframe_pin(pf);
-    memset(pf->pf_addr, 0, PAGE_SIZE);
+    if (swap_res == 0){
+        memset(pf->pf_addr, 0, PAGE_SIZE);
+    }
     return 0;
 }
 
@@ -124,8 +161,9 @@ anon_dirtypage(mmobj_t *o, pframe_t *pf)
     return 0;
 }
 
+/* Only pages pageoutd has picked for swap-out are ever cleaned. */
 static int
 anon_cleanpage(mmobj_t *o, pframe_t *pf)
 {
-    return 0;
+    return swap_writepage(o, pf);
 }
@@ -89,6 +89,8 @@ do_brk(void *addr, void **ret)
 
         uint32_t npages = old_brk_end_page - brk_end_page;
 
+        /* this frees the heap pages past the new break and flushes just
+         * their TLB entries */
         vmmap_remove(curproc->p_vmmap, brk_end_page, npages);
 
        /* curproc->p_brk = addr;*/
@@ -6,6 +6,7 @@
 #include "mm/tlb.h"
 #include "mm/mman.h"
 #include "mm/page.h"
+#include "mm/pagetable.h"
 
 #include "proc/proc.h"
 
@@ -30,8 +31,10 @@ static int valid_fd(int fd){
 
 /*
  * This function implements the mmap(2) syscall, but only
- * supports the MAP_SHARED, MAP_PRIVATE, MAP_FIXED, and
- * MAP_ANON flags.
+ * supports the MAP_SHARED, MAP_PRIVATE, MAP_FIXED, MAP_ANON,
+ * MAP_POPULATE and MAP_LARGEPAGE flags. Large page mappings of at
+ * least 4mb are placed on a 4mb boundary if the caller does not choose
+ * the address, so that they can be backed with 4mb pages.
  *
  * Add a mapping to the current process's address space.
  * You need to do some error checking; see the ERRORS section
@@ -109,6 +112,18 @@ do_mmap(void *addr, size_t len, int prot, int flags,
         vnode = NULL;
     }
 
+    if ((flags & MAP_LARGEPAGE) && addr == NULL && len >= LARGE_PAGE_SIZE){
+        uint32_t npages = (uint32_t) PAGE_ALIGN_UP(len) / PAGE_SIZE;
+        int lopage = vmmap_find_range(curproc->p_vmmap,
+                npages + LARGE_PAGE_NPAGES - 1, VMMAP_DIR_HILO);
+
+        if (lopage >= 0){
+            /* the range has room for the mapping past its first 4mb boundary */
+            addr = PN_TO_ADDR((lopage + LARGE_PAGE_NPAGES - 1)
+                    & ~(LARGE_PAGE_NPAGES - 1));
+        }
+    }
+
     vmarea_t *vma;
 
     int retval = vmmap_map(curproc->p_vmmap, vnode, ADDR_TO_PN(addr),
@@ -127,7 +142,13 @@ do_mmap(void *addr, size_t len, int prot, int flags,
         tlb_flush_range((uintptr_t) PN_TO_ADDR(vma->vma_start),
                 (uint32_t) PAGE_ALIGN_UP(len) / PAGE_SIZE);
     }
-    
+
+    /* the mapping stays even if populating it fails; the pages we could
+     * not fill will simply be faulted on later */
+    if (retval >= 0 && (flags & MAP_POPULATE)){
+        vmmap_populate(curproc->p_vmmap, vma->vma_start,
+                vma->vma_end - vma->vma_start, 1);
+    }
 
 
     return retval;
@@ -165,3 +186,123 @@ do_munmap(void *addr, size_t len)
     return ret;
 }
 
+
+static int valid_advice(int advice){
+    return (advice == MADV_NORMAL || advice == MADV_RANDOM ||
+            advice == MADV_SEQUENTIAL || advice == MADV_WILLNEED ||
+            advice == MADV_DONTNEED);
+}
+
+/*
+ * This function implements the madvise(2) syscall, supporting the
+ * MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED and
+ * MADV_DONTNEED hints.
+ *
+ * Error checking mirrors do_munmap(); additionally every page in the
+ * range must be mapped (-ENOMEM otherwise). The work is done by
+ * vmmap_advise(), which also takes care of the page tables and the TLB
+ * for MADV_DONTNEED.
+ */
+int
+do_madvise(void *addr, size_t len, int advice)
+{
+    if ((uintptr_t) addr < USER_MEM_LOW || USER_MEM_HIGH - (uint32_t) addr < len){
+        return -EINVAL;
+    }
+
+    if (len == 0){
+        return -EINVAL;
+    }
+
+    if (!PAGE_ALIGNED(addr)){
+        return -EINVAL;
+    }
+
+    if (!valid_advice(advice)){
+        return -EINVAL;
+    }
+
+    return vmmap_advise(curproc->p_vmmap, ADDR_TO_PN(addr),
+            (uint32_t) PAGE_ALIGN_UP(len) / PAGE_SIZE, advice);
+}
+
+/*
+ * This function implements the mlock(2) syscall.
+ *
+ * Performs the same error checking as do_munmap(), then has
+ * vmmap_lock() fault in and pin every page of the range.
+ */
+int
+do_mlock(void *addr, size_t len)
+{
+    if ((uintptr_t) addr < USER_MEM_LOW || USER_MEM_HIGH - (uint32_t) addr < len){
+        return -EINVAL;
+    }
+
+    if (len == 0){
+        return -EINVAL;
+    }
+
+    if (!PAGE_ALIGNED(addr)){
+        return -EINVAL;
+    }
+
+    return vmmap_lock(curproc->p_vmmap, ADDR_TO_PN(addr),
+            (uint32_t) PAGE_ALIGN_UP(len) / PAGE_SIZE);
+}
+
+/*
+ * This function implements the munlock(2) syscall; the reverse
+ * of do_mlock(). Pages of the range which are not locked are
+ * ignored.
+ */
+int
+do_munlock(void *addr, size_t len)
+{
+    if ((uintptr_t) addr < USER_MEM_LOW || USER_MEM_HIGH - (uint32_t) addr < len){
+        return -EINVAL;
+    }
+
+    if (len == 0){
+        return -EINVAL;
+    }
+
+    if (!PAGE_ALIGNED(addr)){
+        return -EINVAL;
+    }
+
+    return vmmap_unlock(curproc->p_vmmap, ADDR_TO_PN(addr),
+            (uint32_t) PAGE_ALIGN_UP(len) / PAGE_SIZE);
+}
+
+/*
+ * This function implements the msync(2) syscall.
+ *
+ * Error checking mirrors do_munmap(); additionally flags may only
+ * contain MS_ASYNC, MS_SYNC and MS_INVALIDATE, not both of MS_ASYNC and
+ * MS_SYNC (-EINVAL), and every page in the range must be mapped
+ * (-ENOMEM). vmmap_sync() does the write back.
+ */
+int
+do_msync(void *addr, size_t len, int flags)
+{
+    if ((uintptr_t) addr < USER_MEM_LOW || USER_MEM_HIGH - (uint32_t) addr < len){
+        return -EINVAL;
+    }
+
+    if (len == 0){
+        return -EINVAL;
+    }
+
+    if (!PAGE_ALIGNED(addr)){
+        return -EINVAL;
+    }
+
+    if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE))
+        || ((flags & MS_ASYNC) && (flags & MS_SYNC))){
+        return -EINVAL;
+    }
+
+    return vmmap_sync(curproc->p_vmmap, ADDR_TO_PN(addr),
+            (uint32_t) PAGE_ALIGN_UP(len) / PAGE_SIZE, flags);
+}
@@ -4,6 +4,7 @@
 #include "errno.h"
 
 #include "util/debug.h"
+#include "util/string.h"
 
 #include "proc/proc.h"
 
@@ -16,6 +17,9 @@
 
 #include "vm/pagefault.h"
 #include "vm/vmmap.h"
+#include "vm/anon.h"
+#include "vm/shadow.h"
+#include "vm/swap.h"
 
 #include "mm/tlb.h"
 
@@ -40,6 +44,184 @@ static int has_valid_permissions(vmarea_t *vma, uint32_t cause){
     return 1;
 }
 
+/* number of pages past a faulting page which are brought into memory
+ * for file-backed areas, depending on the area's madvise(2) hint */
+#define READAHEAD_NORMAL     2
+#define READAHEAD_SEQUENTIAL 16
+
+static uint32_t readahead_pages(vmarea_t *vma){
+    switch (vma->vma_advice){
+        case MADV_RANDOM:
+            return 0;
+        case MADV_SEQUENTIAL:
+            return READAHEAD_SEQUENTIAL;
+        default:
+            return READAHEAD_NORMAL;
+    }
+}
+
+/*
+ * Read ahead of a fault at page number pagenum (of vma->vma_obj). The pages
+ * are only made resident, not mapped, so a later access still faults but
+ * does not have to wait for the disk. Anonymous areas are skipped since
+ * their pages are zero-filled on demand. Sequential areas also drop the
+ * page behind the fault to the front of the pageout queue, as a sequential
+ * reader is not coming back for it. This is best effort: errors are
+ * ignored.
+ */
+static void readahead(vmarea_t *vma, uint32_t pagenum){
+    mmobj_t *bottom_obj = mmobj_bottom_obj(vma->vma_obj);
+
+    if (anon_is_anon(bottom_obj)){
+        return;
+    }
+
+    if (vma->vma_advice == MADV_SEQUENTIAL && pagenum > vma->vma_off){
+        pframe_deactivate(bottom_obj, pagenum - 1);
+    }
+
+    uint32_t last = vma->vma_off + (vma->vma_end - vma->vma_start);
+    uint32_t n = readahead_pages(vma);
+
+    if (last - (pagenum + 1) < n){
+        n = last - (pagenum + 1);
+    }
+
+    uint32_t i;
+    for (i = 1; i <= n; i++){
+        pframe_t *p;
+        if (pframe_lookup(vma->vma_obj, pagenum + i, 0, &p) < 0){
+            return;
+        }
+    }
+}
+
+/*
+ * Returns the first of the LARGE_PAGE_NPAGES pages of o starting at page
+ * number first if they are all resident, dirty, and consecutive pages of
+ * one 4mb-aligned block, so that they can be mapped with a single 4mb page;
+ * NULL otherwise.
+ */
+static void *large_page_resident(mmobj_t *o, uint32_t first){
+    void *base = NULL;
+
+    uint32_t i;
+    for (i = 0; i < LARGE_PAGE_NPAGES; i++){
+        pframe_t *pf = pframe_get_resident(o, first + i);
+
+        if (pf == NULL || pframe_is_busy(pf) || !pframe_is_dirty(pf)
+                || pf->pf_merged != NULL){
+            return NULL;
+        }
+        if (i == 0){
+            base = pf->pf_addr;
+            if (!LARGE_PAGE_ALIGNED(pt_virt_to_phys((uintptr_t) base))){
+                return NULL;
+            }
+        } else if (pf->pf_addr != (char *) base + i * PAGE_SIZE){
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < LARGE_PAGE_NPAGES; i++){
+        swap_keep_resident(pframe_get_resident(o, first + i));
+    }
+
+    return base;
+}
+
+/*
+ * Gives o the LARGE_PAGE_NPAGES zero-filled pages starting at page number
+ * first, all from one 4mb block, provided that o has none of them yet.
+ * Returns the block, or NULL if that is not possible; the pages that o got
+ * before it turned out not to be possible stay as ordinary pages.
+ */
+static void *large_page_fill(mmobj_t *o, uint32_t first){
+    uint32_t i;
+    for (i = 0; i < LARGE_PAGE_NPAGES; i++){
+        if (pframe_get_resident(o, first + i) != NULL
+                || swap_has_page(o, first + i)){
+            return NULL;
+        }
+    }
+
+    char *block = page_alloc_n(LARGE_PAGE_NPAGES);
+
+    if (block == NULL){
+        return NULL;
+    }
+
+    if (!LARGE_PAGE_ALIGNED(pt_virt_to_phys((uintptr_t) block))){
+        page_free_n(block, LARGE_PAGE_NPAGES);
+        return NULL;
+    }
+
+    memset(block, 0, LARGE_PAGE_SIZE);
+
+    for (i = 0; i < LARGE_PAGE_NPAGES; i++){
+        pframe_t *pf;
+
+        if (pframe_adopt(o, first + i, block + i * PAGE_SIZE, &pf) < 0){
+            /* the pages of a 4mb block can be freed one by one */
+            for (; i < LARGE_PAGE_NPAGES; i++){
+                page_free(block + i * PAGE_SIZE);
+            }
+            return NULL;
+        }
+    }
+
+    return block;
+}
+
+/*
+ * Areas mapped with MAP_LARGEPAGE are backed with 4mb pages where possible:
+ * those parts of private anonymous areas that are 4mb aligned and lie
+ * entirely in the area, as long as the area has not been forked (its top
+ * shadow object directly shadows the anonymous object). The first fault
+ * on such a part gives the top object a zero-filled, 4mb-aligned block of
+ * pages and maps them all with a single page directory entry. Anything
+ * that later unmaps one of the pages (fork, swap-out, mprotect) removes
+ * the whole 4mb mapping and the pages fault back in one at a time, or as a
+ * 4mb page again if they are all still there.
+ *
+ * Returns 1 if the fault was handled this way, 0 if it was not.
+ */
+static int large_page_fault(vmarea_t *vma, uintptr_t vaddr){
+    mmobj_t *o = vma->vma_obj;
+
+    if (!(vma->vma_flags & MAP_LARGEPAGE) || !pt_large_pages()
+            || (vma->vma_flags & MAP_TYPE) != MAP_PRIVATE
+            || !shadow_is_shadow(o) || o->mmo_shadowed != o->mmo_un.mmo_bottom_obj
+            || !anon_is_anon(o->mmo_shadowed)){
+        return 0;
+    }
+
+    uint32_t lopage = ADDR_TO_PN(vaddr) & ~(LARGE_PAGE_NPAGES - 1);
+
+    if (lopage < vma->vma_start || lopage + LARGE_PAGE_NPAGES > vma->vma_end){
+        return 0;
+    }
+
+    uint32_t first = lopage - vma->vma_start + vma->vma_off;
+    void *block = large_page_resident(o, first);
+
+    if (block == NULL && (block = large_page_fill(o, first)) == NULL){
+        return 0;
+    }
+
+    int pdflags = PD_PRESENT | PD_USER;
+
+    if (vma->vma_prot & PROT_WRITE){
+        pdflags |= PD_WRITE;
+    }
+
+    pt_map_large(curproc->p_pagedir, (uintptr_t) PN_TO_ADDR(lopage),
+            pt_virt_to_phys((uintptr_t) block), pdflags);
+    tlb_flush_all();
+
+    return 1;
+}
+
 size_t
 pt_mapping_info(const void *pt, char *buf, size_t osize);
 /*
@@ -93,10 +275,14 @@ handle_pagefault(uintptr_t vaddr, uint32_t cause)
         panic("returned from do_exit");
     }
 
+    if (large_page_fault(vma, vaddr)){
+        return;
+    }
+
     pframe_t *p;
     int forwrite = (cause & FAULT_WRITE) ? 1 : 0;
-    int lookup_res = pframe_lookup(vma->vma_obj, ADDR_TO_PN(vaddr) -
-            vma->vma_start + vma->vma_off, forwrite, &p);   
+    uint32_t pagenum = ADDR_TO_PN(vaddr) - vma->vma_start + vma->vma_off;
+    int lookup_res = pframe_lookup(vma->vma_obj, pagenum, forwrite, &p);
 
     if (lookup_res < 0){
         do_exit(EFAULT);
@@ -129,4 +315,7 @@ handle_pagefault(uintptr_t vaddr, uint32_t cause)
 
     tlb_flush_all();
     /* TODO flush TLB (?) */
+
+    /* only once the faulting page is mapped, since this may block */
+    readahead(vma, pagenum);
 }
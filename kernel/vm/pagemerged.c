@@ -0,0 +1,474 @@
+#include "types.h"
+#include "globals.h"
+#include "kernel.h"
+#include "config.h"
+#include "errno.h"
+
+#include "mm/mm.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+#include "mm/tlb.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/kthread.h"
+
+#include "vm/vmmap.h"
+#include "vm/swap.h"
+#include "vm/pagemerged.h"
+
+#ifdef __PAGEMERGE__
+/*
+ * The same-page merging daemon. It walks the address spaces of all
+ * processes a few pages at a time, hashing the contents of the resident
+ * pages of their anonymous and shadow objects, and makes pages with
+ * identical contents share a single frame:
+ *
+ *   - merged frames live in the stable table. Every pframe whose pf_merged
+ *     points at one uses its page as pf_addr. The page must never change,
+ *     so a merged pframe is only ever mapped read-only; pframe_dirty()
+ *     calls pagemerge_unshare() to give it a private copy first, which is
+ *     the copy-on-write fault path for these pages.
+ *   - pages seen during the current round (a full walk of all address
+ *     spaces) that have not been merged yet are remembered in the unstable
+ *     table by object and page number, since their pframes may go away at
+ *     any time. Their contents are compared again before merging. The table
+ *     is emptied at the end of every round.
+ *
+ * Only pages pinned by nothing but their object are merged, so mlock()ed
+ * pages and pages pageoutd is swapping out are left alone. So are the pages
+ * of large page mappings, which merging would break up.
+ */
+
+typedef struct pmframe {
+        uint32_t        pm_hash;
+        void           *pm_addr;
+        int             pm_refcount;    /* number of pframes sharing it */
+        list_link_t     pm_link;        /* link on the stable table */
+} pmframe_t;
+
+typedef struct pmcand {
+        uint32_t        pc_hash;
+        mmobj_t        *pc_obj;
+        uint32_t        pc_pagenum;
+        list_link_t     pc_link;        /* link on the unstable table */
+} pmcand_t;
+
+static slab_allocator_t *pmframe_allocator;
+static slab_allocator_t *pmcand_allocator;
+
+static list_t stable_table[PAGEMERGE_HASH_SIZE];
+static list_t unstable_table[PAGEMERGE_HASH_SIZE];
+
+/*
+ * Nothing may block while the address spaces are walked, so the entries a
+ * run may need are allocated up front. A run ends early when they run out.
+ */
+static list_t spare_pmframes, spare_pmcands;
+static int nspare_pmframes, nspare_pmcands;
+
+/* Where the next run resumes: the first area at or past scan_vfn of the
+ * first process whose pid is at least scan_pid */
+static pid_t scan_pid;
+static uint32_t scan_vfn;
+
+/* Statistics */
+static uint32_t pagemerge_nshared;      /* merged frames */
+static uint32_t pagemerge_nsharing;     /* pframes using them */
+static uint32_t pagemerge_nunshared;    /* copies made by write faults */
+static uint32_t pagemerge_nscanned;     /* pages looked at */
+static uint32_t pagemerge_nrounds;      /* full walks done */
+
+static ktqueue_t pagemerged_waitq;
+static proc_t *pagemerged_proc;
+static kthread_t *pagemerged_thr;
+
+/* FNV-1a over the words of the page */
+static uint32_t
+page_hash(const void *addr)
+{
+        const uint32_t *p = addr, *end = p + PAGE_SIZE / sizeof(uint32_t);
+        uint32_t h = 2166136261U;
+
+        while (p < end) {
+                h = (h ^ *p++) * 16777619U;
+        }
+        return h;
+}
+
+/* Returns 1 if pf may be merged: see the comment at the top */
+static int
+pagemerge_eligible(pframe_t *pf)
+{
+        return NULL == pf->pf_merged && !(pf->pf_flags & PF_LARGE)
+               && 1 == pf->pf_pincount
+               && !pframe_is_busy(pf) && swap_is_swappable(pf->pf_obj);
+}
+
+/* Makes pf use the merged frame pm instead of its own page */
+static void
+pagemerge_attach(pframe_t *pf, pmframe_t *pm)
+{
+        tlb_flush((uintptr_t)pf->pf_addr);
+        pframe_remove_from_pts(pf);
+        page_free(pf->pf_addr);
+
+        pf->pf_addr = pm->pm_addr;
+        pf->pf_merged = pm;
+        pm->pm_refcount++;
+        pagemerge_nsharing++;
+}
+
+/*
+ * Turns the page of pf into a merged frame. Any writable mappings of it are
+ * removed, so the next write faults and unshares it.
+ */
+static pmframe_t *
+pagemerge_stabilize(pframe_t *pf, uint32_t hash)
+{
+        pmframe_t *pm;
+
+        KASSERT(!list_empty(&spare_pmframes));
+        pm = list_head(&spare_pmframes, pmframe_t, pm_link);
+        list_remove(&pm->pm_link);
+        nspare_pmframes--;
+
+        tlb_flush((uintptr_t)pf->pf_addr);
+        pframe_remove_from_pts(pf);
+
+        pm->pm_hash = hash;
+        pm->pm_addr = pf->pf_addr;
+        pm->pm_refcount = 1;
+        list_insert_head(&stable_table[hash % PAGEMERGE_HASH_SIZE], &pm->pm_link);
+        pf->pf_merged = pm;
+        pagemerge_nshared++;
+        pagemerge_nsharing++;
+
+        return pm;
+}
+
+/* Drops pf's reference on its merged frame, freeing the frame's page if
+ * free_page is set and pf was its last user */
+static void
+pagemerge_detach(pframe_t *pf, int free_page)
+{
+        pmframe_t *pm = pf->pf_merged;
+
+        KASSERT(NULL != pm && pm->pm_refcount > 0);
+        pf->pf_merged = NULL;
+        pagemerge_nsharing--;
+
+        if (0 == --pm->pm_refcount) {
+                list_remove(&pm->pm_link);
+                if (free_page) {
+                        page_free(pm->pm_addr);
+                }
+                slab_obj_free(pmframe_allocator, pm);
+                pagemerge_nshared--;
+        }
+}
+
+/*
+ * Looks for pf in the tables, merging it if an identical page is found.
+ * Returns -1 if a spare entry was needed but there are none left.
+ */
+static int
+pagemerge_page(pframe_t *pf)
+{
+        uint32_t hash;
+        pmframe_t *pm;
+        pmcand_t *pc;
+
+        if (!pagemerge_eligible(pf)) {
+                return 0;
+        }
+        pagemerge_nscanned++;
+        hash = page_hash(pf->pf_addr);
+
+        list_iterate_begin(&stable_table[hash % PAGEMERGE_HASH_SIZE], pm, pmframe_t, pm_link) {
+                if (hash == pm->pm_hash && 0 == memcmp(pm->pm_addr, pf->pf_addr, PAGE_SIZE)) {
+                        pagemerge_attach(pf, pm);
+                        return 0;
+                }
+        } list_iterate_end();
+
+        list_iterate_begin(&unstable_table[hash % PAGEMERGE_HASH_SIZE], pc, pmcand_t, pc_link) {
+                if (hash != pc->pc_hash) {
+                        continue;
+                }
+                if (pf->pf_obj == pc->pc_obj && pf->pf_pagenum == pc->pc_pagenum) {
+                        /* seen already this round */
+                        return 0;
+                }
+                if (list_empty(&spare_pmframes)) {
+                        return -1;
+                }
+
+                pframe_t *other = pframe_get_resident(pc->pc_obj, pc->pc_pagenum);
+
+                /* The candidate leaves the table either way: it is merged
+                 * below, or it is gone or has changed since we saw it */
+                list_remove(&pc->pc_link);
+                slab_obj_free(pmcand_allocator, pc);
+                if (NULL == other || !pagemerge_eligible(other)
+                    || 0 != memcmp(other->pf_addr, pf->pf_addr, PAGE_SIZE)) {
+                        continue;
+                }
+
+                pagemerge_attach(pf, pagemerge_stabilize(other, hash));
+                return 0;
+        } list_iterate_end();
+
+        if (list_empty(&spare_pmcands)) {
+                return -1;
+        }
+        pc = list_head(&spare_pmcands, pmcand_t, pc_link);
+        list_remove(&pc->pc_link);
+        nspare_pmcands--;
+
+        pc->pc_hash = hash;
+        pc->pc_obj = pf->pf_obj;
+        pc->pc_pagenum = pf->pf_pagenum;
+        list_insert_tail(&unstable_table[hash % PAGEMERGE_HASH_SIZE], &pc->pc_link);
+        return 0;
+}
+
+/*
+ * Looks at the resident pages of vma's objects. Returns how many, or -1 if
+ * the spare entries ran out.
+ */
+static int
+pagemerge_scan_area(vmarea_t *vma)
+{
+        uint32_t lopage = vma->vma_off;
+        uint32_t hipage = lopage + (vma->vma_end - vma->vma_start);
+        mmobj_t *o;
+        int n = 0;
+
+        for (o = vma->vma_obj; NULL != o; o = o->mmo_shadowed) {
+                pframe_t *pf;
+
+                if (!swap_is_swappable(o)) {
+                        continue;
+                }
+                list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                        if (pf->pf_pagenum >= lopage && pf->pf_pagenum < hipage) {
+                                if (pagemerge_page(pf) < 0) {
+                                        return -1;
+                                }
+                                n++;
+                        }
+                } list_iterate_end();
+        }
+
+        return n;
+}
+
+/* Ends a round: forgets the unmerged pages */
+static void
+pagemerge_end_round(void)
+{
+        pmcand_t *pc;
+        int i;
+
+        for (i = 0; i < PAGEMERGE_HASH_SIZE; ++i) {
+                list_iterate_begin(&unstable_table[i], pc, pmcand_t, pc_link) {
+                        list_remove(&pc->pc_link);
+                        slab_obj_free(pmcand_allocator, pc);
+                } list_iterate_end();
+        }
+
+        scan_pid = 0;
+        scan_vfn = 0;
+        pagemerge_nrounds++;
+}
+
+/* Tops up the spare entries; may block */
+static int
+pagemerge_fill_spares(void)
+{
+        while (nspare_pmframes < PAGEMERGE_SCAN_PAGES) {
+                pmframe_t *pm = slab_obj_alloc(pmframe_allocator);
+                if (NULL == pm) {
+                        return -ENOMEM;
+                }
+                list_insert_head(&spare_pmframes, &pm->pm_link);
+                nspare_pmframes++;
+        }
+        while (nspare_pmcands < PAGEMERGE_SCAN_PAGES) {
+                pmcand_t *pc = slab_obj_alloc(pmcand_allocator);
+                if (NULL == pc) {
+                        return -ENOMEM;
+                }
+                list_insert_head(&spare_pmcands, &pc->pc_link);
+                nspare_pmcands++;
+        }
+        return 0;
+}
+
+/*
+ * One run of the daemon: look at about PAGEMERGE_SCAN_PAGES pages, a whole
+ * area at a time, starting where the last run stopped. If the spare entries
+ * run out in the middle of an area, the next run starts over with that
+ * area; the pages already seen are cheap to skip. Nothing here blocks.
+ */
+static void
+pagemerge_scan(void)
+{
+        int budget = PAGEMERGE_SCAN_PAGES;
+        proc_t *p;
+        int n;
+
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                vmarea_t *vma;
+
+                if (p->p_pid < scan_pid || PROC_RUNNING != p->p_state
+                    || NULL == p->p_vmmap) {
+                        continue;
+                }
+                list_iterate_begin(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+                        if (p->p_pid == scan_pid && vma->vma_end <= scan_vfn) {
+                                continue;
+                        }
+                        scan_pid = p->p_pid;
+                        if (budget <= 0 || (n = pagemerge_scan_area(vma)) < 0) {
+                                /* resume with this area */
+                                scan_vfn = vma->vma_start;
+                                return;
+                        }
+                        budget -= n;
+                        scan_vfn = vma->vma_end;
+                } list_iterate_end();
+        } list_iterate_end();
+
+        pagemerge_end_round();
+}
+
+static void *
+pagemerged(int arg1, void *arg2)
+{
+        while (1) {
+                if (0 == pagemerge_fill_spares()) {
+                        pagemerge_scan();
+                }
+
+                if (sched_cancellable_sleep_on(&pagemerged_waitq) < 0) {
+                        return (void *)0;
+                }
+        }
+}
+
+void
+pagemerged_wakeup()
+{
+        sched_broadcast_on(&pagemerged_waitq);
+}
+
+int
+pagemerge_unshare(pframe_t *pf)
+{
+        pmframe_t *pm = pf->pf_merged;
+        void *addr = NULL;
+
+        KASSERT(NULL != pm);
+        KASSERT(pframe_is_busy(pf));
+
+        if (pm->pm_refcount > 1 && NULL == (addr = page_alloc())) {
+                return -ENOMEM;
+        }
+
+        /* The other users may have gone away while we blocked */
+        if (1 == pm->pm_refcount) {
+                /* the frame becomes pf's own page */
+                if (NULL != addr) {
+                        page_free(addr);
+                }
+                pagemerge_detach(pf, 0);
+                return 0;
+        }
+
+        memcpy(addr, pm->pm_addr, PAGE_SIZE);
+        tlb_flush((uintptr_t)pf->pf_addr);
+        pframe_remove_from_pts(pf);
+        pf->pf_addr = addr;
+        pagemerge_detach(pf, 1);
+        pagemerge_nunshared++;
+
+        return 0;
+}
+
+void
+pagemerge_release(pframe_t *pf)
+{
+        pagemerge_detach(pf, 1);
+}
+
+size_t
+pagemerge_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "merged frames:  %u\n", pagemerge_nshared);
+        iprintf(&buf, &size, "pages sharing:  %u (%u pages saved)\n",
+                pagemerge_nsharing, pagemerge_nsharing - pagemerge_nshared);
+        iprintf(&buf, &size, "unshared:       %u\n", pagemerge_nunshared);
+        iprintf(&buf, &size, "pages scanned:  %u in %u full rounds\n",
+                pagemerge_nscanned, pagemerge_nrounds);
+
+        return size;
+}
+
+static __attribute__((unused)) void
+pagemerged_init()
+{
+        int i;
+
+        pmframe_allocator = slab_allocator_create("pmframe", sizeof(pmframe_t));
+        KASSERT(NULL != pmframe_allocator);
+        pmcand_allocator = slab_allocator_create("pmcand", sizeof(pmcand_t));
+        KASSERT(NULL != pmcand_allocator);
+
+        for (i = 0; i < PAGEMERGE_HASH_SIZE; ++i) {
+                list_init(&stable_table[i]);
+                list_init(&unstable_table[i]);
+        }
+        list_init(&spare_pmframes);
+        list_init(&spare_pmcands);
+
+        sched_queue_init(&pagemerged_waitq);
+
+        KASSERT(NULL != curproc && (PID_IDLE == curproc->p_pid));
+        pagemerged_proc = proc_create("pagemerged");
+        KASSERT(NULL != pagemerged_proc);
+        pagemerged_thr = kthread_create(pagemerged_proc, pagemerged, 0, NULL);
+        KASSERT(NULL != pagemerged_thr);
+
+        sched_make_runnable(pagemerged_thr);
+}
+init_func(pagemerged_init);
+init_depends(sched_init);
+
+/*
+ * Cancel pagemerged
+ */
+void
+pagemerged_shutdown()
+{
+        KASSERT(NULL != pagemerged_thr);
+        KASSERT(PID_IDLE == curproc->p_pid);
+        kthread_cancel(pagemerged_thr, (void *)0);
+        pagemerged_thr = NULL;
+        int pid = pagemerged_proc->p_pid;
+        int child = do_waitpid(-1, 0, NULL);
+        KASSERT(child == pid && "waited on process other than pagemerged");
+}
+#endif
@@ -14,17 +14,9 @@
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/shadowd.h"
-
-#define SHADOW_SINGLETON_THRESHOLD 5
+#include "vm/swap.h"
 
 int shadow_count = 0; /* for debugging/verification purposes */
-#ifdef __SHADOWD__
-/*
- * number of shadow objects with a single parent, that is another shadow
- * object in the shadow objects tree(singletons)
- */
-static int shadow_singleton_count = 0;
-#endif
 
 static slab_allocator_t *shadow_allocator;
 
@@ -65,12 +57,6 @@ shadow_init()
 mmobj_t *
 shadow_create()
 {
-    static uint32_t ncreated = 0;
-
-    if (ncreated++ % 10 == 0){
-        shadowd_wakeup();
-    }
-
     mmobj_t *newshadow = slab_obj_alloc(shadow_allocator);
 
     if (newshadow != NULL){
@@ -80,6 +66,62 @@ shadow_create()
     return newshadow;
 }
 
+/*
+ * Returns 1 if 'o' is a shadow object, 0 otherwise.
+ */
+int
+shadow_is_shadow(mmobj_t *o)
+{
+    return o->mmo_ops == &shadow_mmobj_ops;
+}
+
+/*
+ * Makes 'o' shadow 'shadowed'. The caller is responsible for the
+ * reference 'o' holds on 'shadowed'.
+ */
+void
+shadow_set_shadowed(mmobj_t *o, mmobj_t *shadowed)
+{
+    KASSERT(o->mmo_ops == &shadow_mmobj_ops);
+
+    if (list_link_is_linked(&o->mmo_shadower_link)){
+        list_remove(&o->mmo_shadower_link);
+    }
+    o->mmo_shadowed = shadowed;
+    list_insert_tail(&shadowed->mmo_shadowers, &o->mmo_shadower_link);
+}
+
+/*
+ * Returns 1 if 'o' is an intermediate shadow object that is needed by
+ * nothing but the one shadow object above it (and its own pages), so that
+ * it can be collapsed into that object.
+ */
+int
+shadow_is_collapsible(mmobj_t *o)
+{
+    list_t *shadowers = &o->mmo_shadowers;
+
+    return o->mmo_ops == &shadow_mmobj_ops
+           && o->mmo_refcount - o->mmo_nrespages == 1
+           && !list_empty(shadowers) && shadowers->l_next == shadowers->l_prev;
+}
+
+/*
+ * Returns the number of shadow objects in the chain starting at 'o'.
+ */
+int
+shadow_chain_depth(mmobj_t *o)
+{
+    int depth = 0;
+
+    while (o->mmo_shadowed != NULL){
+        depth++;
+        o = o->mmo_shadowed;
+    }
+
+    return depth;
+}
+
 /* Implementation of mmobj entry points: */
 
 /*
@@ -99,6 +141,11 @@ shadow_ref(mmobj_t *o)
  * longer in use and, since it is a shadow object, it will never
  * be used again. You should unpin and uncache all of the object's
  * pages and then free the object itself.
+ *
+ * Pages being swapped out are busy and unpinned; wait for them first.
+ *
+ * If the object is left with a single shadow object above it and nothing
+ * else, shadowd is asked to collapse it into that object.
  */
 static void
 shadow_put(mmobj_t *o)
@@ -106,12 +153,23 @@ shadow_put(mmobj_t *o)
     KASSERT(o->mmo_refcount > o->mmo_nrespages && "refcount == nrespages already!");
     KASSERT(o->mmo_nrespages >= 0);
 
+    while (o->mmo_refcount == o->mmo_nrespages + 1 && pframe_wait_busy(o))
+        ;
+
     if (o->mmo_refcount == o->mmo_nrespages + 1){
         pframe_t *p;
         list_iterate_begin(&o->mmo_respages, p, pframe_t, pf_olink){
-            pframe_unpin(p);
+            if (pframe_is_pinned(p)){
+                pframe_unpin(p);
+            }
             pframe_free(p);
         } list_iterate_end();
+        swap_drop_obj(o);
+#ifdef __SHADOWD__
+        shadowd_dequeue(o);
+#endif
+        KASSERT(list_empty(&o->mmo_shadowers));
+        list_remove(&o->mmo_shadower_link);
 
         mmobj_t *shadowed_obj = o->mmo_shadowed;
         mmobj_t *bottom_obj = o->mmo_un.mmo_bottom_obj;
@@ -122,6 +180,11 @@ shadow_put(mmobj_t *o)
         slab_obj_free(shadow_allocator, o);
     } else {
         o->mmo_refcount--;
+#ifdef __SHADOWD__
+        if (shadow_is_collapsible(o)){
+            shadowd_enqueue(o);
+        }
+#endif
     }
 }
 
@@ -133,27 +196,40 @@ shadow_put(mmobj_t *o)
  * given page resident). copy-on-write magic (necessary when forwrite
  * is true) is handled in shadow_fillpage, not here. It is important to
  * use iteration rather than recursion here as a recursive implementation
- * can overflow the kernel stack when looking down a long shadow chain */
+ * can overflow the kernel stack when looking down a long shadow chain.
+ * A swapped out page counts as present in its object; it is brought back
+ * in with pframe_get(), while holding a reference on its object so that
+ * shadowd does not collapse the object in the meantime */
 static int
 shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 {
-    if (forwrite){
-        return pframe_get(o, pagenum, pf);
-    }
-
-    pframe_t *p = NULL;
     mmobj_t *curr = o;
 
-    while (p == NULL && curr->mmo_shadowed != NULL){
-        p = pframe_get_resident(curr, pagenum);
-        curr = curr->mmo_shadowed;
+    if (!forwrite){
+        while (curr->mmo_shadowed != NULL
+               && pframe_get_resident(curr, pagenum) == NULL
+               && !swap_has_page(curr, pagenum)){
+            curr = curr->mmo_shadowed;
+        }
+
+        if (curr->mmo_shadowed == NULL){
+            return pframe_lookup(curr, pagenum, 0, pf);
+        }
     }
 
-    if (p == NULL){
-        return pframe_lookup(curr, pagenum, 0, pf);
+    if (curr != o){
+        curr->mmo_ops->ref(curr);
+    }
+    int get_res = pframe_get(curr, pagenum, pf);
+    if (curr != o){
+        curr->mmo_ops->put(curr);
+    }
+
+    if (get_res < 0){
+        return get_res;
     }
-   
-    *pf = p;
+
+    swap_keep_resident(*pf);
     return 0;
 }
 
@@ -167,15 +243,36 @@ shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
  * for the pf->pf_pagenum-th page from the last object in the chain).
  * It is important to use iteration rather than recursion here as a 
  * recursive implementation can overflow the kernel stack when 
- * looking down a long shadow chain */
+ * looking down a long shadow chain. If the page itself was swapped out,
+ * it is simply read back; a swapped out page further down the chain is
+ * brought back in before it is copied. */
 static int
 shadow_fillpage(mmobj_t *o, pframe_t *pf)
 {
+    int swap_res = swap_readpage(o, pf);
+
+    if (swap_res < 0){
+        return swap_res;
+    }
+    if (swap_res > 0){
+        pframe_pin(pf);
+        return 0;
+    }
+
     pframe_t *p = NULL;
     mmobj_t *curr = o->mmo_shadowed;
 
     while (p == NULL && curr != o->mmo_un.mmo_bottom_obj){
         p = pframe_get_resident(curr, pf->pf_pagenum);
+        if (p == NULL && swap_has_page(curr, pf->pf_pagenum)){
+            curr->mmo_ops->ref(curr);
+            int get_res = pframe_get(curr, pf->pf_pagenum, &p);
+            curr->mmo_ops->put(curr);
+
+            if (get_res < 0){
+                return get_res;
+            }
+        }
         curr = curr->mmo_shadowed;
     }
     
@@ -203,8 +300,9 @@ shadow_dirtypage(mmobj_t *o, pframe_t *pf)
     return 0;
 }
 
+/* Only pages pageoutd has picked for swap-out are ever cleaned. */
 static int
 shadow_cleanpage(mmobj_t *o, pframe_t *pf)
 {
-    return 0;
+    return swap_writepage(o, pf);
 }
@@ -1,20 +1,36 @@
 #include "types.h"
 #include "globals.h"
+#include "kernel.h"
+#include "config.h"
+#include "errno.h"
 
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 
 #include "util/debug.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 #include "proc/proc.h"
 #include "proc/sched.h"
 #include "proc/kthread.h"
 
+#include "vm/vmmap.h"
+#include "vm/shadow.h"
+#include "vm/shadowd.h"
+#include "vm/swap.h"
+
 #ifdef __SHADOWD__
 static ktqueue_t shadowd_waitq, kmem_alloc_waitq;
 static int shadowd_initialized = 0;
 
+/* Shadow objects waiting to be collapsed, linked by mmo_collapse_link */
+static list_t shadowd_queue;
+
+/* Statistics */
+static uint32_t shadowd_nqueued;        /* objects handed to shadowd */
+static uint32_t shadowd_ncollapsed;     /* objects collapsed */
+
 void
 shadowd_wakeup()
 {
@@ -36,72 +52,206 @@ shadowd_alloc_sleep()
 }
 
 /*
- * The shadow daemon main routine. This should periodically
- * traverese all the shadow object trees, removing any
- * unnecessary shadow objects.
- *
- * A shadow object is considered unnecessary if it is not top most
- * (directly descendant from a vmarea), and if it has only 1
- * parent.
- *
- * For each shadow object we want to migrate all of its pages up
- * to the closest mmobj with at least 2 parents, or the topmost
- * one, then remove this object from the tree (if we remove it any
- * earlier we can cause big problems).
- *
+ * Returns 1 if some page of o is pinned by someone other than o itself
+ * (mlock(2)), or busy being swapped in or out. Such a page may not be
+ * migrated, as its pinner expects it to stay where it is, so o has to stay
+ * in its chain for now.
+ */
+static int
+shadowd_has_locked_pages(mmobj_t *o)
+{
+        pframe_t *pf;
+        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                if (pf->pf_pincount > 1 || pframe_is_busy(pf)) {
+                        return 1;
+                }
+        } list_iterate_end();
+        return 0;
+}
+
+/*
+ * Collapses the shadow object o into the one shadow object above it, if o
+ * is still collapsible: all of o's pages move up into that object, unless
+ * it has its own, newer, versions of them, and o is removed from the
+ * chain. Returns 0 if o was collapsed or no longer needs to be, and
+ * -EBUSY if it has to wait because of locked pages. This does not block.
+ */
+static int
+shadowd_collapse(mmobj_t *o)
+{
+        mmobj_t *above, *below;
+        pframe_t *pf;
+
+        if (!shadow_is_collapsible(o)) {
+                return 0;
+        }
+        if (shadowd_has_locked_pages(o)) {
+                return -EBUSY;
+        }
+
+        above = list_head(&o->mmo_shadowers, mmobj_t, mmo_shadower_link);
+        below = o->mmo_shadowed;
+        KASSERT(above->mmo_shadowed == o && NULL != below);
+
+        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                /* pin pages pageoutd has picked for swap-out again and
+                 * forget their swap copies */
+                swap_keep_resident(pf);
+                /* o has refcount 1+nrespages, so this won't delete it yet */
+                pframe_migrate(pf, above);
+        } list_iterate_end();
+        /* and move up the pages that are on swap */
+        swap_migrate(o, above);
+
+        /* above takes over o's reference on below */
+        below->mmo_ops->ref(below);
+        shadow_set_shadowed(above, below);
+        KASSERT(o->mmo_refcount == 1 && o->mmo_nrespages == 0);
+        o->mmo_ops->put(o);
+
+        shadowd_ncollapsed++;
+        return 0;
+}
+
+void
+shadowd_enqueue(mmobj_t *o)
+{
+        KASSERT(shadowd_initialized);
+        if (!list_link_is_linked(&o->mmo_collapse_link)) {
+                list_insert_tail(&shadowd_queue, &o->mmo_collapse_link);
+                shadowd_nqueued++;
+                sched_broadcast_on(&shadowd_waitq);
+        }
+}
+
+void
+shadowd_dequeue(mmobj_t *o)
+{
+        if (list_link_is_linked(&o->mmo_collapse_link)) {
+                list_remove(&o->mmo_collapse_link);
+        }
+}
+
+static void
+shadowd_collapse_queued()
+{
+        list_t retry;
+        mmobj_t *o;
+
+        list_init(&retry);
+        while (!list_empty(&shadowd_queue)) {
+                o = list_head(&shadowd_queue, mmobj_t, mmo_collapse_link);
+                list_remove(&o->mmo_collapse_link);
+                if (shadowd_collapse(o) < 0) {
+                        list_insert_tail(&retry, &o->mmo_collapse_link);
+                }
+        }
+        /* Objects with locked pages are tried again next time */
+        while (!list_empty(&retry)) {
+                o = list_head(&retry, mmobj_t, mmo_collapse_link);
+                list_remove(&o->mmo_collapse_link);
+                list_insert_tail(&shadowd_queue, &o->mmo_collapse_link);
+        }
+}
+
+/*
+ * Collapses right away every shadow object below top that is collapsible,
+ * without waiting for shadowd. Objects with locked pages are left queued
+ * for shadowd. This does not block.
  */
+static void
+shadowd_collapse_chain(mmobj_t *top)
+{
+        mmobj_t *o, *below;
+
+        for (o = top->mmo_shadowed; NULL != o->mmo_shadowed; o = below) {
+                below = o->mmo_shadowed;
+                if (shadow_is_collapsible(o)) {
+                        shadowd_dequeue(o);
+                        if (shadowd_collapse(o) < 0) {
+                                shadowd_enqueue(o);
+                        }
+                }
+        }
+}
+
+/*
+ * Gives the top object of vma its own copy of every page that it sees
+ * through the shadow objects below it, and then makes it shadow the bottom
+ * object directly. This is what is left when the objects in the chain are
+ * shared with other processes, and so cannot be collapsed. Only done when
+ * the top object belongs to vma alone, as only vma's pages are copied.
+ */
+static int
+shadowd_flatten(vmarea_t *vma)
+{
+        mmobj_t *top = vma->vma_obj;
+        mmobj_t *bottom = top->mmo_un.mmo_bottom_obj;
+        mmobj_t *o;
+        pframe_t *pf;
+        uint32_t pagenum, endpage;
+        int ret = 0;
 
+        if (top->mmo_refcount - top->mmo_nrespages != 1) {
+                return -EBUSY;
+        }
+
+        top->mmo_ops->ref(top);
+        endpage = vma->vma_off + (vma->vma_end - vma->vma_start);
+        for (pagenum = vma->vma_off; pagenum < endpage; ++pagenum) {
+                if (NULL != pframe_get_resident(top, pagenum)
+                    || swap_has_page(top, pagenum)) {
+                        continue;
+                }
+                for (o = top->mmo_shadowed; o != bottom; o = o->mmo_shadowed) {
+                        if (NULL != pframe_get_resident(o, pagenum)
+                            || swap_has_page(o, pagenum)) {
+                                break;
+                        }
+                }
+                /* the copy-on-write fill copies the page up into top */
+                if (o != bottom && (ret = pframe_get(top, pagenum, &pf)) < 0) {
+                        break;
+                }
+        }
+
+        if (0 == ret && top->mmo_shadowed != bottom) {
+                o = top->mmo_shadowed;
+                bottom->mmo_ops->ref(bottom);
+                shadow_set_shadowed(top, bottom);
+                o->mmo_ops->put(o);
+        }
+        top->mmo_ops->put(top);
+        return ret;
+}
+
+int
+shadowd_limit_depth(vmarea_t *vma)
+{
+        if (shadow_chain_depth(vma->vma_obj) <= SHADOW_MAX_DEPTH) {
+                return 0;
+        }
+        shadowd_collapse_chain(vma->vma_obj);
+        if (shadow_chain_depth(vma->vma_obj) <= SHADOW_MAX_DEPTH) {
+                return 0;
+        }
+        return shadowd_flatten(vma);
+}
+
+/*
+ * The shadow daemon main routine. A shadow object is unnecessary if it is
+ * not top most (directly descendant from a vmarea), and if it has only 1
+ * parent. Rather than periodically traversing all the shadow object trees
+ * looking for such objects, shadowd is handed them by shadow_put() as soon
+ * as they become unnecessary, typically when a process on the other branch
+ * of a fork exits, and collapses each into its one parent. The work done
+ * is local to the chains that changed.
+ */
 static void *
 shadowd(int arg1, void *arg2)
 {
         while (1) {
-                proc_t *p;
-                /* for each process, go through its vmareas */
-                list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
-                        /* all of the dead process's shadow objects will be takenen care of by init */
-                        if (PROC_RUNNING == p->p_state) {
-                                vmarea_t *vma;
-                                list_iterate_begin(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
-                                        mmobj_t *last = vma->vma_obj, *o = last->mmo_shadowed;
-                                        /* ref last, so if all processes on this branch die while shadowd is
-                                         * sleeping, the branch won't get destroyed until shadowd() is done
-                                         * with it */
-                                        last->mmo_ops->ref(last);
-                                        while (NULL != o && NULL != o->mmo_shadowed) {
-                                                mmobj_t *shadow = o->mmo_shadowed;
-                                                /* iff the object has only one parent, and is not right under vm_area */
-                                                KASSERT(o != last);
-                                                if (o->mmo_refcount - o->mmo_nrespages == 1) {
-                                                        /* migrate all its pages to last, and remove it from the shadow tree */
-                                                        pframe_t *pf;
-                                                        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
-                                                                /* Because the operations that could be
-                                                                 * performed with an intermediate shadow object
-                                                                 * to make pages busy are non-blocking,
-                                                                 * we always expect to see non-busy pages. */
-                                                                KASSERT(!pframe_is_busy(pf));
-                                                                /* o has refcount 1+nrespages, so this won't delete it yet */
-                                                                pframe_migrate(pf, last);
-                                                        } list_iterate_end();
-                                                        last->mmo_shadowed = o->mmo_shadowed;
-                                                        /* Ref o's shadowed, so we don't accidentally delete it when we
-                                                         * finally put o */
-                                                        o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
-                                                        KASSERT(o->mmo_refcount == 1 && o->mmo_nrespages == 0);
-                                                        o->mmo_ops->put(o);
-                                                } else {
-                                                        /*KASSERT(o->mmo_refcount - o->mmo_nrespages == 2);*/
-                                                        o->mmo_ops->ref(o);
-                                                        last->mmo_ops->put(last);
-                                                        last = o;
-                                                }
-                                                o = shadow;
-                                        }
-                                        KASSERT(NULL != last);
-                                        last->mmo_ops->put(last);
-                                } list_iterate_end();
-                        }
-                } list_iterate_end();
+                shadowd_collapse_queued();
 
                 sched_broadcast_on(&kmem_alloc_waitq);
                 if (sched_cancellable_sleep_on(&shadowd_waitq) < 0) {
@@ -110,6 +260,44 @@ shadowd(int arg1, void *arg2)
         }
 }
 
+size_t
+shadowd_info(const void *arg, char *buf, size_t osize)
+{
+        uint32_t hist[SHADOW_MAX_DEPTH + 2];
+        size_t size = osize;
+        uint32_t nqueued = 0;
+        list_link_t *l;
+        proc_t *p;
+        int i;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        memset(hist, 0, sizeof(hist));
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if (PROC_RUNNING == p->p_state && NULL != p->p_vmmap) {
+                        vmarea_t *vma;
+                        list_iterate_begin(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+                                int depth = shadow_chain_depth(vma->vma_obj);
+                                hist[MIN(depth, SHADOW_MAX_DEPTH + 1)]++;
+                        } list_iterate_end();
+                }
+        } list_iterate_end();
+        for (l = shadowd_queue.l_next; l != &shadowd_queue; l = l->l_next) {
+                nqueued++;
+        }
+
+        iprintf(&buf, &size, "collapsed: %u of %u queued (%u waiting)\n",
+                shadowd_ncollapsed, shadowd_nqueued, nqueued);
+        iprintf(&buf, &size, "chain length histogram (shadow objects per area):\n");
+        for (i = 0; i <= SHADOW_MAX_DEPTH; ++i) {
+                iprintf(&buf, &size, "  %2d:  %u\n", i, hist[i]);
+        }
+        iprintf(&buf, &size, " >%2d:  %u\n", SHADOW_MAX_DEPTH, hist[SHADOW_MAX_DEPTH + 1]);
+
+        return size;
+}
+
 static proc_t *shadowd_proc;
 static kthread_t *shadowd_thr;
 
@@ -118,6 +306,7 @@ shadowd_init()
 {
         sched_queue_init(&shadowd_waitq);
         sched_queue_init(&kmem_alloc_waitq);
+        list_init(&shadowd_queue);
 
         KASSERT(NULL != curproc && (PID_IDLE == curproc->p_pid));
         shadowd_proc = proc_create("shadowd");
@@ -0,0 +1,763 @@
+#include "config.h"
+#include "globals.h"
+#include "errno.h"
+#include "types.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/lz.h"
+#include "util/string.h"
+#include "util/printf.h"
+
+#include "drivers/dev.h"
+#include "drivers/blockdev.h"
+
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mm.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "vm/anon.h"
+#include "vm/shadow.h"
+#include "vm/swap.h"
+
+/*
+ * A swapped out page of an anonymous or shadow object. Entries are found by
+ * (object, page number) through swap_hash, and by object through the
+ * object's mmo_swapents list.
+ *
+ * Swapped out pages are kept in the cheapest place that will take them:
+ *     SE_ZERO   the page is all zeros; nothing is stored
+ *     SE_ZPOOL  compressed, in the in-memory compressed pool (zpool), if it
+ *               compresses to at most ZPOOL_MAX_ZLEN bytes and the pool
+ *               has room
+ *     SE_DISK   in a slot of the swap device, if swap is on
+ * The zero and zpool tiers work without a swap device.
+ *
+ * A page is either resident or has a swap entry, except while it is being
+ * written out (it is then busy and has both). A resident page of a swappable
+ * object is pinned, as usual, unless pageoutd has picked it for swap-out;
+ * looking a page up pins it again and drops its entry (see
+ * swap_keep_resident()), since the page may be about to change.
+ */
+#define SE_ZERO         0
+#define SE_ZPOOL        1
+#define SE_DISK         2
+
+typedef struct swapent {
+        mmobj_t        *se_obj;
+        uint32_t        se_pagenum;
+        int             se_where;       /* SE_ZERO, SE_ZPOOL or SE_DISK */
+        uint32_t        se_slot;        /* SE_DISK: the swap slot */
+        char           *se_zdata;       /* SE_ZPOOL: the compressed page */
+        uint32_t        se_zlen;        /* SE_ZPOOL: and its length */
+        list_link_t     se_hlink;       /* link on the swap_hash chain */
+        list_link_t     se_olink;       /* link on se_obj->mmo_swapents */
+} swapent_t;
+
+static slab_allocator_t *swapent_allocator;
+
+#define hash_swapent(obj, pagenum)  ((((uint32_t)(obj)) + (pagenum)) \
+                                     % SWAP_HASH_SIZE)
+static list_t swap_hash[SWAP_HASH_SIZE];
+
+static blockdev_t *swap_bdev = NULL;
+static int swap_draining = 0;           /* swap_off() in progress */
+
+/* Slot allocator: one bit per slot, set if the slot is in use */
+static uint32_t *swap_bitmap = NULL;
+static uint32_t swap_nslots = 0;
+static uint32_t swap_nfree = 0;
+static uint32_t swap_nbad = 0;          /* slots taken out of use after a
+                                         * failed write */
+static uint32_t swap_cursor = 0;        /* where the next-fit search starts */
+static char *swap_cluster_buf = NULL;   /* SWAP_CLUSTER pages, to read or
+                                         * write runs of slots through */
+static int swap_cluster_busy = 0;
+
+/* Compressed pool. Compressed pages are kmalloc()ed, which takes a
+ * power-of-two bucket that also holds a pointer-sized header, so a page
+ * must fit in half a page with the header to save anything. */
+#define ZPOOL_MAX_ZLEN          ((PAGE_SIZE >> 1) - sizeof(void *))
+#define ZPOOL_MIN_ALLOC         64      /* kmalloc()'s smallest bucket */
+static char zpool_buf[ZPOOL_MAX_ZLEN];  /* compression scratch space */
+static uint32_t zpool_limit = 0;        /* max bytes of memory taken */
+static uint32_t zpool_bytes = 0;        /* bytes of memory taken by
+                                         * compressed data */
+static uint32_t zpool_npages = 0;       /* pages in the pool */
+static uint32_t swap_nzero = 0;         /* zero pages swapped out */
+
+static uint32_t swap_nin = 0;           /* pages read back from swap */
+static uint32_t swap_nout = 0;          /* pages written to swap */
+static uint32_t swap_nclusterin = 0;    /* pages read from several slots */
+static uint32_t swap_nclusterout = 0;   /* and written to several slots
+                                         * in one request */
+
+/* The memory kmalloc() takes to hold zlen bytes of compressed data */
+static uint32_t
+zpool_alloc_size(uint32_t zlen)
+{
+        uint32_t size = ZPOOL_MIN_ALLOC;
+
+        while (size < zlen + sizeof(void *)) {
+                size <<= 1;
+        }
+        return size;
+}
+
+#define SLOT_WORD(slot)         ((slot) >> 5)
+#define SLOT_BIT(slot)          (1U << ((slot) & 31))
+#define SWAP_BITMAP_SIZE(n)     ((((n) + 31) >> 5) * sizeof(uint32_t))
+
+void
+swap_init(void)
+{
+        swapent_allocator = slab_allocator_create("swapent", sizeof(swapent_t));
+        KASSERT(NULL != swapent_allocator && "failed to create swapent allocator!");
+
+        int i;
+        for (i = 0; i < SWAP_HASH_SIZE; ++i)
+                list_init(&swap_hash[i]);
+
+        zpool_limit = ZPOOL_FRAC(page_free_count()) * PAGE_SIZE;
+}
+
+static int
+slot_is_free(uint32_t slot)
+{
+        return slot < swap_nslots && !(swap_bitmap[SLOT_WORD(slot)] & SLOT_BIT(slot));
+}
+
+static void
+slot_take(uint32_t slot)
+{
+        KASSERT(slot_is_free(slot));
+        swap_bitmap[SLOT_WORD(slot)] |= SLOT_BIT(slot);
+        swap_nfree--;
+}
+
+static void
+slot_release(uint32_t slot)
+{
+        KASSERT(slot < swap_nslots && !slot_is_free(slot));
+        swap_bitmap[SLOT_WORD(slot)] &= ~SLOT_BIT(slot);
+        swap_nfree++;
+}
+
+static swapent_t *
+swapent_lookup(mmobj_t *o, uint32_t pagenum)
+{
+        swapent_t *se;
+
+        list_iterate_begin(&swap_hash[hash_swapent(o, pagenum)], se, swapent_t, se_hlink) {
+                if (o == se->se_obj && pagenum == se->se_pagenum) {
+                        return se;
+                }
+        } list_iterate_end();
+
+        return NULL;
+}
+
+static void
+swapent_insert(swapent_t *se, mmobj_t *o, uint32_t pagenum)
+{
+        se->se_obj = o;
+        se->se_pagenum = pagenum;
+        list_insert_head(&swap_hash[hash_swapent(o, pagenum)], &se->se_hlink);
+        list_insert_tail(&o->mmo_swapents, &se->se_olink);
+}
+
+static void
+swapent_free(swapent_t *se)
+{
+        list_remove(&se->se_hlink);
+        list_remove(&se->se_olink);
+        switch (se->se_where) {
+                case SE_ZERO:
+                        swap_nzero--;
+                        break;
+                case SE_ZPOOL:
+                        kfree(se->se_zdata);
+                        zpool_bytes -= zpool_alloc_size(se->se_zlen);
+                        zpool_npages--;
+                        break;
+                case SE_DISK:
+                        slot_release(se->se_slot);
+                        break;
+        }
+        slab_obj_free(swapent_allocator, se);
+}
+
+/*
+ * Picks a free slot for page 'pagenum' of 'o'. Slots next to those of the
+ * page's neighbours are preferred, so that runs of pages of an object land
+ * in runs of slots and are read back with little seeking; otherwise the
+ * first free slot at or after the cursor is taken.
+ */
+static int
+slot_alloc(mmobj_t *o, uint32_t pagenum, uint32_t *slotp)
+{
+        swapent_t *se;
+        uint32_t slot, i;
+
+        if (0 == swap_nfree) {
+                return -ENOSPC;
+        }
+
+        if (pagenum > 0 && NULL != (se = swapent_lookup(o, pagenum - 1))
+            && SE_DISK == se->se_where && slot_is_free(se->se_slot + 1)) {
+                slot = se->se_slot + 1;
+                goto found;
+        }
+        if (NULL != (se = swapent_lookup(o, pagenum + 1)) && SE_DISK == se->se_where
+            && se->se_slot > 0 && slot_is_free(se->se_slot - 1)) {
+                slot = se->se_slot - 1;
+                goto found;
+        }
+
+        slot = swap_cursor;
+        for (i = 0; i < swap_nslots; ++i, ++slot) {
+                if (slot >= swap_nslots) {
+                        slot = 0;
+                }
+                if (0 == (slot & 31) && ~0U == swap_bitmap[SLOT_WORD(slot)]) {
+                        /* whole word in use, skip it */
+                        i += 31;
+                        slot += 31;
+                        continue;
+                }
+                if (slot_is_free(slot)) {
+                        goto found;
+                }
+        }
+        panic("swap_nfree is %u but no free slot found\n", swap_nfree);
+
+found:
+        slot_take(slot);
+        swap_cursor = slot + 1;
+        *slotp = slot;
+        return 0;
+}
+
+int
+swap_on(devid_t dev)
+{
+        blockdev_t *bd;
+        uint32_t nslots;
+
+        if (NULL != swap_bdev) {
+                return -EBUSY;
+        }
+        if (NULL == (bd = blockdev_lookup(dev))) {
+                return -ENODEV;
+        }
+#ifdef __S5FS__
+        int num;
+        if (NULL != vfs_root_vn
+            && 1 == sscanf(vfs_root_vn->vn_fs->fs_dev, "disk%d", &num)
+            && (devid_t)MKDEVID(DISK_MAJOR, num) == dev) {
+                return -EBUSY;
+        }
+#endif
+
+        nslots = MIN(bd->bd_nblocks, SWAP_MAX_SLOTS);
+        if (0 == nslots) {
+                return -EINVAL;
+        }
+        if (NULL == (swap_bitmap = kmalloc(SWAP_BITMAP_SIZE(nslots)))) {
+                return -ENOMEM;
+        }
+        memset(swap_bitmap, 0, SWAP_BITMAP_SIZE(nslots));
+        /* without it, pages are read and written one at a time */
+        swap_cluster_buf = page_alloc_n(SWAP_CLUSTER);
+
+        swap_nslots = nslots;
+        swap_nfree = nslots;
+        swap_nbad = 0;
+        swap_cursor = 0;
+        swap_bdev = bd;
+
+        dbginfo(DBG_VM, swap_info, NULL);
+        return 0;
+}
+
+/* Returns any entry of a page on the swap device, or NULL if there are none */
+static swapent_t *
+swapent_any_disk(void)
+{
+        swapent_t *se;
+        int i;
+        for (i = 0; i < SWAP_HASH_SIZE; ++i) {
+                list_iterate_begin(&swap_hash[i], se, swapent_t, se_hlink) {
+                        if (SE_DISK == se->se_where) {
+                                return se;
+                        }
+                } list_iterate_end();
+        }
+        return NULL;
+}
+
+int
+swap_off(void)
+{
+        swapent_t *se;
+
+        if (NULL == swap_bdev || swap_draining) {
+                return -EINVAL;
+        }
+
+        /*
+         * Stop pageoutd from swapping anything else out to the device, then
+         * bring every page on it back in. Reading blocks and entries may
+         * come and go meanwhile, so look for one from the start every time.
+         * Pages in the compressed pool stay where they are.
+         */
+        swap_draining = 1;
+        while (NULL != (se = swapent_any_disk())) {
+                mmobj_t *o = se->se_obj;
+                pframe_t *pf;
+                int err;
+
+                /* keep o alive while we block */
+                o->mmo_ops->ref(o);
+                if (0 == (err = pframe_get(o, se->se_pagenum, &pf))) {
+                        swap_keep_resident(pf);
+                }
+                o->mmo_ops->put(o);
+
+                if (err < 0) {
+                        swap_draining = 0;
+                        return err;
+                }
+        }
+        KASSERT(swap_nfree + swap_nbad == swap_nslots);
+
+        kfree(swap_bitmap);
+        swap_bitmap = NULL;
+        if (NULL != swap_cluster_buf) {
+                page_free_n(swap_cluster_buf, SWAP_CLUSTER);
+                swap_cluster_buf = NULL;
+        }
+        swap_nslots = swap_nfree = swap_nbad = 0;
+        swap_bdev = NULL;
+        swap_draining = 0;
+
+        return 0;
+}
+
+uint32_t
+swap_room(void)
+{
+        uint32_t room = 0;
+
+        if (NULL != swap_bdev && !swap_draining) {
+                room += swap_nfree;
+        }
+        if (zpool_bytes < zpool_limit) {
+                /* compressed pages are smaller; this is a lower bound */
+                room += (zpool_limit - zpool_bytes) / PAGE_SIZE + 1;
+        }
+        return room;
+}
+
+int
+swap_is_swappable(mmobj_t *o)
+{
+        return anon_is_anon(o) || shadow_is_shadow(o);
+}
+
+int
+swap_has_page(mmobj_t *o, uint32_t pagenum)
+{
+        return NULL != swapent_lookup(o, pagenum);
+}
+
+/*
+ * Reads page pf of o, which is in slot 'slot', from the swap device, along
+ * with the pages after it in o whose slots follow, up to SWAP_CLUSTER in
+ * all, in one request. The pages after it are only read if they are not
+ * resident and there is memory to spare. They are made resident and busy
+ * before the read, as pf is, so that nobody else reads them or drops their
+ * swap entries meanwhile, and are pinned afterwards, as swapped in pages
+ * are.
+ */
+static int
+swap_read_cluster(mmobj_t *o, pframe_t *pf, uint32_t slot)
+{
+        pframe_t *cluster[SWAP_CLUSTER];
+        swapent_t *se;
+        uint32_t n, i;
+        int err;
+
+        if (NULL == swap_cluster_buf || swap_cluster_busy
+            || page_free_count() <= 2 * SWAP_CLUSTER) {
+                return blockdev_read(swap_bdev, pf->pf_addr, slot, 1);
+        }
+        swap_cluster_busy = 1;
+
+        for (n = 1; n < SWAP_CLUSTER; ++n) {
+                se = swapent_lookup(o, pf->pf_pagenum + n);
+                if (NULL == se || SE_DISK != se->se_where || slot + n != se->se_slot
+                    || NULL != pframe_get_resident(o, pf->pf_pagenum + n)
+                    || pframe_get_nofill(o, pf->pf_pagenum + n, 0, &cluster[n]) < 0) {
+                        break;
+                }
+                pframe_set_busy(cluster[n]);
+                /* in case we blocked */
+                se = swapent_lookup(o, pf->pf_pagenum + n);
+                if (NULL == se || SE_DISK != se->se_where || slot + n != se->se_slot) {
+                        pframe_clear_busy(cluster[n]);
+                        pframe_free(cluster[n]);
+                        break;
+                }
+        }
+
+        if (1 == n) {
+                err = blockdev_read(swap_bdev, pf->pf_addr, slot, 1);
+        } else if ((err = blockdev_read(swap_bdev, swap_cluster_buf, slot, n)) >= 0) {
+                memcpy(pf->pf_addr, swap_cluster_buf, PAGE_SIZE);
+                swap_nclusterin += n;
+        }
+        for (i = 1; i < n; ++i) {
+                if (err >= 0) {
+                        memcpy(cluster[i]->pf_addr, swap_cluster_buf + i * PAGE_SIZE,
+                               PAGE_SIZE);
+                        swapent_free(swapent_lookup(o, cluster[i]->pf_pagenum));
+                        swap_nin++;
+                }
+                pframe_clear_busy(cluster[i]);
+                sched_broadcast_on(&cluster[i]->pf_waitq);
+                if (err >= 0) {
+                        pframe_pin(cluster[i]);
+                } else {
+                        /* whoever waited for it reads it again */
+                        pframe_free(cluster[i]);
+                }
+        }
+
+        swap_cluster_busy = 0;
+        return err;
+}
+
+int
+swap_readpage(mmobj_t *o, pframe_t *pf)
+{
+        swapent_t *se;
+        int err;
+
+        if (NULL == (se = swapent_lookup(o, pf->pf_pagenum))) {
+                return 0;
+        }
+
+        switch (se->se_where) {
+                case SE_ZERO:
+                        memset(pf->pf_addr, 0, PAGE_SIZE);
+                        break;
+                case SE_ZPOOL:
+                        if (PAGE_SIZE != lz_decompress(se->se_zdata, se->se_zlen,
+                                                       pf->pf_addr, PAGE_SIZE)) {
+                                panic("corrupt compressed page %u of obj %p\n",
+                                      pf->pf_pagenum, o);
+                        }
+                        break;
+                case SE_DISK:
+                        /* pf is busy, so nobody drops se while we block */
+                        if ((err = swap_read_cluster(o, pf, se->se_slot)) < 0) {
+                                return err;
+                        }
+                        break;
+        }
+        swap_nin++;
+
+        /* The page will be pinned and may change; the copy on swap is of
+         * no further use */
+        swapent_free(se);
+        return 1;
+}
+
+/* Returns 1 if the page at addr is all zeros */
+static int
+page_is_zero(const void *addr)
+{
+        const uint32_t *p = addr, *end = p + PAGE_SIZE / sizeof(uint32_t);
+        while (p < end) {
+                if (0 != *p++) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/* Tries to put the page at addr into the compressed pool as se */
+static int
+zpool_store(swapent_t *se, const void *addr)
+{
+        size_t zlen;
+
+        if (zpool_bytes >= zpool_limit) {
+                return -ENOSPC;
+        }
+        if (0 == (zlen = lz_compress(addr, PAGE_SIZE, zpool_buf, ZPOOL_MAX_ZLEN))) {
+                return -EFBIG;
+        }
+        if (NULL == (se->se_zdata = kmalloc(zlen))) {
+                return -ENOMEM;
+        }
+        memcpy(se->se_zdata, zpool_buf, zlen);
+
+        se->se_where = SE_ZPOOL;
+        se->se_zlen = zlen;
+        zpool_bytes += zpool_alloc_size(zlen);
+        zpool_npages++;
+        return 0;
+}
+
+/*
+ * Returns page pagenum of o if it can be written to swap, to 'slot', in
+ * the same request as the page before it: pageoutd has picked it for
+ * swap-out, and it is not all zeros. Otherwise returns NULL.
+ */
+static pframe_t *
+swap_cluster_page(mmobj_t *o, uint32_t pagenum, uint32_t slot)
+{
+        pframe_t *pf = pframe_get_resident(o, pagenum);
+
+        if (NULL == pf || pframe_is_pinned(pf) || pframe_is_busy(pf)
+            || !pframe_is_dirty(pf) || !slot_is_free(slot)
+            || page_is_zero(pf->pf_addr)) {
+                return NULL;
+        }
+        return pf;
+}
+
+/*
+ * Writes page pf of o, which is busy being cleaned and has slot 'slot',
+ * along with the pages after it in o that pageoutd has picked for swap-out
+ * too, to the free slots after slot, up to SWAP_CLUSTER pages in one
+ * request. This is only done once the zpool is full: until then, those
+ * pages are better off compressed. They are cleaned as pframe_clean()
+ * would, and moved to the head of the allocated list, so that pageoutd
+ * reclaims them next. Returns 0 if pf was written along with other pages,
+ * -EAGAIN if there are none, or -errno; the caller then writes pf alone.
+ */
+static int
+swap_write_cluster(mmobj_t *o, pframe_t *pf, uint32_t slot)
+{
+        pframe_t *cluster[SWAP_CLUSTER];
+        swapent_t *ses[SWAP_CLUSTER];
+        uint32_t n, i;
+        int err;
+
+        if (NULL == swap_cluster_buf || swap_cluster_busy
+            || zpool_bytes < zpool_limit) {
+                return -EAGAIN;
+        }
+        swap_cluster_busy = 1;
+
+        /* count the pages, allocate their entries, which may block, and
+         * then look at the pages again */
+        for (n = 1; n < SWAP_CLUSTER
+                    && NULL != swap_cluster_page(o, pf->pf_pagenum + n, slot + n); ++n)
+                ;
+        for (i = 1; i < n && NULL != (ses[i] = slab_obj_alloc(swapent_allocator)); ++i)
+                ;
+        for (n = 1; n < i && NULL != (cluster[n] = swap_cluster_page(o,
+                                        pf->pf_pagenum + n, slot + n)); ++n)
+                ;
+        while (i > n) {
+                slab_obj_free(swapent_allocator, ses[--i]);
+        }
+        if (1 == n) {
+                swap_cluster_busy = 0;
+                return -EAGAIN;
+        }
+
+        memcpy(swap_cluster_buf, pf->pf_addr, PAGE_SIZE);
+        for (i = 1; i < n; ++i) {
+                swap_drop_page(o, cluster[i]->pf_pagenum);
+                slot_take(slot + i);
+                ses[i]->se_where = SE_DISK;
+                ses[i]->se_slot = slot + i;
+                swapent_insert(ses[i], o, cluster[i]->pf_pagenum);
+                pframe_writeback_begin(cluster[i]);
+                memcpy(swap_cluster_buf + i * PAGE_SIZE, cluster[i]->pf_addr, PAGE_SIZE);
+        }
+
+        /* the pages are busy, so nobody drops their entries while we block */
+        err = blockdev_write(swap_bdev, swap_cluster_buf, slot, n);
+        for (i = 1; i < n; ++i) {
+                if (err < 0) {
+                        swapent_free(ses[i]);
+                }
+                pframe_writeback_end(cluster[i], err);
+                if (err >= 0) {
+                        pframe_deactivate(o, cluster[i]->pf_pagenum);
+                }
+        }
+        if (err >= 0) {
+                swap_nout += n - 1;
+                swap_nclusterout += n;
+        }
+
+        swap_cluster_busy = 0;
+        return err;
+}
+
+int
+swap_writepage(mmobj_t *o, pframe_t *pf)
+{
+        swapent_t *se;
+        int err;
+
+        /* Nothing may have dirtied the page without dropping its entry
+         * first, but don't count on it */
+        swap_drop_page(o, pf->pf_pagenum);
+
+        if (NULL == (se = slab_obj_alloc(swapent_allocator))) {
+                err = -ENOMEM;
+                goto failed;
+        }
+
+        /* Neither of the in-memory tiers blocks */
+        if (page_is_zero(pf->pf_addr)) {
+                se->se_where = SE_ZERO;
+                swap_nzero++;
+                goto stored;
+        }
+        if (0 == zpool_store(se, pf->pf_addr)) {
+                goto stored;
+        }
+
+        if (NULL == swap_bdev || swap_draining) {
+                slab_obj_free(swapent_allocator, se);
+                err = -ENOSPC;
+                goto failed;
+        }
+        if ((err = slot_alloc(o, pf->pf_pagenum, &se->se_slot)) < 0) {
+                slab_obj_free(swapent_allocator, se);
+                goto failed;
+        }
+        se->se_where = SE_DISK;
+        swapent_insert(se, o, pf->pf_pagenum);
+
+        /* pf is busy, so nobody drops se while we block */
+        if (0 == swap_write_cluster(o, pf, se->se_slot)) {
+                swap_nout++;
+                return 0;
+        }
+        if ((err = blockdev_write(swap_bdev, pf->pf_addr,
+                                   se->se_slot, 1)) < 0) {
+                /* The slot may be bad; keep it out of use for good. Its
+                 * old contents are lost, but the page is still resident. */
+                dbg(DBG_VM, "swap write to slot %u failed: %d\n", se->se_slot, err);
+                list_remove(&se->se_hlink);
+                list_remove(&se->se_olink);
+                slab_obj_free(swapent_allocator, se);
+                swap_nbad++;
+                goto failed;
+        }
+        swap_nout++;
+        return 0;
+
+stored:
+        swapent_insert(se, o, pf->pf_pagenum);
+        swap_nout++;
+        return 0;
+
+failed:
+        /* Keep pageoutd from picking the page again right away */
+        pframe_pin(pf);
+        return err;
+}
+
+void
+swap_keep_resident(pframe_t *pf)
+{
+        KASSERT(!pframe_is_busy(pf));
+
+        if (!swap_is_swappable(pf->pf_obj)) {
+                return;
+        }
+        if (!pframe_is_pinned(pf)) {
+                pframe_pin(pf);
+        }
+        swap_drop_page(pf->pf_obj, pf->pf_pagenum);
+}
+
+void
+swap_drop_page(mmobj_t *o, uint32_t pagenum)
+{
+        swapent_t *se;
+
+        if (NULL != (se = swapent_lookup(o, pagenum))) {
+                swapent_free(se);
+        }
+}
+
+void
+swap_drop_obj(mmobj_t *o)
+{
+        swapent_t *se;
+
+        list_iterate_begin(&o->mmo_swapents, se, swapent_t, se_olink) {
+                swapent_free(se);
+        } list_iterate_end();
+}
+
+void
+swap_migrate(mmobj_t *src, mmobj_t *dest)
+{
+        swapent_t *se;
+
+        list_iterate_begin(&src->mmo_swapents, se, swapent_t, se_olink) {
+                if (NULL != pframe_get_resident(dest, se->se_pagenum)
+                    || NULL != swapent_lookup(dest, se->se_pagenum)) {
+                        /* dest has a newer version of the page */
+                        swapent_free(se);
+                } else {
+                        list_remove(&se->se_hlink);
+                        list_remove(&se->se_olink);
+                        swapent_insert(se, dest, se->se_pagenum);
+                }
+        } list_iterate_end();
+}
+
+size_t
+swap_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        if (NULL == swap_bdev) {
+                iprintf(&buf, &size, "swap is off\n");
+        } else {
+                iprintf(&buf, &size, "swap device:  %u:%u%s\n",
+                        MAJOR(swap_bdev->bd_id), MINOR(swap_bdev->bd_id),
+                        swap_draining ? " (turning off)" : "");
+                iprintf(&buf, &size, "slots in use: %u of %u (%u bad)\n",
+                        swap_nslots - swap_nfree - swap_nbad, swap_nslots,
+                        swap_nbad);
+        }
+        iprintf(&buf, &size, "zero pages:   %u\n", swap_nzero);
+        iprintf(&buf, &size, "zpool:        %u pages in %u bytes (limit %u)\n",
+                zpool_npages, zpool_bytes, zpool_limit);
+        if (0 != zpool_bytes) {
+                uint32_t ratio = (uint32_t)(((uint64_t)zpool_npages * PAGE_SIZE * 100)
+                                            / zpool_bytes);
+                iprintf(&buf, &size, "zpool ratio:  %u.%02u:1\n",
+                        ratio / 100, ratio % 100);
+        }
+        iprintf(&buf, &size, "swapped out:  %u pages (%u clustered)\n",
+                swap_nout, swap_nclusterout);
+        iprintf(&buf, &size, "swapped in:   %u pages (%u clustered)\n",
+                swap_nin, swap_nclusterin);
+
+        return size;
+}
@@ -1,10 +1,12 @@
 #include "kernel.h"
 #include "errno.h"
 #include "globals.h"
+#include "config.h"
 
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/swap.h"
 
 #include "proc/proc.h"
 
@@ -23,14 +25,26 @@
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/mmobj.h"
+#include "mm/pframe.h"
 
 #include "mm/tlb.h"
+#include "mm/pagetable.h"
 
 #define MIN_PAGENUM ADDR_TO_PN(USER_MEM_LOW) /* inclusive */
 #define MAX_PAGENUM ADDR_TO_PN(USER_MEM_HIGH) /* exclusive */
 
 static slab_allocator_t *vmmap_allocator;
 static slab_allocator_t *vmarea_allocator;
+static slab_allocator_t *vmlock_allocator;
+
+/* A page pinned by mlock(2). The pframe is remembered rather than looked
+ * up again at munlock time since a later copy-on-write fault may hide it
+ * behind a different page. */
+typedef struct vmlock {
+        uint32_t     vml_vfn;
+        pframe_t    *vml_pframe;
+        list_link_t  vml_link;
+} vmlock_t;
 
 void
 vmmap_init(void)
@@ -39,6 +53,8 @@ vmmap_init(void)
         KASSERT(NULL != vmmap_allocator && "failed to create vmmap allocator!");
         vmarea_allocator = slab_allocator_create("vmarea", sizeof(vmarea_t));
         KASSERT(NULL != vmarea_allocator && "failed to create vmarea allocator!");
+        vmlock_allocator = slab_allocator_create("vmlock", sizeof(vmlock_t));
+        KASSERT(NULL != vmlock_allocator && "failed to create vmlock allocator!");
 }
 
 vmarea_t *
@@ -71,6 +87,8 @@ vmmap_create(void)
 
     list_init(&vmm->vmm_list);
     vmm->vmm_proc = NULL;
+    list_init(&vmm->vmm_locked);
+    vmm->vmm_nlocked = 0;
     return vmm;
 }
 
@@ -91,6 +109,8 @@ void vmarea_cleanup(vmarea_t *vma){
 void
 vmmap_destroy(vmmap_t *map)
 {
+    vmmap_unlock(map, MIN_PAGENUM, MAX_PAGENUM - MIN_PAGENUM);
+
     vmarea_t *curr;
     list_iterate_begin(&map->vmm_list, curr, vmarea_t, vma_plink){
         vmarea_cleanup(curr);
@@ -285,6 +305,7 @@ static vmarea_t *simple_vmarea_clone(vmarea_t *oldvma){
 
     newvma->vma_prot = oldvma->vma_prot;
     newvma->vma_flags = oldvma->vma_flags;
+    newvma->vma_advice = oldvma->vma_advice;
 
     newvma->vma_vmmap = NULL;
     newvma->vma_obj = NULL;
@@ -408,6 +429,7 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
 
     vma->vma_prot = prot;
     vma->vma_flags = flags;
+    vma->vma_advice = MADV_NORMAL;
 
     /*vma->vma_vmmap = map;*/
     list_link_init(&vma->vma_plink);
@@ -445,7 +467,7 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
             return -ENOMEM;
         }
 
-        shadow_obj->mmo_shadowed = new_mmobj;
+        shadow_set_shadowed(shadow_obj, new_mmobj);
         new_mmobj->mmo_ops->ref(new_mmobj);
 
         mmobj_t *bottom_obj;
@@ -506,8 +528,8 @@ static overlap_t get_overlap_type(vmarea_t *vma, uint32_t lopage, uint32_t npage
 
 /* this should NOT be called from vmmap_clone, since it
  * assigns a vm obj and increases the reference count
- * of the object. This should ONLY be called from within
- * vmmap_remove
+ * of the object. This should ONLY be called when splitting
+ * a vmarea (vmmap_remove and vmarea_split)
  */
 static vmarea_t *vmarea_clone(vmarea_t *old_vma){
     vmarea_t *new_vma = vmarea_alloc();
@@ -522,6 +544,7 @@ static vmarea_t *vmarea_clone(vmarea_t *old_vma){
 
     new_vma->vma_prot = old_vma->vma_prot;
     new_vma->vma_flags = old_vma->vma_flags;
+    new_vma->vma_advice = old_vma->vma_advice;
 
     new_vma->vma_obj = old_vma->vma_obj;
 
@@ -564,7 +587,15 @@ static vmarea_t *vmarea_clone(vmarea_t *old_vma){
  * Case 4: *[*************]**
  * The region completely contains the vmarea. Remove the vmarea from the
  * list.
+ *
+ * In cases 1 to 3 the area keeps its object, so the private pages
+ * backing the removed part are freed here (see vmarea_drop_private()).
+ * Otherwise they would stay resident until the whole area goes away,
+ * and would reappear if the range were mapped again, e.g. when brk(2)
+ * shrinks the heap and grows it again.
  */
+static void vmarea_drop_private(vmarea_t *vma, uint32_t lopage, uint32_t hipage);
+
 int
 vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
 {
@@ -572,6 +603,9 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
         return 0;
     }
 
+    /* the areas may drop the last references to the locked pages' objects */
+    vmmap_unlock(map, lopage, npages);
+
     list_t *list = &map->vmm_list;
     list_link_t *currlink = list->l_next;
 
@@ -592,7 +626,9 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
                 if (next_vma == NULL){
                     return -ENOMEM;
                 }
-                
+                /* only now that the area can be split */
+                vmarea_drop_private(vma, lopage, lopage + npages);
+
                 next_vma->vma_start = lopage + npages;
                 next_vma->vma_end = vma->vma_end;
                 next_vma->vma_off = vma->vma_off + (lopage + npages - vma->vma_start);
@@ -602,9 +638,11 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
                 vmmap_insert(map, next_vma);
                 break;
             case CASE_2:
+                vmarea_drop_private(vma, lopage, vma->vma_end);
                 vma->vma_end = lopage;
                 break;
             case CASE_3:
+                vmarea_drop_private(vma, vma->vma_start, lopage + npages);
                 vma->vma_off += (lopage + npages - vma->vma_start);
                 vma->vma_start = lopage + npages;
                 break; 
@@ -625,6 +663,526 @@ finished:
     return 0;
 }
 
+/* Splits vma in two at vfn, which must lie strictly inside it. vma keeps
+ * [vma_start, vfn) and a new area covering [vfn, vma_end) is inserted into
+ * the map. Returns 0 on success, -ENOMEM on failure. */
+static int vmarea_split(vmmap_t *map, vmarea_t *vma, uint32_t vfn){
+    KASSERT(vma->vma_start < vfn && vfn < vma->vma_end);
+
+    vmarea_t *next_vma = vmarea_clone(vma);
+    if (next_vma == NULL){
+        return -ENOMEM;
+    }
+
+    next_vma->vma_start = vfn;
+    next_vma->vma_end = vma->vma_end;
+    next_vma->vma_off = vma->vma_off + (vfn - vma->vma_start);
+
+    vma->vma_end = vfn;
+
+    vmmap_insert(map, next_vma);
+    return 0;
+}
+
+/* Returns 1 if every page in [lopage, lopage + npages) is covered by some
+ * vmarea, 0 otherwise. */
+static int vmmap_is_range_mapped(vmmap_t *map, uint32_t lopage, uint32_t npages){
+    uint32_t hipage = lopage + npages;
+    uint32_t next = lopage;
+
+    vmarea_t *vma;
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink){
+        if (vma->vma_end <= next){
+            continue;
+        }
+        if (vma->vma_start > next){
+            return 0;
+        }
+        next = vma->vma_end;
+        if (next >= hipage){
+            return 1;
+        }
+    } list_iterate_end();
+
+    return next >= hipage;
+}
+
+/* Throws away a private page of an object, and its copy on swap, so that
+ * the next access to it faults in a fresh copy. Busy pages and pages pinned
+ * by someone other than their object are left alone. */
+static void vmmap_drop_page(mmobj_t *o, uint32_t pagenum){
+    pframe_t *pf = pframe_get_resident(o, pagenum);
+
+    if (pf != NULL && (pframe_is_busy(pf) || pf->pf_pincount > 1)){
+        return;
+    }
+
+    swap_drop_page(o, pagenum);
+    if (pf == NULL){
+        return;
+    }
+
+    if (pframe_is_pinned(pf)){
+        pframe_unpin(pf);
+    }
+    pframe_free(pf);
+}
+
+/* MADV_WILLNEED: bring the pages of [lopage, hipage) that lie in vma into
+ * memory without mapping them. Anonymous memory is zero-filled on demand,
+ * so there is nothing to read ahead for it. */
+static int vmarea_willneed(vmarea_t *vma, uint32_t lopage, uint32_t hipage){
+    if (anon_is_anon(mmobj_bottom_obj(vma->vma_obj))){
+        return 0;
+    }
+
+    uint32_t vfn;
+    for (vfn = lopage; vfn < hipage; vfn++){
+        pframe_t *p;
+        int lookup_res = pframe_lookup(vma->vma_obj,
+                vfn - vma->vma_start + vma->vma_off, 0, &p);
+
+        if (lookup_res < 0){
+            return lookup_res;
+        }
+    }
+
+    return 0;
+}
+
+/* Frees the private pages backing [lopage, hipage) in vma: the copies in
+ * the top shadow object and, if the mapping is anonymous, the zero pages of
+ * the bottom object (which are never written through a private mapping).
+ * Pages in shadow objects further down the chain are shared with other
+ * processes after a fork, and are left alone. */
+static void vmarea_drop_private(vmarea_t *vma, uint32_t lopage, uint32_t hipage){
+    if ((vma->vma_flags & MAP_TYPE) != MAP_PRIVATE){
+        return;
+    }
+
+    mmobj_t *bottom_obj = mmobj_bottom_obj(vma->vma_obj);
+    int drop_bottom = anon_is_anon(bottom_obj);
+
+    uint32_t vfn;
+    for (vfn = lopage; vfn < hipage; vfn++){
+        uint32_t pagenum = vfn - vma->vma_start + vma->vma_off;
+
+        vmmap_drop_page(vma->vma_obj, pagenum);
+        if (drop_bottom){
+            vmmap_drop_page(bottom_obj, pagenum);
+        }
+    }
+}
+
+/* MADV_DONTNEED: free the private pages backing [lopage, hipage) in vma,
+ * so that subsequent accesses see the underlying object again: zeros for
+ * anonymous memory, the file contents for file mappings. Shared mappings
+ * keep their pages; they are only unmapped by the caller.
+ *
+ * After a fork the area's private pages may also lie in shadow objects
+ * further down the chain, shared with other processes, which cannot be
+ * freed. The part of the area in the range is then split off and given a
+ * fresh shadow object right above the bottom object instead. Returns 0 on
+ * success and -ENOMEM on failure. */
+static int vmarea_dontneed(vmmap_t *map, vmarea_t *vma, uint32_t lopage,
+        uint32_t hipage){
+    if ((vma->vma_flags & MAP_TYPE) != MAP_PRIVATE){
+        return 0;
+    }
+
+    mmobj_t *bottom_obj = mmobj_bottom_obj(vma->vma_obj);
+
+    if (vma->vma_obj->mmo_shadowed != bottom_obj){
+        int err;
+
+        if (vma->vma_start < lopage){
+            /* the range is in the next area; see vmmap_advise() */
+            return vmarea_split(map, vma, lopage);
+        }
+        if (vma->vma_end > hipage && (err = vmarea_split(map, vma, hipage)) < 0){
+            return err;
+        }
+
+        mmobj_t *shadow_obj = shadow_create();
+        if (shadow_obj == NULL){
+            return -ENOMEM;
+        }
+
+        shadow_set_shadowed(shadow_obj, bottom_obj);
+        bottom_obj->mmo_ops->ref(bottom_obj);
+        shadow_obj->mmo_un.mmo_bottom_obj = bottom_obj;
+        bottom_obj->mmo_ops->ref(bottom_obj);
+
+        /* the areas split off still hold the old top object, so its pages
+         * in the range have to be freed before we let go of it */
+        vmarea_drop_private(vma, vma->vma_start, vma->vma_end);
+
+        vma->vma_obj->mmo_ops->put(vma->vma_obj);
+        vma->vma_obj = shadow_obj;
+        shadow_obj->mmo_ops->ref(shadow_obj);
+        return 0;
+    }
+
+    vmarea_drop_private(vma, lopage, hipage);
+    return 0;
+}
+
+/*
+ * Applies the madvise(2) hint 'advice' to [lopage, lopage + npages). The
+ * whole range must be mapped; if it is not, -ENOMEM is returned and nothing
+ * is changed.
+ *
+ * MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL are recorded in vma_advice of
+ * every covered vmarea (splitting areas at the ends of the range) and tune
+ * read-ahead and drop-behind in the page fault handler. MADV_WILLNEED and
+ * MADV_DONTNEED act on the resident pages of the range right away.
+ * MADV_DONTNEED fails with -EINVAL if the range has mlock()ed pages.
+ */
+int
+vmmap_advise(vmmap_t *map, uint32_t lopage, uint32_t npages, int advice)
+{
+    KASSERT(map != NULL);
+    KASSERT(advice == MADV_NORMAL || advice == MADV_RANDOM
+         || advice == MADV_SEQUENTIAL || advice == MADV_WILLNEED
+         || advice == MADV_DONTNEED);
+
+    if (!vmmap_is_range_mapped(map, lopage, npages)){
+        return -ENOMEM;
+    }
+
+    uint32_t hipage = lopage + npages;
+
+    if (advice == MADV_DONTNEED){
+        vmlock_t *vml;
+        list_iterate_begin(&map->vmm_locked, vml, vmlock_t, vml_link){
+            if (vml->vml_vfn >= lopage && vml->vml_vfn < hipage){
+                return -EINVAL;
+            }
+        } list_iterate_end();
+    }
+
+    list_link_t *link;
+    for (link = map->vmm_list.l_next; link != &map->vmm_list; link = link->l_next){
+        vmarea_t *vma = list_item(link, vmarea_t, vma_plink);
+        int err;
+
+        if (vma->vma_end <= lopage){
+            continue;
+        }
+        if (vma->vma_start >= hipage){
+            break;
+        }
+
+        uint32_t start = vma->vma_start > lopage ? vma->vma_start : lopage;
+        uint32_t end = vma->vma_end < hipage ? vma->vma_end : hipage;
+
+        switch (advice){
+            case MADV_WILLNEED:
+                if ((err = vmarea_willneed(vma, start, end)) < 0){
+                    return err;
+                }
+                break;
+            case MADV_DONTNEED:
+                if ((err = vmarea_dontneed(map, vma, start, end)) < 0){
+                    return err;
+                }
+                break;
+            default:
+                if (vma->vma_advice == advice){
+                    break;
+                }
+                if (vma->vma_start < start){
+                    /* advise only the upper part; it is the next area */
+                    if ((err = vmarea_split(map, vma, start)) < 0){
+                        return err;
+                    }
+                    break;
+                }
+                if (vma->vma_end > end && (err = vmarea_split(map, vma, end)) < 0){
+                    return err;
+                }
+                vma->vma_advice = advice;
+        }
+    }
+
+    if (advice == MADV_DONTNEED){
+        tlb_flush_range((uint32_t) PN_TO_ADDR(lopage), npages);
+        pt_unmap_range(curproc->p_pagedir, (uint32_t) PN_TO_ADDR(lopage),
+                (uint32_t) PN_TO_ADDR(hipage));
+    }
+
+    return 0;
+}
+
+/* Faults in page vfn of vma and maps it into the page table of the area's
+ * process, as the page fault handler would for an access of the given kind.
+ * The page is mapped writable only if it was looked up for writing.
+ * Returns 0 on success and -errno on failure. */
+static int vmarea_fault_in(vmarea_t *vma, uint32_t vfn, int forwrite, pframe_t **result){
+    KASSERT(vma->vma_vmmap != NULL && vma->vma_vmmap->vmm_proc != NULL);
+
+    pframe_t *p;
+    int err = pframe_lookup(vma->vma_obj, vfn - vma->vma_start + vma->vma_off,
+            forwrite, &p);
+
+    if (err < 0){
+        return err;
+    }
+
+    int pdflags = PD_PRESENT | PD_USER;
+    int ptflags = PT_PRESENT | PT_USER;
+
+    if (forwrite){
+        pframe_pin(p);
+        err = pframe_dirty(p);
+        pframe_unpin(p);
+
+        if (err < 0){
+            return err;
+        }
+
+        if (vma->vma_prot & PROT_WRITE){
+            pdflags |= PD_WRITE;
+            ptflags |= PT_WRITE;
+        }
+    }
+
+    err = pt_map(vma->vma_vmmap->vmm_proc->p_pagedir, (uintptr_t) PN_TO_ADDR(vfn),
+            pt_virt_to_phys((uintptr_t) p->pf_addr), pdflags, ptflags);
+
+    if (err < 0){
+        return err;
+    }
+
+    *result = p;
+    return 0;
+}
+
+/*
+ * Fills and maps every page of [lopage, lopage + npages) which is covered by
+ * a vmarea (MAP_POPULATE). If forwrite is set, pages of private writable
+ * areas are copied up front as if written, so later writes do not fault;
+ * all other pages are mapped for reading. The TLB is flushed once for the
+ * whole range rather than once per page as in the fault handler.
+ * Returns 0 on success and -errno on failure.
+ */
+int
+vmmap_populate(vmmap_t *map, uint32_t lopage, uint32_t npages, int forwrite)
+{
+    uint32_t hipage = lopage + npages;
+    int err = 0;
+
+    list_link_t *link;
+    for (link = map->vmm_list.l_next;
+            link != &map->vmm_list && err >= 0; link = link->l_next){
+        vmarea_t *vma = list_item(link, vmarea_t, vma_plink);
+
+        if (vma->vma_end <= lopage){
+            continue;
+        }
+        if (vma->vma_start >= hipage){
+            break;
+        }
+
+        uint32_t start = vma->vma_start > lopage ? vma->vma_start : lopage;
+        uint32_t end = vma->vma_end < hipage ? vma->vma_end : hipage;
+        int write = forwrite && (vma->vma_flags & MAP_PRIVATE)
+                && (vma->vma_prot & PROT_WRITE);
+
+        uint32_t vfn;
+        for (vfn = start; vfn < end && err >= 0; vfn++){
+            pframe_t *p;
+            err = vmarea_fault_in(vma, vfn, write, &p);
+        }
+    }
+
+    tlb_flush_range((uintptr_t) PN_TO_ADDR(lopage), npages);
+    return err;
+}
+
+static vmlock_t *vmlock_find(vmmap_t *map, uint32_t vfn){
+    vmlock_t *vml;
+    list_iterate_begin(&map->vmm_locked, vml, vmlock_t, vml_link){
+        if (vml->vml_vfn == vfn){
+            return vml;
+        }
+    } list_iterate_end();
+
+    return NULL;
+}
+
+/*
+ * Locks [lopage, lopage + npages) into memory (mlock(2)): every page is
+ * faulted in, mapped and pinned, so pageoutd never reclaims it. Pages of
+ * private writable areas are copied into the area's top shadow object
+ * first, so the pinned page is the one the process keeps using. A process
+ * may have at most MLOCK_MAX_PAGES pages locked; -EAGAIN is returned if the
+ * request would exceed that, and -ENOMEM if the range is not fully mapped.
+ */
+int
+vmmap_lock(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+    if (!vmmap_is_range_mapped(map, lopage, npages)){
+        return -ENOMEM;
+    }
+
+    uint32_t hipage = lopage + npages;
+    uint32_t nlocked = 0;
+
+    vmlock_t *vml;
+    list_iterate_begin(&map->vmm_locked, vml, vmlock_t, vml_link){
+        if (vml->vml_vfn >= lopage && vml->vml_vfn < hipage){
+            nlocked++;
+        }
+    } list_iterate_end();
+
+    if (map->vmm_nlocked - nlocked + npages > MLOCK_MAX_PAGES){
+        return -EAGAIN;
+    }
+
+    uint32_t vfn;
+    for (vfn = lopage; vfn < hipage; vfn++){
+        if (vmlock_find(map, vfn) != NULL){
+            continue;
+        }
+
+        vmarea_t *vma = vmmap_lookup(map, vfn);
+        KASSERT(vma != NULL);
+
+        int write = (vma->vma_flags & MAP_PRIVATE) && (vma->vma_prot & PROT_WRITE);
+
+        pframe_t *p;
+        int err = vmarea_fault_in(vma, vfn, write, &p);
+
+        if (err < 0){
+            return err;
+        }
+
+        if ((vml = slab_obj_alloc(vmlock_allocator)) == NULL){
+            return -ENOMEM;
+        }
+
+        pframe_pin(p);
+        vml->vml_vfn = vfn;
+        vml->vml_pframe = p;
+        list_insert_tail(&map->vmm_locked, &vml->vml_link);
+        map->vmm_nlocked++;
+    }
+
+    tlb_flush_range((uintptr_t) PN_TO_ADDR(lopage), npages);
+    return 0;
+}
+
+/*
+ * Unpins every page of [lopage, lopage + npages) locked with vmmap_lock().
+ * Unlocked pages of the range are ignored. Always returns 0.
+ */
+int
+vmmap_unlock(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+    uint32_t hipage = lopage + npages;
+
+    vmlock_t *vml;
+    list_iterate_begin(&map->vmm_locked, vml, vmlock_t, vml_link){
+        if (vml->vml_vfn >= lopage && vml->vml_vfn < hipage){
+            pframe_unpin(vml->vml_pframe);
+            list_remove(&vml->vml_link);
+            slab_obj_free(vmlock_allocator, vml);
+            map->vmm_nlocked--;
+        }
+    } list_iterate_end();
+
+    return 0;
+}
+
+/*
+ * Faults in the page holding vaddr as a user access of the given kind
+ * would, and pins it, so that its frame can be used for I/O (O_DIRECT)
+ * until the caller unpins it with pframe_unpin(). A page of a private
+ * area that is pinned for writing is copied into the area's top shadow
+ * object first, as for vmmap_lock(). Returns -EFAULT if vaddr is not
+ * mapped for the kind of access, or another -errno if the page could not
+ * be faulted in.
+ */
+int
+vmmap_pin(vmmap_t *map, const void *vaddr, int forwrite, pframe_t **result)
+{
+    uint32_t vfn = ADDR_TO_PN(vaddr);
+    vmarea_t *vma = vmmap_lookup(map, vfn);
+
+    if (vma == NULL || !(vma->vma_prot & (forwrite ? PROT_WRITE : PROT_READ))){
+        return -EFAULT;
+    }
+
+    pframe_t *p;
+    int err = vmarea_fault_in(vma, vfn, forwrite, &p);
+
+    if (err < 0){
+        return err;
+    }
+
+    tlb_flush((uintptr_t) PN_TO_ADDR(vfn));
+    pframe_pin(p);
+    *result = p;
+    return 0;
+}
+
+/*
+ * Implements msync(2) for [lopage, lopage + npages). The whole range must be
+ * mapped; if it is not, -ENOMEM is returned.
+ *
+ * With MS_SYNC the dirty resident pages of the shared file mappings in the
+ * range are written back to their files before returning. Private and
+ * anonymous mappings have nothing to write. MS_ASYNC and MS_INVALIDATE need
+ * no work: every mapping of a file shares the file's pages, so the data is
+ * already visible to read(2) and to other mappings, and pageoutd or sync(2)
+ * will write it eventually.
+ */
+int
+vmmap_sync(vmmap_t *map, uint32_t lopage, uint32_t npages, int flags)
+{
+    KASSERT(map != NULL);
+
+    if (!vmmap_is_range_mapped(map, lopage, npages)){
+        return -ENOMEM;
+    }
+
+    if (!(flags & MS_SYNC)){
+        return 0;
+    }
+
+    uint32_t hipage = lopage + npages;
+    int ret = 0;
+
+    list_link_t *link;
+    for (link = map->vmm_list.l_next; link != &map->vmm_list; link = link->l_next){
+        vmarea_t *vma = list_item(link, vmarea_t, vma_plink);
+        int err;
+
+        if (vma->vma_end <= lopage){
+            continue;
+        }
+        if (vma->vma_start >= hipage){
+            break;
+        }
+        if (!(vma->vma_flags & MAP_SHARED) || anon_is_anon(vma->vma_obj)){
+            continue;
+        }
+
+        uint32_t start = vma->vma_start > lopage ? vma->vma_start : lopage;
+        uint32_t end = vma->vma_end < hipage ? vma->vma_end : hipage;
+
+        err = pframe_clean_range(vma->vma_obj,
+                start - vma->vma_start + vma->vma_off,
+                end - vma->vma_start + vma->vma_off);
+        if (err < 0 && ret == 0){
+            ret = err;
+        }
+    }
+
+    return ret;
+}
+
 /*
  * Returns 1 if the given address space has no mappings for the
  * given range, 0 otherwise.
@@ -750,14 +1308,15 @@ vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
 
             int write_size = min(PAGE_SIZE - data_offset, count - srcpos);
 
-            memcpy((char *) p->pf_addr + data_offset, (char *) buf + srcpos, write_size); 
-
+            /* before writing: dirtying may give the page a new frame */
             int dirty_res = pframe_dirty(p);
 
             if (dirty_res < 0){
                 return dirty_res;
             }
 
+            memcpy((char *) p->pf_addr + data_offset, (char *) buf + srcpos, write_size); 
+
             srcpos += write_size;
             curraddr = (char *) curraddr + write_size;
         }
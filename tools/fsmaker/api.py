@@ -3,18 +3,44 @@ import math
 import struct
 
 S5_MAGIC = 0x727f
-S5_CURRENT_VERSION = 3
+S5_CURRENT_VERSION = 6
+S5_FREE_LIST_VERSION = 3
+S5_SINGLE_INDIRECT_VERSION = 4
+S5_NO_JOURNAL_VERSION = 5
 S5_BLOCK_SIZE = 4096
+S5_BITS_PER_BLOCK = S5_BLOCK_SIZE * 8
+S5_ALLOC_RUN = 8
+
+# the metadata journal, see s5fs.h
+S5_JOURNAL_NBLOCKS = 128
+S5_JOURNAL_MIN_NBLOCKS = 8
+S5_JOURNAL_MAGIC = 0x4a524e4c
+S5_JOURNAL_SUPER = 1
+S5_JOURNAL_DESCRIPTOR = 2
+S5_JOURNAL_COMMIT = 3
+S5_JOURNAL_REVOKE = 0x80000000
+S5_JOURNAL_MAX_ENTRIES = S5_BLOCK_SIZE / 4 - 4
+
+def S5_JOURNAL_SIZE(nblocks):
+    if (nblocks / 16 < S5_JOURNAL_MIN_NBLOCKS):
+        return 0
+    return min(nblocks / 16, S5_JOURNAL_NBLOCKS)
 
 S5_NBLKS_PER_FNODE = 30
-S5_NDIRECT_BLOCKS = 28
-S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + math.floor(S5_BLOCK_SIZE / 4)
+S5_NDIRECT_BLOCKS = 26
+S5_INDIRECT_LEVELS = 3
+S5_NIDIRECT_BLOCKS = S5_BLOCK_SIZE / 4
+S5_MAX_FILE_BLOCKS = 0x7fffffff / S5_BLOCK_SIZE
 S5_MAX_FILE_SIZE = S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
 
 S5_NAME_LEN = 28
 S5_DIRENT_SIZE = S5_NAME_LEN + 4
+S5_DIR_INDEX_BLOCK = S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS
+# set in pointers to blocks that were allocated by fallocate(2) but never
+# written, which read as zeros
+S5_BLOCK_UNWRITTEN = 0x80000000
 
-S5_INODE_SIZE = 16 + S5_NDIRECT_BLOCKS * 4
+S5_INODE_SIZE = 12 + (S5_NDIRECT_BLOCKS + S5_INDIRECT_LEVELS) * 4
 S5_INODES_PER_BLOCK = S5_BLOCK_SIZE / S5_INODE_SIZE
 
 S5_TYPE_FREE = 0x0
@@ -68,15 +94,7 @@ class Block:
             self._simdisk._simfile.write('\0')
 
     def free(self):
-        if (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
-            self._simdisk.set_free_block(self._simdisk.get_nfree(), self._blockno)
-            self._simdisk.set_nfree(self._simdisk.get_nfree() + 1)
-        else:
-            for i in xrange(S5_NBLKS_PER_FNODE - 1):
-                self.write(i * 4, struct.pack("I", self._simdisk.get_free_block(i)))
-            self.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self._simdisk.get_last_free_block()))
-            self._simdisk.set_last_free_block(self._blockno)
-            self._simdisk.set_nfree(0)
+        self._simdisk.free_block(self._blockno)
 
 class Dirent:
     
@@ -87,6 +105,7 @@ class Dirent:
         self._offset = offset
 
     def remove(self):
+        self._parent._drop_dir_index()
         self._parent.write(self._offset + 4, '\0')
 
 class Inode:
@@ -157,6 +176,22 @@ class Inode:
         self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
         self._simfile.write(struct.pack("I", val))
 
+    def get_dindirect_blockno(self):
+        self._simfile.seek(int(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS + 1)))
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_dindirect_blockno(self, val):
+        self._simfile.seek(int(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS + 1)))
+        self._simfile.write(struct.pack("I", val))
+
+    def get_tindirect_blockno(self):
+        self._simfile.seek(int(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS + 2)))
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_tindirect_blockno(self, val):
+        self._simfile.seek(int(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS + 2)))
+        self._simfile.write(struct.pack("I", val))
+
     def get_type_str(self, short=False):
         t = self.get_type()
         name = "INV" if short else "INVALID"
@@ -195,11 +230,80 @@ class Inode:
             if (res[-1] != "\n"):
                 res += "\n"
             res += "indirect block: {0}\n".format(self.get_indirect_blockno())
+            res += "double indirect block: {0}\n".format(self.get_dindirect_blockno())
+            res += "triple indirect block: {0}\n".format(self.get_tindirect_blockno())
         elif (self.get_type() == S5_TYPE_FREE):
             res += "next free: {0}\n".format(self.get_next_free())
         res = res[:-1]
         return res
 
+    # the roots of the trees of indirect blocks, as (level, getter, setter)
+    def _trees(self):
+        return [ (1, self.get_indirect_blockno, self.set_indirect_blockno),
+                 (2, self.get_dindirect_blockno, self.set_dindirect_blockno),
+                 (3, self.get_tindirect_blockno, self.set_tindirect_blockno) ]
+
+    def _block_goal(self, blockloc):
+        prev = self._get_blockno(blockloc - 1) if (blockloc > 0) else 0
+        return (prev & ~S5_BLOCK_UNWRITTEN) + 1 if prev != 0 else 0
+
+    # returns the disk block holding the given block of the file, or 0 if
+    # it is sparse; with alloc, the block and any indirect blocks on the way
+    # to it are allocated (and zeroed) if they are missing, and a block that
+    # is unwritten is zeroed and marked written. Without alloc, unwritten
+    # blocks are returned with S5_BLOCK_UNWRITTEN set.
+    def _get_blockno(self, blockloc, alloc=False):
+        if (blockloc < S5_NDIRECT_BLOCKS):
+            blockno = self.get_direct_blockno(blockloc)
+            if (blockno == 0 and alloc):
+                block = self._simdisk.alloc_block(self._block_goal(blockloc))
+                block.zero()
+                blockno = block.get_blockno()
+                self.set_direct_blockno(blockloc, blockno)
+            elif (blockno & S5_BLOCK_UNWRITTEN and alloc):
+                blockno &= ~S5_BLOCK_UNWRITTEN
+                self._simdisk.get_block(blockno).zero()
+                self.set_direct_blockno(blockloc, blockno)
+            return blockno
+        index = blockloc - S5_NDIRECT_BLOCKS
+        for (level, getter, setter) in self._trees():
+            if (index < S5_NIDIRECT_BLOCKS ** level):
+                break
+            index -= S5_NIDIRECT_BLOCKS ** level
+        blockno = getter()
+        goal = None
+        if (blockno == 0):
+            if (not alloc):
+                return 0
+            goal = self._block_goal(blockloc)
+            block = self._simdisk.alloc_block(goal)
+            block.zero()
+            blockno = block.get_blockno()
+            goal = blockno + 1
+            setter(blockno)
+        while (level > 0):
+            span = S5_NIDIRECT_BLOCKS ** (level - 1)
+            table = self._simdisk.get_block(blockno)
+            entry = struct.unpack("I", table.read((index / span) * 4, 4))[0]
+            if (entry == 0):
+                if (not alloc):
+                    return 0
+                if (goal == None):
+                    goal = self._block_goal(blockloc)
+                block = self._simdisk.alloc_block(goal)
+                block.zero()
+                entry = block.get_blockno()
+                goal = entry + 1
+                table.write((index / span) * 4, struct.pack("I", entry))
+            elif (entry & S5_BLOCK_UNWRITTEN and alloc):
+                entry &= ~S5_BLOCK_UNWRITTEN
+                self._simdisk.get_block(entry).zero()
+                table.write((index / span) * 4, struct.pack("I", entry))
+            blockno = entry
+            index %= span
+            level -= 1
+        return blockno
+
     def read(self, offset=0, size=None):
         if (size == None):
             size = self.get_size()
@@ -208,19 +312,10 @@ class Inode:
         size = min(size, min(S5_MAX_FILE_SIZE, self.get_size()) - offset)
         res = ""
         while (size > 0):
-            blockno = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, size)
-            if (blockno < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockno)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno -= S5_NDIRECT_BLOCKS
-                    blockno = struct.unpack("I", indirect.read(blockno * 4, 4))[0]
-            if (blockno == 0):
+            blockno = self._get_blockno(int(offset / S5_BLOCK_SIZE))
+            if (blockno == 0 or blockno & S5_BLOCK_UNWRITTEN):
                 for i in xrange(ammount):
                     res += '\0'
             else:
@@ -236,30 +331,9 @@ class Inode:
             raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), S5_MAX_FILE_SIZE))
         remaining = len(data)
         while (remaining > 0):
-            blockloc = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, remaining)
-            if (blockloc < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockloc)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    indirect = self._simdisk.alloc_block()
-                    indirect.zero()
-                    self.set_indirect_blockno(indirect.get_blockno())
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((blockloc - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno == 0):
-                block = self._simdisk.alloc_block()
-                block.zero()
-                if (blockloc < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(blockloc, block.get_blockno())
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((blockloc - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", block.get_blockno()))
-            else:
-                block = self._simdisk.get_block(blockno)
+            block = self._simdisk.get_block(self._get_blockno(int(offset / S5_BLOCK_SIZE), alloc=True))
             if (remaining == ammount):
                 block.write(blockoff, data[-remaining:])
             else:
@@ -269,37 +343,40 @@ class Inode:
         if (offset > self.get_size()):
             self.set_size(offset)
 
-    def truncate(self, size=0):
-        target = math.floor((size - 1) / S5_BLOCK_SIZE)
-        curr = math.floor(self.get_size() / S5_BLOCK_SIZE)
-        while (curr > target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(curr)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((curr - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno > 0):
-                block = self._simdisk.get_block(blockno)
-                block.free()
-                if (curr < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(curr, 0)
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
-                    if (curr == S5_NDIRECT_BLOCKS):
-                        indirect.free()
-                        self.set_indirect_blockno(0)
-            curr -= 1
-        while (curr < target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                self.set_direct_blockno(0)
+    # frees the blocks at or past the file's block 'first' in the tree
+    # rooted at the indirect block blockno; returns True (and frees blockno
+    # too) if nothing is left in the tree
+    def _truncate_tree(self, blockno, level, first):
+        table = self._simdisk.get_block(blockno)
+        span = S5_NIDIRECT_BLOCKS ** (level - 1)
+        empty = True
+        for index in xrange(S5_NIDIRECT_BLOCKS):
+            entry = struct.unpack("I", table.read(index * 4, 4))[0]
+            if (entry == 0):
+                continue
+            if ((index + 1) * span <= first):
+                empty = False
+            elif (level == 1 or self._truncate_tree(entry, level - 1, max(first - index * span, 0))):
+                if (level == 1):
+                    self._simdisk.get_block(entry & ~S5_BLOCK_UNWRITTEN).free()
+                table.write(index * 4, struct.pack("I", 0))
             else:
-                if (self.get_indirect_blockno() != 0):
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
+                empty = False
+        if (empty):
+            table.free()
+        return empty
+
+    def truncate(self, size=0):
+        first = int((size + S5_BLOCK_SIZE - 1) / S5_BLOCK_SIZE)
+        for i in xrange(first, S5_NDIRECT_BLOCKS):
+            if (self.get_direct_blockno(i) != 0):
+                self._simdisk.get_block(self.get_direct_blockno(i) & ~S5_BLOCK_UNWRITTEN).free()
+                self.set_direct_blockno(i, 0)
+        base = S5_NDIRECT_BLOCKS
+        for (level, getter, setter) in self._trees():
+            if (getter() != 0 and self._truncate_tree(getter(), level, max(first - base, 0))):
+                setter(0)
+            base += S5_NIDIRECT_BLOCKS ** level
         self.set_size(size)
 
     def _find_dirent(self, name, types=S5_TYPES):
@@ -352,6 +429,13 @@ class Inode:
         inode.set_link_count(0)
         inode.free()
 
+    # the kernel keeps an index of large directories in their own blocks,
+    # past their entries, which goes stale when they are changed here
+    def _drop_dir_index(self):
+        blockno = self._get_blockno(S5_DIR_INDEX_BLOCK)
+        if (blockno != 0):
+            self._simdisk.get_block(blockno).write(0, struct.pack("I", 0))
+
     def _make_dirent(self, inode, name):
         if (self.get_type() != S5_TYPE_DIR):
             raise S5fsException("cannot create directory entry in non-directory inode of type " + self.get_type_str())
@@ -366,6 +450,7 @@ class Inode:
                 raise S5fsException("directory already has entry with same name: {0}".format(name))
             if (len(name) == 0):
                 empty = i
+        self._drop_dir_index()
         if (empty >= 0):
             self.write(empty, struct.pack("I", inode))
             self.write(empty + 4, name.ljust(S5_NAME_LEN, '\0'))
@@ -382,6 +467,8 @@ class Inode:
             for i in xrange(S5_NDIRECT_BLOCKS):
                 inode.set_direct_blockno(i, 0)
             inode.set_indirect_blockno(0)
+            inode.set_dindirect_blockno(0)
+            inode.set_tindirect_blockno(0)
             self._make_dirent(inode.get_number(), name)
             return inode
         except S5fsException as e:
@@ -397,6 +484,8 @@ class Inode:
             for i in xrange(S5_NDIRECT_BLOCKS):
                 inode.set_direct_blockno(i, 0)
             inode.set_indirect_blockno(0)
+            inode.set_dindirect_blockno(0)
+            inode.set_tindirect_blockno(0)
             inode._make_dirent(inode.get_number(), ".")
             inode._make_dirent(self.get_number(), "..")
             self.set_link_count(self.get_link_count() + 1)
@@ -469,6 +558,11 @@ class Simdisk:
 
     def __init__(self, simfile):
         self._simfile = simfile
+        # finish what was committed before the disk was last unmounted
+        self._simfile.seek(0)
+        if (len(self._simfile.read(S5_BLOCK_SIZE)) == S5_BLOCK_SIZE
+            and self.get_magic() == S5_MAGIC and self.get_version() == S5_CURRENT_VERSION):
+            self._replay_journal()
 
     def get_magic(self):
         self._simfile.seek(0)
@@ -536,6 +630,115 @@ class Simdisk:
         self._simfile.seek(20 + 4 * S5_NBLKS_PER_FNODE)
         self._simfile.write(struct.pack("I", val))
 
+    def _get_super_field(self, index):
+        self._simfile.seek(24 + 4 * (S5_NBLKS_PER_FNODE + index))
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def _set_super_field(self, index, val):
+        self._simfile.seek(24 + 4 * (S5_NBLKS_PER_FNODE + index))
+        self._simfile.write(struct.pack("I", val))
+
+    def get_nblocks(self):
+        return self._get_super_field(0)
+
+    def set_nblocks(self, val):
+        self._set_super_field(0, val)
+
+    def get_bitmap_block(self):
+        return self._get_super_field(1)
+
+    def set_bitmap_block(self, val):
+        self._set_super_field(1, val)
+
+    def get_bitmap_nblocks(self):
+        return self._get_super_field(2)
+
+    def set_bitmap_nblocks(self, val):
+        self._set_super_field(2, val)
+
+    def get_nfree_blocks(self):
+        return self._get_super_field(3)
+
+    def set_nfree_blocks(self, val):
+        self._set_super_field(3, val)
+
+    def get_journal_block(self):
+        return self._get_super_field(4)
+
+    def set_journal_block(self, val):
+        self._set_super_field(4, val)
+
+    def get_journal_nblocks(self):
+        return self._get_super_field(5)
+
+    def set_journal_nblocks(self, val):
+        self._set_super_field(5, val)
+
+    def _read_journal_block(self, num):
+        self._simfile.seek(num * S5_BLOCK_SIZE)
+        data = self._simfile.read(S5_BLOCK_SIZE)
+        magic, jtype, seq, nentries = struct.unpack("IIII", data[:16])
+        if (magic != S5_JOURNAL_MAGIC or nentries > S5_JOURNAL_MAX_ENTRIES):
+            return (None, None, [])
+        return (jtype, seq, list(struct.unpack("{0}I".format(nentries), data[16:16 + 4 * nentries])))
+
+    def _write_journal_super(self, seq):
+        self._simfile.seek(self.get_journal_block() * S5_BLOCK_SIZE)
+        self._simfile.write(struct.pack("IIII", S5_JOURNAL_MAGIC, S5_JOURNAL_SUPER, seq, 0).ljust(S5_BLOCK_SIZE, '\0'))
+
+    # the transactions committed to the journal, as (position, entries)
+    # pairs, and the sequence number of the next one
+    def _journal_transactions(self):
+        start = self.get_journal_block()
+        nblocks = self.get_journal_nblocks()
+        jtype, seq, entries = self._read_journal_block(start)
+        if (jtype != S5_JOURNAL_SUPER):
+            raise S5fsException("journal at block {0} is corrupt".format(start))
+        res = []
+        pos = 1
+        while (pos + 2 <= nblocks):
+            jtype, dseq, entries = self._read_journal_block(start + pos)
+            if (jtype != S5_JOURNAL_DESCRIPTOR or dseq != seq):
+                break
+            nimages = len([e for e in entries if not (e & S5_JOURNAL_REVOKE)])
+            if (pos + nimages + 2 > nblocks):
+                break
+            jtype, cseq, centries = self._read_journal_block(start + pos + nimages + 1)
+            if (jtype != S5_JOURNAL_COMMIT or cseq != seq):
+                break
+            res.append((pos, entries))
+            pos += nimages + 2
+            seq += 1
+        return (res, seq)
+
+    # writes what the journal holds to where it belongs, newest transaction
+    # first, the way the kernel does when it mounts the disk
+    def _replay_journal(self):
+        if (self.get_journal_nblocks() == 0):
+            return
+        start = self.get_journal_block()
+        txns, seq = self._journal_transactions()
+        if (len(txns) == 0):
+            return
+        done = set()
+        for pos, entries in reversed(txns):
+            revoked = set()
+            image = pos
+            for e in entries:
+                if (e & S5_JOURNAL_REVOKE):
+                    revoked.add(e & ~S5_JOURNAL_REVOKE)
+                    continue
+                image += 1
+                if (e in done):
+                    continue
+                self._simfile.seek((start + image) * S5_BLOCK_SIZE)
+                data = self._simfile.read(S5_BLOCK_SIZE)
+                self._simfile.seek(e * S5_BLOCK_SIZE)
+                self._simfile.write(data)
+                done.add(e)
+            done |= revoked
+        self._write_journal_super(seq)
+
     def get_super_block_summary(self):
         res = ""
         res += "magic:      0x{0:04x} ({1})\n".format(self.get_magic(), "VALID" if self.get_magic() == S5_MAGIC else "INVALID")
@@ -543,14 +746,27 @@ class Simdisk:
         res += "num inodes: {0}\n".format(self.get_num_inodes())
         res += "free inode: {0}{1}\n".format(self.get_free_inode(), "" if self.get_free_inode() < self.get_num_inodes() else " (INVALID)")
         res += "root inode: {0}{1}\n".format(self.get_root_inode(), "" if self.get_root_inode() < self.get_num_inodes() else " (INVALID)")
-        res += "free blocks ({0}{1}):\n".format(self.get_nfree(), "" if self.get_nfree() <= S5_NBLKS_PER_FNODE else (", too large shouldn't exceed " + str(S5_NBLKS_PER_FNODE)))
-        for i in xrange(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
-            res += "  {0}".format(self.get_free_block(i))
-            if ((i + 1) % 10 == 0):
+        if (self.get_version() == S5_FREE_LIST_VERSION):
+            res += "free blocks ({0}{1}):\n".format(self.get_nfree(), "" if self.get_nfree() <= S5_NBLKS_PER_FNODE else (", too large shouldn't exceed " + str(S5_NBLKS_PER_FNODE)))
+            for i in xrange(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
+                res += "  {0}".format(self.get_free_block(i))
+                if ((i + 1) % 10 == 0):
+                    res += "\n"
+            if (res[-1] != "\n"):
                 res += "\n"
-        if (res[-1] != "\n"):
-            res += "\n"
-        res += "  last free block: {0}\n".format(self.get_last_free_block())
+            res += "  last free block: {0}\n".format(self.get_last_free_block())
+        else:
+            res += "num blocks: {0}\n".format(self.get_nblocks())
+            res += "bitmap:     blocks {0}-{1}{2}\n".format(self.get_bitmap_block(), self.get_bitmap_block() + self.get_bitmap_nblocks() - 1,
+                                                       "" if self.get_bitmap_nblocks() * S5_BITS_PER_BLOCK >= self.get_nblocks() else " (INVALID, too small)")
+            res += "free:       {0} blocks\n".format(self.get_nfree_blocks())
+        if (self.get_version() == S5_CURRENT_VERSION):
+            if (self.get_journal_nblocks() == 0):
+                res += "journal:    none\n"
+            else:
+                res += "journal:    blocks {0}-{1}, {2} transactions to replay\n".format(self.get_journal_block(),
+                                                                                   self.get_journal_block() + self.get_journal_nblocks() - 1,
+                                                                                   len(self._journal_transactions()[0]))
         return res
 
     def format(self, inodes, size):
@@ -560,8 +776,9 @@ class Simdisk:
             raise S5fsException("cannot format disk to size {0} which is not a multiple of the block size {1}".format(size, S5_BLOCK_SIZE))
         blocks = int(size / S5_BLOCK_SIZE)
         iblocks = int(math.floor((inodes - 1) / S5_INODES_PER_BLOCK) + 1)
-        if (iblocks + 1 >= blocks):
-            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks) * S5_BLOCK_SIZE))
+        bmblocks = int((blocks + S5_BITS_PER_BLOCK - 1) / S5_BITS_PER_BLOCK)
+        if (iblocks + bmblocks + 1 >= blocks):
+            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes and free block bitmap require at least {2} bytes of space".format(size, inodes, (1 + iblocks + bmblocks) * S5_BLOCK_SIZE))
         self._simfile.truncate()
         self._simfile.seek(size)
         self._simfile.write("")
@@ -577,25 +794,33 @@ class Simdisk:
         inode.set_next_free(0xffffffff)
         self.set_free_inode(0)
 
+        # the superblock, inode blocks, bitmap blocks and journal are in
+        # use, as are the bits past the end of the disk
+        jblocks = S5_JOURNAL_SIZE(blocks)
+        if (iblocks + bmblocks + jblocks + 1 >= blocks):
+            jblocks = 0
+        used = iblocks + 1 + bmblocks + jblocks
+        self.set_nfree(0)
         self.set_last_free_block(0xffffffff)
-        i = 0
-        for num in xrange(iblocks+1, blocks):
-            if (i == S5_NBLKS_PER_FNODE - 1):
-                block = self.get_block(num)
-                for j in xrange(S5_NBLKS_PER_FNODE - 1):
-                    block.write(j * 4, struct.pack("I", self.get_free_block(j)))
-                block.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self.get_last_free_block()))
-                self.set_last_free_block(num)
-                i = 0
-            else:
-                self.set_free_block(i, num)
-                i += 1
-        self.set_nfree(i)
+        self.set_nblocks(blocks)
+        self.set_bitmap_block(iblocks + 1)
+        self.set_bitmap_nblocks(bmblocks)
+        bitmap = bytearray(bmblocks * S5_BLOCK_SIZE)
+        for num in range(0, used) + range(blocks, bmblocks * S5_BITS_PER_BLOCK):
+            bitmap[num / 8] |= 1 << (num % 8)
+        self._write_bitmap(bitmap)
+        self.set_nfree_blocks(blocks - used)
+        self.set_journal_block(iblocks + 1 + bmblocks if jblocks else 0)
+        self.set_journal_nblocks(jblocks)
+        if (jblocks):
+            self._write_journal_super(1)
 
         root = self.alloc_inode()
         for i in xrange(S5_NDIRECT_BLOCKS):
             root.set_direct_blockno(i, 0)
         root.set_indirect_blockno(0)
+        root.set_dindirect_blockno(0)
+        root.set_tindirect_blockno(0)
         root.set_type(S5_TYPE_DIR)
         root.set_size(0)
         root.set_link_count(1)
@@ -630,22 +855,65 @@ class Simdisk:
         offset = S5_BLOCK_SIZE * index
         return Block(self, offset, index)
 
-    def alloc_block(self):
-        if (self.get_nfree() > S5_NBLKS_PER_FNODE - 1):
-            raise S5fsException("nfree {0} is invalid, maximum value is {1}".format(self.get_nfree(), S5_NBLKS_PER_FNODE - 1))
-        if (self.get_nfree() == 0):
-            if (self.get_last_free_block() == 0xffffffff):
-                raise S5fsDiskSpaceException()
-            else:
-                block = self.get_block(self.get_last_free_block())
-                for i in xrange(S5_NBLKS_PER_FNODE - 1):
-                    self.set_free_block(i, struct.unpack("I", block.read(i * 4, 4))[0])
-                self.set_last_free_block(struct.unpack("I", block.read((S5_NBLKS_PER_FNODE - 1) * 4, 4))[0])
-                self.set_nfree(S5_NBLKS_PER_FNODE - 1)
-            return block
-        else:
-            self.set_nfree(self.get_nfree() - 1)
-            return self.get_block(self.get_free_block(self.get_nfree()))
+    def _read_bitmap(self):
+        size = self.get_bitmap_nblocks() * S5_BLOCK_SIZE
+        self._simfile.seek(self.get_bitmap_block() * S5_BLOCK_SIZE)
+        return bytearray(self._simfile.read(size))
+
+    def _write_bitmap(self, bitmap):
+        self._simfile.seek(self.get_bitmap_block() * S5_BLOCK_SIZE)
+        self._simfile.write(str(bitmap))
+
+    def _check_version(self):
+        if (self.get_version() != S5_CURRENT_VERSION):
+            raise S5fsException("disk is version {0}, only version {1} can be modified (mount it in weenix to convert it)".format(self.get_version(), S5_CURRENT_VERSION))
+
+    # allocates a block the same way the kernel does: goal if it is free,
+    # else the first free block shortly after it, else the start of the
+    # first run of S5_ALLOC_RUN free blocks, else any free block
+    def alloc_block(self, goal=0):
+        self._check_version()
+        if (self.get_nfree_blocks() == 0):
+            raise S5fsDiskSpaceException()
+        nblocks = self.get_nblocks()
+        bitmap = self._read_bitmap()
+        def is_free(num):
+            return num < nblocks and not (bitmap[num / 8] & (1 << (num % 8)))
+        def find_run(start, end, length):
+            for num in xrange(start, end):
+                if all(is_free(num + i) for i in xrange(length)):
+                    return num
+            return None
+        if (goal >= nblocks):
+            goal = 0
+        found = None
+        if (goal != 0):
+            found = find_run(goal, min(goal + S5_ALLOC_RUN, nblocks), 1)
+        if (found == None):
+            found = find_run(goal, nblocks, S5_ALLOC_RUN)
+        if (found == None):
+            found = find_run(0, goal, S5_ALLOC_RUN)
+        if (found == None):
+            found = find_run(0, nblocks, 1)
+        if (found == None):
+            raise S5fsException("free block count {0} is invalid, no free blocks in bitmap".format(self.get_nfree_blocks()))
+        bitmap[found / 8] |= 1 << (found % 8)
+        self._write_bitmap(bitmap)
+        self.set_nfree_blocks(self.get_nfree_blocks() - 1)
+        return self.get_block(found)
+
+    def free_block(self, num):
+        self._check_version()
+        if (num <= math.floor((self.get_num_inodes() - 1) / S5_INODES_PER_BLOCK) + 1 or num >= self.get_nblocks()
+            or (num >= self.get_bitmap_block() and num < self.get_bitmap_block() + self.get_bitmap_nblocks())
+            or (num >= self.get_journal_block() and num < self.get_journal_block() + self.get_journal_nblocks())):
+            raise S5fsException("cannot free block {0}, it is not a data block".format(num))
+        bitmap = self._read_bitmap()
+        if (not (bitmap[num / 8] & (1 << (num % 8)))):
+            raise S5fsException("cannot free block {0}, it is already free".format(num))
+        bitmap[num / 8] &= ~(1 << (num % 8))
+        self._write_bitmap(bitmap)
+        self.set_nfree_blocks(self.get_nfree_blocks() + 1)
 
     def open(self, path, create=False):
         return self.get_inode(self.get_root_inode()).open(path, create=create)
@@ -33,6 +33,8 @@ void    yield(void);
 pid_t   getpid(void);
 int     halt(void);
 void    sync(void);
+int     fsync(int fd);
+int     fallocate(int fd, off_t offset, off_t len);
 
 size_t  get_free_mem(void);
 
@@ -57,6 +59,10 @@ int     pipe(int pipefd[2]);
 /* VM-related */
 void    *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
 int     munmap(void *addr, size_t len);
+int     madvise(void *addr, size_t len, int advice);
+int     mlock(const void *addr, size_t len);
+int     munlock(const void *addr, size_t len);
+int     msync(void *addr, size_t len, int flags);
 int     brk(void *addr);
 void    *sbrk(int incr);
 
@@ -69,8 +69,15 @@ static int fdzero;
 #define INIT_MMAP() \
         { if ((fdzero = _open("/dev/zero", O_RDWR, 0000)) == -1) \
                         wrterror("open of /dev/zero"); }
+#define HAS_MADVISE
 #define MADV_FREE                       MADV_DONTNEED
 
+/*
+ * Runs of at least this many free pages are always handed back to the
+ * kernel with madvise(2), whether or not the 'H' option is set.
+ */
+#define malloc_hint_minpages    4U
+
 /*
  * No user serviceable parts behind this point.
  */
@@ -851,7 +858,7 @@ free_pages(void *ptr, int index, struct pginfo *info)
                 memset(ptr, SOME_JUNK, l);
 
 #ifdef HAS_MADVISE
-        if (malloc_hint)
+        if (malloc_hint || i >= malloc_hint_minpages)
                 madvise(ptr, l, MADV_FREE);
 #endif
 
@@ -934,11 +941,12 @@ free_pages(void *ptr, int index, struct pginfo *info)
                 malloc_brk = pf->end;
 
                 index = ptr2index(pf->end);
-                last_index = index - 1;
 
                 for (i = index; i <= last_index;)
                         page_dir[i++] = MALLOC_NOT_MINE;
 
+                last_index = index - 1;
+
                 /* XXX: We could realloc/shrink the pagedir here I guess. */
         }
         if (pt)
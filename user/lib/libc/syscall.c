@@ -159,11 +159,69 @@ int munmap(void *addr, size_t len)
         return trap(SYS_munmap, (uint32_t) &args);
 }
 
+int madvise(void *addr, size_t len, int advice)
+{
+        madvise_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+        args.advice = advice;
+
+        return trap(SYS_madvise, (uint32_t) &args);
+}
+
+int mlock(const void *addr, size_t len)
+{
+        mlock_args_t args;
+
+        args.addr = (void *) addr;
+        args.len = len;
+
+        return trap(SYS_mlock, (uint32_t) &args);
+}
+
+int munlock(const void *addr, size_t len)
+{
+        mlock_args_t args;
+
+        args.addr = (void *) addr;
+        args.len = len;
+
+        return trap(SYS_munlock, (uint32_t) &args);
+}
+
+int msync(void *addr, size_t len, int flags)
+{
+        msync_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+        args.flags = flags;
+
+        return trap(SYS_msync, (uint32_t) &args);
+}
+
 void sync(void)
 {
         trap(SYS_sync, 0);
 }
 
+int fsync(int fd)
+{
+        return trap(SYS_fsync, (uint32_t) fd);
+}
+
+int fallocate(int fd, off_t offset, off_t len)
+{
+        fallocate_args_t args;
+
+        args.fd = fd;
+        args.offset = offset;
+        args.len = len;
+
+        return trap(SYS_fallocate, (uint32_t) &args);
+}
+
 int open(const char *filename, int flags, int mode)
 {
         open_args_t args;
@@ -347,6 +347,54 @@ static int test_start_brk(void)
         return 0;
 }
 
+static int test_brk_shrink(void)
+{
+        char *oldbrk, *base, *top, *p;
+        size_t free_before, free_spike;
+        int i;
+
+        printf("Testing that shrinking brk returns memory\n");
+
+        oldbrk = sbrk(0);
+        base = PAGE_ALIGN_UP(oldbrk);
+        top = base + PAGE_SIZE * 64;
+
+        /* Keep the first page so that the heap area is shortened, not removed */
+        test_assert(0 == brk(base + PAGE_SIZE), NULL);
+        base[0] = 'k';
+        free_before = get_free_mem();
+
+        test_assert(0 == brk(top), NULL);
+        for (i = 1; i < 64; i++) {
+                base[PAGE_SIZE * i] = 'a';
+        }
+        free_spike = get_free_mem();
+        test_assert(free_before - free_spike >= PAGE_SIZE * 63, NULL);
+
+        test_assert(0 == brk(base + PAGE_SIZE), NULL);
+        test_assert(get_free_mem() - free_spike >= PAGE_SIZE * 63, "heap pages were not freed");
+        test_assert('k' == base[0], NULL);
+        assert_fault(char foo = base[PAGE_SIZE], "");
+
+        /* Growing again gives fresh pages */
+        test_assert(0 == brk(top), NULL);
+        for (i = 1; i < 64; i++) {
+                test_assert('\0' == base[PAGE_SIZE * i], NULL);
+        }
+        test_assert(0 == brk(oldbrk), NULL);
+
+        /* malloc() trims its heap when a big block at the top is freed */
+        test_assert(NULL != (p = malloc(PAGE_SIZE * 64)), NULL);
+        memset(p, 'm', PAGE_SIZE * 64);
+        test_assert((char *)sbrk(0) >= p + PAGE_SIZE * 64, NULL);
+        free_spike = get_free_mem();
+        free(p);
+        test_assert((char *)sbrk(0) < p + PAGE_SIZE * 64, "malloc did not trim the heap");
+        test_assert(get_free_mem() - free_spike >= PAGE_SIZE * 48, NULL);
+
+        return 0;
+}
+
 static int test_brk_mmap(void)
 {
         printf("Testing interactions of brk() and mmap()\n");
@@ -594,6 +642,258 @@ static int test_mmap_beyond(void)
         return 0;
 }
 
+static int test_madvise(void)
+{
+#define MADVISE_FILE "madvisetest"
+#define MADVISE_STR "WillNeed"
+
+        int fd, status;
+        char *addr, *addr2;
+
+        printf("Testing madvise()\n");
+
+        /* Bad arguments */
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 5,
+                                               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        test_assert(0 == munmap(addr + PAGE_SIZE * 4, PAGE_SIZE), NULL);
+        test_assert(-1 == madvise(addr + 1, PAGE_SIZE, MADV_NORMAL), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(-1 == madvise(addr, 0, MADV_NORMAL), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(-1 == madvise(addr, PAGE_SIZE, 42), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(-1 == madvise(addr, PAGE_SIZE * 5, MADV_NORMAL), NULL);
+        test_assert(ENOMEM == errno, NULL);
+
+        /* Access pattern hints don't change the contents */
+        memset(addr, 'a', PAGE_SIZE * 4);
+        test_assert(0 == madvise(addr + PAGE_SIZE, PAGE_SIZE * 2, MADV_SEQUENTIAL), NULL);
+        test_assert(0 == madvise(addr, PAGE_SIZE, MADV_RANDOM), NULL);
+        test_assert('a' == addr[0] && 'a' == addr[PAGE_SIZE * 4 - 1], NULL);
+
+        /* Dropped private anonymous pages come back zeroed */
+        test_assert(0 == madvise(addr + PAGE_SIZE, PAGE_SIZE * 2, MADV_DONTNEED), NULL);
+        test_assert('a' == addr[PAGE_SIZE - 1], NULL);
+        test_assert('\0' == addr[PAGE_SIZE], NULL);
+        test_assert('\0' == addr[PAGE_SIZE * 3 - 1], NULL);
+        test_assert('a' == addr[PAGE_SIZE * 3], NULL);
+        addr[PAGE_SIZE] = 'b';
+        test_assert('b' == addr[PAGE_SIZE], NULL);
+
+        /* Even after a fork, when they are shared with the other process */
+        memset(addr, 'c', PAGE_SIZE * 4);
+        test_fork_begin() {
+                if (0 != madvise(addr + PAGE_SIZE, PAGE_SIZE, MADV_DONTNEED)
+                    || '\0' != addr[PAGE_SIZE] || 'c' != addr[0]
+                    || 'c' != addr[PAGE_SIZE * 2]) {
+                        exit(1);
+                }
+                addr[PAGE_SIZE] = 'd';
+        } test_fork_end(&status);
+        test_assert(0 == status, "Child saw wrong contents");
+        test_assert('c' == addr[PAGE_SIZE], NULL);
+        test_assert(0 == madvise(addr + PAGE_SIZE * 2, PAGE_SIZE, MADV_DONTNEED), NULL);
+        test_assert('\0' == addr[PAGE_SIZE * 2], NULL);
+        test_assert('c' == addr[PAGE_SIZE * 3], NULL);
+        test_assert(0 == munmap(addr, PAGE_SIZE * 4), NULL);
+
+        /* Set up test file */
+        test_assert(-1 != (fd = open(MADVISE_FILE, O_RDWR | O_CREAT, 0)), NULL);
+        test_assert(PAGE_SIZE * 2 == lseek(fd, PAGE_SIZE * 2, SEEK_SET), NULL);
+        test_assert(9 == write(fd, MADVISE_STR, 9), NULL);
+        test_assert(0 == unlink(MADVISE_FILE), NULL);
+
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 3,
+                                               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)), NULL);
+        test_assert(MAP_FAILED != (addr2 = mmap(NULL, PAGE_SIZE * 3,
+                                                PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)), NULL);
+        test_assert(0 == madvise(addr, PAGE_SIZE * 3, MADV_WILLNEED), NULL);
+        test_assert(!strcmp(addr + PAGE_SIZE * 2, MADVISE_STR), NULL);
+
+        /* Shared mappings keep their data, private ones revert to the file */
+        addr[0] = 'S';
+        addr2[PAGE_SIZE * 2] = 'P';
+        test_assert(0 == madvise(addr, PAGE_SIZE * 3, MADV_DONTNEED), NULL);
+        test_assert(0 == madvise(addr2, PAGE_SIZE * 3, MADV_DONTNEED), NULL);
+        test_assert('S' == addr[0], NULL);
+        test_assert('S' == addr2[0], NULL);
+        test_assert(!strcmp(addr2 + PAGE_SIZE * 2, MADVISE_STR), NULL);
+
+        return 0;
+}
+
+static int test_populate_mlock(void)
+{
+#define POPULATE_FILE "populatetest"
+#define POPULATE_STR "Populated"
+
+        int fd, i;
+        char *addr, *addr2;
+
+        printf("Testing MAP_POPULATE, mlock() and munlock()\n");
+
+        /* Populated anonymous memory reads as zeros and is writable */
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 8, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANON | MAP_POPULATE, -1, 0)), NULL);
+        for (i = 0; i < 8; i++) {
+                test_assert('\0' == addr[PAGE_SIZE * i], NULL);
+                addr[PAGE_SIZE * i] = 'a' + i;
+        }
+        test_assert('h' == addr[PAGE_SIZE * 7], NULL);
+
+        /* Populated file mappings see the file */
+        test_assert(-1 != (fd = open(POPULATE_FILE, O_RDWR | O_CREAT, 0)), NULL);
+        test_assert(10 == write(fd, POPULATE_STR, 10), NULL);
+        test_assert(0 == unlink(POPULATE_FILE), NULL);
+        test_assert(MAP_FAILED != (addr2 = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, fd, 0)), NULL);
+        test_assert(!strcmp(addr2, POPULATE_STR), NULL);
+
+        /* Bad arguments */
+        test_assert(-1 == mlock(addr + 1, PAGE_SIZE), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(-1 == mlock(addr, 0), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(0 == munmap(addr + PAGE_SIZE * 7, PAGE_SIZE), NULL);
+        test_assert(-1 == mlock(addr, PAGE_SIZE * 8), NULL);
+        test_assert(ENOMEM == errno, NULL);
+
+        /* Locking keeps the contents, and locking twice is fine */
+        test_assert(0 == mlock(addr, PAGE_SIZE * 7), NULL);
+        test_assert(0 == mlock(addr + PAGE_SIZE, PAGE_SIZE * 2), NULL);
+        for (i = 0; i < 7; i++) {
+                test_assert('a' + i == addr[PAGE_SIZE * i], NULL);
+        }
+        addr[0] = 'z';
+        test_assert('z' == addr[0], NULL);
+        test_assert(0 == mlock(addr2, PAGE_SIZE), NULL);
+        addr2[0] = 'p';
+        test_assert(0 == munlock(addr2, PAGE_SIZE), NULL);
+        test_assert('p' == addr2[0], NULL);
+
+        /* Unlocking (including by munmap) is fine, even when not locked */
+        test_assert(0 == munlock(addr, PAGE_SIZE * 3), NULL);
+        test_assert(0 == munlock(addr, PAGE_SIZE * 3), NULL);
+        test_assert(0 == munmap(addr + PAGE_SIZE * 3, PAGE_SIZE), NULL);
+        test_assert('e' == addr[PAGE_SIZE * 4], NULL);
+
+        /* There is a limit to how much can be locked */
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 1024, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        test_assert(-1 == mlock(addr, PAGE_SIZE * 1024), NULL);
+        test_assert(EAGAIN == errno, NULL);
+
+        return 0;
+}
+
+static int test_msync(void)
+{
+#define MSYNC_FILE "msynctest"
+
+        int fd, i;
+        char *addr;
+        char buf[PAGE_SIZE];
+
+        printf("Testing msync() and fsync()\n");
+
+        memset(buf, 0, sizeof(buf));
+        test_assert(-1 != (fd = open(MSYNC_FILE, O_RDWR | O_CREAT, 0)), NULL);
+        for (i = 0; i < 4; i++) {
+                test_assert(PAGE_SIZE == write(fd, buf, PAGE_SIZE), NULL);
+        }
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 4, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED, fd, 0)), NULL);
+
+        /* Bad arguments */
+        test_assert(-1 == msync(addr + 1, PAGE_SIZE, MS_SYNC), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(-1 == msync(addr, 0, MS_SYNC), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(-1 == msync(addr, PAGE_SIZE, MS_SYNC | MS_ASYNC), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(-1 == msync(addr, PAGE_SIZE, 8), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(-1 == fsync(-1), NULL);
+        test_assert(EBADF == errno, NULL);
+
+        /* Written back pages are seen by read() */
+        for (i = 0; i < 4; i++) {
+                addr[PAGE_SIZE * i] = 'a' + i;
+        }
+        test_assert(0 == msync(addr + PAGE_SIZE, PAGE_SIZE * 2, MS_SYNC), NULL);
+        test_assert(0 == msync(addr, PAGE_SIZE * 4, MS_ASYNC | MS_INVALIDATE), NULL);
+        test_assert(0 == fsync(fd), NULL);
+        for (i = 0; i < 4; i++) {
+                test_assert((off_t)(PAGE_SIZE * i) == lseek(fd, PAGE_SIZE * i, SEEK_SET), NULL);
+                test_assert(1 == read(fd, buf, 1), NULL);
+                test_assert('a' + i == buf[0], NULL);
+        }
+
+        /* Private mappings have nothing to write */
+        test_assert(0 == munmap(addr, PAGE_SIZE * 4), NULL);
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 4, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE, fd, 0)), NULL);
+        addr[0] = 'z';
+        test_assert(0 == msync(addr, PAGE_SIZE * 4, MS_SYNC), NULL);
+        test_assert(0 == lseek(fd, 0, SEEK_SET), NULL);
+        test_assert(1 == read(fd, buf, 1), NULL);
+        test_assert('a' == buf[0], NULL);
+
+        /* The whole range must be mapped */
+        test_assert(0 == munmap(addr + PAGE_SIZE * 3, PAGE_SIZE), NULL);
+        test_assert(-1 == msync(addr, PAGE_SIZE * 4, MS_SYNC), NULL);
+        test_assert(ENOMEM == errno, NULL);
+
+        test_assert(0 == close(fd), NULL);
+        test_assert(0 == unlink(MSYNC_FILE), NULL);
+
+        return 0;
+}
+
+static int test_largepage(void)
+{
+#define LARGE_SIZE (PAGE_SIZE * 1024)
+
+        int i, status;
+        char *addr;
+
+        printf("Testing MAP_LARGEPAGE\n");
+
+        test_assert(MAP_FAILED != (addr = mmap(NULL, LARGE_SIZE, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANON | MAP_LARGEPAGE, -1, 0)), NULL);
+        test_assert(0 == (uintptr_t)addr % LARGE_SIZE, "Large page mapping not aligned");
+
+        /* It behaves like any other anonymous memory */
+        for (i = 0; i < 1024; i++) {
+                test_assert('\0' == addr[PAGE_SIZE * i], NULL);
+                addr[PAGE_SIZE * i] = 'a' + i % 26;
+        }
+
+        /* Including copy-on-write after a fork */
+        test_fork_begin() {
+                for (i = 0; i < 1024; i++) {
+                        if ('a' + i % 26 != addr[PAGE_SIZE * i]) {
+                                return 1;
+                        }
+                        addr[PAGE_SIZE * i] = 'C';
+                }
+                return 0;
+        } test_fork_end(&status);
+        test_assert(0 == status, "Child saw wrong contents");
+        for (i = 0; i < 1024; i++) {
+                test_assert('a' + i % 26 == addr[PAGE_SIZE * i], NULL);
+        }
+
+        /* Unmapping part of it leaves the rest */
+        test_assert(0 == munmap(addr + PAGE_SIZE * 512, PAGE_SIZE), NULL);
+        assert_fault(char foo = addr[PAGE_SIZE * 512], "");
+        test_assert('a' + 511 % 26 == addr[PAGE_SIZE * 511], NULL);
+        test_assert('a' + 513 % 26 == addr[PAGE_SIZE * 513], NULL);
+        test_assert(0 == munmap(addr, LARGE_SIZE), NULL);
+
+        return 0;
+}
+
 int main(int argc, char **argv)
 {
         if (argc != 1) {
@@ -621,10 +921,15 @@ int main(int argc, char **argv)
         childtest(test_brk_bounds);
         childtest(test_munmap);
         childtest(test_start_brk);
+        childtest(test_brk_shrink);
         childtest(test_brk_mmap);
         childtest(test_mmap_fill);
         childtest(test_mmap_repeat);
         childtest(test_mmap_beyond);
+        childtest(test_madvise);
+        childtest(test_populate_mlock);
+        childtest(test_msync);
+        childtest(test_largepage);
         test_fini();
 
         return 0;
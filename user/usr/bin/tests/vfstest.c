@@ -752,6 +752,71 @@ vfstest_getdents(void)
         syscall_success(chdir(".."));
 }
 
+#ifdef __MOUNTING__
+/*
+ * Tests mount() and umount(), with a tmpfs.
+ */
+static void
+vfstest_mount(void)
+{
+        int fd, i, j;
+        char buf[256];
+        struct stat s;
+
+        syscall_success(mkdir("mount", 0));
+        syscall_success(chdir("mount"));
+        syscall_success(mkdir("mnt", 0));
+        create_file("file01");
+
+        /* mount errors */
+        syscall_fail(mount("tmpfs", "file01", "tmpfs"), ENOTDIR);
+        syscall_fail(mount("tmpfs", "noent", "tmpfs"), ENOENT);
+        syscall_fail(mount("tmpfs", "mnt", "nosuchfs"), EINVAL);
+
+        syscall_success(mount("tmpfs", "mnt", "tmpfs"));
+        syscall_fail(mount("tmpfs", "mnt", "tmpfs"), EBUSY);
+
+        /* a file of several pages, written and read back a piece at a time */
+        syscall_success(fd = open("mnt/file02", O_RDWR | O_CREAT, 0));
+        for (i = 0; i < 64; i++) {
+                memset(buf, i, sizeof(buf));
+                test_assert(sizeof(buf) == write(fd, buf, sizeof(buf)), NULL);
+        }
+        syscall_success(stat("mnt/file02", &s));
+        test_assert(64 * sizeof(buf) == (size_t) s.st_size, "actual size: %d", s.st_size);
+        test_lseek(lseek(fd, 0, SEEK_SET), 0);
+        for (i = 0; i < 64; i++) {
+                test_assert(sizeof(buf) == read(fd, buf, sizeof(buf)), NULL);
+                for (j = 0; j < (int) sizeof(buf) && buf[j] == (char) i; j++)
+                        ;
+                test_assert(j == sizeof(buf), "unexpected data read at %d", i * sizeof(buf) + j);
+        }
+        test_assert(0 == read(fd, buf, sizeof(buf)), NULL);
+        syscall_success(close(fd));
+
+        /* ".." climbs back out of it */
+        syscall_success(stat("mnt/../file01", &s));
+        syscall_success(chdir("mnt"));
+        syscall_success(stat("../file01", &s));
+        syscall_fail(umount("."), EBUSY);
+        syscall_success(chdir(".."));
+
+        /* links cannot cross it, and it cannot be removed */
+        syscall_fail(link("file01", "mnt/file01"), EXDEV);
+        syscall_fail(rmdir("mnt"), EBUSY);
+        syscall_fail(umount("file01"), EINVAL);
+
+        syscall_success(mkdir("mnt/dir01", 0));
+        syscall_success(umount("mnt"));
+
+        /* what was in it is gone */
+        syscall_fail(stat("mnt/dir01", &s), ENOENT);
+        syscall_success(rmdir("mnt"));
+
+        syscall_success(chdir(".."));
+}
+#endif
+
 #ifdef __VM__
 /*
  * Tests link(), rename(), and mmap() (and munmap, and brk).
@@ -920,6 +985,10 @@ int vfstest_main(int argc, char **argv)
         vfstest_read();
         vfstest_getdents();
 
+#ifdef __MOUNTING__
+        vfstest_mount();
+#endif
+
 #ifdef __VM__
         vfstest_s5fs_vm();
 #endif